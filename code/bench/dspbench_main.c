@@ -0,0 +1,108 @@
+/*
+ * Host run of the DSP kernels benchmark, see dspbench.c.
+ * Prints one CSV line per kernel, the columns of kvr_stream -b without
+ * the type: kernel,variant,unit,calls,best,mean (per call)
+ * With -c, the best times are compared with a previous run and the exit
+ * status is 1 when a kernel got slower by more than the tolerance:
+ *   ./dspbench_q15 > baseline.csv
+ *   ./dspbench_q15 -q -c baseline.csv -T 10
+ * A target run compares the same way once the type column is cut.
+ */
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "dspbench.h"
+
+#define DEFAULT_TOLERANCE 10.0 // Percent
+
+static const char* const variants[] = {"q15", "q31", "f32"};
+
+static double perCall(const stream_bench_t* row)
+{
+  return (double)row->best * row->repeats / row->calls;
+}
+
+/* Baseline best time of a kernel and variant, negative when not found */
+static double baseline(FILE* f, const char* name, const char* variant)
+{
+  char line[256];
+
+  rewind(f);
+  while (fgets(line, sizeof(line), f) != NULL)
+  {
+    char kernel[32], var[8];
+    double best;
+
+    if (sscanf(line, "%31[^,],%7[^,],%*[^,],%*u,%lf", kernel, var, &best) == 3 &&
+        strcmp(kernel, name) == 0 && strcmp(var, variant) == 0)
+      return best;
+  }
+  return -1.0;
+}
+
+int main(int argc, char** argv)
+{
+  double tolerance = DEFAULT_TOLERANCE;
+  FILE* base = NULL;
+  const stream_bench_t* rows;
+  size_t count, i;
+  bool quiet = false;
+  int status = 0;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "qc:T:h")) != -1)
+  {
+    switch (opt) {
+    case 'q': quiet = true; break;
+    case 'c':
+      base = fopen(optarg, "r");
+      if (base == NULL)
+      {
+        perror(optarg);
+        return 2;
+      }
+      break;
+    case 'T': tolerance = atof(optarg); break;
+    default:
+      fprintf(stderr, "usage: %s [-q] [-c baseline.csv] [-T percent]\n", argv[0]);
+      return 2;
+    }
+  }
+
+  dspbenchRun();
+  rows = dspbenchResults(&count);
+
+  if (!quiet)
+    printf("kernel,variant,unit,calls,best,mean\n");
+  for (i = 0; i < count; i++)
+  {
+    const char* variant = variants[rows[i].variant];
+    const double best = perCall(&rows[i]);
+
+    printf("%.*s,%s,ns,%u,%.2f,%.2f\n", (int)sizeof(rows[i].name), rows[i].name, variant,
+           rows[i].calls, best, (double)rows[i].total / rows[i].calls);
+
+    if (base != NULL)
+    {
+      char name[sizeof(rows[i].name) + 1];
+      double ref;
+
+      memcpy(name, rows[i].name, sizeof(rows[i].name));
+      name[sizeof(rows[i].name)] = 0;
+      ref = baseline(base, name, variant);
+      if (ref > 0 && best > ref * (1.0 + tolerance / 100.0))
+      {
+        fprintf(stderr, "%s %s: %.2f ns per call, %.2f in the baseline (+%.0f%%)\n", name, variant,
+                best, ref, 100.0 * (best - ref) / ref);
+        status = 1;
+      }
+    }
+  }
+
+  if (base != NULL)
+    fclose(base);
+  return status;
+}
@@ -0,0 +1,246 @@
+/*
+ * Host benchmark of the knock DSP chain.
+ * Runs the variant selected by KNOCK_DSP on synthetic knock frames and
+ * compares its spectrum with a double precision DFT of the same frame.
+ * Prints one CSV line per signal level:
+ * variant,signal_dbfs,ns_per_frame,cycles_per_frame,snr_db,band_error_pct
+ * Then checks the output integrator against every TPIC time constant and
+ * exits with 1 when one saturates or drifts from the window mean.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC 1
+#endif
+
+#include "knock_dsp.h"
+
+#define BENCH_RATE 100000 // Hz, KNOCK_DEFAULT_RATE
+#define BENCH_FREQ 6600 // Hz, between two bins on purpose
+#define BENCH_RATIO 20000 // Default knock_ratio setting
+#define BENCH_ITERATIONS 2000
+#define BENCH_ADC_FULL_SCALE 2047 // Offset corrected 12 bits ADC
+#define BENCH_NOISE_LSB 0.5 // Input noise, ADC LSB rms
+
+#if KNOCK_DSP == KNOCK_DSP_Q15
+#define BENCH_VARIANT "q15"
+#elif KNOCK_DSP == KNOCK_DSP_Q31
+#define BENCH_VARIANT "q31"
+#else
+#define BENCH_VARIANT "f32"
+#endif
+
+static const double levels[] = {-6.0, -20.0, -40.0, -60.0}; // dBFS
+
+/* TPIC8101 integrator time constants, us */
+static const uint16_t tpic_integrators[] = {
+  40, 45, 50, 55, 60, 65, 70, 75,
+  80, 90, 100, 110, 120, 130, 140, 150,
+  160, 180, 200, 220, 240, 260, 280, 300,
+  320, 360, 400, 440, 480, 520, 560, 600
+};
+static const uint32_t window_frames[] = {1, 4, 50, 2000};
+static const uint32_t integrator_values[] = {1, 1000, 0xFFFF, 2 * 0xFFFF}; // Up to the highest gain
+
+static knock_dsp_t dsp;
+static knock_kernel_t kernel;
+static q15_t frame[FFT_SIZE];
+static uint16_t spectrum[SPECTRUM_SIZE];
+static double reference[SPECTRUM_SIZE];
+
+static uint32_t lcg_state = 1;
+
+/* Uniform noise in [-0.5, 0.5), deterministic between runs and variants */
+static double noise(void)
+{
+  lcg_state = lcg_state * 1664525U + 1013904223U;
+  return ((double)(lcg_state >> 8) / 16777216.0) - 0.5;
+}
+
+/*
+ * Same format as the knock ADC: offset corrected, left aligned,
+ * so 12 bits signed codes shifted by 3.
+ */
+static void makeFrame(double dbfs)
+{
+  const double amplitude = BENCH_ADC_FULL_SCALE * pow(10.0, dbfs / 20.0);
+  uint16_t i;
+
+  lcg_state = 1;
+  for (i = 0; i < FFT_SIZE; i++)
+  {
+    double val = amplitude * sin(2.0 * M_PI * BENCH_FREQ * i / BENCH_RATE);
+    long code;
+
+    val += BENCH_NOISE_LSB * sqrt(12.0) * noise();
+    code = lround(val);
+    if (code > BENCH_ADC_FULL_SCALE)
+      code = BENCH_ADC_FULL_SCALE;
+    else if (code < -BENCH_ADC_FULL_SCALE - 1)
+      code = -BENCH_ADC_FULL_SCALE - 1;
+    frame[i] = (q15_t)(code * 8);
+  }
+}
+
+/* Spectrum in the unit of knockDspMagnitude(), sine amplitude in input codes */
+static void makeReference(void)
+{
+  const double gain = KNOCK_DSP_USE_WINDOW ? 4.0 / FFT_SIZE : 2.0 / FFT_SIZE;
+  uint16_t k, i;
+
+  for (k = 0; k < SPECTRUM_SIZE; k++)
+  {
+    double re = 0.0, im = 0.0;
+
+    for (i = 0; i < FFT_SIZE; i++)
+    {
+      double val = frame[i];
+#if KNOCK_DSP_USE_WINDOW
+      val *= 0.5 - 0.5 * cos(2.0 * M_PI * i / FFT_SIZE);
+#endif
+      re += val * cos(2.0 * M_PI * k * i / FFT_SIZE);
+      im -= val * sin(2.0 * M_PI * k * i / FFT_SIZE);
+    }
+    reference[k] = gain * sqrt(re * re + im * im);
+  }
+}
+
+static double referenceBand(void)
+{
+  double res = reference[kernel.index];
+  uint16_t i;
+
+  for (i = 1; i < KNOCK_KERNEL_RANGE; i++)
+    res += kernel.weights[i] * (reference[kernel.index + i] + reference[kernel.index - i]);
+
+  return res > 65535.0 ? 65535.0 : res;
+}
+
+static double snr(void)
+{
+  double sig = 0.0, err = 0.0;
+  uint16_t k;
+
+  for (k = 0; k < SPECTRUM_SIZE; k++)
+  {
+    double diff = spectrum[k] - reference[k];
+    sig += reference[k] * reference[k];
+    err += diff * diff;
+  }
+
+  if (err == 0.0)
+    return INFINITY;
+
+  return 10.0 * log10(sig / err);
+}
+
+static uint16_t process(void)
+{
+  knockDspWindow(&dsp, frame);
+  knockDspTransform(&dsp);
+  knockDspMagnitude(&dsp, spectrum);
+  return knockDspIntegrate(&kernel, spectrum);
+}
+
+/*
+ * Constant band level over windows of several lengths, the output must be
+ * the level scaled by KNOCK_INTEGRATOR_REF / tau whatever the length, so
+ * only levels above full scale saturate at the shortest time constants.
+ */
+static int checkIntegrator(void)
+{
+  const uint32_t frame_us = ((uint64_t)FFT_SIZE * 1000000U) / BENCH_RATE;
+  int errors = 0;
+  size_t t, w, v;
+
+  for (t = 0; t < sizeof(tpic_integrators) / sizeof(tpic_integrators[0]); t++)
+  {
+    for (w = 0; w < sizeof(window_frames) / sizeof(window_frames[0]); w++)
+    {
+      for (v = 0; v < sizeof(integrator_values) / sizeof(integrator_values[0]); v++)
+      {
+        const uint32_t val = integrator_values[v];
+        uint64_t expected = ((uint64_t)val * KNOCK_INTEGRATOR_REF) / tpic_integrators[t];
+        knock_integrator_t it;
+        uint16_t out = 0;
+        uint32_t f;
+
+        if (expected > 0xFFFF)
+          expected = 0xFFFF;
+
+        knockDspIntegratorReset(&it);
+        for (f = 0; f < window_frames[w]; f++)
+          out = knockDspIntegratorAdd(&it, val, frame_us, tpic_integrators[t]);
+
+        if (out != expected || (val <= 0xFFFF && out > val))
+        {
+          fprintf(stderr, "integrator: tau %u us, %u frames, value %u gave %u instead of %llu\n",
+                  tpic_integrators[t], window_frames[w], val, out, (unsigned long long)expected);
+          errors++;
+        }
+      }
+    }
+  }
+
+  return errors;
+}
+
+static double nanoseconds(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int main(int argc, char** argv)
+{
+  volatile uint16_t sink = 0;
+  size_t l;
+  uint32_t i;
+
+  knockDspInit(&dsp);
+  knockDspKernel(&kernel, BENCH_FREQ, BENCH_RATIO, BENCH_RATE);
+
+  if (argc < 2 || strcmp(argv[1], "-q") != 0)
+    printf("variant,signal_dbfs,ns_per_frame,cycles_per_frame,snr_db,band_error_pct\n");
+
+  for (l = 0; l < sizeof(levels) / sizeof(levels[0]); l++)
+  {
+    double start, ns, ref;
+    uint16_t band;
+#ifdef HAVE_TSC
+    uint64_t cycles;
+#endif
+
+    makeFrame(levels[l]);
+    makeReference();
+    ref = referenceBand();
+
+    band = process(); // Warm up, and the output we check
+    start = nanoseconds();
+#ifdef HAVE_TSC
+    cycles = __rdtsc();
+#endif
+    for (i = 0; i < BENCH_ITERATIONS; i++)
+      sink += process();
+#ifdef HAVE_TSC
+    cycles = __rdtsc() - cycles;
+#endif
+    ns = (nanoseconds() - start) / BENCH_ITERATIONS;
+
+    printf("%s,%.0f,%.0f,", BENCH_VARIANT, levels[l], ns);
+#ifdef HAVE_TSC
+    printf("%llu,", (unsigned long long)(cycles / BENCH_ITERATIONS));
+#else
+    printf("-,");
+#endif
+    printf("%.1f,%.2f\n", snr(), ref > 0.0 ? 100.0 * (band - ref) / ref : 0.0);
+  }
+  (void)sink;
+
+  return checkIntegrator() ? 1 : 0;
+}
@@ -0,0 +1,209 @@
+#include "calib.h"
+#include "vr.h"
+
+/*
+ * ADC offset and DAC bias calibration.
+ * At boot each ADC runs its self-calibration (done by adcStart), then the
+ * zero-input code is averaged over a one-shot conversion with the offset
+ * disabled.
+ * While running, idle frames (no signal) are fed back through a slow filter
+ * so the offsets follow temperature and supply drift.
+ */
+
+#define CALIB_SETTLE_MS 10 // Bias network settling time after a DAC change
+
+typedef struct {
+  ADCDriver *adcp;
+  uint8_t channel;
+  bool left_aligned; // Offset corrected data is signed and shifted by 3
+} calib_input_t;
+
+static const calib_input_t inputs[CALIB_INPUTS] = {
+  {&KNOCK_ADCD, KNOCK_SENSOR1_CHANNEL, true},
+#if KNOCK_SENSORS > 1
+  {&KNOCK_ADCD, KNOCK_SENSOR2_CHANNEL, true},
+#endif
+#if KNOCK_SENSORS > 2
+  {&KNOCK_ADCD, KNOCK_SENSOR3_CHANNEL, true},
+#endif
+#if KNOCK_SENSORS > 3
+  {&KNOCK_ADCD, KNOCK_SENSOR4_CHANNEL, true},
+#endif
+  {&VR1_ADCD, VR1_ADC_CHANNEL, false},
+  {&VR2_ADCD, VR2_ADC_CHANNEL, false},
+  {&VR3_ADCD, VR3_ADC_CHANNEL, false},
+#if KNOCK_USE_DUAL_MODE
+  {&KNOCK_DUAL_ADCD, KNOCK_SENSOR1_CHANNEL, true}
+#endif
+};
+
+calibration_t calibration;
+
+static uint16_t applied[CALIB_INPUTS]; // Offset currently loaded in OFR1
+static int32_t idle_acc[CALIB_INPUTS]; // Idle filter state, offset << CALIB_IDLE_SHIFT
+static adcsample_t calib_samples[CALIB_SAMPLES];
+static ADCConversionGroup calib_grp = {
+  FALSE,
+  1,
+  NULL,
+  NULL,
+  ADC_CFGR_CONT,                    /* CFGR - Continuous, right aligned */
+  ADC_TR(0, 4095),                  /* TR1     */
+  {0, 0},                           /* SMPR[2] */
+  {0, 0, 0, 0}                      /* SQR[4]  */
+};
+
+/*
+ * Averages the zero-input code of an input.
+ * The ADC must be started and no conversion running.
+ */
+uint16_t calibMeasure(uint8_t input)
+{
+  const calib_input_t *in = &inputs[input];
+  uint32_t sum = 0;
+  uint16_t i;
+
+  /* Longest sampling time, we want the quietest reading. */
+  if (in->channel < 10) {
+    calib_grp.smpr[0] = ADC_SMPR_SMP_601P5 << (in->channel * 3);
+    calib_grp.smpr[1] = 0;
+  }
+  else {
+    calib_grp.smpr[0] = 0;
+    calib_grp.smpr[1] = ADC_SMPR_SMP_601P5 << ((in->channel - 10) * 3);
+  }
+  calib_grp.sqr[0] = ADC_SQR1_SQ1_N(in->channel);
+
+  in->adcp->adcm->OFR1 = 0;
+  in->adcp->adcm->OFR2 = 0;
+  in->adcp->adcm->OFR3 = 0;
+  in->adcp->adcm->OFR4 = 0;
+  calibration.calfact[input] = in->adcp->adcm->CALFACT & ADC_CALFACT_CALFACT_S;
+
+  if (adcConvert(in->adcp, &calib_grp, calib_samples, CALIB_SAMPLES) != MSG_OK)
+  {
+    if (calibration.offset[input] == 0) // Never measured
+      calibration.offset[input] = CALIB_ADC_MID;
+    return calibration.offset[input]; // Keep the previous value
+  }
+
+  for (i = 0; i < CALIB_SAMPLES; i++)
+    sum += calib_samples[i];
+
+  calibration.offset[input] = (uint16_t)((sum + CALIB_SAMPLES / 2) / CALIB_SAMPLES);
+  idle_acc[input] = (int32_t)calibration.offset[input] << CALIB_IDLE_SHIFT;
+
+  return calibration.offset[input];
+}
+
+void calibrateKnock(void)
+{
+  uint8_t i;
+
+  for (i = 0; i < KNOCK_SENSORS; i++)
+    calibMeasure(CALIB_KNOCK + i);
+#if KNOCK_USE_DUAL_MODE
+  calibMeasure(CALIB_KNOCK_DUAL);
+#endif
+}
+
+/*
+ * The VR sensors and comparators are biased by DAC1.
+ * We move the bias so the idle inputs read mid-scale, then measure
+ * the remaining offset of each ADC.
+ */
+void calibrateVr(void)
+{
+  int32_t error = 0;
+  uint8_t i;
+
+  calibration.dac_bias = CALIB_ADC_MID;
+  dacPutChannelX(&VR_DACD, 0, calibration.dac_bias);
+  chThdSleepMilliseconds(CALIB_SETTLE_MS);
+
+  for (i = CALIB_VR_FIRST; i <= CALIB_VR3; i++)
+    error += (int32_t)calibMeasure(i) - CALIB_ADC_MID;
+  error /= (CALIB_VR3 - CALIB_VR_FIRST + 1);
+
+  if (error > CALIB_DAC_MAX_TRIM)
+    error = CALIB_DAC_MAX_TRIM;
+  else if (error < -CALIB_DAC_MAX_TRIM)
+    error = -CALIB_DAC_MAX_TRIM;
+
+  calibration.dac_bias = (uint16_t)(CALIB_ADC_MID - error);
+  dacPutChannelX(&VR_DACD, 0, calibration.dac_bias);
+  chThdSleepMilliseconds(CALIB_SETTLE_MS);
+
+  for (i = CALIB_VR_FIRST; i <= CALIB_VR3; i++)
+    calibMeasure(i);
+}
+
+/*
+ * Returns the OFRx value that moves the measured offset of an input to zero.
+ * The hardware can only subtract, when the offset is below zero we return
+ * a null offset and the caller works with the raw offset.
+ */
+uint32_t calibOffsetReg(uint8_t input, uint16_t zero)
+{
+  const calib_input_t *in = &inputs[input];
+  uint16_t offset = calibration.offset[input];
+
+  applied[input] = offset > zero ? offset - zero : 0;
+
+  return ADC_OFR1_OFFSET1_EN |
+         ((uint32_t)in->channel << ADC_OFR1_OFFSET1_CH_Pos) |
+         (applied[input] & 0xFFF);
+}
+
+/*
+ * Zero-input code left after the OFR1 offset returned by calibOffsetReg().
+ */
+uint16_t calibZero(uint8_t input)
+{
+  return calibration.offset[input] - applied[input];
+}
+
+/*
+ * Feeds a frame to the idle offset filter, n samples stride apart.
+ * Frames with a signal on them are ignored.
+ * Returns true when the offset moved enough to be reloaded in OFR1,
+ * conversions have to be stopped to do so.
+ */
+CCM_FUNC bool calibTrackIdle(uint8_t input, const adcsample_t* samples, size_t n, size_t stride)
+{
+  int32_t val, min = INT32_MAX, max = INT32_MIN, sum = 0;
+  int32_t offset;
+  size_t i;
+
+  if (n == 0)
+    return false;
+
+  for (i = 0; i < n; i++)
+  {
+    if (inputs[input].left_aligned)
+      val = (int16_t)samples[i * stride] >> 3;
+    else
+      val = samples[i * stride];
+
+    if (val < min) min = val;
+    if (val > max) max = val;
+    sum += val;
+  }
+
+  if (max - min > CALIB_IDLE_MAX_SPAN)
+    return false;
+
+  /* Back to raw codes */
+  val = (sum / (int32_t)n) + applied[input];
+  idle_acc[input] += val - (idle_acc[input] >> CALIB_IDLE_SHIFT);
+  offset = idle_acc[input] >> CALIB_IDLE_SHIFT;
+
+  if (offset - calibration.offset[input] < CALIB_IDLE_MIN_STEP &&
+      calibration.offset[input] - offset < CALIB_IDLE_MIN_STEP)
+    return false;
+
+  calibration.offset[input] = (uint16_t)offset;
+  calibration.updates++;
+
+  return true;
+}
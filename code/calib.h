@@ -0,0 +1,44 @@
+#ifndef CALIB_H_
+#define CALIB_H_
+
+#include "hal.h"
+#include "knock.h"
+
+/* Calibrated analog inputs */
+#define CALIB_KNOCK 0 // First knock sensor, one input per sensor
+#define CALIB_VR1   (CALIB_KNOCK + KNOCK_SENSORS)
+#define CALIB_VR2   (CALIB_VR1 + 1)
+#define CALIB_VR3   (CALIB_VR1 + 2)
+#if KNOCK_USE_DUAL_MODE
+#define CALIB_KNOCK_DUAL (CALIB_VR3 + 1) // Knock input seen by the master ADC
+#define CALIB_VR_FIRST CALIB_VR2 // ADC1 belongs to the knock input
+#define CALIB_INPUTS (CALIB_KNOCK_DUAL + 1)
+#else
+#define CALIB_VR_FIRST CALIB_VR1
+#define CALIB_INPUTS (CALIB_VR3 + 1)
+#endif
+
+#define CALIB_SAMPLES 256 // Samples averaged by a one-shot measurement
+#define CALIB_ADC_MID 2048 // Ideal zero-input code, ADC raw value
+#define CALIB_DAC_MAX_TRIM 128 // Max DAC bias correction, DAC raw value
+#define CALIB_IDLE_MAX_SPAN 48 // Max peak to peak of a frame considered idle, ADC raw value
+#define CALIB_IDLE_SHIFT 4 // Idle tracking filter weight (1/16 per frame)
+#define CALIB_IDLE_MIN_STEP 2 // Offset change that triggers an OFR1 reload, ADC raw value
+
+typedef struct {
+  uint16_t offset[CALIB_INPUTS]; // Measured zero-input code, ADC raw value
+  uint16_t calfact[CALIB_INPUTS]; // ADC single ended self-calibration factor
+  uint16_t dac_bias; // DAC1 code biasing the VR sensors and comparators
+  uint16_t updates; // Idle re-calibrations applied since boot
+} calibration_t;
+
+extern calibration_t calibration;
+
+uint16_t calibMeasure(uint8_t input);
+void calibrateKnock(void);
+void calibrateVr(void);
+uint32_t calibOffsetReg(uint8_t input, uint16_t zero);
+uint16_t calibZero(uint8_t input);
+bool calibTrackIdle(uint8_t input, const adcsample_t* samples, size_t n, size_t stride);
+
+#endif
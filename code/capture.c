@@ -0,0 +1,322 @@
+#include "capture.h"
+#include "settings.h"
+#include "knock.h"
+#include "vr.h"
+#include "notify.h"
+#include "timebase.h"
+#include "usb_stream.h"
+
+/*
+ * The rings are written by the knock and VR threads, the space is
+ * reserved with the system locked and the copy is done unlocked. The
+ * capture freezes once every copy is done, the image is stable until
+ * captureDoneI() since the writers stop.
+ */
+
+#define RING_KNOCK 0
+#define RING_VR 1
+
+typedef struct {
+  uint16_t* buf;
+  uint16_t size;
+  uint16_t pos; // Next write
+  uint16_t filled; // Samples recorded since armed, up to size
+  uint16_t post; // Samples kept after the trigger
+  uint16_t left; // Post-trigger samples still to write
+} ring_t;
+
+static uint16_t knock_buf[CAPTURE_KNOCK_SAMPLES];
+static uint16_t vr_buf[CAPTURE_VR_SAMPLES];
+static ring_t rings[2] = {{knock_buf, CAPTURE_KNOCK_SAMPLES, 0, 0, 0, 0},
+                          {vr_buf, CAPTURE_VR_SAMPLES, 0, 0, 0, 0}};
+static uint8_t state = CAPTURE_IDLE;
+static uint8_t writers; // Copies running into the rings
+static uint16_t vr_phase; // First VR sample of the next block kept by the decimation
+static uint16_t usb_offset; // Image words sent on the stream
+static uint16_t seq;
+
+static union {
+  capture_header_t h;
+  uint16_t words[CAPTURE_HEADER_WORDS];
+} header;
+
+static void armI(void)
+{
+  uint8_t i;
+
+  for (i = 0; i < 2; i++)
+  {
+    rings[i].pos = 0;
+    rings[i].filled = 0;
+  }
+  vr_phase = 0;
+
+  header.h.knock_sensor = settings.capture_sensor;
+  header.h.vr = settings.capture_vr;
+  header.h.vr_decimation = settings.capture_vr_decimation == 0 ? 1 : settings.capture_vr_decimation;
+  state = CAPTURE_ARMED;
+}
+
+static void freezeI(void)
+{
+  uint8_t i;
+
+  header.h.magic = CAPTURE_MAGIC;
+  header.h.seq = ++seq;
+  header.h.end_time = timebaseNowI();
+  header.h.knock_count = rings[RING_KNOCK].filled;
+  header.h.knock_trigger = rings[RING_KNOCK].filled - (rings[RING_KNOCK].post - rings[RING_KNOCK].left);
+  header.h.vr_count = rings[RING_VR].filled;
+  header.h.vr_trigger = rings[RING_VR].filled - (rings[RING_VR].post - rings[RING_VR].left);
+  for (i = 0; i < 2; i++)
+    rings[i].left = 0;
+
+  usb_offset = 0;
+  state = CAPTURE_FROZEN;
+  notifyI(NOTIFY_CAPTURE, chSysGetRealtimeCounterX());
+}
+
+/*
+ * Follows the settings, from the knock thread once per frame.
+ */
+void captureUpdate(void)
+{
+  chSysLock();
+  if (settings.capture_trigger == 0)
+  {
+    if (state != CAPTURE_FROZEN)
+      state = CAPTURE_IDLE;
+  }
+  else if (state == CAPTURE_IDLE ||
+           (state == CAPTURE_ARMED &&
+            (header.h.knock_sensor != settings.capture_sensor ||
+             header.h.vr != settings.capture_vr ||
+             header.h.vr_decimation != (settings.capture_vr_decimation == 0 ? 1 : settings.capture_vr_decimation))))
+  {
+    armI();
+  }
+  chSysUnlock();
+}
+
+static void writeRing(uint8_t id, const uint16_t* samples, size_t n, uint16_t step)
+{
+  ring_t* r = &rings[id];
+  const uint16_t phase = id == RING_VR ? vr_phase : 0;
+  const size_t kept = phase < n ? (n - phase + step - 1) / step : 0;
+  size_t count = kept, i;
+  uint16_t pos;
+
+  if (id == RING_VR)
+    vr_phase = phase + kept * step - n;
+
+  chSysLock();
+  if (state != CAPTURE_ARMED && state != CAPTURE_TRIGGERED)
+  {
+    chSysUnlock();
+    return;
+  }
+  if (state == CAPTURE_TRIGGERED)
+  {
+    if (count > r->left)
+      count = r->left;
+    r->left -= count;
+  }
+  if (count > r->size)
+  {
+    samples += (count - r->size) * step; // Only the newest fit
+    count = r->size;
+  }
+  pos = r->pos;
+  r->pos = (pos + count) % r->size;
+  r->filled = count > (size_t)(r->size - r->filled) ? r->size : r->filled + count;
+  writers++;
+  chSysUnlock();
+
+  for (i = 0; i < count; i++)
+  {
+    r->buf[pos] = samples[phase + i * step];
+    if (++pos == r->size)
+      pos = 0;
+  }
+
+  chSysLock();
+  writers--;
+  if (state == CAPTURE_TRIGGERED && writers == 0 &&
+      ((rings[RING_KNOCK].left == 0 && rings[RING_VR].left == 0) ||
+       timebaseNowI() - header.h.trigger_time >= CAPTURE_POST_TIMEOUT_US))
+  {
+    freezeI();
+  }
+  chSysUnlock();
+}
+
+/*
+ * Knock frame of a sensor, q15 samples are stored as they are.
+ */
+void captureKnock(uint8_t sensor, const uint16_t* samples, size_t n)
+{
+  if (state == CAPTURE_IDLE || state == CAPTURE_FROZEN || sensor != header.h.knock_sensor)
+    return;
+
+  writeRing(RING_KNOCK, samples, n, 1);
+}
+
+void captureVr(uint8_t vr, const uint16_t* samples, size_t n)
+{
+  if (state == CAPTURE_IDLE || state == CAPTURE_FROZEN || vr != header.h.vr)
+    return;
+
+  writeRing(RING_VR, samples, n, header.h.vr_decimation);
+}
+
+/*
+ * Trigger source, ignored unless enabled and armed. The VR triggers only
+ * apply to the recorded VR.
+ */
+void captureTriggerI(uint8_t trigger, uint8_t channel, uint16_t value)
+{
+  uint8_t i;
+
+  trigger &= settings.capture_trigger;
+  if (state != CAPTURE_ARMED || trigger == 0)
+    return;
+  if ((trigger & CAPTURE_TRIG_KNOCK) == 0 && channel != header.h.vr)
+    return;
+
+  header.h.trigger = trigger;
+  header.h.channel = channel;
+  header.h.value = value;
+  header.h.trigger_time = timebaseNowI();
+  header.h.knock_rate = knockGetSampleFreq();
+  header.h.vr_rate = VR_SAMPLE_FREQ;
+
+  for (i = 0; i < 2; i++)
+  {
+    const uint16_t post = settings.capture_post > 100 ? 100 : settings.capture_post;
+
+    rings[i].post = (uint32_t)rings[i].size * post / 100;
+    rings[i].left = rings[i].post;
+  }
+
+  state = CAPTURE_TRIGGERED;
+  if (rings[RING_KNOCK].post == 0 && rings[RING_VR].post == 0 && writers == 0)
+    freezeI(); // No post-trigger samples
+}
+
+/*
+ * Register value: state in the low byte, captures in the high one.
+ */
+uint16_t captureGetStatus(void)
+{
+  return state | (seq << 8);
+}
+
+/*
+ * Sequence and size in words of the frozen image, false if there is none.
+ */
+bool captureImageI(uint16_t* image_seq, uint16_t* size)
+{
+  if (state != CAPTURE_FROZEN)
+    return false;
+
+  *image_seq = seq;
+  *size = CAPTURE_HEADER_WORDS + rings[RING_KNOCK].filled + rings[RING_VR].filled;
+  return true;
+}
+
+static uint16_t imageWord(uint16_t i)
+{
+  uint8_t id;
+
+  if (i < CAPTURE_HEADER_WORDS)
+    return header.words[i];
+  i -= CAPTURE_HEADER_WORDS;
+
+  for (id = 0; id < 2; id++)
+  {
+    const ring_t* r = &rings[id];
+
+    if (i < r->filled)
+    {
+      uint32_t pos = r->pos + r->size - r->filled + i; // Oldest first
+      if (pos >= r->size)
+        pos -= r->size;
+      return r->buf[pos];
+    }
+    i -= r->filled;
+  }
+  return 0;
+}
+
+/*
+ * Image words, valid while the image captureImageI() returned is frozen.
+ */
+void captureRead(uint16_t offset, uint16_t* dst, size_t n)
+{
+  size_t i;
+
+  for (i = 0; i < n; i++)
+    dst[i] = imageWord(offset + i);
+}
+
+/*
+ * The image was dumped, recording starts again.
+ */
+void captureDoneI(uint16_t image_seq)
+{
+  if (state != CAPTURE_FROZEN || image_seq != seq)
+    return;
+
+  if (settings.capture_trigger != 0)
+    armI();
+  else
+    state = CAPTURE_IDLE;
+}
+
+/*
+ * Sends the frozen image on the USB stream, a frame per call, from the
+ * USB thread. Frames start with their image offset, the stream channel
+ * is the capture sequence.
+ */
+static uint16_t usb_frame[1 + CAPTURE_USB_WORDS];
+
+void captureUsbService(void)
+{
+  uint16_t image_seq, size, offset, n;
+
+  if (!usbStreamEnabled(STREAM_CAPTURE))
+    return;
+
+  chSysLock();
+  if (!captureImageI(&image_seq, &size))
+  {
+    chSysUnlock();
+    return;
+  }
+  offset = usb_offset;
+  chSysUnlock();
+
+  n = size - offset > CAPTURE_USB_WORDS ? CAPTURE_USB_WORDS : size - offset;
+  usb_frame[0] = offset;
+  captureRead(offset, &usb_frame[1], n);
+
+  chSysLock();
+  if (state != CAPTURE_FROZEN || seq != image_seq)
+  {
+    chSysUnlock();
+    return; // Dumped on SPI meanwhile, the copy may be torn
+  }
+  chSysUnlock();
+
+  if (!usbStreamWrite(STREAM_CAPTURE, image_seq & 0xFF, usb_frame, n + 1))
+    return; // No room, sent again
+
+  chSysLock();
+  if (state == CAPTURE_FROZEN && seq == image_seq)
+  {
+    usb_offset = offset + n;
+    if (usb_offset >= size)
+      captureDoneI(image_seq);
+  }
+  chSysUnlock();
+}
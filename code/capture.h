@@ -0,0 +1,40 @@
+#ifndef CAPTURE_H_
+#define CAPTURE_H_
+
+#include "ch.h"
+#include "capture_format.h"
+#include "knock.h"
+
+/*
+ * Pre-trigger capture of the knock and VR samples, see capture_format.h.
+ * One knock sensor and one VR are recorded in RAM rings, a trigger keeps
+ * settings.capture_post percent of each ring for the samples following
+ * it, then the rings are frozen until dumped. Acquisition goes on, only
+ * the recording stops.
+ */
+
+#define CAPTURE_KNOCK_SAMPLES 2048 // 4 frames, 20ms at 100kS/s
+#define CAPTURE_VR_SAMPLES 1024 // 8.4ms with a decimation of 8
+#define CAPTURE_POST_TIMEOUT_US 100000 // Frozen anyway when a source is stopped
+#define CAPTURE_USB_WORDS 256 // Image words per stream frame
+#define CAPTURE_SPI_WORDS 64 // Image words per SPI frame
+
+#define CAPTURE_DEFAULT_POST 50 // Percent
+#define CAPTURE_DEFAULT_DECIMATION 8
+#if KNOCK_USE_DUAL_MODE
+#define CAPTURE_DEFAULT_VR 1 // VR1 is off
+#else
+#define CAPTURE_DEFAULT_VR 0
+#endif
+
+void captureUpdate(void);
+void captureKnock(uint8_t sensor, const uint16_t* samples, size_t n);
+void captureVr(uint8_t vr, const uint16_t* samples, size_t n);
+void captureTriggerI(uint8_t trigger, uint8_t channel, uint16_t value);
+uint16_t captureGetStatus(void);
+bool captureImageI(uint16_t* seq, uint16_t* size);
+void captureRead(uint16_t offset, uint16_t* dst, size_t n);
+void captureDoneI(uint16_t seq);
+void captureUsbService(void);
+
+#endif
@@ -0,0 +1,46 @@
+#ifndef CAPTURE_FORMAT_H_
+#define CAPTURE_FORMAT_H_
+
+#include <stdint.h>
+
+/*
+ * Frozen capture image, shared with the host tools.
+ * 16 bits words, little endian: the header, the knock samples then the
+ * VR samples, oldest first. The trigger indexes are the first sample
+ * written after the trigger, with the resolution of an ADC block, the
+ * trigger time gives the exact instant.
+ */
+
+#define CAPTURE_MAGIC 0x4350 // "PC" on the wire
+
+#define CAPTURE_TRIG_KNOCK (1 << 0) // A knock sensor output reached settings.capture_level
+#define CAPTURE_TRIG_VR_LOST (1 << 1) // Recorded VR lost its signal after a valid tooth
+#define CAPTURE_TRIG_VR_TIMEOUT (1 << 2) // Recorded VR overflow timer ran out
+
+#define CAPTURE_IDLE 0 // No trigger enabled
+#define CAPTURE_ARMED 1 // Recording, waiting for a trigger
+#define CAPTURE_TRIGGERED 2 // Recording the post-trigger samples
+#define CAPTURE_FROZEN 3 // Waiting to be dumped
+
+typedef struct {
+  uint16_t magic;
+  uint8_t trigger; // CAPTURE_TRIG_ that fired
+  uint8_t channel; // Knock sensor or VR of the trigger
+  uint16_t value; // Knock output or VR interval at the trigger
+  uint16_t seq; // Captures since reset
+  uint16_t knock_count; // Samples
+  uint16_t knock_trigger;
+  uint16_t vr_count;
+  uint16_t vr_trigger;
+  uint8_t knock_sensor;
+  uint8_t vr;
+  uint16_t vr_decimation;
+  uint32_t knock_rate; // Hz
+  uint32_t vr_rate; // Hz, before the decimation
+  uint32_t trigger_time; // Local timebase us
+  uint32_t end_time; // Last sample, local timebase us
+} __attribute__((packed)) capture_header_t;
+
+#define CAPTURE_HEADER_WORDS (sizeof(capture_header_t) / 2)
+
+#endif
@@ -590,7 +590,8 @@
  * @details User fields added to the end of the @p thread_t structure.
  */
 #define CH_CFG_THREAD_EXTRA_FIELDS                                          \
-  /* Add threads custom fields here.*/
+  /* Add threads custom fields here.*/                                      \
+  uint8_t load_slot; /* CPU load accounting, 0 until it first runs */
 
 /**
  * @brief   Threads initialization hook.
@@ -601,6 +602,7 @@
  */
 #define CH_CFG_THREAD_INIT_HOOK(tp) {                                       \
   /* Add threads initialization code here.*/                                \
+  (tp)->load_slot = 0;                                                      \
 }
 
 /**
@@ -617,6 +619,9 @@
  */
 #define CH_CFG_CONTEXT_SWITCH_HOOK(ntp, otp) {                              \
   /* Context switch code here.*/                                            \
+  (void)(otp);                                                              \
+  cpuloadSwitchHook(ntp);                                                   \
+  traceSwitchHook(ntp);                                                     \
 }
 
 /**
@@ -624,6 +629,8 @@
  */
 #define CH_CFG_IRQ_PROLOGUE_HOOK() {                                        \
   /* IRQ prologue code here.*/                                              \
+  cpuloadIrqEnter();                                                        \
+  traceIrqHook();                                                           \
 }
 
 /**
@@ -631,6 +638,7 @@
  */
 #define CH_CFG_IRQ_EPILOGUE_HOOK() {                                        \
   /* IRQ epilogue code here.*/                                              \
+  cpuloadIrqLeave();                                                        \
 }
 
 /**
@@ -675,9 +683,11 @@
  * @details This hook is invoked in case to a system halting error before
  *          the system is halted.
  */
+#if !defined(CH_CFG_SYSTEM_HALT_HOOK)
 #define CH_CFG_SYSTEM_HALT_HOOK(reason) {                                   \
   /* System halt code here.*/                                               \
 }
+#endif
 
 /**
  * @brief   Trace hook.
@@ -694,6 +704,16 @@
 /* Port-specific settings (override port settings defaulted in chcore.h).    */
 /*===========================================================================*/
 
+/* CPU load and trace hooks, see cpuload.c and trace.c */
+#if !defined(_FROM_ASM_)
+struct ch_thread;
+void cpuloadSwitchHook(struct ch_thread *ntp);
+void cpuloadIrqEnter(void);
+void cpuloadIrqLeave(void);
+void traceSwitchHook(struct ch_thread *ntp);
+void traceIrqHook(void);
+#endif
+
 #endif  /* CHCONF_H */
 
 /** @} */
@@ -0,0 +1,190 @@
+#include <string.h>
+#include "hal.h"
+#include "cpuload.h"
+#include "usb_stream.h"
+
+/*
+ * Cycles are charged to the running context at each change: thread
+ * switches from the kernel hook, interrupt entries and exits from the
+ * IRQ hooks. Nested interrupts are stacked so each one only gets its own
+ * cycles. Exception stacking and the fast interrupts above the kernel
+ * are charged to the interrupted context.
+ * Slots are given on first use, when they run out slot 0 gets the rest.
+ */
+
+#define SLOT_OTHER 0
+#define SLOT_TOTAL CPULOAD_SLOTS // Windows only
+
+static uint32_t cycles[CPULOAD_SLOTS]; // Running totals, wrap
+static rtcnt_t last; // Counter at the last change
+static uint8_t current; // Slot being charged
+static uint8_t nested[CORTEX_PRIORITY_LEVELS]; // Slots of the interrupted contexts
+static uint8_t depth;
+static uint8_t irq_slots[CPULOAD_VECTORS];
+static uint8_t slots = 1; // In use
+static uint16_t ids[CPULOAD_SLOTS];
+static thread_t* threads[CPULOAD_SLOTS]; // For the names
+
+/* Monitor thread side */
+static uint32_t previous[CPULOAD_SLOTS]; // Totals at the last update
+static rtcnt_t previous_time;
+static bool started;
+static uint16_t history[CPULOAD_HISTORY][CPULOAD_SLOTS + 1];
+static uint16_t averages[CPULOAD_SLOTS + 1];
+static uint16_t peaks[CPULOAD_SLOTS + 1];
+static uint8_t history_pos;
+static uint8_t history_len;
+static uint16_t frame[(CPULOAD_SLOTS + 1) * sizeof(stream_load_t) / 2];
+
+static uint8_t newSlotI(uint16_t id, thread_t* tp)
+{
+  if (slots == CPULOAD_SLOTS)
+    return SLOT_OTHER;
+
+  ids[slots] = id;
+  threads[slots] = tp;
+  return slots++;
+}
+
+CCM_FUNC static void chargeI(uint8_t next)
+{
+  const rtcnt_t now = chSysGetRealtimeCounterX();
+
+  cycles[current] += now - last;
+  last = now;
+  current = next;
+}
+
+/*
+ * CH_CFG_CONTEXT_SWITCH_HOOK, runs from thread mode with the kernel locked.
+ */
+CCM_FUNC void cpuloadSwitchHook(thread_t* ntp)
+{
+  if (ntp->load_slot == 0)
+    ntp->load_slot = newSlotI(slots, ntp);
+  chargeI(ntp->load_slot);
+}
+
+/*
+ * CH_CFG_IRQ_PROLOGUE_HOOK and CH_CFG_IRQ_EPILOGUE_HOOK, higher priority
+ * interrupts are masked while the stack changes.
+ */
+CCM_FUNC void cpuloadIrqEnter(void)
+{
+  const uint32_t vector = __get_IPSR() & 0x1FF;
+  uint8_t slot;
+
+  port_lock_from_isr();
+  slot = irq_slots[vector];
+  if (slot == 0)
+    slot = irq_slots[vector] = newSlotI(STREAM_LOAD_IRQ | vector, NULL);
+  nested[depth++] = current;
+  chargeI(slot);
+  port_unlock_from_isr();
+}
+
+CCM_FUNC void cpuloadIrqLeave(void)
+{
+  port_lock_from_isr();
+  chargeI(nested[--depth]);
+  port_unlock_from_isr();
+}
+
+static uint16_t loadOf(uint32_t count, uint32_t period)
+{
+  return (uint16_t)(((uint64_t)count * 1000 + period / 2) / period);
+}
+
+/*
+ * Closes a window, called every CPULOAD_PERIOD_MS by the monitor thread.
+ * The table is sent on the USB stream when enabled.
+ */
+void cpuloadUpdate(void)
+{
+  thread_t* const idle = chSysGetIdleThreadX();
+  uint32_t totals[CPULOAD_SLOTS];
+  uint16_t* const window = history[history_pos];
+  stream_load_t* const rows = (stream_load_t*)frame;
+  uint32_t period, sum;
+  rtcnt_t now;
+  uint8_t used, i, j;
+
+  chSysLock();
+  chargeI(current);
+  now = last;
+  used = slots;
+  memcpy(totals, cycles, sizeof(totals));
+  chSysUnlock();
+
+  period = now - previous_time;
+  previous_time = now;
+  if (!started || period == 0)
+  {
+    /* The first window starts here */
+    memcpy(previous, totals, sizeof(previous));
+    started = true;
+    return;
+  }
+
+  window[SLOT_TOTAL] = 1000;
+  for (i = 0; i < used; i++)
+  {
+    window[i] = loadOf(totals[i] - previous[i], period);
+    previous[i] = totals[i];
+    if (i != SLOT_OTHER && threads[i] == idle)
+      window[SLOT_TOTAL] = window[i] < 1000 ? 1000 - window[i] : 0;
+  }
+
+  if (history_len < CPULOAD_HISTORY)
+    history_len++;
+  if (++history_pos == CPULOAD_HISTORY)
+    history_pos = 0;
+
+  for (i = 0; i <= SLOT_TOTAL; i++)
+  {
+    if (i >= used && i != SLOT_TOTAL)
+      continue;
+    sum = 0;
+    for (j = 0; j < history_len; j++)
+      sum += history[j][i];
+    averages[i] = sum / history_len;
+    if (window[i] > peaks[i])
+      peaks[i] = window[i];
+  }
+
+  if (!usbStreamEnabled(STREAM_LOAD))
+    return;
+
+  memset(frame, 0, sizeof(frame));
+  rows[0].id = STREAM_LOAD_TOTAL;
+  rows[0].load = window[SLOT_TOTAL];
+  rows[0].average = averages[SLOT_TOTAL];
+  rows[0].peak = peaks[SLOT_TOTAL];
+  for (i = 0; i < used; i++)
+  {
+    stream_load_t* row = &rows[i + 1];
+
+    row->id = i == SLOT_OTHER ? STREAM_LOAD_OTHER : ids[i];
+    row->load = window[i];
+    row->average = averages[i];
+    row->peak = peaks[i];
+    if (threads[i] != NULL && chRegGetThreadNameX(threads[i]) != NULL)
+      strncpy(row->name, chRegGetThreadNameX(threads[i]), sizeof(row->name));
+  }
+  usbStreamWrite(STREAM_LOAD, 0, frame, (used + 1) * sizeof(stream_load_t) / 2);
+}
+
+uint16_t cpuloadGetLoad(void)
+{
+  return history[history_pos == 0 ? CPULOAD_HISTORY - 1 : history_pos - 1][SLOT_TOTAL];
+}
+
+uint16_t cpuloadGetAverage(void)
+{
+  return averages[SLOT_TOTAL];
+}
+
+uint16_t cpuloadGetPeak(void)
+{
+  return peaks[SLOT_TOTAL];
+}
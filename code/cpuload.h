@@ -0,0 +1,24 @@
+#ifndef CPULOAD_H_
+#define CPULOAD_H_
+
+#include "ch.h"
+
+/*
+ * CPU load of each thread and interrupt, from the DWT cycle counter.
+ * Loads are in 0.1 % of the cycles of a CPULOAD_PERIOD_MS window, the
+ * average is over the last CPULOAD_HISTORY windows and the peak is the
+ * highest window since reset. The total is everything but idle.
+ */
+
+#define CPULOAD_PERIOD_MS 1000
+#define CPULOAD_HISTORY 10 // Windows averaged, 10 s
+#define CPULOAD_SLOTS 24 // Threads and interrupts accounted, slot 0 gets the rest
+#define CPULOAD_VECTORS (16 + CORTEX_NUM_VECTORS) // Exception numbers
+
+/* The hooks are declared in chconf.h */
+void cpuloadUpdate(void);
+uint16_t cpuloadGetLoad(void);
+uint16_t cpuloadGetAverage(void);
+uint16_t cpuloadGetPeak(void);
+
+#endif
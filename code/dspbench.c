@@ -0,0 +1,274 @@
+#include <string.h>
+#include <math.h>
+#include "dspbench.h"
+#include "knock_dsp.h"
+#include "vr_dsp.h"
+#if !defined(DSPBENCH_HOSTED)
+#include "ch.h"
+#include "usb_stream.h"
+#include "vr.h"
+#else
+#include <time.h>
+#define VR_SAMPLES 512 // vr.h
+#define VR_ZERO 2047
+#endif
+
+/*
+ * Each kernel is timed alone, its setup is not, and the timer overhead
+ * is taken off. A run makes per_run calls of the kernel, the median
+ * filter is called for every sample of a VR frame for instance.
+ * The fastest repeat is the one to compare, the mean shows the spread
+ * from the interrupts and caches.
+ */
+
+#define BENCH_RATE 100000 // Hz, KNOCK_DEFAULT_RATE
+#define BENCH_KNOCK_FREQ 6600 // Hz, between two bins
+#define BENCH_KNOCK_AMP 1000 // ADC codes
+#define BENCH_VR_FREQ 3600 // Hz, 36 teeth at 6000 rpm
+#define BENCH_VR_SAMPLE_FREQ 972972 // VR_SAMPLE_FREQ
+#define BENCH_VR_AMP 800 // ADC codes
+#define BENCH_RATIO 20000 // Default knock_ratio setting
+
+#if defined(DSPBENCH_HOSTED)
+#define BENCH_UNIT STREAM_BENCH_NS
+
+static uint32_t benchNow(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint32_t)(ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+#else
+#define BENCH_UNIT STREAM_BENCH_CYCLES
+#define benchNow() chSysGetRealtimeCounterX()
+#endif
+
+typedef struct {
+  const char* name;
+  void (*setup)(void);
+  void (*run)(void);
+  uint16_t runs; // Per repeat
+  uint16_t per_run;
+} bench_kernel_t;
+
+static knock_dsp_t dsp;
+static knock_kernel_t kernel;
+static q15_t knock_frame[FFT_SIZE];
+static knock_dsp_sample_t windowed[FFT_SIZE];
+static uint16_t spectrum[SPECTRUM_SIZE];
+static uint16_t vr_frame[VR_SAMPLES];
+static pair_t vr_pairs[VR_SAMPLES];
+static median_t median;
+static high_low_t peak;
+static const high_low_t threshold = {VR_ZERO + 400, VR_ZERO - 400};
+static volatile uint16_t sink;
+
+static stream_bench_t results[DSPBENCH_KERNELS];
+static size_t result_count;
+#if !defined(DSPBENCH_HOSTED)
+static uint16_t frame[DSPBENCH_KERNELS * sizeof(stream_bench_t) / 2];
+static bool sent;
+#endif
+
+static uint32_t lcg_state;
+
+/* Uniform noise in [-0.5, 0.5), the same on every build */
+static float noise(void)
+{
+  lcg_state = lcg_state * 1664525U + 1013904223U;
+  return ((float)(lcg_state >> 8) / 16777216.0f) - 0.5f;
+}
+
+/* Offset corrected, left aligned knock samples, as the ADC gives them */
+static void makeInputs(void)
+{
+  uint16_t i;
+
+  lcg_state = 1;
+  for (i = 0; i < FFT_SIZE; i++)
+  {
+    const float val = BENCH_KNOCK_AMP * sinf(2.0f * PI * BENCH_KNOCK_FREQ * i / BENCH_RATE) + 4.0f * noise();
+    knock_frame[i] = (q15_t)lroundf(val) * 8;
+  }
+  for (i = 0; i < VR_SAMPLES; i++)
+  {
+    const float val = BENCH_VR_AMP * sinf(2.0f * PI * BENCH_VR_FREQ * i / BENCH_VR_SAMPLE_FREQ) + 16.0f * noise();
+    vr_frame[i] = (uint16_t)(VR_ZERO + lroundf(val));
+  }
+
+  knockDspInit(&dsp);
+  knockDspKernel(&kernel, BENCH_KNOCK_FREQ, BENCH_RATIO, BENCH_RATE);
+  knockDspWindow(&dsp, knock_frame);
+  memcpy(windowed, dsp.input, sizeof(windowed));
+  knockDspTransform(&dsp);
+  knockDspMagnitude(&dsp, spectrum);
+  median_init(&median, VR_ZERO, vr_pairs, VR_SAMPLES);
+}
+
+static void runWindow(void)
+{
+  knockDspWindow(&dsp, knock_frame);
+}
+
+/* The transform uses its input as scratch */
+static void setupTransform(void)
+{
+  memcpy(dsp.input, windowed, sizeof(windowed));
+}
+
+static void runTransform(void)
+{
+  knockDspTransform(&dsp);
+}
+
+static void runComplexMag(void)
+{
+  knockDspComplexMag(&dsp);
+}
+
+static void runSpectrum(void)
+{
+  knockDspSpectrum(&dsp, spectrum);
+}
+
+static void runIntegrate(void)
+{
+  uint8_t i;
+
+  for (i = 0; i < 16; i++)
+    sink += knockDspIntegrate(&kernel, spectrum);
+}
+
+/* Everything processKnockFrame() does to a sensor frame */
+static void runKnockFrame(void)
+{
+  knockDspWindow(&dsp, knock_frame);
+  knockDspTransform(&dsp);
+  knockDspMagnitude(&dsp, spectrum);
+  sink += knockDspIntegrate(&kernel, spectrum);
+}
+
+static void runMedian(void)
+{
+  uint16_t i;
+
+  for (i = 0; i < VR_SAMPLES; i++)
+    sink += median_filter(&median, vr_frame[i]);
+}
+
+static void setupCheckPeak(void)
+{
+  peak.high = VR_ZERO;
+  peak.low = VR_ZERO;
+}
+
+static void runCheckPeak(void)
+{
+  sink += vrDspCheckPeak(&peak, &threshold, &median, vr_frame, VR_SAMPLES);
+}
+
+static const bench_kernel_t kernels[DSPBENCH_KERNELS] = {
+  {"window", NULL, runWindow, 25, 1},
+  {"rfft", setupTransform, runTransform, 25, 1},
+  {"cmplx_mag", NULL, runComplexMag, 25, 1},
+  {"spectrum", NULL, runSpectrum, 25, 1}, // The output_knock conversion
+  {"integrate", NULL, runIntegrate, 25, 16},
+  {"knock_frame", setupTransform, runKnockFrame, 25, 1},
+  {"median", NULL, runMedian, 10, VR_SAMPLES},
+  {"check_peak", setupCheckPeak, runCheckPeak, 10, 1},
+};
+
+static uint32_t timerOverhead(void)
+{
+  uint32_t best = UINT32_MAX, start, ticks;
+  uint8_t i;
+
+  for (i = 0; i < 16; i++)
+  {
+    start = benchNow();
+    ticks = benchNow() - start;
+    if (ticks < best)
+      best = ticks;
+  }
+  return best;
+}
+
+/*
+ * Runs every kernel, takes from a few hundred ms on the target.
+ */
+void dspbenchRun(void)
+{
+  const uint32_t overhead = timerOverhead();
+  size_t k;
+
+  makeInputs();
+
+  for (k = 0; k < DSPBENCH_KERNELS; k++)
+  {
+    const bench_kernel_t* b = &kernels[k];
+    stream_bench_t* res = &results[k];
+    uint16_t r, i;
+
+    memset(res, 0, sizeof(*res));
+    strncpy(res->name, b->name, sizeof(res->name));
+    res->variant = KNOCK_DSP;
+    res->unit = BENCH_UNIT;
+    res->repeats = DSPBENCH_REPEATS;
+    res->best = UINT32_MAX;
+
+    /* Untimed, loads the caches and the branch predictor */
+    if (b->setup != NULL)
+      b->setup();
+    b->run();
+
+    for (r = 0; r < DSPBENCH_REPEATS; r++)
+    {
+      uint32_t ticks = 0;
+
+      for (i = 0; i < b->runs; i++)
+      {
+        uint32_t start, elapsed;
+
+        if (b->setup != NULL)
+          b->setup();
+        start = benchNow();
+        b->run();
+        elapsed = benchNow() - start;
+        ticks += elapsed > overhead ? elapsed - overhead : 0;
+      }
+      if (ticks < res->best)
+        res->best = ticks;
+      res->total += ticks;
+    }
+    res->calls = (uint32_t)DSPBENCH_REPEATS * b->runs * b->per_run;
+  }
+  result_count = DSPBENCH_KERNELS;
+#if !defined(DSPBENCH_HOSTED)
+  memcpy(frame, results, sizeof(frame));
+  sent = false;
+#endif
+}
+
+const stream_bench_t* dspbenchResults(size_t* count)
+{
+  *count = result_count;
+  return results;
+}
+
+#if !defined(DSPBENCH_HOSTED)
+/*
+ * Sends the results once the stream is enabled, called by the monitor
+ * thread.
+ */
+void dspbenchUpdate(void)
+{
+  if (!usbStreamEnabled(STREAM_BENCH))
+  {
+    sent = false;
+    return;
+  }
+  if (!sent && result_count != 0)
+    sent = usbStreamWrite(STREAM_BENCH, 0, frame, sizeof(frame) / 2);
+}
+#endif
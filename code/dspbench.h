@@ -0,0 +1,26 @@
+#ifndef DSPBENCH_H_
+#define DSPBENCH_H_
+
+#include <stddef.h>
+#include "stream_format.h"
+
+/*
+ * Benchmark of the DSP kernels of the knock and VR paths, on fixed
+ * inputs so the results compare across commits.
+ * The firmware runs it once at start when built with USE_DSPBENCH=yes,
+ * before the threads and the watchdog, and sends the results as a
+ * STREAM_BENCH frame (kvr_stream -b). bench/ runs it on the host.
+ */
+
+#if !defined(DSPBENCH_ENABLED)
+#define DSPBENCH_ENABLED FALSE
+#endif
+
+#define DSPBENCH_KERNELS 8
+#define DSPBENCH_REPEATS 8
+
+void dspbenchRun(void);
+const stream_bench_t* dspbenchResults(size_t* count);
+void dspbenchUpdate(void);
+
+#endif
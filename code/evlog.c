@@ -0,0 +1,141 @@
+#include <string.h>
+#include "evlog.h"
+#include "evlog_encode.h"
+#include "timebase.h"
+#include "usb_stream.h"
+
+/*
+ * Blocks are filled from interrupts with the system locked, closed ones
+ * are sent by the USB thread. When every block is waiting the events are
+ * counted and the next block tells how many were dropped.
+ */
+
+static uint16_t blocks[EVLOG_BLOCKS][EVLOG_BLOCK_SIZE / 2]; // Sent as words
+static uint16_t lens[EVLOG_BLOCKS]; // Bytes
+static uint8_t head; // Block being filled
+static uint8_t tail; // Oldest closed block
+static uint8_t closed; // Blocks waiting to be sent
+static bool open; // The head block was started
+static uint16_t key_len; // Length of the head block time
+static uint32_t open_time;
+static uint32_t last_time; // Previous event, local us
+static uint32_t dropped;
+static bool enabled; // The stream is on
+
+static bool openBlockI(uint32_t now)
+{
+  uint8_t* block = (uint8_t*)blocks[head];
+  size_t len;
+
+  if (closed == EVLOG_BLOCKS)
+    return false;
+
+  len = evlogPutEvent(block, EVLOG_TIME, 0, now, 0);
+  key_len = len;
+  if (dropped != 0)
+  {
+    len += evlogPutEvent(&block[len], EVLOG_OVERFLOW, 0, 0, dropped);
+    dropped = 0;
+  }
+
+  lens[head] = len;
+  open = true;
+  open_time = now;
+  last_time = now;
+  return true;
+}
+
+static void closeBlockI(void)
+{
+  uint8_t* block = (uint8_t*)blocks[head];
+
+  if (lens[head] & 1)
+    block[lens[head]++] = EVLOG_PAD;
+
+  open = false;
+  closed++;
+  if (++head == EVLOG_BLOCKS)
+    head = 0;
+}
+
+/*
+ * Appends an event, timestamped now.
+ */
+CCM_FUNC void evlogI(uint8_t type, uint8_t channel, uint32_t value)
+{
+  uint8_t event[EVLOG_MAX_EVENT];
+  uint32_t now;
+  size_t len;
+
+  if (!enabled)
+    return;
+
+  now = timebaseNowI();
+  if (!open && !openBlockI(now))
+  {
+    dropped++;
+    return;
+  }
+
+  len = evlogPutEvent(event, type, channel, now - last_time, value);
+  if (lens[head] + len > EVLOG_BLOCK_SIZE)
+  {
+    closeBlockI();
+    if (!openBlockI(now))
+    {
+      dropped++;
+      return;
+    }
+    len = evlogPutEvent(event, type, channel, 0, value);
+  }
+
+  memcpy((uint8_t*)blocks[head] + lens[head], event, len);
+  lens[head] += len;
+  last_time = now;
+}
+
+/*
+ * Sends a block per call from the USB thread, a partial block once it
+ * is EVLOG_FLUSH_US old.
+ */
+void evlogUsbService(void)
+{
+  uint8_t block;
+
+  chSysLock();
+  enabled = usbStreamEnabled(STREAM_EVLOG);
+  if (!enabled)
+  {
+    head = tail = closed = 0;
+    open = false;
+    dropped = 0;
+    chSysUnlock();
+    return;
+  }
+
+  /* Drops are reported even when no event follows */
+  if (closed == 0 && !open && dropped != 0)
+    openBlockI(timebaseNowI());
+
+  if (closed == 0 && open && lens[head] > key_len &&
+      timebaseNowI() - open_time >= EVLOG_FLUSH_US)
+    closeBlockI();
+
+  if (closed == 0)
+  {
+    chSysUnlock();
+    return;
+  }
+  block = tail;
+  chSysUnlock();
+
+  /* Closed blocks are not written, the copy is done unlocked */
+  if (!usbStreamWrite(STREAM_EVLOG, 0, blocks[block], lens[block] / 2))
+    return; // No room, sent again
+
+  chSysLock();
+  if (++tail == EVLOG_BLOCKS)
+    tail = 0;
+  closed--;
+  chSysUnlock();
+}
@@ -0,0 +1,20 @@
+#ifndef EVLOG_H_
+#define EVLOG_H_
+
+#include "ch.h"
+#include "evlog_format.h"
+
+/*
+ * Event log of the teeth, knock windows and faults, see evlog_format.h.
+ * Events go to a ring of blocks sent on the USB stream as STREAM_EVLOG
+ * frames, one block per frame. Nothing is logged while the stream is off.
+ */
+
+#define EVLOG_BLOCKS 8
+#define EVLOG_BLOCK_SIZE 256 // Bytes
+#define EVLOG_FLUSH_US 10000 // Age of a partial block sent anyway
+
+void evlogI(uint8_t type, uint8_t channel, uint32_t value);
+void evlogUsbService(void);
+
+#endif
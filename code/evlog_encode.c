@@ -0,0 +1,30 @@
+#include "evlog_encode.h"
+
+size_t evlogPutVarint(uint8_t* dst, uint32_t val)
+{
+  size_t len = 0;
+
+  while (val >= 0x80)
+  {
+    dst[len++] = (val & 0x7F) | 0x80;
+    val >>= 7;
+  }
+  dst[len++] = val;
+
+  return len;
+}
+
+/*
+ * Returns the event length.
+ */
+size_t evlogPutEvent(uint8_t* dst, uint8_t type, uint8_t channel, uint32_t delta, uint32_t value)
+{
+  size_t len = 1;
+
+  dst[0] = EVLOG_TAG(type, channel & 0x0F);
+  len += evlogPutVarint(&dst[len], delta);
+  if (EVLOG_HAS_VALUE(type))
+    len += evlogPutVarint(&dst[len], value);
+
+  return len;
+}
@@ -0,0 +1,16 @@
+#ifndef EVLOG_ENCODE_H_
+#define EVLOG_ENCODE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "evlog_format.h"
+
+/*
+ * Event encoder, portable so the host tests run the firmware code.
+ * The destination needs EVLOG_MAX_EVENT bytes.
+ */
+
+size_t evlogPutVarint(uint8_t* dst, uint32_t val);
+size_t evlogPutEvent(uint8_t* dst, uint8_t type, uint8_t channel, uint32_t delta, uint32_t value);
+
+#endif
@@ -0,0 +1,44 @@
+#ifndef EVLOG_FORMAT_H_
+#define EVLOG_FORMAT_H_
+
+#include <stdint.h>
+
+/*
+ * Compact event log, shared with the host tools.
+ * Event: tag byte (type in the low nibble, channel in the high one),
+ * varint time delta in us from the previous event, then a varint value
+ * for the types that have one. Varints are 7 bits per byte, least
+ * significant first, the high bit set on every byte but the last.
+ * The log is cut in blocks, each one starts with EVLOG_TIME so it can be
+ * decoded on its own, null bytes pad the end.
+ */
+
+#define EVLOG_PAD 0x0 // Skipped, no delta
+#define EVLOG_TIME 0x1 // The delta is the absolute local time, starts a block
+#define EVLOG_OVERFLOW 0x2 // value: events dropped before this block
+#define EVLOG_TOOTH 0x3 // channel: VR, value: interval in VR_TIM_FREQ ticks
+#define EVLOG_SYNC 0x4 // channel: VR, tooth signal acquired
+#define EVLOG_LOST 0x5 // channel: VR, tooth signal lost
+#define EVLOG_KNOCK 0x6 // channel: cylinder, value: knock output of the window
+#define EVLOG_THRESHOLD 0x7 // channel: VR, value: new threshold from the zero
+#define EVLOG_FAULT 0x8 // channel: EVLOG_FAULT_, value: detail
+#define EVLOG_TYPES 9
+
+#define EVLOG_FAULT_SPI_CRC 0 // value: CRC errors so far
+#define EVLOG_FAULT_TIME_STEP 1 // value: ECU time offset error, us, signed
+#define EVLOG_FAULT_POOL 2 // Samples dropped, the message pool was empty
+#define EVLOG_FAULT_MAILBOX 3 // Samples dropped, value: mailbox full, see IPC_MAILBOXES
+#define EVLOG_FAULT_STACK 4 // value: stack under MEMHEALTH_STACK_MARGIN, STREAM_MEMORY row
+
+#define EVLOG_TAG(type, channel) ((type) | ((channel) << 4))
+#define EVLOG_TAG_TYPE(tag) ((tag) & 0x0F)
+#define EVLOG_TAG_CHANNEL(tag) ((tag) >> 4)
+
+#define EVLOG_HAS_VALUE(type) ((type) == EVLOG_OVERFLOW || (type) == EVLOG_TOOTH || \
+                               (type) == EVLOG_KNOCK || (type) == EVLOG_THRESHOLD || \
+                               (type) == EVLOG_FAULT)
+
+#define EVLOG_MAX_VARINT 5 // 32 bits
+#define EVLOG_MAX_EVENT (1 + EVLOG_MAX_VARINT * 2)
+
+#endif
@@ -142,6 +142,18 @@
  */
 #define ONEWIRE_USE_SEARCH_ROM      TRUE
 
+/*===========================================================================*/
+/* CRC driver related settings.                                              */
+/*===========================================================================*/
+
+/**
+ * @brief   Enables DMA transfers.
+ * @note    The CRC1 DMA stream is the SPI1 RX one, keep it disabled.
+ */
+#if !defined(CRC_USE_DMA) || defined(__DOXYGEN__)
+#define CRC_USE_DMA                 FALSE
+#endif
+
 /*===========================================================================*/
 /* QEI driver related settings.                                              */
 /*===========================================================================*/
@@ -0,0 +1,112 @@
+#include <string.h>
+#include "evlog_decode.h"
+
+#define STATE_TAG 0
+#define STATE_DELTA 1
+#define STATE_VALUE 2
+
+void evlogDecoderInit(evlog_decoder_t* dec, evlog_event_cb cb, void* ctx)
+{
+  memset(dec, 0, sizeof(*dec));
+  dec->cb = cb;
+  dec->ctx = ctx;
+}
+
+void evlogDecoderReset(evlog_decoder_t* dec)
+{
+  dec->state = STATE_TAG;
+  dec->time_valid = false;
+}
+
+static void fail(evlog_decoder_t* dec)
+{
+  dec->errors++;
+  evlogDecoderReset(dec);
+}
+
+static void emit(evlog_decoder_t* dec, uint32_t value)
+{
+  evlog_event_t event;
+
+  event.type = EVLOG_TAG_TYPE(dec->tag);
+  event.channel = EVLOG_TAG_CHANNEL(dec->tag);
+  event.value = value;
+
+  if (event.type == EVLOG_TIME)
+  {
+    dec->time = dec->delta;
+    dec->time_valid = true;
+    event.value = 0;
+  }
+  else
+  {
+    dec->time += dec->delta;
+  }
+  if (event.type == EVLOG_OVERFLOW)
+    dec->dropped += value;
+
+  event.time = dec->time;
+  event.time_valid = dec->time_valid;
+  dec->events++;
+  dec->state = STATE_TAG;
+
+  if (dec->cb != NULL)
+    dec->cb(dec->ctx, &event);
+}
+
+void evlogDecode(evlog_decoder_t* dec, const uint8_t* data, size_t len)
+{
+  size_t i;
+
+  for (i = 0; i < len; i++)
+  {
+    const uint8_t b = data[i];
+    uint8_t type;
+
+    if (dec->state == STATE_TAG)
+    {
+      if (b == EVLOG_PAD)
+        continue;
+
+      type = EVLOG_TAG_TYPE(b);
+      if (type == EVLOG_PAD || type >= EVLOG_TYPES)
+      {
+        fail(dec);
+        continue;
+      }
+      dec->tag = b;
+      dec->state = STATE_DELTA;
+      dec->acc = 0;
+      dec->shift = 0;
+      continue;
+    }
+
+    /* The fifth byte only has 4 bits left and ends the varint */
+    if (dec->shift == 28 && (b & 0xF0) != 0)
+    {
+      fail(dec);
+      continue;
+    }
+    dec->acc |= (uint32_t)(b & 0x7F) << dec->shift;
+    dec->shift += 7;
+    if (b & 0x80)
+      continue;
+
+    if (dec->state == STATE_DELTA)
+    {
+      dec->delta = dec->acc;
+      if (EVLOG_HAS_VALUE(EVLOG_TAG_TYPE(dec->tag)))
+      {
+        dec->state = STATE_VALUE;
+        dec->acc = 0;
+        dec->shift = 0;
+        continue;
+      }
+      emit(dec, 0);
+    }
+    else
+    {
+      emit(dec, dec->acc);
+    }
+  }
+}
@@ -0,0 +1,44 @@
+#ifndef EVLOG_DECODE_H_
+#define EVLOG_DECODE_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "evlog_format.h"
+
+/*
+ * Streaming decoder of the event log, data can be fed in chunks of any
+ * size. Times are only valid once an EVLOG_TIME was decoded, reset the
+ * decoder when input is lost so the following deltas are not trusted.
+ */
+
+typedef struct {
+  uint8_t type;
+  uint8_t channel;
+  bool time_valid;
+  uint32_t time; // Local us
+  uint32_t value;
+} evlog_event_t;
+
+typedef void (*evlog_event_cb)(void* ctx, const evlog_event_t* event);
+
+typedef struct {
+  evlog_event_cb cb;
+  void* ctx;
+  uint8_t state;
+  uint8_t tag;
+  uint8_t shift;
+  uint32_t acc; // Varint being read
+  uint32_t delta;
+  uint32_t time;
+  bool time_valid;
+  unsigned long events;
+  unsigned long errors; // Bad tags or varints
+  unsigned long dropped; // From EVLOG_OVERFLOW
+} evlog_decoder_t;
+
+void evlogDecoderInit(evlog_decoder_t* dec, evlog_event_cb cb, void* ctx);
+void evlogDecoderReset(evlog_decoder_t* dec);
+void evlogDecode(evlog_decoder_t* dec, const uint8_t* data, size_t len);
+
+#endif
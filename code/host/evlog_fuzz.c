@@ -0,0 +1,275 @@
+/*
+ * Round-trip and robustness tests of the event log: random events are
+ * cut in blocks with the firmware encoder, as evlog.c does, then decoded
+ * from chunks of random sizes. Corrupted and random input must neither
+ * crash the decoder nor prevent it from resyncing on the next block.
+ *
+ *   evlog_fuzz [iterations] [seed]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "evlog_decode.h"
+#include "evlog_encode.h"
+
+#define BLOCK_SIZE 256
+#define MAX_EVENTS 4096
+#define MAX_LOG (MAX_EVENTS * EVLOG_MAX_EVENT * 2)
+
+typedef struct {
+  evlog_event_t events[MAX_EVENTS];
+  size_t count;
+} events_t;
+
+static evlog_event_t sent[MAX_EVENTS];
+static size_t sent_count;
+static size_t block_start[MAX_EVENTS]; // Log offset of each block
+static size_t block_first[MAX_EVENTS]; // First sent event of each block
+static size_t blocks;
+static uint8_t log_buf[MAX_LOG];
+static size_t log_len;
+static events_t received;
+static int failures;
+
+static uint32_t rnd(void)
+{
+  return ((uint32_t)rand() << 16) ^ (uint32_t)rand();
+}
+
+/* Deltas and values of every length, short ones are the most common */
+static uint32_t rndValue(void)
+{
+  switch (rand() % 6) {
+  case 0: return 0;
+  case 1: return rnd() & 0x7F;
+  case 2: return rnd() & 0x3FFF;
+  case 3: return rnd() & 0x1FFFFF;
+  case 4: return 0xFFFFFFFF - (rnd() & 0xFF);
+  default: return rnd();
+  }
+}
+
+static void onEvent(void* ctx, const evlog_event_t* event)
+{
+  events_t* events = ctx;
+
+  if (event->type == EVLOG_TIME || events->count == MAX_EVENTS)
+    return;
+  events->events[events->count++] = *event;
+}
+
+static void closeBlock(void)
+{
+  if (log_len & 1)
+    log_buf[log_len++] = EVLOG_PAD;
+}
+
+static void openBlock(uint32_t now)
+{
+  block_start[blocks] = log_len;
+  block_first[blocks] = sent_count;
+  blocks++;
+  log_len += evlogPutEvent(&log_buf[log_len], EVLOG_TIME, 0, now, 0);
+}
+
+/*
+ * Encodes random events, a new block starts when one does not fit.
+ */
+static void generate(size_t count)
+{
+  uint32_t now = rnd(), last = now;
+  uint8_t event[EVLOG_MAX_EVENT];
+  size_t i, len;
+
+  sent_count = 0;
+  blocks = 0;
+  log_len = 0;
+  openBlock(now);
+
+  for (i = 0; i < count; i++)
+  {
+    evlog_event_t* e = &sent[sent_count];
+
+    do
+      e->type = rnd() % EVLOG_TYPES;
+    while (e->type == EVLOG_PAD || e->type == EVLOG_TIME);
+    e->channel = rnd() & 0x0F;
+    e->value = EVLOG_HAS_VALUE(e->type) ? rndValue() : 0;
+    now += rndValue();
+    e->time = now;
+    e->time_valid = true;
+
+    len = evlogPutEvent(event, e->type, e->channel, now - last, e->value);
+    if (log_len - block_start[blocks - 1] + len > BLOCK_SIZE)
+    {
+      closeBlock();
+      openBlock(now);
+      len = evlogPutEvent(event, e->type, e->channel, 0, e->value);
+    }
+    memcpy(&log_buf[log_len], event, len);
+    log_len += len;
+    last = now;
+    sent_count++;
+  }
+  closeBlock();
+  block_start[blocks] = log_len;
+  block_first[blocks] = sent_count;
+}
+
+static void decodeChunks(evlog_decoder_t* dec, const uint8_t* data, size_t len)
+{
+  while (len > 0)
+  {
+    size_t n = 1 + rand() % 64;
+
+    if (n > len)
+      n = len;
+    evlogDecode(dec, data, n);
+    data += n;
+    len -= n;
+  }
+}
+
+static int sameEvent(const evlog_event_t* a, const evlog_event_t* b)
+{
+  return a->type == b->type && a->channel == b->channel && a->value == b->value &&
+         a->time == b->time && a->time_valid == b->time_valid;
+}
+
+static void check(int cond, const char* what, unsigned iteration)
+{
+  if (!cond)
+  {
+    printf("FAIL iteration %u: %s\n", iteration, what);
+    failures++;
+  }
+}
+
+/* Every event back, in order, with its absolute time */
+static void testRoundTrip(unsigned iteration)
+{
+  evlog_decoder_t dec;
+  size_t i;
+
+  generate(1 + rnd() % (MAX_EVENTS - 1));
+  received.count = 0;
+  evlogDecoderInit(&dec, onEvent, &received);
+  decodeChunks(&dec, log_buf, log_len);
+
+  check(received.count == sent_count, "round trip count", iteration);
+  for (i = 0; i < received.count && i < sent_count; i++)
+  {
+    if (!sameEvent(&received.events[i], &sent[i]))
+    {
+      check(0, "round trip event", iteration);
+      break;
+    }
+  }
+  check(dec.errors == 0, "round trip errors", iteration);
+}
+
+/* Blocks lost in transport, the others decode on their own */
+static void testBlockLoss(unsigned iteration)
+{
+  evlog_decoder_t dec;
+  size_t b, i, expected = 0;
+  int ok = 1;
+
+  generate(1 + rnd() % (MAX_EVENTS - 1));
+  received.count = 0;
+  evlogDecoderInit(&dec, onEvent, &received);
+
+  for (b = 0; b < blocks; b++)
+  {
+    if (rand() % 3 == 0)
+      continue;
+    evlogDecoderReset(&dec);
+    decodeChunks(&dec, &log_buf[block_start[b]], block_start[b + 1] - block_start[b]);
+    for (i = block_first[b]; i < block_first[b + 1] && ok; i++)
+      ok = expected < received.count && sameEvent(&received.events[expected++], &sent[i]);
+  }
+  check(ok && expected == received.count, "block loss", iteration);
+}
+
+/* Corrupted input, then a clean block must decode exactly */
+static void testCorruption(unsigned iteration)
+{
+  evlog_decoder_t dec;
+  size_t i, n, first;
+  int ok = 1;
+
+  generate(1 + rnd() % 256);
+  received.count = 0;
+  evlogDecoderInit(&dec, onEvent, &received);
+
+  n = rnd() % 32 + 1;
+  for (i = 0; i < n; i++)
+    log_buf[rnd() % log_len] ^= 1 << (rnd() % 8);
+  decodeChunks(&dec, log_buf, rnd() % (log_len + 1)); // Truncated too
+
+  for (i = 0; i < MAX_LOG / 4; i++)
+    log_buf[i] = rnd();
+  decodeChunks(&dec, log_buf, rnd() % (MAX_LOG / 4));
+
+  generate(1 + rnd() % 256);
+  evlogDecoderReset(&dec);
+  first = received.count;
+  decodeChunks(&dec, log_buf, block_start[1]);
+  for (i = 0; i < block_first[1] && ok; i++)
+    ok = first + i < received.count && sameEvent(&received.events[first + i], &sent[i]);
+  check(ok && received.count - first == block_first[1], "resync after corruption", iteration);
+}
+
+/* Every value length, single events */
+static void testVarints(void)
+{
+  static const uint32_t values[] = {0, 1, 0x7F, 0x80, 0x3FFF, 0x4000, 0x1FFFFF, 0x200000,
+                                    0xFFFFFFF, 0x10000000, 0xFFFFFFFF};
+  uint8_t buf[EVLOG_MAX_EVENT];
+  size_t i, len;
+
+  for (i = 0; i < sizeof(values) / sizeof(values[0]); i++)
+  {
+    evlog_decoder_t dec;
+
+    received.count = 0;
+    evlogDecoderInit(&dec, onEvent, &received);
+    len = evlogPutEvent(buf, EVLOG_TIME, 0, 0, 0);
+    evlogDecode(&dec, buf, len);
+    len = evlogPutEvent(buf, EVLOG_TOOTH, 2, values[i], values[i]);
+    check(len <= EVLOG_MAX_EVENT, "event length", i);
+    evlogDecode(&dec, buf, len);
+    check(received.count == 1 && received.events[0].value == values[i] &&
+          received.events[0].time == values[i] && received.events[0].channel == 2, "varint", i);
+  }
+
+  /* Varints over 32 bits are rejected */
+  {
+    static const uint8_t bad[] = {EVLOG_TAG(EVLOG_SYNC, 0), 0xFF, 0xFF, 0xFF, 0xFF, 0x1F};
+    evlog_decoder_t dec;
+
+    evlogDecoderInit(&dec, NULL, NULL);
+    evlogDecode(&dec, bad, sizeof(bad));
+    check(dec.errors == 1 && dec.events == 0, "long varint", 0);
+  }
+}
+
+int main(int argc, char** argv)
+{
+  const unsigned iterations = argc > 1 ? (unsigned)atoi(argv[1]) : 2000;
+  const unsigned seed = argc > 2 ? (unsigned)atoi(argv[2]) : 1;
+  unsigned i;
+
+  srand(seed);
+  testVarints();
+  for (i = 0; i < iterations; i++)
+  {
+    testRoundTrip(i);
+    testBlockLoss(i);
+    testCorruption(i);
+  }
+
+  printf("%u iterations, seed %u: %s\n", iterations, seed, failures == 0 ? "PASS" : "FAIL");
+  return failures != 0;
+}
@@ -0,0 +1,264 @@
+/*
+ * Loopback test of the protocol: the firmware handler (proto.c) runs in a
+ * thread on one end of a socket pair with an in-memory register map, the
+ * host library talks to it from the other end.
+ * Exits with 0 when every check passes.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include "kvr_proto.h"
+#include "proto.h"
+#include "proto_frame.h"
+
+#define REG_COUNT 0x40
+#define REG_WRITABLE 0x28 // Settings start, as on the device
+#define EVENT_PERIOD_MS 20
+#define TELEMETRY_ADDR 0x02
+
+static uint16_t regs[REG_COUNT];
+static pthread_mutex_t regs_lock = PTHREAD_MUTEX_INITIALIZER;
+static volatile int device_stop;
+static volatile int device_corrupt; // Flips a bit in the next device frame
+
+static int failures;
+static int telemetry_count;
+static int telemetry_bad;
+static int event_count;
+
+#define CHECK(cond) check(cond, #cond, __LINE__)
+
+static void check(int cond, const char* text, int line)
+{
+  if (!cond)
+  {
+    printf("FAIL line %d: %s\n", line, text);
+    failures++;
+  }
+}
+
+static long long nowMs(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+uint8_t protoRegisterCount(void)
+{
+  return REG_COUNT;
+}
+
+bool protoReadRegisters(uint8_t addr, uint8_t count, uint16_t* values)
+{
+  if (addr >= REG_COUNT || count > REG_COUNT - addr)
+    return false;
+
+  pthread_mutex_lock(&regs_lock);
+  memcpy(values, &regs[addr], count * sizeof(uint16_t));
+  pthread_mutex_unlock(&regs_lock);
+  return true;
+}
+
+bool protoWriteRegisters(uint8_t addr, uint8_t count, const uint16_t* values)
+{
+  if (addr < REG_WRITABLE || addr >= REG_COUNT || count > REG_COUNT - addr)
+    return false;
+
+  pthread_mutex_lock(&regs_lock);
+  memcpy(&regs[addr], values, count * sizeof(uint16_t));
+  pthread_mutex_unlock(&regs_lock);
+  return true;
+}
+
+static void deviceSend(int fd, const uint8_t* msg, size_t len)
+{
+  uint8_t frame[PROTO_MAX_FRAME];
+  size_t n = protoFrame(msg, len, frame);
+
+  if (device_corrupt)
+  {
+    frame[1] ^= 0x10;
+    if (frame[1] == 0)
+      frame[1] = 0x10;
+    device_corrupt = 0;
+  }
+  if (write(fd, frame, n) != (ssize_t)n)
+    device_stop = 1;
+}
+
+/*
+ * Same loop as ThreadUsb, the live registers count up every millisecond.
+ */
+static void* deviceThread(void* arg)
+{
+  const int fd = *(int*)arg;
+  uint8_t rx[PROTO_MAX_FRAME], msg[PROTO_MAX_MSG], reply[PROTO_MAX_MSG];
+  size_t rx_len = 0;
+  long long telemetry_last = nowMs(), event_last = nowMs();
+  const long long start = nowMs();
+
+  while (!device_stop)
+  {
+    struct timeval tv = {0, 1000};
+    fd_set set;
+    uint8_t buf[64];
+    ssize_t n, i;
+    uint32_t time;
+
+    FD_ZERO(&set);
+    FD_SET(fd, &set);
+    if (select(fd + 1, &set, NULL, NULL, &tv) > 0)
+    {
+      n = read(fd, buf, sizeof(buf));
+      if (n <= 0)
+        break;
+      for (i = 0; i < n; i++)
+      {
+        size_t len;
+
+        if (buf[i] != 0)
+        {
+          if (rx_len < sizeof(rx))
+            rx[rx_len++] = buf[i];
+          continue;
+        }
+        len = protoUnframe(rx, rx_len, msg);
+        rx_len = 0;
+        if (len != 0 && (len = protoProcess(msg, len, reply)) != 0)
+          deviceSend(fd, reply, len);
+      }
+    }
+
+    time = (uint32_t)(nowMs() - start) * 1000;
+    pthread_mutex_lock(&regs_lock);
+    regs[TELEMETRY_ADDR]++;
+    regs[TELEMETRY_ADDR + 1] = regs[TELEMETRY_ADDR] * 2;
+    pthread_mutex_unlock(&regs_lock);
+
+    if (protoEventMask() != 0 && nowMs() - event_last >= EVENT_PERIOD_MS)
+    {
+      event_last = nowMs();
+      deviceSend(fd, msg, protoEvent(msg, 0x01 & protoEventMask(), time));
+    }
+
+    if (protoTelemetryPeriod() == 0)
+    {
+      telemetry_last = nowMs();
+    }
+    else if (nowMs() - telemetry_last >= protoTelemetryPeriod())
+    {
+      size_t len = protoTelemetry(msg, time);
+
+      telemetry_last = nowMs();
+      if (len != 0)
+        deviceSend(fd, msg, len);
+    }
+  }
+  return NULL;
+}
+
+static void onTelemetry(void* ctx, uint32_t time, uint8_t addr, uint8_t count, const uint16_t* values)
+{
+  (void)ctx;
+  (void)time;
+  telemetry_count++;
+  if (addr != TELEMETRY_ADDR || count != 2 || values[1] != (uint16_t)(values[0] * 2))
+    telemetry_bad++;
+}
+
+static void onEvent(void* ctx, uint32_t time, uint16_t events)
+{
+  (void)ctx;
+  (void)time;
+  if (events == 0x01)
+    event_count++;
+}
+
+int main(void)
+{
+  int sv[2];
+  pthread_t device;
+  kvr_t kvr;
+  uint16_t values[8], readback[8];
+  uint8_t version, reg_count, i;
+
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0)
+  {
+    perror("socketpair");
+    return 1;
+  }
+
+  for (i = 0; i < REG_COUNT; i++)
+    regs[i] = 0x100 + i;
+  pthread_create(&device, NULL, deviceThread, &sv[1]);
+
+  kvrAttach(&kvr, sv[0]);
+  kvrSetCallbacks(&kvr, onTelemetry, onEvent, NULL);
+
+  /* Requests */
+  CHECK(kvrPing(&kvr, &version, &reg_count) == PROTO_OK);
+  CHECK(version == PROTO_VERSION && reg_count == REG_COUNT);
+
+  CHECK(kvrRead(&kvr, 0x30, 4, values) == PROTO_OK);
+  CHECK(values[0] == 0x130 && values[3] == 0x133);
+  CHECK(kvrRead(&kvr, REG_COUNT - 2, 4, values) == PROTO_BAD_ADDRESS);
+  CHECK(kvrRead(&kvr, 0, 0, values) == PROTO_BAD_ADDRESS);
+  CHECK(kvrRead(&kvr, 0, PROTO_MAX_REGS + 1, NULL) == PROTO_BAD_ADDRESS);
+
+  for (i = 0; i < 8; i++)
+    values[i] = 0xA000 + i;
+  CHECK(kvrWrite(&kvr, REG_WRITABLE, 8, values) == PROTO_OK);
+  CHECK(kvrRead(&kvr, REG_WRITABLE, 8, readback) == PROTO_OK);
+  CHECK(memcmp(values, readback, sizeof(values)) == 0);
+
+  /* Rejected as a whole when it reaches a read-only register */
+  CHECK(kvrWrite(&kvr, REG_WRITABLE - 1, 2, values) == PROTO_BAD_ADDRESS);
+  CHECK(kvrRead(&kvr, REG_WRITABLE - 1, 2, readback) == PROTO_OK);
+  CHECK(readback[0] == 0x100 + REG_WRITABLE - 1 && readback[1] == 0xA000);
+
+  CHECK(kvrRequest(&kvr, 0x3F, NULL, 0, NULL, NULL) == PROTO_BAD_TYPE);
+  CHECK(kvrRequest(&kvr, PROTO_READ, (const uint8_t*)values, 1, NULL, NULL) == PROTO_BAD_LENGTH);
+
+  /* Line noise and a corrupted reply: dropped, the next request works */
+  CHECK(write(sv[0], "\x12\x34\x56\x00\x00\xFF", 6) == 6);
+  device_corrupt = 1;
+  kvr.timeout_ms = 100;
+  CHECK(kvrPing(&kvr, &version, &reg_count) == KVR_ERR_TIMEOUT);
+  CHECK(kvr.bad_frames == 1);
+  kvr.timeout_ms = 500;
+  CHECK(kvrPing(&kvr, &version, &reg_count) == PROTO_OK);
+
+  /* Telemetry and events while requests go on */
+  CHECK(kvrSubscribe(&kvr, TELEMETRY_ADDR, 2, 5) == PROTO_OK);
+  CHECK(kvrEvents(&kvr, 0xFFFF) == PROTO_OK);
+  for (i = 0; i < 20; i++)
+  {
+    CHECK(kvrRead(&kvr, REG_WRITABLE, 1, readback) == PROTO_OK);
+    CHECK(kvrPoll(&kvr, 10) == 0);
+  }
+  CHECK(kvrSubscribe(&kvr, 0, 0, 0) == PROTO_OK);
+  CHECK(kvrEvents(&kvr, 0) == PROTO_OK);
+  CHECK(kvrPoll(&kvr, 20) == 0);
+
+  printf("telemetry %d (bad %d), events %d, lost %lu, bad frames %lu\n",
+         telemetry_count, telemetry_bad, event_count, kvr.lost, kvr.bad_frames);
+  CHECK(telemetry_count > 10 && telemetry_bad == 0);
+  CHECK(event_count > 2);
+  CHECK(kvr.lost == 0);
+  CHECK(kvrSubscribe(&kvr, REG_COUNT - 1, 2, 5) == PROTO_BAD_ADDRESS);
+
+  device_stop = 1;
+  pthread_join(device, NULL);
+  kvrClose(&kvr);
+  close(sv[1]);
+
+  printf("%s\n", failures == 0 ? "PASS" : "FAIL");
+  return failures != 0;
+}
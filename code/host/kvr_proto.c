@@ -0,0 +1,304 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include "kvr_proto.h"
+#include "proto_frame.h"
+
+#define KVR_DEFAULT_TIMEOUT_MS 500
+
+static uint16_t get16(const uint8_t* p)
+{
+  return p[0] | (p[1] << 8);
+}
+
+static void put16(uint8_t* p, uint16_t val)
+{
+  p[0] = val & 0xFF;
+  p[1] = val >> 8;
+}
+
+static long long nowMs(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Serial port in raw mode, the baud rate means nothing for USB CDC.
+ */
+int kvrOpen(kvr_t* kvr, const char* path)
+{
+  struct termios tio;
+  int fd = open(path, O_RDWR | O_NOCTTY);
+
+  if (fd < 0)
+    return KVR_ERR_IO;
+
+  if (tcgetattr(fd, &tio) == 0)
+  {
+    cfmakeraw(&tio);
+    tcsetattr(fd, TCSANOW, &tio);
+  }
+  tcflush(fd, TCIOFLUSH);
+
+  kvrAttach(kvr, fd);
+  return 0;
+}
+
+/*
+ * Any byte stream, a pipe or a socket for tests.
+ */
+void kvrAttach(kvr_t* kvr, int fd)
+{
+  memset(kvr, 0, sizeof(*kvr));
+  kvr->fd = fd;
+  kvr->timeout_ms = KVR_DEFAULT_TIMEOUT_MS;
+}
+
+void kvrClose(kvr_t* kvr)
+{
+  if (kvr->fd >= 0)
+    close(kvr->fd);
+  kvr->fd = -1;
+}
+
+void kvrSetCallbacks(kvr_t* kvr, kvr_telemetry_cb telemetry, kvr_event_cb event, void* ctx)
+{
+  kvr->telemetry = telemetry;
+  kvr->event = event;
+  kvr->ctx = ctx;
+}
+
+static int sendMessage(kvr_t* kvr, const uint8_t* msg, size_t len)
+{
+  uint8_t frame[PROTO_MAX_FRAME + 1];
+  size_t n, sent = 0;
+
+  /* Leading delimiter, flushes a partial frame left on the device */
+  frame[0] = 0;
+  n = protoFrame(msg, len, &frame[1]) + 1;
+
+  while (sent < n)
+  {
+    ssize_t r = write(kvr->fd, &frame[sent], n - sent);
+
+    if (r < 0 && errno != EINTR)
+      return KVR_ERR_IO;
+    if (r > 0)
+      sent += r;
+  }
+  return 0;
+}
+
+static void deviceMessage(kvr_t* kvr, const uint8_t* msg, size_t len)
+{
+  uint16_t values[PROTO_MAX_REGS];
+  uint8_t i, count;
+
+  if (kvr->seen)
+    kvr->lost += (uint8_t)(msg[0] - kvr->next_seq);
+  kvr->seen = true;
+  kvr->next_seq = msg[0] + 1;
+
+  if (msg[1] == PROTO_TELEMETRY && len >= 8)
+  {
+    count = msg[7];
+    if (count > PROTO_MAX_REGS || len != 8 + count * 2u)
+      return;
+    for (i = 0; i < count; i++)
+      values[i] = get16(&msg[8 + i * 2]);
+    if (kvr->telemetry != NULL)
+      kvr->telemetry(kvr->ctx, get16(&msg[2]) | ((uint32_t)get16(&msg[4]) << 16),
+                     msg[6], count, values);
+  }
+  else if (msg[1] == PROTO_EVENT && len == 8)
+  {
+    if (kvr->event != NULL)
+      kvr->event(kvr->ctx, get16(&msg[2]) | ((uint32_t)get16(&msg[4]) << 16), get16(&msg[6]));
+  }
+}
+
+/*
+ * Reads until a message arrives or the deadline passes, device messages
+ * are dispatched. Returns the length of a reply, 0 on timeout.
+ */
+static int receive(kvr_t* kvr, long long deadline, uint8_t* msg)
+{
+  for (;;)
+  {
+    size_t len;
+    uint8_t b;
+
+    if (kvr->in_pos == kvr->in_len)
+    {
+      struct pollfd pfd = {kvr->fd, POLLIN, 0};
+      long long left = deadline - nowMs();
+      ssize_t n;
+
+      if (left < 0)
+        left = 0;
+      if (poll(&pfd, 1, (int)left) <= 0)
+        return 0;
+
+      n = read(kvr->fd, kvr->in, sizeof(kvr->in));
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        return KVR_ERR_IO;
+      kvr->in_pos = 0;
+      kvr->in_len = n;
+    }
+
+    b = kvr->in[kvr->in_pos++];
+    if (b != 0)
+    {
+      if (kvr->rx_len < sizeof(kvr->rx))
+        kvr->rx[kvr->rx_len++] = b;
+      else
+        kvr->rx_overflow = true;
+      continue;
+    }
+
+    len = kvr->rx_overflow ? 0 : protoUnframe(kvr->rx, kvr->rx_len, msg);
+    if (len == 0 && kvr->rx_len != 0)
+      kvr->bad_frames++;
+    kvr->rx_len = 0;
+    kvr->rx_overflow = false;
+    if (len < 2)
+      continue;
+
+    if ((msg[1] & PROTO_REPLY) == 0)
+      deviceMessage(kvr, msg, len);
+    else
+      return (int)len;
+  }
+}
+
+/*
+ * Sends a request and waits for its reply, the status is the first byte
+ * of the reply payload.
+ */
+int kvrRequest(kvr_t* kvr, uint8_t type, const uint8_t* payload, size_t len,
+               uint8_t* reply, size_t* reply_len)
+{
+  uint8_t msg[PROTO_MAX_MSG];
+  const long long deadline = nowMs() + kvr->timeout_ms;
+  const uint8_t seq = kvr->seq++;
+  int n;
+
+  if (len > PROTO_MAX_MSG - 4)
+    return PROTO_BAD_LENGTH;
+
+  msg[0] = seq;
+  msg[1] = type;
+  memcpy(&msg[2], payload, len);
+  if (sendMessage(kvr, msg, len + 2) != 0)
+    return KVR_ERR_IO;
+
+  for (;;)
+  {
+    n = receive(kvr, deadline, msg);
+    if (n < 0)
+      return n;
+    if (n == 0)
+      return KVR_ERR_TIMEOUT;
+    if (n >= 3 && msg[0] == seq && msg[1] == (type | PROTO_REPLY))
+      break; // Late replies of timed out requests are skipped
+  }
+
+  if (reply != NULL)
+  {
+    memcpy(reply, &msg[3], n - 3);
+    *reply_len = n - 3;
+  }
+  return msg[2];
+}
+
+int kvrPing(kvr_t* kvr, uint8_t* version, uint8_t* reg_count)
+{
+  uint8_t reply[PROTO_MAX_MSG];
+  size_t len;
+  int ret = kvrRequest(kvr, PROTO_PING, NULL, 0, reply, &len);
+
+  if (ret == PROTO_OK)
+  {
+    if (len != 2)
+      return PROTO_BAD_LENGTH;
+    *version = reply[0];
+    *reg_count = reply[1];
+  }
+  return ret;
+}
+
+int kvrRead(kvr_t* kvr, uint8_t addr, uint8_t count, uint16_t* values)
+{
+  uint8_t reply[PROTO_MAX_MSG];
+  const uint8_t req[2] = {addr, count};
+  size_t len;
+  uint8_t i;
+  int ret = kvrRequest(kvr, PROTO_READ, req, sizeof(req), reply, &len);
+
+  if (ret == PROTO_OK)
+  {
+    if (len != count * 2u)
+      return PROTO_BAD_LENGTH;
+    for (i = 0; i < count; i++)
+      values[i] = get16(&reply[i * 2]);
+  }
+  return ret;
+}
+
+int kvrWrite(kvr_t* kvr, uint8_t addr, uint8_t count, const uint16_t* values)
+{
+  uint8_t req[1 + PROTO_MAX_REGS * 2];
+  uint8_t i;
+
+  if (count > PROTO_MAX_REGS)
+    return PROTO_BAD_LENGTH;
+
+  req[0] = addr;
+  for (i = 0; i < count; i++)
+    put16(&req[1 + i * 2], values[i]);
+  return kvrRequest(kvr, PROTO_WRITE, req, 1 + count * 2, NULL, NULL);
+}
+
+int kvrSubscribe(kvr_t* kvr, uint8_t addr, uint8_t count, uint16_t period_ms)
+{
+  uint8_t req[4] = {addr, count};
+
+  put16(&req[2], period_ms);
+  return kvrRequest(kvr, PROTO_SUBSCRIBE, req, sizeof(req), NULL, NULL);
+}
+
+int kvrEvents(kvr_t* kvr, uint16_t mask)
+{
+  uint8_t req[2];
+
+  put16(req, mask);
+  return kvrRequest(kvr, PROTO_EVENTS, req, sizeof(req), NULL, NULL);
+}
+
+/*
+ * Dispatches the device messages received within the timeout.
+ */
+int kvrPoll(kvr_t* kvr, int timeout_ms)
+{
+  uint8_t msg[PROTO_MAX_MSG];
+  const long long deadline = nowMs() + timeout_ms;
+  int n;
+
+  do
+  {
+    n = receive(kvr, deadline, msg);
+    if (n < 0)
+      return n;
+  } while (n != 0); // Stray replies are dropped
+
+  return 0;
+}
@@ -0,0 +1,55 @@
+#ifndef KVR_PROTO_H_
+#define KVR_PROTO_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "proto_format.h"
+
+/*
+ * Host side of the command and telemetry protocol, see proto_format.h.
+ * Requests block until their reply, telemetry and events received
+ * meanwhile go to the callbacks. Functions return a PROTO_ status or
+ * a negative KVR_ERR_ code.
+ */
+
+#define KVR_ERR_IO -1
+#define KVR_ERR_TIMEOUT -2
+
+typedef void (*kvr_telemetry_cb)(void* ctx, uint32_t time, uint8_t addr,
+                                 uint8_t count, const uint16_t* values);
+typedef void (*kvr_event_cb)(void* ctx, uint32_t time, uint16_t events);
+
+typedef struct {
+  int fd;
+  int timeout_ms; // Per request
+  uint8_t seq;
+  uint8_t in[256]; // Read but not decoded yet
+  size_t in_pos, in_len;
+  uint8_t rx[PROTO_MAX_FRAME];
+  size_t rx_len;
+  bool rx_overflow;
+  kvr_telemetry_cb telemetry;
+  kvr_event_cb event;
+  void* ctx;
+  bool seen; // A device message was received
+  uint8_t next_seq; // Expected device message sequence
+  unsigned long lost; // Device messages lost
+  unsigned long bad_frames; // Dropped for their CRC or encoding
+} kvr_t;
+
+int kvrOpen(kvr_t* kvr, const char* path);
+void kvrAttach(kvr_t* kvr, int fd);
+void kvrClose(kvr_t* kvr);
+void kvrSetCallbacks(kvr_t* kvr, kvr_telemetry_cb telemetry, kvr_event_cb event, void* ctx);
+
+int kvrPing(kvr_t* kvr, uint8_t* version, uint8_t* reg_count);
+int kvrRead(kvr_t* kvr, uint8_t addr, uint8_t count, uint16_t* values);
+int kvrWrite(kvr_t* kvr, uint8_t addr, uint8_t count, const uint16_t* values);
+int kvrSubscribe(kvr_t* kvr, uint8_t addr, uint8_t count, uint16_t period_ms);
+int kvrEvents(kvr_t* kvr, uint16_t mask);
+int kvrPoll(kvr_t* kvr, int timeout_ms);
+int kvrRequest(kvr_t* kvr, uint8_t type, const uint8_t* payload, size_t len,
+               uint8_t* reply, size_t* reply_len);
+
+#endif
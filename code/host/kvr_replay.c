@@ -0,0 +1,324 @@
+/*
+ * Replays recorded samples into the knock and VR processing threads of
+ * a firmware built with USE_REPLAY=yes, see replay.c.
+ * The knock and VR frames of a kvr_stream capture are sent at the pace
+ * of their timestamps, raw int16 LE samples (kvr_siggen, the simulator
+ * file sources) at the pace of the sampling rate. -x changes the speed.
+ * The device stats are printed at the end, the frames the threads were
+ * too slow for are in the dropped count.
+ *
+ *   kvr_stream -k -e -w field.bin -t 30
+ *   kvr_replay -r field.bin
+ *   kvr_siggen -t 5 -e rpm=4000 -i knock:prob=0.2 -i knock -o knock.raw
+ *   kvr_replay -k knock.raw -R 100000 -l
+ *
+ * The VR frames of a capture are only replayed when it was taken with
+ * -d 1, they come at close to 2MB/s so the full speed bus does not keep
+ * up with a real time replay of them, -x slows it down. The teeth do
+ * not come from the samples, a VR replay drives the peaks, thresholds
+ * and calibration only.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <time.h>
+#include <libusb.h>
+#include "stream_decode.h"
+#include "knockconf.h"
+
+#define KVR_VID 0x0483
+#define KVR_PID 0xBEEF
+#define KVR_STREAM_IF 2
+#define KVR_REPLAY_EP 3 // OUT
+
+#define VR_FRAME_WORDS 256 // VR_SAMPLES / 2, vr.h
+#define KNOCK_DEFAULT_RATE 100000 // Hz
+#define KNOCK_DEFAULT_SENSORS 2 // KNOCK_SENSORS, 1 with KNOCK_USE_DUAL_MODE
+#define KNOCK_SCALE 8 // ADC codes to offset corrected, left aligned samples
+
+typedef struct {
+  stream_header_t header;
+  uint16_t data[STREAM_DECODE_MAX_WORDS];
+} replay_frame_t;
+
+static volatile sig_atomic_t running = 1;
+static libusb_device_handle* dev;
+static double speed = 1.0;
+static struct timespec start;
+static unsigned long frames, skipped, errors;
+
+static void stop(int sig)
+{
+  (void)sig;
+  running = 0;
+}
+
+static int vendorRequest(uint8_t req, uint16_t value)
+{
+  return libusb_control_transfer(dev,
+                                 LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR |
+                                 LIBUSB_RECIPIENT_INTERFACE,
+                                 req, value, KVR_STREAM_IF, NULL, 0, 1000);
+}
+
+/* Waits until us after the start, scaled by the speed */
+static void waitUntil(double us)
+{
+  const double ns = start.tv_nsec + us * 1000.0 / speed;
+  struct timespec deadline;
+
+  deadline.tv_sec = start.tv_sec + (time_t)(ns / 1e9);
+  deadline.tv_nsec = (long)(ns - (double)(deadline.tv_sec - start.tv_sec) * 1e9);
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) != 0 && running);
+}
+
+/* The header then the samples, as two transfers */
+static void sendFrame(replay_frame_t* frame)
+{
+  static uint16_t seqs[STREAM_TYPES];
+  const int len = frame->header.count * 2;
+  int sent;
+
+  frame->header.sync = STREAM_SYNC;
+  frame->header.seq = seqs[frame->header.type]++;
+  if (libusb_bulk_transfer(dev, KVR_REPLAY_EP, (uint8_t*)&frame->header, sizeof(frame->header),
+                           &sent, 1000) != 0 || sent != sizeof(frame->header) ||
+      libusb_bulk_transfer(dev, KVR_REPLAY_EP, (uint8_t*)frame->data, len, &sent, 1000) != 0 ||
+      sent != len)
+  {
+    if (errors++ == 0)
+      fprintf(stderr, "replay transfer failed\n");
+    return;
+  }
+  frames++;
+}
+
+/* Knock and VR frames of a kvr_stream capture */
+static uint16_t captureSources(const stream_header_t* header)
+{
+  if (header->type == STREAM_KNOCK_RAW)
+    return STREAM_REPLAY_MSK(STREAM_REPLAY_KNOCK);
+  if (header->type == STREAM_VR_RAW && header->count == VR_FRAME_WORDS &&
+      header->channel < STREAM_REPLAY_SOURCES - STREAM_REPLAY_VR1)
+    return STREAM_REPLAY_MSK(STREAM_REPLAY_VR1 + header->channel);
+  return 0;
+}
+
+typedef struct {
+  uint16_t mask;
+  bool scan; // Only collects the sources
+  bool started;
+  uint32_t first; // Time of the first frame
+  double offset; // us, of the loops already replayed
+  double last; // us
+} capture_ctx_t;
+
+static void captureFrame(void* arg, const stream_header_t* header, const uint16_t* data)
+{
+  capture_ctx_t* ctx = arg;
+  static replay_frame_t frame;
+  const uint16_t source = captureSources(header);
+
+  if (source == 0)
+  {
+    if (ctx->scan && header->type == STREAM_VR_RAW)
+      skipped++;
+    return;
+  }
+  if (ctx->scan)
+  {
+    ctx->mask |= source;
+    return;
+  }
+  if (!running)
+    return;
+
+  if (!ctx->started)
+  {
+    ctx->first = header->time;
+    ctx->started = true;
+  }
+  ctx->last = ctx->offset + (uint32_t)(header->time - ctx->first);
+  waitUntil(ctx->last);
+
+  frame.header = *header;
+  memcpy(frame.data, data, header->count * 2);
+  sendFrame(&frame);
+}
+
+static bool replayCapture(FILE* f, bool loop, double seconds)
+{
+  capture_ctx_t ctx = {0};
+  stream_decoder_t dec;
+  uint8_t buf[4096];
+  size_t n;
+
+  ctx.scan = true;
+  streamDecoderInit(&dec);
+  while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+    streamDecode(&dec, buf, n, captureFrame, &ctx);
+  if (skipped != 0)
+    fprintf(stderr, "%lu VR frames skipped, decimated, capture them with kvr_stream -d 1\n", skipped);
+  if (ctx.mask == 0)
+  {
+    fprintf(stderr, "no knock or VR frames to replay\n");
+    return false;
+  }
+
+  if (vendorRequest(STREAM_REQ_REPLAY, ctx.mask) < 0)
+  {
+    fprintf(stderr, "replay request failed, firmware built without USE_REPLAY=yes?\n");
+    return false;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  ctx.scan = false;
+  do
+  {
+    rewind(f);
+    streamDecoderInit(&dec);
+    ctx.started = false;
+    while (running && (n = fread(buf, 1, sizeof(buf), f)) > 0 &&
+           (seconds == 0 || ctx.last < seconds * 1e6))
+      streamDecode(&dec, buf, n, captureFrame, &ctx);
+    /* The next loop starts a frame period later, as if it followed */
+    ctx.offset = ctx.last + (double)FFT_SIZE * 1e6 / KNOCK_DEFAULT_RATE;
+  } while (loop && running && (seconds == 0 || ctx.last < seconds * 1e6));
+  return true;
+}
+
+/* Raw int16 LE knock samples, the sensors interleaved */
+static bool replayRaw(FILE* f, uint32_t rate, uint8_t sensors, bool loop, double seconds)
+{
+  static replay_frame_t frame;
+  const size_t words = FFT_SIZE * sensors;
+  const double period = (double)FFT_SIZE * 1e6 / rate; // us
+  uint8_t buf[sizeof(frame.data)];
+  unsigned long count = 0;
+  size_t i;
+
+  if (vendorRequest(STREAM_REQ_REPLAY, STREAM_REPLAY_MSK(STREAM_REPLAY_KNOCK)) < 0)
+  {
+    fprintf(stderr, "replay request failed, firmware built without USE_REPLAY=yes?\n");
+    return false;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  frame.header.type = STREAM_KNOCK_RAW;
+  frame.header.channel = 0;
+  frame.header.count = words;
+  while (running && (seconds == 0 || count * period < seconds * 1e6))
+  {
+    if (fread(buf, 2, words, f) != words)
+    {
+      if (!loop || count == 0)
+        break;
+      rewind(f);
+      continue;
+    }
+    for (i = 0; i < words; i++)
+      frame.data[i] = (uint16_t)((int16_t)(buf[2 * i] | (buf[2 * i + 1] << 8)) * KNOCK_SCALE);
+
+    count++;
+    frame.header.time = (uint32_t)(count * period);
+    waitUntil(count * period);
+    sendFrame(&frame);
+  }
+  return true;
+}
+
+static void usage(const char* name)
+{
+  fprintf(stderr,
+          "usage: %s -r capture.bin [-x speed] [-l] [-t seconds]\n"
+          "       %s -k knock.raw [-R rate] [-n sensors] [-x speed] [-l] [-t seconds]\n"
+          "  -r knock and VR frames of a kvr_stream capture, at their times\n"
+          "  -k raw int16 knock samples, sensors interleaved, 2 by default,\n"
+          "     1 for a KNOCK_USE_DUAL_MODE build, -R rate 100000 by default\n"
+          "  -x speed, 1 is real time, -l loops, -t stops after the length\n", name, name);
+}
+
+int main(int argc, char** argv)
+{
+  const char* capture = NULL;
+  const char* raw = NULL;
+  uint32_t rate = KNOCK_DEFAULT_RATE;
+  uint8_t sensors = KNOCK_DEFAULT_SENSORS;
+  double seconds = 0;
+  bool loop = false, ok = false;
+  stream_replay_stats_t stats;
+  FILE* f;
+  int opt, ret = 1;
+
+  while ((opt = getopt(argc, argv, "r:k:R:n:x:lt:h")) != -1)
+  {
+    switch (opt) {
+    case 'r': capture = optarg; break;
+    case 'k': raw = optarg; break;
+    case 'R': rate = atoi(optarg); break;
+    case 'n': sensors = atoi(optarg); break;
+    case 'x': speed = atof(optarg); break;
+    case 'l': loop = true; break;
+    case 't': seconds = atof(optarg); break;
+    default: usage(argv[0]); return 1;
+    }
+  }
+  if ((capture == NULL) == (raw == NULL) || rate == 0 || sensors == 0 ||
+      FFT_SIZE * sensors > STREAM_DECODE_MAX_WORDS || speed <= 0)
+  {
+    usage(argv[0]);
+    return 1;
+  }
+
+  f = fopen(capture != NULL ? capture : raw, "rb");
+  if (f == NULL)
+  {
+    perror(capture != NULL ? capture : raw);
+    return 1;
+  }
+
+  if (libusb_init(NULL) != 0)
+    goto file;
+  dev = libusb_open_device_with_vid_pid(NULL, KVR_VID, KVR_PID);
+  if (dev == NULL)
+  {
+    fprintf(stderr, "no device %04x:%04x\n", KVR_VID, KVR_PID);
+    goto exit;
+  }
+  if (libusb_claim_interface(dev, KVR_STREAM_IF) != 0)
+  {
+    fprintf(stderr, "cannot claim interface %d\n", KVR_STREAM_IF);
+    goto close;
+  }
+
+  signal(SIGINT, stop);
+  if (capture != NULL)
+    ok = replayCapture(f, loop, seconds);
+  else
+    ok = replayRaw(f, rate, sensors, loop, seconds);
+  vendorRequest(STREAM_REQ_REPLAY, 0); // The ADC frames again
+
+  if (libusb_control_transfer(dev,
+                              LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR |
+                              LIBUSB_RECIPIENT_INTERFACE,
+                              STREAM_REQ_REPLAY_STATS, 0, KVR_STREAM_IF,
+                              (uint8_t*)&stats, sizeof(stats), 1000) == sizeof(stats))
+  {
+    fprintf(stderr, "device: %u frames, %u rejected, %u dropped\n",
+            stats.frames, stats.rejected, stats.dropped);
+  }
+  fprintf(stderr, "%lu frames sent, %lu transfer errors\n", frames, errors);
+  ret = ok && errors == 0 ? 0 : 1;
+
+  libusb_release_interface(dev, KVR_STREAM_IF);
+close:
+  libusb_close(dev);
+exit:
+  libusb_exit(NULL);
+file:
+  fclose(f);
+  return ret;
+}
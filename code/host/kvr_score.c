@@ -0,0 +1,513 @@
+/*
+ * Scores the detections of a recorded stream against the ground truth
+ * of its inputs, to check that a change keeps the knock and VR outputs
+ * right. The truth is the CSV of kvr_sim -G or kvr_siggen -g, or a hand
+ * labelled one in the same format, the detections the event log of the
+ * stream file (kvr_sim -S e -w, kvr_stream -e -w).
+ *   - Teeth, for each VR: sync time from the first tooth, missed and
+ *     extra teeth once synced, latency of the event log from the zero
+ *     crossing. The teeth of truth channel N are scored against vrN.
+ *   - Knock, for each cylinder: a window is positive when a knock of
+ *     its cylinder starts while it is open, detected when its output is
+ *     at least the knock level. True positive rate over the positive
+ *     windows, false positive rate over the others, latency of the
+ *     output from the end of the window. The firmware does not know the
+ *     cylinders, the windows of the truth give them.
+ * Only the truth covered by the event log is scored, it starts once the
+ * stream is enabled.
+ * The report is CSV, metric,channel,value,limit,result, and the exit
+ * status is 1 when a limit is not met.
+ *
+ *   kvr_score -g truth.csv -r stream.bin -k 2000 -T 95 -F 2
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include "stream_decode.h"
+#include "evlog_decode.h"
+
+#define VR_COUNT 3
+#define CYLINDERS 8 // KNOCK_MAX_CYLINDERS
+#define TIME_SLACK 1.0 // us, the event log times are truncated
+
+#define CHECK_NONE 0
+#define CHECK_MAX 1
+#define CHECK_MIN 2
+
+typedef struct {
+  double time; // us
+  int32_t value;
+} point_t;
+
+typedef struct {
+  point_t* items;
+  size_t count;
+  size_t size;
+} points_t;
+
+/* Truth */
+static points_t teeth[VR_COUNT]; // value: tooth index, -1 when dropped
+static points_t knocks[CYLINDERS];
+static points_t windows[CYLINDERS]; // value: level
+/* Detections */
+static points_t tooth_events[VR_COUNT];
+static points_t sync_events[VR_COUNT];
+static unsigned lost_events[VR_COUNT];
+static points_t knock_events; // value: output of the window
+
+static stream_decoder_t decoder;
+static evlog_decoder_t evlog;
+static bool log_seen;
+static double log_start, log_end;
+
+static struct {
+  double knock_level;
+  double tp_min; // %
+  double fp_max; // %
+  double missed_max; // %
+  double sync_max; // ms
+  double tooth_latency_max; // us, p99
+  double knock_latency_max; // us, p99
+  double match; // us
+} limits = {1000, 90, 5, 0.1, 100, 20, 500, 1000};
+
+static bool quiet;
+static unsigned failures;
+
+static void usage(const char* name)
+{
+  fprintf(stderr,
+          "usage: %s -g truth.csv -r stream.bin [-k level] [-T pct] [-F pct] [-M pct]\n"
+          "       [-S ms] [-L us] [-K us] [-m us] [-q]\n"
+          "  -k knock output detected as a knock, 1000 by default\n"
+          "  -T min knock true positive rate, 90%% by default\n"
+          "  -F max knock false positive rate, 5%% by default\n"
+          "  -M max missed and extra teeth, 0.1%% by default\n"
+          "  -S max tooth sync time, 100ms by default\n"
+          "  -L max tooth latency (p99), 20us by default\n"
+          "  -K max knock output latency (p99), 500us by default\n"
+          "  -m max distance of a detection to its truth, 1000us by default\n"
+          "  -q no CSV header\n", name);
+}
+
+static void append(points_t* p, double time, int32_t value)
+{
+  if (p->count == p->size)
+  {
+    p->size = p->size != 0 ? p->size * 2 : 256;
+    p->items = realloc(p->items, p->size * sizeof(point_t));
+    if (p->items == NULL)
+    {
+      perror("realloc");
+      exit(2);
+    }
+  }
+  p->items[p->count].time = time;
+  p->items[p->count].value = value;
+  p->count++;
+}
+
+static int comparePoints(const void* a, const void* b)
+{
+  const double ta = ((const point_t*)a)->time;
+  const double tb = ((const point_t*)b)->time;
+
+  return ta < tb ? -1 : ta > tb;
+}
+
+static void sortPoints(points_t* p)
+{
+  if (p->count > 1)
+    qsort(p->items, p->count, sizeof(point_t), comparePoints);
+}
+
+static int compareDoubles(const void* a, const void* b)
+{
+  const double da = *(const double*)a;
+  const double db = *(const double*)b;
+
+  return da < db ? -1 : da > db;
+}
+
+/* Sorts the values */
+static double percentile(double* values, size_t count, double pct)
+{
+  size_t i;
+
+  if (count == 0)
+    return 0.0;
+  qsort(values, count, sizeof(double), compareDoubles);
+  i = (size_t)ceil(pct / 100.0 * count);
+  return values[i > 0 ? i - 1 : 0];
+}
+
+static bool inLog(double time)
+{
+  return log_seen && time >= log_start && time <= log_end - limits.match;
+}
+
+static void report(const char* metric, unsigned channel, double value, double limit, int check)
+{
+  const bool fail = (check == CHECK_MAX && value > limit) || (check == CHECK_MIN && value < limit);
+
+  if (check == CHECK_NONE)
+    printf("%s,%u,%.3f,,\n", metric, channel, value);
+  else
+    printf("%s,%u,%.3f,%.3f,%s\n", metric, channel, value, limit, fail ? "fail" : "pass");
+  if (fail)
+  {
+    fprintf(stderr, "%s %u: %.3f, limit %.3f\n", metric, channel, value, limit);
+    failures++;
+  }
+}
+
+static bool loadTruth(const char* path)
+{
+  FILE* f = fopen(path, "r");
+  char line[256];
+
+  if (f == NULL)
+  {
+    perror(path);
+    return false;
+  }
+
+  while (fgets(line, sizeof(line), f) != NULL)
+  {
+    char signal[16];
+    double time;
+    unsigned channel;
+    int value;
+
+    if (sscanf(line, "%lf,%15[^,],%u,%d", &time, signal, &channel, &value) != 4)
+      continue; // Header
+    if (strcmp(signal, "tooth") == 0 && channel >= 1 && channel <= VR_COUNT)
+      append(&teeth[channel - 1], time, value);
+    else if (strcmp(signal, "knock") == 0 && channel >= 1 && channel <= CYLINDERS)
+      append(&knocks[channel - 1], time, value);
+    else if (strcmp(signal, "window") == 0 && channel >= 1 && channel <= CYLINDERS)
+      append(&windows[channel - 1], time, value);
+  }
+  fclose(f);
+  return true;
+}
+
+static void addEvent(void* ctx, const evlog_event_t* event)
+{
+  const double time = event->time;
+  (void)ctx;
+
+  if (!event->time_valid || event->type == EVLOG_PAD)
+    return;
+  if (!log_seen || time < log_start)
+    log_start = time;
+  if (!log_seen || time > log_end)
+    log_end = time;
+  log_seen = true;
+
+  if (event->channel >= VR_COUNT && event->type != EVLOG_KNOCK)
+    return;
+  switch (event->type)
+  {
+  case EVLOG_TOOTH: append(&tooth_events[event->channel], time, event->value); break;
+  case EVLOG_SYNC: append(&sync_events[event->channel], time, 0); break;
+  case EVLOG_LOST: lost_events[event->channel]++; break;
+  case EVLOG_KNOCK: append(&knock_events, time, event->value); break;
+  default: break;
+  }
+}
+
+static void addFrame(void* ctx, const stream_header_t* header, const uint16_t* data)
+{
+  (void)ctx;
+
+  if (header->type != STREAM_EVLOG)
+    return;
+  /* A frame is a block, decoded on its own */
+  evlogDecoderReset(&evlog);
+  evlogDecode(&evlog, (const uint8_t*)data, header->count * 2);
+}
+
+static bool loadStream(const char* path)
+{
+  FILE* f = fopen(path, "rb");
+  uint8_t buf[4096];
+  size_t n;
+
+  if (f == NULL)
+  {
+    perror(path);
+    return false;
+  }
+  while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+    streamDecode(&decoder, buf, n, addFrame, NULL);
+  fclose(f);
+  return true;
+}
+
+static void scoreTeeth(uint8_t vr)
+{
+  const points_t* truth = &teeth[vr];
+  const points_t* events = &tooth_events[vr];
+  bool* matched = calloc(truth->count + 1, sizeof(bool));
+  double* latencies = malloc((events->count + 1) * sizeof(double));
+  size_t latency_count = 0, expected = 0, missed = 0, extra = 0;
+  double first = -1, sync = -1;
+  size_t i, t = 0;
+
+  for (i = 0; i < truth->count && first < 0; i++)
+  {
+    if (truth->items[i].value >= 0 && inLog(truth->items[i].time))
+      first = truth->items[i].time;
+  }
+  if (first < 0)
+    goto done; // No signal in the log
+
+  for (i = 0; i < sync_events[vr].count && sync < 0; i++)
+  {
+    if (sync_events[vr].items[i].time >= first - TIME_SLACK)
+      sync = sync_events[vr].items[i].time;
+  }
+
+  /* Each event takes the last tooth before it, if still free */
+  for (i = 0; i < events->count; i++)
+  {
+    const double time = events->items[i].time;
+    size_t k;
+
+    if (!inLog(time))
+      continue;
+    while (t < truth->count && truth->items[t].time <= time + TIME_SLACK)
+      t++;
+    k = t;
+    while (k > 0 && truth->items[k - 1].value < 0) // Dropped, no signal
+      k--;
+    if (k > 0 && !matched[k - 1] && time - truth->items[k - 1].time <= limits.match)
+    {
+      matched[k - 1] = true;
+      latencies[latency_count++] = fmax(0.0, time - truth->items[k - 1].time);
+    }
+    else
+      extra++;
+  }
+
+  for (i = 0; i < truth->count && sync >= 0; i++)
+  {
+    if (truth->items[i].value < 0 || truth->items[i].time < sync - TIME_SLACK ||
+        !inLog(truth->items[i].time))
+      continue;
+    expected++;
+    if (!matched[i])
+      missed++;
+  }
+
+  report("tooth_sync_ms", vr + 1, sync >= 0 ? (sync - first) / 1000.0 : INFINITY,
+         limits.sync_max, CHECK_MAX);
+  report("teeth", vr + 1, expected, 0, CHECK_NONE);
+  report("teeth_missed_pct", vr + 1, expected != 0 ? 100.0 * missed / expected : 0.0,
+         limits.missed_max, CHECK_MAX);
+  report("teeth_extra_pct", vr + 1, expected != 0 ? 100.0 * extra / expected : 0.0,
+         limits.missed_max, CHECK_MAX);
+  report("tooth_lost", vr + 1, lost_events[vr], 0, CHECK_NONE);
+  report("tooth_latency_p99_us", vr + 1, percentile(latencies, latency_count, 99),
+         limits.tooth_latency_max, CHECK_MAX);
+  report("tooth_latency_max_us", vr + 1, percentile(latencies, latency_count, 100), 0, CHECK_NONE);
+
+done:
+  free(matched);
+  free(latencies);
+}
+
+/* Positive when a knock of the cylinder started in the window */
+static bool knocked(uint8_t cyl, double open, double close)
+{
+  size_t i;
+
+  for (i = 0; i < knocks[cyl].count; i++)
+  {
+    if (knocks[cyl].items[i].time >= open && knocks[cyl].items[i].time < close)
+      return true;
+  }
+  return false;
+}
+
+/* First unused output of the log after the window closed */
+static const point_t* knockOutput(double close, bool* used)
+{
+  size_t i;
+
+  for (i = 0; i < knock_events.count; i++)
+  {
+    const double time = knock_events.items[i].time;
+
+    if (time > close + limits.match)
+      break;
+    if (time >= close - TIME_SLACK && !used[i])
+    {
+      used[i] = true;
+      return &knock_events.items[i];
+    }
+  }
+  return NULL;
+}
+
+static void scoreKnock(void)
+{
+  bool* used = calloc(knock_events.count + 1, sizeof(bool));
+  double* latencies = NULL;
+  size_t latency_count = 0, latency_size = 0;
+  uint8_t cyl;
+
+  for (cyl = 0; cyl < CYLINDERS; cyl++)
+  {
+    const points_t* w = &windows[cyl];
+    unsigned positives = 0, negatives = 0, tp = 0, fp = 0, missing = 0;
+    double min_positive = INFINITY, max_negative = 0;
+    double open = -1;
+    size_t i;
+
+    for (i = 0; i < w->count; i++)
+    {
+      const double close = w->items[i].time;
+      const point_t* out;
+      bool positive;
+
+      if (w->items[i].value != 0)
+      {
+        open = close;
+        continue;
+      }
+      if (open < 0 || !inLog(open) || !inLog(close))
+        continue;
+
+      positive = knocked(cyl, open, close);
+      out = knockOutput(close, used);
+      open = -1;
+      if (positive)
+        positives++;
+      else
+        negatives++;
+      if (out == NULL)
+      {
+        missing++;
+        continue;
+      }
+
+      if (latency_count == latency_size)
+      {
+        latency_size = latency_size != 0 ? latency_size * 2 : 256;
+        latencies = realloc(latencies, latency_size * sizeof(double));
+      }
+      latencies[latency_count++] = fmax(0.0, out->time - close);
+
+      if (positive)
+      {
+        min_positive = fmin(min_positive, out->value);
+        if (out->value >= limits.knock_level)
+          tp++;
+      }
+      else
+      {
+        max_negative = fmax(max_negative, out->value);
+        if (out->value >= limits.knock_level)
+          fp++;
+      }
+    }
+
+    if (positives + negatives == 0)
+      continue;
+    report("knock_windows", cyl + 1, positives + negatives, 0, CHECK_NONE);
+    report("knock_windows_missing", cyl + 1, missing, 0, CHECK_NONE);
+    if (positives != 0)
+    {
+      report("knock_tp_pct", cyl + 1, 100.0 * tp / positives, limits.tp_min, CHECK_MIN);
+      report("knock_positive_min", cyl + 1, isinf(min_positive) ? 0.0 : min_positive, 0, CHECK_NONE);
+    }
+    if (negatives != 0)
+    {
+      report("knock_fp_pct", cyl + 1, 100.0 * fp / negatives, limits.fp_max, CHECK_MAX);
+      report("knock_negative_max", cyl + 1, max_negative, 0, CHECK_NONE);
+    }
+  }
+
+  if (latency_count != 0)
+  {
+    report("knock_latency_p99_us", 0, percentile(latencies, latency_count, 99),
+           limits.knock_latency_max, CHECK_MAX);
+    report("knock_latency_max_us", 0, percentile(latencies, latency_count, 100), 0, CHECK_NONE);
+  }
+
+  free(used);
+  free(latencies);
+}
+
+int main(int argc, char** argv)
+{
+  const char* truth_path = NULL;
+  const char* stream_path = NULL;
+  uint8_t i;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "g:r:k:T:F:M:S:L:K:m:qh")) != -1)
+  {
+    switch (opt) {
+    case 'g': truth_path = optarg; break;
+    case 'r': stream_path = optarg; break;
+    case 'k': limits.knock_level = atof(optarg); break;
+    case 'T': limits.tp_min = atof(optarg); break;
+    case 'F': limits.fp_max = atof(optarg); break;
+    case 'M': limits.missed_max = atof(optarg); break;
+    case 'S': limits.sync_max = atof(optarg); break;
+    case 'L': limits.tooth_latency_max = atof(optarg); break;
+    case 'K': limits.knock_latency_max = atof(optarg); break;
+    case 'm': limits.match = atof(optarg); break;
+    case 'q': quiet = true; break;
+    default: usage(argv[0]); return 2;
+    }
+  }
+  if (truth_path == NULL || stream_path == NULL)
+  {
+    usage(argv[0]);
+    return 2;
+  }
+
+  streamDecoderInit(&decoder);
+  evlogDecoderInit(&evlog, addEvent, NULL);
+  if (!loadTruth(truth_path) || !loadStream(stream_path))
+    return 2;
+
+  for (i = 0; i < VR_COUNT; i++)
+  {
+    sortPoints(&teeth[i]);
+    sortPoints(&tooth_events[i]);
+    sortPoints(&sync_events[i]);
+  }
+  for (i = 0; i < CYLINDERS; i++)
+  {
+    sortPoints(&knocks[i]);
+    sortPoints(&windows[i]);
+  }
+  sortPoints(&knock_events);
+
+  if (!quiet)
+    printf("metric,channel,value,limit,result\n");
+  /* Scores from an incomplete log do not mean anything */
+  report("log_seconds", 0, log_seen ? (log_end - log_start) / 1e6 : 0.0, 0, CHECK_NONE);
+  report("log_frames_lost", 0, decoder.lost, 0, CHECK_MAX);
+  report("log_events_dropped", 0, evlog.dropped, 0, CHECK_MAX);
+  report("log_errors", 0, evlog.errors, 0, CHECK_MAX);
+
+  for (i = 0; i < VR_COUNT; i++)
+    scoreTeeth(i);
+  scoreKnock();
+
+  if (!log_seen)
+  {
+    fprintf(stderr, "%s: no event log\n", stream_path);
+    return 1;
+  }
+  return failures != 0;
+}
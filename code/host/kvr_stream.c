@@ -0,0 +1,412 @@
+/*
+ * Receiver of the KVR USB bulk stream.
+ * Captures the raw stream to a file and/or decodes it to CSV, one line
+ * per frame: type,channel,seq,time,values...
+ * Event log frames give one line per event: type,event,channel,time,value
+ * CPU load frames give one line per context: type,time,name,load,average,peak
+ * Latency frames give: type,path,time,count,p50,p99,max (us),buckets...
+ * Trace frames give one line per record: type,cycles,event,channel,arg
+ * Memory frames give one line per row: type,time,kind,name,size,used,peak,failures
+ * Benchmark frames give one line per kernel: type,kernel,variant,unit,calls,best,mean
+ *   (best and mean per call, in cycles or ns)
+ * Several transfers are kept queued so the device never waits on the host.
+ *
+ *   kvr_stream -k -s -v -d 8 -w capture.bin -o frames.csv -t 10
+ *   kvr_stream -r capture.bin -o frames.csv
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <time.h>
+#include <libusb.h>
+#include "stream_decode.h"
+#include "evlog_decode.h"
+#include "latency_format.h"
+#include "trace_format.h"
+#include "supervisor_format.h"
+
+#define KVR_VID 0x0483
+#define KVR_PID 0xBEEF
+#define KVR_STREAM_IF 2
+#define KVR_STREAM_EP (0x80 | 3)
+
+#define TRANSFERS 8
+#define TRANSFER_SIZE (16 * 1024)
+
+static volatile sig_atomic_t running = 1;
+static FILE* raw_file;
+static FILE* csv_file;
+static stream_decoder_t decoder;
+static evlog_decoder_t evlog;
+static unsigned long long total_bytes;
+static int pending;
+
+static void stop(int sig)
+{
+  (void)sig;
+  running = 0;
+}
+
+static void printEvent(void* ctx, const evlog_event_t* event)
+{
+  (void)ctx;
+
+  if (event->type != EVLOG_TIME && event->type != EVLOG_PAD)
+    fprintf(csv_file, "%u,%u,%u,%u,%u\n", STREAM_EVLOG, event->type, event->channel,
+            event->time, event->value);
+}
+
+static void printLoad(const stream_header_t* header, const uint16_t* data)
+{
+  const stream_load_t* rows = (const stream_load_t*)data;
+  const size_t count = header->count * 2 / sizeof(stream_load_t);
+  char name[sizeof(rows->name) + 1];
+  size_t i;
+
+  for (i = 0; i < count; i++)
+  {
+    if (rows[i].id == STREAM_LOAD_TOTAL)
+      strcpy(name, "total");
+    else if (rows[i].id == STREAM_LOAD_OTHER)
+      strcpy(name, "other");
+    else if (rows[i].id & STREAM_LOAD_IRQ)
+      snprintf(name, sizeof(name), "irq%d", (rows[i].id & ~STREAM_LOAD_IRQ) - 16);
+    else
+    {
+      memcpy(name, rows[i].name, sizeof(rows->name));
+      name[sizeof(rows->name)] = 0;
+    }
+    fprintf(csv_file, "%u,%u,%s,%u,%u,%u\n", STREAM_LOAD, header->time, name,
+            rows[i].load, rows[i].average, rows[i].peak);
+  }
+}
+
+static void printLatency(const stream_header_t* header, const uint16_t* data)
+{
+  latency_summary_t summary;
+  const double us = 1e6;
+  uint16_t i;
+
+  if (header->count * 2 < sizeof(summary))
+    return;
+  memcpy(&summary, data, sizeof(summary));
+  if (summary.clock == 0)
+    return;
+
+  fprintf(csv_file, "%u,%u,%u,%u,%.2f,%.2f,%.2f", STREAM_LATENCY, header->channel, header->time,
+          summary.count, summary.p50 * us / summary.clock, summary.p99 * us / summary.clock,
+          summary.max * us / summary.clock);
+  for (i = sizeof(summary) / 2; i < header->count; i++)
+    fprintf(csv_file, ",%u", data[i]);
+  fputc('\n', csv_file);
+}
+
+static void printTrace(const stream_header_t* header, const uint16_t* data)
+{
+  const trace_record_t* records = (const trace_record_t*)data;
+  const size_t count = header->count * 2 / sizeof(trace_record_t);
+  size_t i;
+
+  for (i = 0; i < count; i++)
+    fprintf(csv_file, "%u,%u,%u,%u,%u\n", STREAM_TRACE, records[i].time, records[i].event,
+            records[i].channel, records[i].arg);
+}
+
+static void printMemory(const stream_header_t* header, const uint16_t* data)
+{
+  const stream_memory_t* rows = (const stream_memory_t*)data;
+  const size_t count = header->count * 2 / sizeof(stream_memory_t);
+  char name[sizeof(rows->name) + 1];
+  size_t i;
+
+  for (i = 0; i < count; i++)
+  {
+    memcpy(name, rows[i].name, sizeof(rows->name));
+    name[sizeof(rows->name)] = 0;
+    fprintf(csv_file, "%u,%u,%u,%s,%u,%u,%u,%u\n", STREAM_MEMORY, header->time, rows[i].kind,
+            name, rows[i].size, rows[i].used, rows[i].peak, rows[i].failures);
+  }
+}
+
+static void printBench(const stream_header_t* header, const uint16_t* data)
+{
+  static const char* const variants[] = {"q15", "q31", "f32"};
+  const stream_bench_t* rows = (const stream_bench_t*)data;
+  const size_t count = header->count * 2 / sizeof(stream_bench_t);
+  char name[sizeof(rows->name) + 1];
+  size_t i;
+
+  for (i = 0; i < count; i++)
+  {
+    if (rows[i].calls == 0 || rows[i].repeats == 0 || rows[i].variant > 2)
+      continue;
+    memcpy(name, rows[i].name, sizeof(rows->name));
+    name[sizeof(rows->name)] = 0;
+    fprintf(csv_file, "%u,%s,%s,%s,%u,%.2f,%.2f\n", STREAM_BENCH, name, variants[rows[i].variant],
+            rows[i].unit == STREAM_BENCH_NS ? "ns" : "cycles", rows[i].calls,
+            (double)rows[i].best * rows[i].repeats / rows[i].calls, (double)rows[i].total / rows[i].calls);
+  }
+}
+
+static void printFault(const uint16_t* data)
+{
+  supervisor_fault_t fault;
+
+  memcpy(&fault, data, sizeof(fault));
+  fprintf(csv_file, "%u,%u,%u,%u,%u,%u\n", STREAM_FAULT, fault.cause, fault.thread,
+          fault.resets, fault.late, fault.uptime);
+}
+
+static void printFrame(void* ctx, const stream_header_t* header, const uint16_t* data)
+{
+  uint16_t i;
+  (void)ctx;
+
+  if (csv_file == NULL)
+    return;
+
+  if (header->type == STREAM_EVLOG)
+  {
+    /* A frame is a block, decoded on its own */
+    evlogDecoderReset(&evlog);
+    evlogDecode(&evlog, (const uint8_t*)data, header->count * 2);
+    return;
+  }
+  if (header->type == STREAM_LOAD)
+  {
+    printLoad(header, data);
+    return;
+  }
+  if (header->type == STREAM_LATENCY)
+  {
+    printLatency(header, data);
+    return;
+  }
+  if (header->type == STREAM_TRACE)
+  {
+    printTrace(header, data);
+    return;
+  }
+  if (header->type == STREAM_MEMORY)
+  {
+    printMemory(header, data);
+    return;
+  }
+  if (header->type == STREAM_BENCH)
+  {
+    printBench(header, data);
+    return;
+  }
+  if (header->type == STREAM_FAULT && header->count * 2 >= sizeof(supervisor_fault_t))
+  {
+    printFault(data);
+    return;
+  }
+
+  fprintf(csv_file, "%u,%u,%u,%u", header->type, header->channel, header->seq, header->time);
+  for (i = 0; i < header->count; i++)
+    fprintf(csv_file, ",%u", data[i]);
+  fputc('\n', csv_file);
+}
+
+static void consume(const uint8_t* data, size_t len)
+{
+  total_bytes += len;
+  if (raw_file != NULL)
+    fwrite(data, 1, len, raw_file);
+  streamDecode(&decoder, data, len, printFrame, NULL);
+}
+
+static void LIBUSB_CALL transferDone(struct libusb_transfer* xfer)
+{
+  if (xfer->status == LIBUSB_TRANSFER_COMPLETED || xfer->status == LIBUSB_TRANSFER_TIMED_OUT)
+    consume(xfer->buffer, xfer->actual_length);
+  else if (xfer->status != LIBUSB_TRANSFER_CANCELLED)
+  {
+    fprintf(stderr, "transfer error %d\n", xfer->status);
+    running = 0;
+  }
+
+  if (running && libusb_submit_transfer(xfer) == 0)
+    return;
+  pending--;
+}
+
+static int decodeFile(const char* path)
+{
+  uint8_t buf[4096];
+  size_t n;
+  FILE* f = fopen(path, "rb");
+
+  if (f == NULL)
+  {
+    perror(path);
+    return 1;
+  }
+  while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+    consume(buf, n);
+  fclose(f);
+  return 0;
+}
+
+static int vendorRequest(libusb_device_handle* dev, uint8_t req, uint16_t value)
+{
+  return libusb_control_transfer(dev,
+                                 LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR |
+                                 LIBUSB_RECIPIENT_INTERFACE,
+                                 req, value, KVR_STREAM_IF, NULL, 0, 1000);
+}
+
+static int capture(uint16_t mask, uint16_t decimation, int seconds)
+{
+  struct libusb_transfer* xfers[TRANSFERS];
+  libusb_device_handle* dev;
+  stream_stats_t stats;
+  time_t start = time(NULL), last = start;
+  unsigned long long last_bytes = 0;
+  int i, ret = 1;
+
+  if (libusb_init(NULL) != 0)
+    return 1;
+
+  dev = libusb_open_device_with_vid_pid(NULL, KVR_VID, KVR_PID);
+  if (dev == NULL)
+  {
+    fprintf(stderr, "no device %04x:%04x\n", KVR_VID, KVR_PID);
+    goto exit;
+  }
+  if (libusb_claim_interface(dev, KVR_STREAM_IF) != 0)
+  {
+    fprintf(stderr, "cannot claim interface %d\n", KVR_STREAM_IF);
+    goto close;
+  }
+
+  if (vendorRequest(dev, STREAM_REQ_VR_DECIMATION, decimation) < 0 ||
+      vendorRequest(dev, STREAM_REQ_SELECT, mask) < 0)
+  {
+    fprintf(stderr, "stream request failed\n");
+    goto release;
+  }
+
+  for (i = 0; i < TRANSFERS; i++)
+  {
+    xfers[i] = libusb_alloc_transfer(0);
+    libusb_fill_bulk_transfer(xfers[i], dev, KVR_STREAM_EP, malloc(TRANSFER_SIZE),
+                              TRANSFER_SIZE, transferDone, NULL, 100);
+    if (libusb_submit_transfer(xfers[i]) == 0)
+      pending++;
+  }
+
+  while (running && (seconds == 0 || time(NULL) - start < seconds))
+  {
+    struct timeval tv = {0, 100000};
+    libusb_handle_events_timeout(NULL, &tv);
+
+    if (time(NULL) != last)
+    {
+      last = time(NULL);
+      fprintf(stderr, "%llu B/s, %lu frames, %lu lost, %lu bytes skipped\n",
+              total_bytes - last_bytes, decoder.frames, decoder.lost, decoder.skipped);
+      last_bytes = total_bytes;
+    }
+  }
+
+  running = 0;
+  vendorRequest(dev, STREAM_REQ_SELECT, 0);
+  for (i = 0; i < TRANSFERS; i++)
+    libusb_cancel_transfer(xfers[i]);
+  while (pending > 0)
+    libusb_handle_events(NULL);
+
+  if (libusb_control_transfer(dev,
+                              LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR |
+                              LIBUSB_RECIPIENT_INTERFACE,
+                              STREAM_REQ_STATS, 0, KVR_STREAM_IF,
+                              (uint8_t*)&stats, sizeof(stats), 1000) == sizeof(stats))
+  {
+    fprintf(stderr, "device: %u frames, %u dropped, %u bytes, %u transfers\n",
+            stats.frames, stats.dropped, stats.bytes, stats.transfers);
+  }
+
+  for (i = 0; i < TRANSFERS; i++)
+  {
+    free(xfers[i]->buffer);
+    libusb_free_transfer(xfers[i]);
+  }
+  ret = 0;
+
+release:
+  libusb_release_interface(dev, KVR_STREAM_IF);
+close:
+  libusb_close(dev);
+exit:
+  libusb_exit(NULL);
+  return ret;
+}
+
+static void usage(const char* name)
+{
+  fprintf(stderr,
+          "usage: %s [-k] [-v] [-s] [-c] [-e] [-l] [-p] [-T] [-m] [-f] [-b] [-d decimation] [-t seconds] [-w raw] [-o csv]\n"
+          "       %s -r raw [-o csv]\n"
+          "  -k knock samples, -v VR samples, -s spectra,\n"
+          "  -c frozen captures, -e event log, -l CPU load,\n"
+          "  -p latency histograms, -T trace records, -m memory use,\n"
+          "  -f last reset record, -b DSP benchmark (USE_DSPBENCH=yes)\n", name, name);
+}
+
+int main(int argc, char** argv)
+{
+  const char* replay = NULL;
+  uint16_t mask = 0, decimation = 16;
+  int seconds = 0, opt, ret;
+
+  while ((opt = getopt(argc, argv, "kvsclpTmfbed:t:w:o:r:h")) != -1)
+  {
+    switch (opt) {
+    case 'k': mask |= STREAM_MSK(STREAM_KNOCK_RAW); break;
+    case 'v': mask |= STREAM_MSK(STREAM_VR_RAW); break;
+    case 's': mask |= STREAM_MSK(STREAM_SPECTRUM); break;
+    case 'c': mask |= STREAM_MSK(STREAM_CAPTURE); break;
+    case 'e': mask |= STREAM_MSK(STREAM_EVLOG); break;
+    case 'l': mask |= STREAM_MSK(STREAM_LOAD); break;
+    case 'p': mask |= STREAM_MSK(STREAM_LATENCY); break;
+    case 'T': mask |= STREAM_MSK(STREAM_TRACE); break;
+    case 'm': mask |= STREAM_MSK(STREAM_MEMORY); break;
+    case 'f': mask |= STREAM_MSK(STREAM_FAULT); break;
+    case 'b': mask |= STREAM_MSK(STREAM_BENCH); break;
+    case 'd': decimation = atoi(optarg); break;
+    case 't': seconds = atoi(optarg); break;
+    case 'w': raw_file = fopen(optarg, "wb"); break;
+    case 'o': csv_file = strcmp(optarg, "-") == 0 ? stdout : fopen(optarg, "w"); break;
+    case 'r': replay = optarg; break;
+    default: usage(argv[0]); return 1;
+    }
+  }
+
+  streamDecoderInit(&decoder);
+  evlogDecoderInit(&evlog, printEvent, NULL);
+  signal(SIGINT, stop);
+
+  if (replay != NULL)
+    ret = decodeFile(replay);
+  else if (mask == 0)
+  {
+    usage(argv[0]);
+    return 1;
+  }
+  else
+    ret = capture(mask, decimation, seconds);
+
+  fprintf(stderr, "%lu frames, %lu lost, %lu bytes skipped\n",
+          decoder.frames, decoder.lost, decoder.skipped);
+
+  if (raw_file != NULL)
+    fclose(raw_file);
+  if (csv_file != NULL && csv_file != stdout)
+    fclose(csv_file);
+  return ret;
+}
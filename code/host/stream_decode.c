@@ -0,0 +1,104 @@
+#include <string.h>
+#include "stream_decode.h"
+
+void streamDecoderInit(stream_decoder_t* dec)
+{
+  memset(dec, 0, sizeof(*dec));
+}
+
+static uint16_t get16(const uint8_t* p)
+{
+  return p[0] | (p[1] << 8);
+}
+
+static uint32_t get32(const uint8_t* p)
+{
+  return get16(p) | ((uint32_t)get16(p + 2) << 16);
+}
+
+/*
+ * Drops bytes up to the next possible sync word.
+ */
+static void resync(stream_decoder_t* dec)
+{
+  size_t i;
+
+  for (i = 1; i + 1 < dec->len; i++)
+  {
+    if (get16(&dec->buf[i]) == STREAM_SYNC)
+      break;
+  }
+  if (i + 1 >= dec->len && dec->buf[dec->len - 1] != (STREAM_SYNC & 0xFF))
+    i = dec->len; // Not even the first byte of a sync word at the end
+
+  dec->skipped += i;
+  dec->len -= i;
+  memmove(dec->buf, &dec->buf[i], dec->len);
+}
+
+/*
+ * Decodes every complete frame in the buffer, returns false when more
+ * data is needed.
+ */
+static bool decodeFrame(stream_decoder_t* dec, stream_frame_cb cb, void* ctx)
+{
+  static uint16_t words[STREAM_DECODE_MAX_WORDS];
+  stream_header_t header;
+  size_t len, i;
+
+  if (dec->len < sizeof(header))
+    return false;
+
+  header.sync = get16(&dec->buf[0]);
+  header.type = dec->buf[2];
+  header.channel = dec->buf[3];
+  header.seq = get16(&dec->buf[4]);
+  header.count = get16(&dec->buf[6]);
+  header.time = get32(&dec->buf[8]);
+
+  if (header.sync != STREAM_SYNC || header.type >= STREAM_TYPES ||
+      header.count > STREAM_DECODE_MAX_WORDS)
+  {
+    resync(dec);
+    return dec->len > 0;
+  }
+
+  len = sizeof(header) + header.count * 2;
+  if (dec->len < len)
+    return false;
+
+  for (i = 0; i < header.count; i++)
+    words[i] = get16(&dec->buf[sizeof(header) + i * 2]);
+
+  if (dec->seen[header.type])
+    dec->lost += (uint16_t)(header.seq - dec->next_seq[header.type]);
+  dec->seen[header.type] = true;
+  dec->next_seq[header.type] = header.seq + 1;
+  dec->frames++;
+
+  if (cb != NULL)
+    cb(ctx, &header, words);
+
+  dec->len -= len;
+  memmove(dec->buf, &dec->buf[len], dec->len);
+  return true;
+}
+
+void streamDecode(stream_decoder_t* dec, const uint8_t* data, size_t len,
+                  stream_frame_cb cb, void* ctx)
+{
+  while (len > 0)
+  {
+    size_t n = sizeof(dec->buf) - dec->len;
+
+    if (n > len)
+      n = len;
+    memcpy(&dec->buf[dec->len], data, n);
+    dec->len += n;
+    data += n;
+    len -= n;
+
+    while (decodeFrame(dec, cb, ctx))
+      ;
+  }
+}
@@ -0,0 +1,32 @@
+#ifndef STREAM_DECODE_H_
+#define STREAM_DECODE_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "stream_format.h"
+
+/*
+ * Incremental decoder of the USB stream, data can be fed in chunks of
+ * any size.
+ */
+
+#define STREAM_DECODE_MAX_WORDS 4096 // Longest payload accepted
+
+typedef void (*stream_frame_cb)(void* ctx, const stream_header_t* header,
+                                const uint16_t* data);
+
+typedef struct {
+  uint8_t buf[sizeof(stream_header_t) + STREAM_DECODE_MAX_WORDS * 2];
+  size_t len;
+  bool seen[STREAM_TYPES];
+  uint16_t next_seq[STREAM_TYPES];
+  unsigned long frames;
+  unsigned long lost; // From sequence gaps
+  unsigned long skipped; // Bytes dropped looking for a sync word
+} stream_decoder_t;
+
+void streamDecoderInit(stream_decoder_t* dec);
+void streamDecode(stream_decoder_t* dec, const uint8_t* data, size_t len,
+                  stream_frame_cb cb, void* ctx);
+
+#endif
@@ -6,11 +6,12 @@
  */
 
 #include "ipc.h"
+#include "evlog.h"
 
-static msg_t buf1[4];
-static msg_t buf2[4];
-static msg_t buf3[4];
-static msg_t buf4[4];
+static msg_t buf1[MAILBOX_SIZE];
+static msg_t buf2[MAILBOX_SIZE];
+static msg_t buf3[MAILBOX_SIZE];
+static msg_t buf4[MAILBOX_SIZE];
 
 MAILBOX_DECL(knock_mb, buf1, sizeof(buf1)/sizeof(msg_t));
 MAILBOX_DECL(vr1_mb, buf2, sizeof(buf2)/sizeof(msg_t));
@@ -20,6 +21,10 @@ MAILBOX_DECL(vr3_mb, buf4, sizeof(buf4)/sizeof(msg_t));
 static samples_message_t samples_messages[POOL_SIZE] __attribute__((aligned(sizeof(stkalign_t))));
 static MEMORYPOOL_DECL(samples_pool, sizeof(samples_message_t), PORT_STACK_ALIGN, NULL);
 
+static mailbox_t* const mailboxes[IPC_MAILBOXES] = {&knock_mb, &vr1_mb, &vr2_mb, &vr3_mb};
+static ipc_usage_t pool_usage;
+static ipc_usage_t mailbox_usage[IPC_MAILBOXES];
+
 void setupIPC(void)
 {
   size_t i;
@@ -36,20 +41,43 @@ void setupIPC(void)
 
 bool allocSendSamplesI(mailbox_t* mb, void * buffer, size_t size)
 {
+  uint8_t i;
+
   if (buffer == NULL) return false;
 
+  for (i = 0; i < IPC_MAILBOXES - 1 && mailboxes[i] != mb; i++);
+
   samples_message_t* info = chPoolAllocI(&samples_pool);
 
-  if (info == NULL) return false;
+  if (info == NULL)
+  {
+    pool_usage.failures++;
+    evlogI(EVLOG_FAULT, EVLOG_FAULT_POOL, 0);
+    return false;
+  }
 
   info->location = buffer;
   info->size = size;
-  chMBPostI(mb, (msg_t)info);
+  info->time = chSysGetRealtimeCounterX();
+  if (chMBPostI(mb, (msg_t)info) != MSG_OK)
+  {
+    /* The receiver is late, the message goes back to the pool */
+    chPoolFreeI(&samples_pool, info);
+    mailbox_usage[i].failures++;
+    evlogI(EVLOG_FAULT, EVLOG_FAULT_MAILBOX, i);
+    return false;
+  }
+
+  if (++pool_usage.used > pool_usage.peak)
+    pool_usage.peak = pool_usage.used;
+  mailbox_usage[i].used = chMBGetUsedCountI(mb);
+  if (mailbox_usage[i].used > mailbox_usage[i].peak)
+    mailbox_usage[i].peak = mailbox_usage[i].used;
 
   return true;
 }
 
-bool recvFreeSamples(mailbox_t* mb, void ** buffer, size_t * size, systime_t timeout)
+bool recvFreeSamples(mailbox_t* mb, void ** buffer, size_t * size, rtcnt_t * time, systime_t timeout)
 {
   msg_t msg;
   samples_message_t data;
@@ -57,13 +85,35 @@ bool recvFreeSamples(mailbox_t* mb, void ** buffer, size_t * size, systime_t tim
   if(chMBFetchTimeout(mb, &msg, timeout) != MSG_OK)
     return false;
 
-  data = *(samples_message_t*)mb;
-  chPoolFree(&samples_pool, (void*)mb);
+  data = *(samples_message_t*)msg;
+  chSysLock();
+  chPoolFreeI(&samples_pool, (void*)msg);
+  pool_usage.used--;
+  chSysUnlock();
 
   if (data.location == NULL) return false;
 
   *buffer = data.location;
   *size = data.size;
+  if (time != NULL)
+    *time = data.time;
 
   return true;
 }
+
+/*
+ * Current and peak occupancy, mailboxes in the order of IPC_MAILBOXES.
+ */
+void ipcGetUsage(ipc_usage_t* pool, ipc_usage_t* mbs)
+{
+  uint8_t i;
+
+  chSysLock();
+  *pool = pool_usage;
+  for (i = 0; i < IPC_MAILBOXES; i++)
+  {
+    mailbox_usage[i].used = chMBGetUsedCountI(mailboxes[i]);
+    mbs[i] = mailbox_usage[i];
+  }
+  chSysUnlock();
+}
@@ -12,6 +12,8 @@
 
 #define MSG_GO 0x1234ABCD
 #define POOL_SIZE 10
+#define MAILBOX_SIZE 4
+#define IPC_MAILBOXES 4 // knock, VR1-3
 
 extern mailbox_t knock_mb;
 extern mailbox_t vr1_mb;
@@ -21,10 +23,19 @@ extern mailbox_t vr3_mb;
 typedef struct {
   void* location;
   size_t size;
+  rtcnt_t time; // Sent, latency start
 } samples_message_t;
 
+/* Occupancy of the pool or of a mailbox */
+typedef struct {
+  uint16_t used;
+  uint16_t peak;
+  uint16_t failures; // Samples dropped because it was full
+} ipc_usage_t;
+
 void setupIPC(void);
 bool allocSendSamplesI(mailbox_t* mb, void * buffer, size_t size);
-bool recvFreeSamples(mailbox_t* mb, void ** buffer, size_t * size, systime_t timeout);
+bool recvFreeSamples(mailbox_t* mb, void ** buffer, size_t * size, rtcnt_t * time, systime_t timeout);
+void ipcGetUsage(ipc_usage_t* pool, ipc_usage_t* mailboxes);
 
 #endif /* IPC_H_ */
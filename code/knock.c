@@ -1,32 +1,67 @@
 #include "knock.h"
 #include "hal.h"
-#include "arm_math.h"
+#include "knock_dsp.h"
 #include "ipc.h"
 #include "settings.h"
 #include "median.h"
+#include "calib.h"
+#include "spi_slave.h"
+#include "notify.h"
+#include "timebase.h"
+#include "usb_stream.h"
+#include "capture.h"
+#include "evlog.h"
+#include "latency.h"
+#include "trace.h"
+#include "memhealth.h"
+#include "supervisor.h"
+#include "replay.h"
 
 /*
  * Knock peripherals:
  * OPAMP2 (buffer)
- * ADC2 Ch3
+ * ADC2 Ch3 (sensor 1), Ch5, Ch11, Ch12 (sensors 2-4)
+ * TIM6 (ADC trigger)
  * DAC2 (result output)
  */
 
+#if STREAM_HEADER_SIZE + FFT_SIZE * KNOCK_SENSORS * 2 > USB_STREAM_BUFFER_SIZE
+#error "Raw knock frames must fit in a USB stream buffer, they would all be dropped"
+#endif
+
 static bool sampling_enabled = false;
-static adcsample_t knock_samples[FFT_SAMPLES];
-static uint16_t knock_value;
+#if KNOCK_USE_DUAL_MODE
+static uint32_t knock_pairs[FFT_SIZE]; // Master and slave results, in time order as q15
+#else
+static adcsample_t knock_samples[FFT_SAMPLES * KNOCK_SENSORS];
+#endif
+static uint16_t knock_values[KNOCK_SENSORS];
+static uint8_t knock_cylinder; // Selects the sensor driving the output
+static uint8_t knock_sensor_select = KNOCK_SENSOR_AUTO; // Overrides the cylinder mapping
+static uint16_t knock_cyl_values[KNOCK_MAX_CYLINDERS]; // Output of the last window of each cylinder
+static uint16_t knock_window; // Output of the current window
+static uint16_t knock_held; // Output when the window closed
+static uint32_t knock_time; // When the window closed, local us
+static rtcnt_t knock_frame_time; // ADC frame of the published values, latency start
 static EVENTSOURCE_DECL(evt_knock_result_rdy);
 
-/* Every 1024 samples at 117.263KHz each, triggers at around 114Hz */
+static knock_kernel_t kernel;
+static uint16_t kernel_rate; // Sampling rate setting the kernel was built for
+
+#if !KNOCK_USE_DUAL_MODE
+/* Every FFT_SIZE scans, triggers at around 195Hz at 100kS/s */
 static void adcCallback(ADCDriver *adcp, adcsample_t *buffer, size_t n)
 {
   (void)adcp;
 
   // Do FFT + Mag in a dedicated thread
+  trace(TRACE_ADC, 0, n);
   chSysLockFromISR();
-  allocSendSamplesI(&knock_mb, (void*)buffer, n); // Send msg with buffer address and size
+  if (!replayActive(STREAM_REPLAY_KNOCK))
+    allocSendSamplesI(&knock_mb, (void*)buffer, n); // Send msg with buffer address and size
   chSysUnlockFromISR();
 }
+#endif
 
 static const DACConfig dac_conf = {
   .init         = 2047U,
@@ -39,59 +74,229 @@ static const OPAMPConfig opamp2_conf = {
   OPAMP2_CSR_VMSEL_FOLWR // INM connected to vout (follower)
 };
 
-/* ADC4 Clk is 72Mhz/1 72Mhz  */
+#if !KNOCK_USE_DUAL_MODE
+/* TIM6 Clk is 36Mhz*2 72Mhz, the update event triggers the ADC */
+static const GPTConfig gpt_conf = {
+  STM32_TIMCLK1,
+  NULL,
+  TIM_CR2_MMS_1, /* CR2 - TRGO on update */
+  0
+};
+
+/* ADC2 Clk is 72Mhz/1 72Mhz  */
 static const ADCConversionGroup adcgrpcfg_knock = {
   TRUE,
-  1,
+  KNOCK_SENSORS,
   adcCallback,
   NULL,
-  ADC_CFGR_CONT | ADC_CFGR_ALIGN,    /* CFGR - Align result to left (convert 12 to 16 bits) */
+  KNOCK_ADC_TRIGGER | ADC_CFGR_ALIGN,    /* CFGR - Timer triggered scan, align result to left (convert 12 to 16 bits) */
   ADC_TR(0, 4095),                  /* TR1     */
   {                                 /* SMPR[2] */
-    ADC_SMPR1_SMP_AN1(ADC_SMPR_SMP_601P5),  /* Sampling rate = 72000000/(601.5+12.5) = 117.263Khz  */
-    0,
+    ADC_SMPR1_SMP_AN3(ADC_SMPR_SMP_181P5) |  /* Conversion time = (181.5+12.5)/72000000 = 2.7us per sensor */
+    ADC_SMPR1_SMP_AN5(ADC_SMPR_SMP_181P5),
+    ADC_SMPR2_SMP_AN11(ADC_SMPR_SMP_181P5) |
+    ADC_SMPR2_SMP_AN12(ADC_SMPR_SMP_181P5),
   },
   {                                 /* SQR[4]  */
-    ADC_SQR1_SQ1_N(ADC_CHANNEL_IN3), /* Channel 3 */
+    ADC_SQR1_SQ1_N(KNOCK_SENSOR1_CHANNEL) | /* Sequence length is set by the sensor count */
+    ADC_SQR1_SQ2_N(KNOCK_SENSOR2_CHANNEL) |
+    ADC_SQR1_SQ3_N(KNOCK_SENSOR3_CHANNEL) |
+    ADC_SQR1_SQ4_N(KNOCK_SENSOR4_CHANNEL),
     0,
     0,
     0
   }
 };
+#endif
+
+#if !KNOCK_USE_DUAL_MODE
+static uint16_t clampRate(uint16_t rate)
+{
+  if (rate < KNOCK_MIN_RATE)
+    return KNOCK_MIN_RATE;
+  if (rate > KNOCK_MAX_RATE)
+    return KNOCK_MAX_RATE;
+  return rate;
+}
+#endif
+
+#if !KNOCK_USE_DUAL_MODE
+/*
+ * Returns the trigger timer period for a sampling rate in kS/s.
+ */
+static gptcnt_t knockTriggerInterval(uint16_t rate)
+{
+  return (gptcnt_t)(STM32_TIMCLK1 / ((uint32_t)clampRate(rate) * 1000));
+}
+#endif
+
+/*
+ * Actual sampling frequency in Hz.
+ */
+static uint32_t knockSampleFreq(uint16_t rate)
+{
+#if KNOCK_USE_DUAL_MODE
+  (void)rate;
+  return KNOCK_DUAL_RATE; // Not adjustable
+#else
+  return STM32_TIMCLK1 / knockTriggerInterval(rate);
+#endif
+}
+
+/*
+ * Duration of a frame in microseconds.
+ */
+static uint32_t knockFrameTime(uint16_t rate)
+{
+  return ((uint64_t)FFT_SIZE * 1000000U) / knockSampleFreq(rate);
+}
+
+static void updateKnockKernel(uint16_t rate)
+{
+  knockDspKernel(&kernel, settings.knock_freq, settings.knock_ratio, knockSampleFreq(rate));
+  kernel_rate = rate;
+
+  /* Both threads run once per frame */
+  supervisorSetPeriod(SUPERVISOR_KNOCK, knockFrameTime(rate));
+  supervisorSetPeriod(SUPERVISOR_KNOCK_OUTPUT, knockFrameTime(rate));
+}
+
+/*
+ * Offsets of each sensor channel, measured by calibrateKnock().
+ * OFR1 to OFR4 follow each other.
+ */
+static void loadKnockOffsets(void)
+{
+  volatile uint32_t* ofr = &KNOCK_ADC->OFR1;
+  uint8_t i;
+
+  for (i = 0; i < KNOCK_SENSORS; i++)
+    ofr[i] = calibOffsetReg(CALIB_KNOCK + i, 0);
+#if KNOCK_USE_DUAL_MODE
+  KNOCK_DUAL_ADC->OFR1 = calibOffsetReg(CALIB_KNOCK_DUAL, 0);
+#endif
+}
 
-CCM_FUNC static uint16_t calculateKnockIntensity(uint16_t tgtFreq, uint16_t ratio, uint16_t smplFreq, const uint16_t* buffer, uint16_t size)
+#if KNOCK_USE_DUAL_MODE
+/*
+ * The common data register holds both results, master in the low half.
+ * Read as q15 the pairs are a single stream in time order,
+ * each half of the buffer is a full FFT frame.
+ */
+CCM_FUNC static void dualDmaCallback(void *p, uint32_t flags)
 {
-  uint16_t i;
-  uint16_t res;
-  float32_t multiplier;
+  (void)p;
 
-  const float32_t hzPerBin = (float32_t)smplFreq / (float32_t)size; // 458Hz
-  const float32_t flRatio = ((float32_t)ratio / 100000.0f);
-  const uint16_t range = 5;
-  uint16_t index = (tgtFreq / (uint16_t)hzPerBin);
+  chSysLockFromISR();
+  if (replayActive(STREAM_REPLAY_KNOCK))
+    flags &= ~(STM32_DMA_ISR_HTIF | STM32_DMA_ISR_TCIF); // The host frames take their place
+  if ((flags & STM32_DMA_ISR_HTIF) != 0)
+  {
+    trace(TRACE_ADC, 0, FFT_SIZE);
+    allocSendSamplesI(&knock_mb, (void*)knock_pairs, FFT_SIZE);
+  }
+  if ((flags & STM32_DMA_ISR_TCIF) != 0)
+  {
+    trace(TRACE_ADC, 0, FFT_SIZE);
+    allocSendSamplesI(&knock_mb, (void*)&knock_pairs[FFT_SIZE / 2], FFT_SIZE);
+  }
+  chSysUnlockFromISR();
+}
 
-  if (index < range)
-    index = range;
-  else if (index > size - range)
-    index = size - range;
+/*
+ * Both ADCs have been started by the HAL, we only take over the
+ * master DMA stream since the HAL dual mode applies to every ADC pair.
+ */
+static void setupDualMode(void)
+{
+  dmaStreamRelease(KNOCK_DUAL_ADCD.dmastp);
+  dmaStreamAllocate(KNOCK_DUAL_ADCD.dmastp, STM32_ADC_ADC1_DMA_IRQ_PRIORITY, dualDmaCallback, NULL);
+}
+
+static void startKnockConversion(void)
+{
+  const stm32_dma_stream_t *dmastp = KNOCK_DUAL_ADCD.dmastp;
+  ADC_TypeDef * const adcs[2] = {KNOCK_DUAL_ADC, KNOCK_ADC};
+  uint8_t i;
 
-  res = buffer[index];
-  for (i = 1; i < range; i++)
+  for (i = 0; i < 2; i++)
   {
-    multiplier = 1.0f / ((float32_t)i / flRatio);
-    res += multiplier * (float32_t)buffer[index + i];
-    res += multiplier * (float32_t)buffer[index - i];
+    adcs[i]->CFGR = ADC_CFGR_CONT | ADC_CFGR_ALIGN; // Continuous, left aligned
+    adcs[i]->SMPR1 = ADC_SMPR1_SMP_AN6(ADC_SMPR_SMP_7P5); // 7.5+12.5 = 20 clocks per conversion
+    adcs[i]->SMPR2 = 0;
+    adcs[i]->SQR1 = ADC_SQR1_SQ1_N(KNOCK_SENSOR1_CHANNEL);
   }
+  loadKnockOffsets();
+
+  /* Regular interleaved, slave delayed by half a conversion, 32 bits DMA */
+  ADC12_COMMON->CCR = (ADC12_COMMON->CCR & ~(ADC_CCR_DUAL_MASK | ADC_CCR_DELAY_MASK |
+                                             ADC_CCR_DMACFG_MASK | ADC_CCR_MDMA_MASK)) |
+                      ADC_CCR_DUAL(7) | ADC_CCR_DELAY(KNOCK_DUAL_DELAY - 1) |
+                      ADC_CCR_DMACFG_CIRCULAR | ADC_CCR_MDMA_WORD;
+
+  dmaStreamSetPeripheral(dmastp, &ADC12_COMMON->CDR);
+  dmaStreamSetMemory0(dmastp, knock_pairs);
+  dmaStreamSetTransactionSize(dmastp, FFT_SIZE);
+  dmaStreamSetMode(dmastp, STM32_DMA_CR_PL(STM32_ADC_ADC1_DMA_PRIORITY) |
+                           STM32_DMA_CR_DIR_P2M | STM32_DMA_CR_MINC |
+                           STM32_DMA_CR_MSIZE_WORD | STM32_DMA_CR_PSIZE_WORD |
+                           STM32_DMA_CR_CIRC | STM32_DMA_CR_HTIE | STM32_DMA_CR_TCIE);
+  dmaStreamEnable(dmastp);
+
+  KNOCK_DUAL_ADC->CR |= ADC_CR_ADSTART; // The master starts both
+}
+
+static void stopKnockConversion(void)
+{
+  KNOCK_DUAL_ADC->CR |= ADC_CR_ADSTP;
+  while (KNOCK_DUAL_ADC->CR & ADC_CR_ADSTP)
+    ;
+  dmaStreamDisable(KNOCK_DUAL_ADCD.dmastp);
+}
+#else
+static void startKnockConversion(void)
+{
+  loadKnockOffsets();
+  adcStartConversion(&KNOCK_ADCD, &adcgrpcfg_knock, knock_samples, FFT_SAMPLES); // Depth in scans
+}
 
-  return res;
+static void stopKnockConversion(void)
+{
+  adcStopConversion(&KNOCK_ADCD);
 }
+#endif
 
 /*
  * Knock processing thread.
  */
-static q15_t fft_output[FFT_SIZE];
-static q15_t fft_mag[SPECTRUM_SIZE];
-static uint16_t output_knock[SPECTRUM_SIZE];
+static knock_dsp_t knock_dsp;
+static uint16_t output_knock[KNOCK_SENSORS][SPECTRUM_SIZE];
+#if KNOCK_SENSORS > 1
+static q15_t knock_frames[KNOCK_SENSORS][FFT_SIZE];
+#endif
+
+CCM_FUNC static void processKnockFrame(uint8_t sensor, const q15_t* frame)
+{
+  uint16_t* output = output_knock[sensor];
+#if !SPI_USE_TPIC8101
+  uint16_t* stream = spiSlaveSpectrumBuffer(sensor); // Computed in place, no copy
+
+  if (stream != NULL)
+    output = stream;
+#endif
+
+  knockDspWindow(&knock_dsp, frame);
+  knockDspTransform(&knock_dsp);
+  knockDspMagnitude(&knock_dsp, output);
+  knock_values[sensor] = knockDspIntegrate(&kernel, output);
+  usbStreamWrite(STREAM_SPECTRUM, sensor, output, SPECTRUM_SIZE);
+
+#if !SPI_USE_TPIC8101
+  if (stream != NULL)
+    spiSlaveSpectrumPublish(sensor);
+#endif
+}
+
 static THD_WORKING_AREA(waThreadKnock, 600);
 THD_FUNCTION(ThreadKnock, arg)
 {
@@ -101,52 +306,103 @@ THD_FUNCTION(ThreadKnock, arg)
 
   q15_t* knock_data_ptr;
   size_t knock_data_sz;
-  uint16_t i;
-
-  /* ADC 2 Ch3 Offset. -0x0FFF */
-  KNOCK_ADC->CFGR |= ADC_CFGR_ALIGN; // Left alignment
-  KNOCK_ADC->OFR1 = ADC_OFR1_OFFSET1_EN | (ADC_OFR1_OFFSET1_CH_0 | ADC_OFR1_OFFSET1_CH_1) | (2048 & 0x0FFF);
+  rtcnt_t frame_time;
+  uint8_t s;
+  bool reload;
 
-  adcStartConversion(&ADCD3, &adcgrpcfg_knock, knock_samples, FFT_SAMPLES);
-
-  /* Initialize the CFFT/CIFFT module */
-  arm_rfft_instance_q15 S1;
-  arm_rfft_init_q15(&S1, FFT_SIZE, 0, 1);
+  startKnockConversion();
+#if !KNOCK_USE_DUAL_MODE
+  gptStartContinuous(&KNOCK_GPTD, knockTriggerInterval(settings.knock_rate));
+#endif
+  updateKnockKernel(settings.knock_rate);
+  knockDspInit(&knock_dsp);
 
   while (TRUE)
   {
-    recvFreeSamples(&knock_mb, (void*)&knock_data_ptr, &knock_data_sz, TIME_INFINITE);
+    recvFreeSamples(&knock_mb, (void*)&knock_data_ptr, &knock_data_sz, &frame_time, TIME_INFINITE);
+    supervisorHeartbeat(SUPERVISOR_KNOCK);
+    latencyAdd(LATENCY_KNOCK_WAKE, frame_time);
+    usbStreamWrite(STREAM_KNOCK_RAW, 0, (uint16_t*)knock_data_ptr, FFT_SIZE * KNOCK_SENSORS);
+    captureUpdate();
+
+#if KNOCK_SENSORS > 1
+    /* Scans are interleaved, split them into one frame per sensor */
+    uint16_t i;
+    for (i = 0; i < FFT_SIZE; i++)
+    {
+      for (s = 0; s < KNOCK_SENSORS; s++)
+        knock_frames[s][i] = *knock_data_ptr++;
+    }
+#endif
 
-    /* Process the data through the RFFT module */
-    arm_rfft_q15(&S1, knock_data_ptr, fft_output);
+    /* Replayed frames are host data, they must not move the ADC offsets */
+    const bool track = !sampling_enabled && !replayActive(STREAM_REPLAY_KNOCK);
+    reload = false;
+    for (s = 0; s < KNOCK_SENSORS; s++)
+    {
+#if KNOCK_SENSORS > 1
+      q15_t* frame = knock_frames[s];
+#else
+      q15_t* frame = knock_data_ptr;
+#endif
+      /* Outside of the knock window, follow the offset drift */
+#if KNOCK_USE_DUAL_MODE
+      /* Master results are the even samples, each ADC has its own offset */
+      if (track)
+      {
+        if (calibTrackIdle(CALIB_KNOCK_DUAL, (adcsample_t*)frame, FFT_SIZE / 2, 2))
+          reload = true;
+        if (calibTrackIdle(CALIB_KNOCK, (adcsample_t*)frame + 1, FFT_SIZE / 2, 2))
+          reload = true;
+      }
+#else
+      if (track && calibTrackIdle(CALIB_KNOCK + s, (adcsample_t*)frame, FFT_SIZE, 1))
+        reload = true;
+#endif
 
-    /* Process the data through the Complex Magnitude Module for
-    calculating the magnitude at each bin */
-    arm_cmplx_mag_q15(fft_output, fft_mag, SPECTRUM_SIZE); // Calculate magnitude, outputs q2.14
+      captureKnock(s, (uint16_t*)frame, FFT_SIZE);
+      processKnockFrame(s, frame);
+      trace(TRACE_KNOCK, s, knock_values[s]);
 
-    // Convert 2.14 to 16 Bits unsigned
-    for (i=0; i < SPECTRUM_SIZE; i++)
-    {
-      uint32_t tmp = (uint32_t)((int32_t)fft_mag[i] + 0x0FFF);
-      if (tmp > 0xFFFF) // Cap to 16b max
-        tmp = 0xFFFF;
-      output_knock[i] = (uint16_t)tmp; // 16 bits minus the 2 fractional bits
+      /* Marks the end of the frame that crossed the level */
+      if (sampling_enabled && knock_values[s] >= settings.capture_level)
+      {
+        chSysLock();
+        captureTriggerI(CAPTURE_TRIG_KNOCK, s, knock_values[s]);
+        chSysUnlock();
+      }
     }
-
-    knock_value = calculateKnockIntensity(
-                                          settings.knock_freq,
-                                          settings.knock_ratio,
-                                          FFT_FREQ,
-                                          output_knock,
-                                          sizeof(output_knock));
+    knock_frame_time = frame_time;
+    latencyAdd(LATENCY_KNOCK_FRAME, frame_time);
     chEvtBroadcast(&evt_knock_result_rdy);
 
+#if !KNOCK_USE_DUAL_MODE
+    if (kernel_rate != settings.knock_rate)
+    {
+      chSysLock();
+      gptChangeIntervalI(&KNOCK_GPTD, knockTriggerInterval(settings.knock_rate));
+      chSysUnlock();
+    }
+#endif
+    if (kernel.freq != settings.knock_freq ||
+        kernel.ratio != settings.knock_ratio ||
+        kernel_rate != settings.knock_rate)
+    {
+      updateKnockKernel(settings.knock_rate);
+    }
+
+    if (reload)
+    {
+      stopKnockConversion();
+      startKnockConversion();
+    }
   }
   return;
 }
 
 /*
- * We just keep the peak value and output it
+ * We just keep the peak value of the sensor mapped
+ * to the current cylinder and output it
  */
 static THD_WORKING_AREA(waThreadKnockOuput, 128);
 CCM_FUNC THD_FUNCTION(ThreadKnockOuput, arg)
@@ -161,18 +417,99 @@ CCM_FUNC THD_FUNCTION(ThreadKnockOuput, arg)
 
   while (TRUE)
   {
-    uint16_t knock_out = 0;
+    uint32_t knock_out = 0;
+    knock_integrator_t integrator;
+    knockDspIntegratorReset(&integrator);
+    supervisorHeartbeat(SUPERVISOR_KNOCK_OUTPUT);
     while (chEvtWaitOne(EVENT_MASK(0)) == 1 && sampling_enabled)
     {
-      if (knock_value > knock_out)
+      supervisorHeartbeat(SUPERVISOR_KNOCK_OUTPUT);
+      uint8_t sensor = knock_sensor_select;
+      if (sensor == KNOCK_SENSOR_AUTO)
+        sensor = KNOCK_CYL_SENSOR(settings.knock_sensor_map, knock_cylinder);
+      if (sensor >= KNOCK_SENSORS)
+        sensor = 0;
+
+      uint32_t val = ((uint32_t)knock_values[sensor] * settings.knock_gain) / KNOCK_UNITY_GAIN;
+
+      if (settings.knock_integrator != 0)
+      {
+        knock_out = knockDspIntegratorAdd(&integrator, val, knockFrameTime(settings.knock_rate),
+                                          settings.knock_integrator);
+      }
+      else if (val > knock_out)
       {
-        knock_out = knock_value;
+        knock_out = val;
       }
-      dacPutChannelX(&KNOCK_DACD, 0, knock_out >> 4); // This sets the knock output DAC to our value.
+      if (knock_out > 0xFFFF) // Cap to 16b max
+        knock_out = 0xFFFF;
+
+      knock_window = (uint16_t)knock_out;
+      dacPutChannelX(&KNOCK_DACD, 0, knock_window >> 4); // This sets the knock output DAC to our value.
+      latencyAdd(LATENCY_KNOCK_DAC, knock_frame_time);
     }
   }
 }
 
+uint16_t knockGetValue(uint8_t sensor)
+{
+  if (sensor >= KNOCK_SENSORS)
+    return 0;
+
+  return knock_values[sensor];
+}
+
+uint16_t knockGetCylinderValue(uint8_t cyl)
+{
+  if (cyl >= KNOCK_MAX_CYLINDERS)
+    return 0;
+
+  return knock_cyl_values[cyl];
+}
+
+/*
+ * Output of the window that just closed, latched on the falling edge
+ * of LINE_SAMPLE.
+ */
+uint16_t knockGetHeld(void)
+{
+  return knock_held;
+}
+
+/*
+ * Closing time of the last window, local timebase us.
+ */
+uint32_t knockGetTime(void)
+{
+  return knock_time;
+}
+
+/*
+ * Sampling frequency in Hz of each sensor.
+ */
+uint32_t knockGetSampleFreq(void)
+{
+  return knockSampleFreq(kernel_rate);
+}
+
+/*
+ * Forces the sensor driving the output, KNOCK_SENSOR_AUTO goes back
+ * to the cylinder mapping.
+ */
+void knockSetSensor(uint8_t sensor)
+{
+  knock_sensor_select = sensor;
+}
+
+/*
+ * Cylinder of the next window, the VR code starts the firing order over
+ * when the crank signal is lost.
+ */
+void knockSetCylinderI(uint8_t cyl)
+{
+  knock_cylinder = cyl % KNOCK_MAX_CYLINDERS;
+}
+
 CCM_FUNC static void sample_cb(void *arg)
 {
   (void)arg;
@@ -180,9 +517,24 @@ CCM_FUNC static void sample_cb(void *arg)
   chSysLockFromISR();
   if (palReadLine(LINE_SAMPLE) == PAL_HIGH) {
     sampling_enabled = true;
+    knock_window = 0;
   }
-  else {
+  else if (sampling_enabled) {
+    /* Published here rather than by the output thread, so the data ready
+       line follows the end of the window by a bounded delay */
+    rtcnt_t now = chSysGetRealtimeCounterX();
     sampling_enabled = false;
+    knock_held = knock_window;
+    knock_cyl_values[knock_cylinder] = knock_held;
+    knock_time = timebaseNowI();
+    evlogI(EVLOG_KNOCK, knock_cylinder, knock_held);
+    trace(TRACE_WINDOW, knock_cylinder, knock_held);
+    if (++knock_cylinder >= settings.knock_cylinders || knock_cylinder >= KNOCK_MAX_CYLINDERS)
+      knock_cylinder = 0;
+#if SPI_USE_TPIC8101
+    spiSlaveHoldI(); // The result is readable right away
+#endif
+    notifyI(NOTIFY_KNOCK, now);
   }
   chSysUnlockFromISR();
 }
@@ -190,7 +542,16 @@ CCM_FUNC static void sample_cb(void *arg)
 void createKnockThread(void)
 {
   opampStart(&KNOCK_OPAMPD, &opamp2_conf);
-  adcStart(&KNOCK_ADCD, NULL);
+  opampEnable(&KNOCK_OPAMPD);
+  adcStart(&KNOCK_ADCD, NULL); // Runs the ADC self-calibration
+#if KNOCK_USE_DUAL_MODE
+  adcStart(&KNOCK_DUAL_ADCD, NULL);
+  calibrateKnock();
+  setupDualMode();
+#else
+  calibrateKnock();
+  gptStart(&KNOCK_GPTD, &gpt_conf);
+#endif
 
   dacStart(&KNOCK_DACD, &dac_conf);
   dacPutChannelX(&KNOCK_DACD, 0, 0); // This sets knock output to 0;
@@ -198,8 +559,10 @@ void createKnockThread(void)
   /* Events initialization. */
   chEvtObjectInit(&evt_knock_result_rdy);
 
-  chThdCreateStatic(waThreadKnock, sizeof(waThreadKnock), NORMALPRIO, ThreadKnock, NULL);
-  chThdCreateStatic(waThreadKnockOuput, sizeof(waThreadKnockOuput), NORMALPRIO, ThreadKnockOuput, NULL);
+  memhealthCreateStatic(waThreadKnock, NORMALPRIO, ThreadKnock, NULL);
+  memhealthCreateStatic(waThreadKnockOuput, NORMALPRIO, ThreadKnockOuput, NULL);
+  supervisorWatch(SUPERVISOR_KNOCK, knockFrameTime(settings.knock_rate));
+  supervisorWatch(SUPERVISOR_KNOCK_OUTPUT, knockFrameTime(settings.knock_rate));
 
   palEnableLineEvent(LINE_SAMPLE, PAL_EVENT_MODE_BOTH_EDGES);
   palSetLineCallback(LINE_SAMPLE, sample_cb, NULL);
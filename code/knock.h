@@ -1,16 +1,69 @@
+#ifndef KNOCK_H_
+#define KNOCK_H_
+
 #include "ch.h"
+#include "knockconf.h"
 
 #define KNOCK_ADC ADC2
 #define KNOCK_ADCD ADCD2
 #define KNOCK_OPAMP OPAMP2
 #define KNOCK_OPAMPD OPAMPD2
+#define KNOCK_ADC_TRIGGER (ADC_CFGR_EXTEN_RISING | ADC_CFGR_EXTSEL_SRC(13)) // TIM6 TRGO
+#define KNOCK_GPTD GPTD6
+
+/*
+ * Interleaved mode, ADC1 and ADC2 sample the same input half a conversion
+ * apart. The input has to be on a pin shared by both ADCs, and VR1 is
+ * disabled since ADC1 belongs to the knock input.
+ */
+#if !defined(KNOCK_USE_DUAL_MODE)
+#define KNOCK_USE_DUAL_MODE FALSE
+#endif
+
+#if KNOCK_USE_DUAL_MODE
+#define KNOCK_SENSORS 1
+#define KNOCK_SENSOR1_CHANNEL ADC_CHANNEL_IN6 // PC0, ADC12_IN6
+#define KNOCK_DUAL_ADC ADC1
+#define KNOCK_DUAL_ADCD ADCD1
+#define KNOCK_DUAL_PRESCALER 16 // PLL/16 4.5Mhz, must match STM32_ADC12PRES
+#define KNOCK_DUAL_DELAY 10 // ADC clocks, half the 7.5+12.5 conversion time
+#define KNOCK_DUAL_RATE (STM32_PLLCLKOUT / KNOCK_DUAL_PRESCALER / KNOCK_DUAL_DELAY) // 450kS/s
+#else
+/* Sensors scanned by the knock ADC, each has an offset register so 4 max */
+#define KNOCK_SENSORS 2
+#define KNOCK_SENSOR1_CHANNEL ADC_CHANNEL_IN3 // OPAMP2 output, PA6
+#endif
+#define KNOCK_SENSOR2_CHANNEL ADC_CHANNEL_IN5 // PC4
+#define KNOCK_SENSOR3_CHANNEL ADC_CHANNEL_IN11 // PC5
+#define KNOCK_SENSOR4_CHANNEL ADC_CHANNEL_IN12 // PB2
+
+/*
+ * Sensor to cylinder mapping, 2 bits per cylinder in firing order.
+ * Each window closing moves to the next cylinder, the first window
+ * after the crank signal is acquired is the first cylinder.
+ */
+#define KNOCK_MAX_CYLINDERS 8
+#define KNOCK_DEFAULT_CYLINDERS 4
+#define KNOCK_CYL_SENSOR(map, cyl) (((map) >> ((cyl) * 2)) & 0x03)
+#define KNOCK_DEFAULT_SENSOR_MAP 0x4444 // Odd cylinders on sensor 1, even on sensor 2
+#define KNOCK_SENSOR_AUTO 0xFF // Sensor picked by the cylinder mapping
 
 #define KNOCK_DAC DAC2
 #define KNOCK_DACD DACD2
 
-#define FFT_SIZE 512
-#define FFT_SAMPLES (FFT_SIZE*2) // We need double the FFT size
-#define FFT_FREQ (117263/2)
-#define SPECTRUM_SIZE (FFT_SIZE/2) // We don't care about the imaginary half
+#define KNOCK_DEFAULT_RATE 100 // kS/s, 195.3Hz per bin
+#define KNOCK_MIN_RATE 20 // kS/s
+#define KNOCK_MAX_RATE (250 / KNOCK_SENSORS) // kS/s, limited by the conversion time
+#define KNOCK_UNITY_GAIN 1000 // knock_gain setting for a gain of 1
 #define KNOCK_RATIO 4.66f // Knock voltage ratio after the divider. TODO: Check value
 #define KNOCK_MAX (3.3*KNOCK_RATIO)
+
+uint16_t knockGetValue(uint8_t sensor);
+uint16_t knockGetCylinderValue(uint8_t cyl);
+uint16_t knockGetHeld(void);
+uint32_t knockGetTime(void);
+uint32_t knockGetSampleFreq(void);
+void knockSetSensor(uint8_t sensor);
+void knockSetCylinderI(uint8_t cyl);
+
+#endif
@@ -0,0 +1,207 @@
+#include "knock_dsp.h"
+#if !defined(KNOCK_DSP_HOSTED)
+#include "board.h"
+#else
+#define CCM_FUNC // Host benchmark, see bench/
+#endif
+
+/*
+ * Every variant produces the amplitude of a sine wave, in input codes.
+ * The transforms scale their output differently, the magnitude stage
+ * brings them all back to this unit.
+ * Q15 and Q31: the RFFT output is divided by FFT_SIZE, the magnitude by 2.
+ * F32: nothing is scaled, but the input is normalized to +/-1.
+ */
+#if KNOCK_DSP_USE_WINDOW
+#define KNOCK_DSP_GAIN_SHIFT 1 // Hann coherent gain is 1/2
+#else
+#define KNOCK_DSP_GAIN_SHIFT 0
+#endif
+#define KNOCK_DSP_F32_SCALE ((2.0f * 32768.0f * (1 << KNOCK_DSP_GAIN_SHIFT)) / FFT_SIZE)
+
+static uint16_t saturate16(uint32_t val)
+{
+  if (val > 0xFFFF) // Cap to 16b max
+    return 0xFFFF;
+  return (uint16_t)val;
+}
+
+void knockDspInit(knock_dsp_t* dsp)
+{
+#if KNOCK_DSP_USE_WINDOW
+  uint16_t i;
+
+  /* Periodic Hann window */
+  for (i = 0; i < FFT_SIZE; i++)
+  {
+    float32_t w = 0.5f - 0.5f * cosf((2.0f * PI * i) / FFT_SIZE);
+#if KNOCK_DSP == KNOCK_DSP_Q15
+    int32_t val = (int32_t)(w * 32768.0f + 0.5f);
+    dsp->window[i] = val > 0x7FFF ? 0x7FFF : (q15_t)val;
+#elif KNOCK_DSP == KNOCK_DSP_Q31
+    int64_t val = (int64_t)((float64_t)w * 2147483648.0 + 0.5);
+    dsp->window[i] = val > 0x7FFFFFFF ? 0x7FFFFFFF : (q31_t)val;
+#else
+    dsp->window[i] = w;
+#endif
+  }
+#endif
+
+  /* Initialize the RFFT module, it holds no state and is shared by the sensors */
+#if KNOCK_DSP == KNOCK_DSP_Q15
+  arm_rfft_init_q15(&dsp->rfft, FFT_SIZE, 0, 1);
+#elif KNOCK_DSP == KNOCK_DSP_Q31
+  arm_rfft_init_q31(&dsp->rfft, FFT_SIZE, 0, 1);
+#else
+  arm_rfft_fast_init_f32(&dsp->rfft, FFT_SIZE);
+#endif
+}
+
+/*
+ * Copies a q15 frame to the working buffer, converting and windowing it.
+ * The frame is left untouched.
+ */
+CCM_FUNC void knockDspWindow(knock_dsp_t* dsp, const q15_t* frame)
+{
+#if KNOCK_DSP == KNOCK_DSP_Q15
+#if KNOCK_DSP_USE_WINDOW
+  arm_mult_q15((q15_t*)frame, dsp->window, dsp->input, FFT_SIZE);
+#else
+  arm_copy_q15((q15_t*)frame, dsp->input, FFT_SIZE);
+#endif
+#elif KNOCK_DSP == KNOCK_DSP_Q31
+  arm_q15_to_q31((q15_t*)frame, dsp->input, FFT_SIZE);
+#if KNOCK_DSP_USE_WINDOW
+  arm_mult_q31(dsp->input, dsp->window, dsp->input, FFT_SIZE);
+#endif
+#else
+  arm_q15_to_float((q15_t*)frame, dsp->input, FFT_SIZE);
+#if KNOCK_DSP_USE_WINDOW
+  arm_mult_f32(dsp->input, dsp->window, dsp->input, FFT_SIZE);
+#endif
+#endif
+}
+
+CCM_FUNC void knockDspTransform(knock_dsp_t* dsp)
+{
+#if KNOCK_DSP == KNOCK_DSP_Q15
+  arm_rfft_q15(&dsp->rfft, dsp->input, dsp->output);
+#elif KNOCK_DSP == KNOCK_DSP_Q31
+  arm_rfft_q31(&dsp->rfft, dsp->input, dsp->output);
+#else
+  arm_rfft_fast_f32(&dsp->rfft, dsp->input, dsp->output, 0);
+#endif
+}
+
+/*
+ * Magnitude of each bin, in the unit of the variant.
+ */
+CCM_FUNC void knockDspComplexMag(knock_dsp_t* dsp)
+{
+#if KNOCK_DSP == KNOCK_DSP_Q15
+  arm_cmplx_mag_q15(dsp->output, dsp->mag, SPECTRUM_SIZE); // Outputs q2.14
+#elif KNOCK_DSP == KNOCK_DSP_Q31
+  arm_cmplx_mag_q31(dsp->output, dsp->mag, SPECTRUM_SIZE); // Outputs q2.30
+#else
+  arm_cmplx_mag_f32(dsp->output, dsp->mag, SPECTRUM_SIZE);
+  dsp->mag[0] = fabsf(dsp->output[0]); // Drop the packed Nyquist bin
+#endif
+}
+
+/*
+ * Magnitudes to the 16 bits amplitude spectrum.
+ */
+CCM_FUNC void knockDspSpectrum(const knock_dsp_t* dsp, uint16_t* spectrum)
+{
+  uint16_t i;
+
+#if KNOCK_DSP == KNOCK_DSP_Q15
+  for (i = 0; i < SPECTRUM_SIZE; i++)
+    spectrum[i] = saturate16((uint32_t)dsp->mag[i] << (2 + KNOCK_DSP_GAIN_SHIFT));
+#elif KNOCK_DSP == KNOCK_DSP_Q31
+  const uint8_t shift = 14 - KNOCK_DSP_GAIN_SHIFT;
+
+  for (i = 0; i < SPECTRUM_SIZE; i++)
+    spectrum[i] = saturate16(((uint32_t)dsp->mag[i] + (1U << (shift - 1))) >> shift);
+#else
+  for (i = 0; i < SPECTRUM_SIZE; i++)
+  {
+    float32_t val = dsp->mag[i] * KNOCK_DSP_F32_SCALE + 0.5f;
+    spectrum[i] = val >= 65535.0f ? 0xFFFF : (uint16_t)val;
+  }
+#endif
+}
+
+/*
+ * Magnitude of each bin, as a 16 bits amplitude.
+ */
+CCM_FUNC void knockDspMagnitude(knock_dsp_t* dsp, uint16_t* spectrum)
+{
+  knockDspComplexMag(dsp);
+  knockDspSpectrum(dsp, spectrum);
+}
+
+/*
+ * Bins around the target frequency are weighted down by their distance.
+ * The kernel only changes with the settings, we keep it between frames.
+ */
+void knockDspKernel(knock_kernel_t* k, uint16_t tgtFreq, uint16_t ratio, uint32_t smplFreq)
+{
+  uint16_t i;
+  const float32_t flRatio = ((float32_t)ratio / 100000.0f);
+  uint32_t index = (((uint32_t)tgtFreq * FFT_SIZE) + (smplFreq / 2)) / smplFreq; // Closest bin
+
+  if (index < KNOCK_KERNEL_RANGE)
+    index = KNOCK_KERNEL_RANGE;
+  else if (index > SPECTRUM_SIZE - KNOCK_KERNEL_RANGE)
+    index = SPECTRUM_SIZE - KNOCK_KERNEL_RANGE;
+
+  k->index = (uint16_t)index;
+  k->weights[0] = 1.0f;
+  for (i = 1; i < KNOCK_KERNEL_RANGE; i++)
+    k->weights[i] = 1.0f / ((float32_t)i / flRatio);
+
+  k->freq = tgtFreq;
+  k->ratio = ratio;
+}
+
+CCM_FUNC uint16_t knockDspIntegrate(const knock_kernel_t* k, const uint16_t* spectrum)
+{
+  uint16_t i;
+  float32_t res;
+
+  res = spectrum[k->index];
+  for (i = 1; i < KNOCK_KERNEL_RANGE; i++)
+  {
+    res += k->weights[i] * (float32_t)spectrum[k->index + i];
+    res += k->weights[i] * (float32_t)spectrum[k->index - i];
+  }
+
+  if (res > 65535.0f)
+    return 0xFFFF;
+
+  return (uint16_t)res;
+}
+
+void knockDspIntegratorReset(knock_integrator_t* it)
+{
+  it->area = 0;
+  it->span = 0;
+}
+
+CCM_FUNC uint16_t knockDspIntegratorAdd(knock_integrator_t* it, uint32_t val, uint32_t frame_us, uint16_t tau)
+{
+  uint64_t res;
+
+  it->area += (uint64_t)val * frame_us;
+  it->span += frame_us;
+
+  if (it->span == 0 || tau == 0)
+    return 0;
+
+  res = (it->area * KNOCK_INTEGRATOR_REF) / ((uint64_t)it->span * tau);
+  if (res > 0xFFFF) // Cap to 16b max
+    return 0xFFFF;
+
+  return (uint16_t)res;
+}
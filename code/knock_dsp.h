@@ -0,0 +1,69 @@
+#ifndef KNOCK_DSP_H_
+#define KNOCK_DSP_H_
+
+#include "arm_math.h"
+#include "knockconf.h"
+
+/*
+ * Knock spectrum stages: window, transform, magnitude and band integration.
+ * The first three use the arithmetic selected by KNOCK_DSP, they all end up
+ * in the same 16 bits spectrum so the integration and everything downstream
+ * do not depend on the variant.
+ */
+
+#if KNOCK_DSP == KNOCK_DSP_Q15
+typedef q15_t knock_dsp_sample_t;
+typedef arm_rfft_instance_q15 knock_dsp_rfft_t;
+#define KNOCK_DSP_OUTPUT_SIZE (FFT_SIZE*2) // Complex output, real and imaginary
+#elif KNOCK_DSP == KNOCK_DSP_Q31
+typedef q31_t knock_dsp_sample_t;
+typedef arm_rfft_instance_q31 knock_dsp_rfft_t;
+#define KNOCK_DSP_OUTPUT_SIZE (FFT_SIZE*2)
+#else
+typedef float32_t knock_dsp_sample_t;
+typedef arm_rfft_fast_instance_f32 knock_dsp_rfft_t;
+#define KNOCK_DSP_OUTPUT_SIZE FFT_SIZE // Packed, the Nyquist bin sits in the DC imaginary part
+#endif
+
+typedef struct {
+  knock_dsp_rfft_t rfft;
+  knock_dsp_sample_t input[FFT_SIZE]; // Windowed frame, the transform uses it as scratch
+  knock_dsp_sample_t output[KNOCK_DSP_OUTPUT_SIZE];
+  knock_dsp_sample_t mag[SPECTRUM_SIZE];
+#if KNOCK_DSP_USE_WINDOW
+  knock_dsp_sample_t window[FFT_SIZE];
+#endif
+} knock_dsp_t;
+
+typedef struct {
+  uint16_t freq; // Settings the kernel was built for
+  uint16_t ratio;
+  uint16_t index; // Target frequency bin
+  float32_t weights[KNOCK_KERNEL_RANGE];
+} knock_kernel_t;
+
+/*
+ * Knock window integrator. The TPIC8101 output is the band level integrated
+ * over the window and divided by its time constant, here it is the mean over
+ * the window scaled by KNOCK_INTEGRATOR_REF / tau so the window length does
+ * not saturate it. The shortest TPIC time constant gives the mean itself.
+ */
+#define KNOCK_INTEGRATOR_REF 40 // us
+
+typedef struct {
+  uint64_t area; // Sum of value * us
+  uint32_t span; // us integrated
+} knock_integrator_t;
+
+void knockDspInit(knock_dsp_t* dsp);
+void knockDspWindow(knock_dsp_t* dsp, const q15_t* frame);
+void knockDspTransform(knock_dsp_t* dsp);
+void knockDspComplexMag(knock_dsp_t* dsp);
+void knockDspSpectrum(const knock_dsp_t* dsp, uint16_t* spectrum);
+void knockDspMagnitude(knock_dsp_t* dsp, uint16_t* spectrum);
+void knockDspKernel(knock_kernel_t* k, uint16_t tgtFreq, uint16_t ratio, uint32_t smplFreq);
+uint16_t knockDspIntegrate(const knock_kernel_t* k, const uint16_t* spectrum);
+void knockDspIntegratorReset(knock_integrator_t* it);
+uint16_t knockDspIntegratorAdd(knock_integrator_t* it, uint32_t val, uint32_t frame_us, uint16_t tau);
+
+#endif
@@ -0,0 +1,37 @@
+#ifndef KNOCKCONF_H_
+#define KNOCKCONF_H_
+
+/*
+ * Knock DSP chain build time configuration.
+ * Can be overridden externally, see USE_KNOCK_DSP in the Makefile.
+ */
+
+#if !defined(TRUE)
+#define TRUE 1 // Host builds, no ChibiOS types
+#define FALSE 0
+#endif
+
+#define FFT_SIZE 512
+#define FFT_SAMPLES (FFT_SIZE*2) // We need double the FFT size
+#define SPECTRUM_SIZE (FFT_SIZE/2) // We don't care about the imaginary half
+#define KNOCK_KERNEL_RANGE 5 // Bins on each side of the target frequency
+
+#define KNOCK_DSP_Q15 0 // Fastest, 16 bits all along
+#define KNOCK_DSP_Q31 1 // 32 bits transform and magnitude
+#define KNOCK_DSP_F32 2 // Floating point, uses the FPU
+
+/* Arithmetic used by the window, transform and magnitude stages */
+#if !defined(KNOCK_DSP)
+#define KNOCK_DSP KNOCK_DSP_Q15
+#endif
+
+/* Hann window before the transform, limits leakage into the knock band */
+#if !defined(KNOCK_DSP_USE_WINDOW)
+#define KNOCK_DSP_USE_WINDOW TRUE
+#endif
+
+#if (KNOCK_DSP != KNOCK_DSP_Q15) && (KNOCK_DSP != KNOCK_DSP_Q31) && (KNOCK_DSP != KNOCK_DSP_F32)
+#error "Unknown KNOCK_DSP variant"
+#endif
+
+#endif
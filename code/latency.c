@@ -0,0 +1,99 @@
+#include <string.h>
+#include "hal.h"
+#include "latency.h"
+#include "usb_stream.h"
+
+typedef struct {
+  uint16_t buckets[LATENCY_BUCKETS];
+  uint32_t count;
+  uint32_t max;
+} histogram_t;
+
+static histogram_t histograms[LATENCY_PATHS];
+static bool enabled;
+static uint16_t frame[(sizeof(latency_summary_t) + LATENCY_BUCKETS * 2 + 1) / 2];
+
+/*
+ * Adds the cycles elapsed since start to a path.
+ */
+CCM_FUNC void latencyAddI(uint8_t path, rtcnt_t start)
+{
+  histogram_t* const h = &histograms[path];
+  const uint32_t cycles = chSysGetRealtimeCounterX() - start;
+  const uint8_t bucket = latencyBucket(cycles);
+  uint8_t i;
+
+  if (h->buckets[bucket] == 0xFFFF)
+  {
+    for (i = 0; i < LATENCY_BUCKETS; i++)
+      h->buckets[i] >>= 1;
+  }
+  h->buckets[bucket]++;
+  h->count++;
+  if (cycles > h->max)
+    h->max = cycles;
+}
+
+void latencyAdd(uint8_t path, rtcnt_t start)
+{
+  chSysLock();
+  latencyAddI(path, start);
+  chSysUnlock();
+}
+
+static uint32_t percentile(const uint16_t* buckets, uint32_t total, uint32_t permille)
+{
+  const uint32_t rank = (total * permille + 999) / 1000;
+  uint32_t sum = 0;
+  uint8_t i;
+
+  for (i = 0; i < LATENCY_BUCKETS; i++)
+  {
+    sum += buckets[i];
+    if (sum >= rank && sum != 0)
+      return latencyBucketStart(i);
+  }
+  return 0;
+}
+
+/*
+ * Sends a frame per path, called every second by the monitor thread.
+ */
+void latencyUpdate(void)
+{
+  latency_summary_t* const summary = (latency_summary_t*)frame;
+  uint16_t* const buckets = &frame[sizeof(latency_summary_t) / 2];
+  uint32_t total;
+  uint8_t path, i;
+
+  if (!usbStreamEnabled(STREAM_LATENCY))
+  {
+    enabled = false;
+    return;
+  }
+  if (!enabled)
+  {
+    /* A new measurement */
+    chSysLock();
+    memset(histograms, 0, sizeof(histograms));
+    chSysUnlock();
+    enabled = true;
+  }
+
+  for (path = 0; path < LATENCY_PATHS; path++)
+  {
+    chSysLock();
+    memcpy(buckets, histograms[path].buckets, sizeof(histograms[path].buckets));
+    summary->count = histograms[path].count;
+    summary->max = histograms[path].max;
+    chSysUnlock();
+
+    total = 0;
+    for (i = 0; i < LATENCY_BUCKETS; i++)
+      total += buckets[i];
+    summary->p50 = percentile(buckets, total, 500);
+    summary->p99 = percentile(buckets, total, 990);
+    summary->clock = STM32_HCLK;
+    usbStreamWrite(STREAM_LATENCY, path, frame, sizeof(frame) / 2);
+  }
+}
@@ -0,0 +1,20 @@
+#ifndef LATENCY_H_
+#define LATENCY_H_
+
+#include "ch.h"
+#include "latency_format.h"
+
+/*
+ * Latency histograms of the processing paths, see latency_format.h.
+ * Probes take chSysGetRealtimeCounterX() when the path starts and add
+ * the elapsed cycles when it ends. Histograms are cleared when the
+ * STREAM_LATENCY stream is selected.
+ */
+
+#define latencyStamp() chSysGetRealtimeCounterX()
+
+void latencyAddI(uint8_t path, rtcnt_t start);
+void latencyAdd(uint8_t path, rtcnt_t start);
+void latencyUpdate(void);
+
+#endif
@@ -0,0 +1,61 @@
+#ifndef LATENCY_FORMAT_H_
+#define LATENCY_FORMAT_H_
+
+#include <stdint.h>
+
+/*
+ * Latency histograms, shared with the host tools.
+ * Latencies are in CPU cycles, bucketed with LATENCY_SUB_BITS bits of
+ * mantissa: below 2 << LATENCY_SUB_BITS each value has its bucket, above
+ * a power of two is split in 1 << LATENCY_SUB_BITS buckets (19% wide).
+ * The last bucket holds everything above LATENCY_MAX_CYCLES.
+ * Counts are halved when one would overflow, the shape is kept.
+ */
+
+#define LATENCY_KNOCK_WAKE 0 // Knock ADC frame complete to the knock thread
+#define LATENCY_KNOCK_FRAME 1 // Knock ADC frame complete to every sensor processed
+#define LATENCY_KNOCK_DAC 2 // Knock ADC frame complete to the DAC output written
+#define LATENCY_VR_EDGE 3 // Comparator interrupt to the threshold and timeout rearmed
+#define LATENCY_VR_FRAME 4 // VR ADC frame complete to the peak checked
+#define LATENCY_PATHS 5
+
+#define LATENCY_SUB_BITS 2
+#define LATENCY_MAX_BITS 24 // 233 ms at 72 MHz
+#define LATENCY_MAX_CYCLES ((1UL << LATENCY_MAX_BITS) - 1)
+#define LATENCY_BUCKETS (((LATENCY_MAX_BITS - LATENCY_SUB_BITS + 1) << LATENCY_SUB_BITS) + 1)
+
+/* Bucket of a latency in cycles */
+static inline uint8_t latencyBucket(uint32_t cycles)
+{
+  uint8_t msb, shift;
+
+  if (cycles > LATENCY_MAX_CYCLES)
+    return LATENCY_BUCKETS - 1;
+  if (cycles < (2 << LATENCY_SUB_BITS))
+    return cycles;
+
+  msb = 31 - __builtin_clz(cycles);
+  shift = msb - LATENCY_SUB_BITS;
+  return (shift << LATENCY_SUB_BITS) + (cycles >> shift);
+}
+
+/* Lowest latency of a bucket, in cycles */
+static inline uint32_t latencyBucketStart(uint8_t bucket)
+{
+  const uint8_t shift = bucket >> LATENCY_SUB_BITS;
+
+  if (shift == 0)
+    return bucket;
+  return (uint32_t)((bucket & ((1 << LATENCY_SUB_BITS) - 1)) | (1 << LATENCY_SUB_BITS)) << (shift - 1);
+}
+
+/* STREAM_LATENCY frame, channel is the path, then the bucket counts */
+typedef struct {
+  uint32_t count; // Latencies recorded since the stream was enabled
+  uint32_t max; // Cycles
+  uint32_t p50; // Cycles, start of the bucket
+  uint32_t p99;
+  uint32_t clock; // Cycles per second
+} __attribute__((packed)) latency_summary_t;
+
+#endif
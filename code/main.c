@@ -18,6 +18,15 @@
 #include "hal.h"
 #include "threads.h"
 #include "usb_config.h"
+#include "ipc.h"
+#include "notify.h"
+#include "cpuload.h"
+#include "latency.h"
+#include "memhealth.h"
+#include "supervisor.h"
+#include "timebase.h"
+#include "replay.h"
+#include "dspbench.h"
 
 /*
  * Watchdog deadline set to 250ms (LSI=40000 / (16 * 1000)).
@@ -31,22 +40,34 @@ static const WDGConfig wdgcfg = {
 /*
  * CPU Load Monitoring thread.
  */
-static THD_WORKING_AREA(waThreadMonitor, 64);
+static THD_WORKING_AREA(waThreadMonitor, 256);
 static THD_FUNCTION(ThreadMonitor, arg)
 {
   (void)arg;
   chRegSetThreadName("Monitor");
 
-  DWT->CTRL |= DWT_CTRL_EXCEVTENA_Msk;
-
-  // TODO
+  systime_t time = chVTGetSystemTimeX();
   while (TRUE)
   {
-    chThdSleepMilliseconds(1000);
+    time = chThdSleepUntilWindowed(time, chTimeAddX(time, TIME_MS2I(CPULOAD_PERIOD_MS)));
+    cpuloadUpdate();
+    latencyUpdate();
+    memhealthUpdate();
+    supervisorUpdate();
+    timebaseUpdate();
+#if DSPBENCH_ENABLED
+    dspbenchUpdate();
+#endif
+#if REPLAY_ENABLED
+    replayUpdate();
+#endif
   }
 }
 
-static THD_WORKING_AREA(waThreadWdg, 64);
+/*
+ * Feeds the watchdog while the supervised threads check in.
+ */
+static THD_WORKING_AREA(waThreadWdg, 128);
 static THD_FUNCTION(ThreadWdg, arg)
 {
   (void)arg;
@@ -54,8 +75,9 @@ static THD_FUNCTION(ThreadWdg, arg)
 
   while (true)
   {
-    wdgResetI(&WDGD1);
-    chThdSleepMilliseconds(200);
+    if (supervisorCheck())
+      wdgReset(&WDGD1);
+    chThdSleepMilliseconds(SUPERVISOR_PERIOD_MS);
   }
 }
 
@@ -66,14 +88,29 @@ int main(void) {
 
   halInit();
   chSysInit();
+  memhealthInit();
+  supervisorInit();
+#if DSPBENCH_ENABLED
+  dspbenchRun(); // Alone, and before the watchdog runs
+#endif
 
   wdgStart(&WDGD1, &wdgcfg);
+  setupIPC();
+  notifyInit();
   createKnockThread();
   createVrThreads();
   createSpiThreads();
 
-  chThdCreateStatic(waThreadMonitor, sizeof(waThreadMonitor), NORMALPRIO + 10, ThreadMonitor, NULL);
-  chThdCreateStatic(waThreadWdg, sizeof(waThreadWdg), HIGHPRIO, ThreadWdg, NULL);
+  /* The board has a fixed D+ pull-up, connecting is a no-op */
+  sduObjectInit(&SDU1);
+  sduStart(&SDU1, &serusbcfg1);
+  usbDisconnectBus(serusbcfg1.usbp);
+  usbStart(serusbcfg1.usbp, &usbcfg);
+  usbConnectBus(serusbcfg1.usbp);
+  createUsbThreads();
+
+  memhealthCreateStatic(waThreadMonitor, NORMALPRIO + 10, ThreadMonitor, NULL);
+  memhealthCreateStatic(waThreadWdg, HIGHPRIO, ThreadWdg, NULL);
 
   /*
    * Normal main() thread activity.
@@ -0,0 +1,138 @@
+#include <string.h>
+#include "hal.h"
+#include "memhealth.h"
+#include "ipc.h"
+#include "evlog.h"
+#include "usb_stream.h"
+
+#if CH_DBG_FILL_THREADS != TRUE
+#error "CH_DBG_FILL_THREADS is needed for the stack high-water marks"
+#endif
+
+#define STACK_FILL 0x55 // CH_DBG_STACK_FILL_VALUE and the crt0 pattern
+
+typedef struct {
+  const uint8_t* base;
+  uint16_t size;
+  uint16_t peak; // Bytes used
+  thread_t* tp; // NULL for the exception stack
+  bool reported;
+} stack_info_t;
+
+extern uint8_t __main_stack_base__[], __main_stack_end__[];
+extern uint8_t __process_stack_base__[], __process_stack_end__[];
+
+static stack_info_t stacks[MEMHEALTH_STACKS];
+static uint8_t stack_count;
+static uint16_t stack_min = 0xFFFF; // Smallest margin left
+static bool low;
+static uint16_t frame[(MEMHEALTH_STACKS + 1 + IPC_MAILBOXES) * sizeof(stream_memory_t) / 2];
+
+static void addStack(thread_t* tp, const uint8_t* base, size_t size)
+{
+  if (stack_count == MEMHEALTH_STACKS)
+    return;
+
+  stacks[stack_count].base = base;
+  stacks[stack_count].size = size;
+  stacks[stack_count].tp = tp;
+  stack_count++;
+}
+
+/*
+ * Called from main() after chSysInit(), main() runs on the process stack.
+ */
+void memhealthInit(void)
+{
+  addStack(NULL, __main_stack_base__, __main_stack_end__ - __main_stack_base__);
+  addStack(chThdGetSelfX(), __process_stack_base__, __process_stack_end__ - __process_stack_base__);
+}
+
+void memhealthAddThread(thread_t* tp, void* wa, size_t size)
+{
+  addStack(tp, wa, size);
+}
+
+/* Bytes from the bottom of the stack never written */
+static uint16_t stackFree(const stack_info_t* s)
+{
+  uint16_t i;
+
+  for (i = 0; i < s->size && s->base[i] == STACK_FILL; i++);
+  return i;
+}
+
+static void putRow(stream_memory_t* row, uint16_t kind, const char* name, uint16_t size,
+                   const ipc_usage_t* usage)
+{
+  row->kind = kind;
+  row->size = size;
+  row->used = usage->used;
+  row->peak = usage->peak;
+  row->failures = usage->failures;
+  if (name != NULL)
+    strncpy(row->name, name, sizeof(row->name));
+}
+
+/*
+ * Scans the stacks, called every second by the monitor thread.
+ * The table is sent on the USB stream when enabled.
+ */
+void memhealthUpdate(void)
+{
+  static const char* const mailbox_names[IPC_MAILBOXES] = {"knock", "vr1", "vr2", "vr3"};
+  stream_memory_t* const rows = (stream_memory_t*)frame;
+  ipc_usage_t pool, mailboxes[IPC_MAILBOXES];
+  ipc_usage_t usage = {0, 0, 0};
+  uint16_t margin, min = 0xFFFF;
+  bool dropped = false;
+  uint8_t i, n = 0;
+
+  memset(frame, 0, sizeof(frame));
+
+  for (i = 0; i < stack_count; i++)
+  {
+    stack_info_t* const s = &stacks[i];
+
+    margin = stackFree(s);
+    s->peak = s->size - margin;
+    if (margin < min)
+      min = margin;
+    if (margin < MEMHEALTH_STACK_MARGIN && !s->reported)
+    {
+      s->reported = true;
+      chSysLock();
+      evlogI(EVLOG_FAULT, EVLOG_FAULT_STACK, i);
+      chSysUnlock();
+    }
+
+    usage.used = usage.peak = s->peak;
+    putRow(&rows[n++], STREAM_MEMORY_STACK, s->tp != NULL ? chRegGetThreadNameX(s->tp) : "irq",
+           s->size, &usage);
+  }
+
+  ipcGetUsage(&pool, mailboxes);
+  dropped = pool.failures != 0;
+  putRow(&rows[n++], STREAM_MEMORY_POOL, "samples", POOL_SIZE, &pool);
+  for (i = 0; i < IPC_MAILBOXES; i++)
+  {
+    dropped |= mailboxes[i].failures != 0;
+    putRow(&rows[n++], STREAM_MEMORY_MAILBOX, mailbox_names[i], MAILBOX_SIZE, &mailboxes[i]);
+  }
+
+  stack_min = min;
+  low = min < MEMHEALTH_STACK_MARGIN || dropped;
+
+  if (usbStreamEnabled(STREAM_MEMORY))
+    usbStreamWrite(STREAM_MEMORY, 0, frame, n * sizeof(stream_memory_t) / 2);
+}
+
+uint16_t memhealthGetStackMin(void)
+{
+  return stack_min;
+}
+
+bool memhealthIsLow(void)
+{
+  return low;
+}
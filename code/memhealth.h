@@ -0,0 +1,28 @@
+#ifndef MEMHEALTH_H_
+#define MEMHEALTH_H_
+
+#include "ch.h"
+
+/*
+ * Stack high-water marks and samples pool and mailboxes occupancy.
+ * Stacks are painted, by crt0 for the main and exception ones and by
+ * the kernel (CH_DBG_FILL_THREADS) for the working areas, the deepest
+ * byte written gives the peak use. A stack with less than
+ * MEMHEALTH_STACK_MARGIN bytes left, or samples dropped for lack of a
+ * message or mailbox slot, raise SPI_STATUS_MEM_LOW.
+ */
+
+#define MEMHEALTH_STACKS 16
+#define MEMHEALTH_STACK_MARGIN 32 // Bytes
+
+/* chThdCreateStatic() of a thread whose stack is watched */
+#define memhealthCreateStatic(wa, prio, fn, arg) \
+  memhealthAddThread(chThdCreateStatic(wa, sizeof(wa), prio, fn, arg), wa, sizeof(wa))
+
+void memhealthInit(void);
+void memhealthAddThread(thread_t* tp, void* wa, size_t size);
+void memhealthUpdate(void);
+uint16_t memhealthGetStackMin(void);
+bool memhealthIsLow(void);
+
+#endif
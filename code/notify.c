@@ -0,0 +1,86 @@
+#include "hal.h"
+#include "notify.h"
+#include "settings.h"
+#include "spi_slave.h"
+#include "timebase.h"
+
+/*
+ * The latency is measured from the event to the line assertion with the
+ * cycle counter, it includes the SPI reply refresh so the ECU never reads
+ * a reply older than the event.
+ */
+
+static uint16_t pending;
+static bool asserted;
+static uint16_t latency; // us, last assertion
+static uint16_t latency_max; // us, since boot
+static uint16_t fetched; // Published since the last notifyFetchI()
+static uint32_t fetched_time; // Last one, local us
+
+void notifyInit(void)
+{
+  palSetLine(LINE_INT); // Released
+}
+
+CCM_FUNC void notifyI(uint16_t events, rtcnt_t since)
+{
+  uint32_t us;
+
+  pending |= events;
+  fetched |= events;
+  fetched_time = timebaseNowI();
+  if (asserted || (pending & settings.int_mask) == 0)
+    return;
+
+#if !SPI_USE_TPIC8101
+  spiSlaveRefreshI();
+#endif
+  palClearLine(LINE_INT);
+  asserted = true;
+
+  us = RTC2US(STM32_HCLK, chSysGetRealtimeCounterX() - since);
+  latency = us > 0xFFFF ? 0xFFFF : (uint16_t)us;
+  if (latency > latency_max)
+    latency_max = latency;
+}
+
+/*
+ * Events read by the ECU, the line stays asserted if others are pending.
+ */
+CCM_FUNC void notifyClearI(uint16_t events)
+{
+  pending &= ~events;
+  if (!asserted || (pending & settings.int_mask) != 0)
+    return;
+
+  palSetLine(LINE_INT);
+  asserted = false;
+}
+
+/*
+ * Events published since the previous call, for the USB protocol.
+ * The line and the SPI events register are not affected.
+ */
+uint16_t notifyFetchI(uint32_t* time)
+{
+  const uint16_t events = fetched;
+
+  fetched = 0;
+  *time = fetched_time;
+  return events;
+}
+
+uint16_t notifyGetPending(void)
+{
+  return pending;
+}
+
+uint16_t notifyGetLatency(void)
+{
+  return latency;
+}
+
+uint16_t notifyGetMaxLatency(void)
+{
+  return latency_max;
+}
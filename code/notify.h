@@ -0,0 +1,28 @@
+#ifndef NOTIFY_H_
+#define NOTIFY_H_
+
+#include "ch.h"
+
+/*
+ * Data ready line (LINE_INT, active low).
+ * Asserted when an event enabled in settings.int_mask is published,
+ * released once the ECU has read the events register.
+ */
+
+#define NOTIFY_KNOCK (1 << 0) // Knock window closed, cylinder value published
+#define NOTIFY_VR_SYNC(n) (1 << (1 + (n))) // VR1-3 tooth signal acquired
+#define NOTIFY_VR_LOST(n) (1 << (4 + (n))) // VR1-3 tooth signal lost, stall or missing teeth
+#define NOTIFY_CAPTURE (1 << 7) // Sample capture frozen, see capture.h
+#define NOTIFY_ALL 0xFF
+
+#define NOTIFY_DEFAULT_MASK NOTIFY_KNOCK
+
+void notifyInit(void);
+void notifyI(uint16_t events, rtcnt_t since);
+void notifyClearI(uint16_t events);
+uint16_t notifyFetchI(uint32_t* time);
+uint16_t notifyGetPending(void);
+uint16_t notifyGetLatency(void);
+uint16_t notifyGetMaxLatency(void);
+
+#endif
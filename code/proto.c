@@ -0,0 +1,148 @@
+#include "proto.h"
+
+static uint8_t telemetry_addr;
+static uint8_t telemetry_count;
+static uint16_t telemetry_period; // ms, 0 when stopped
+static uint16_t event_mask;
+static uint8_t device_seq; // Telemetry and event messages
+
+static uint16_t get16(const uint8_t* p)
+{
+  return p[0] | (p[1] << 8);
+}
+
+static void put16(uint8_t* p, uint16_t val)
+{
+  p[0] = val & 0xFF;
+  p[1] = val >> 8;
+}
+
+static void put32(uint8_t* p, uint32_t val)
+{
+  put16(p, val & 0xFFFF);
+  put16(p + 2, val >> 16);
+}
+
+/*
+ * Values of a register range after the given header, returns the message
+ * length or 0 if the range is rejected.
+ */
+static size_t putRegisters(uint8_t* msg, size_t pos, uint8_t addr, uint8_t count)
+{
+  uint16_t values[PROTO_MAX_REGS];
+  uint8_t i;
+
+  if (count == 0 || count > PROTO_MAX_REGS || !protoReadRegisters(addr, count, values))
+    return 0;
+
+  for (i = 0; i < count; i++)
+    put16(&msg[pos + i * 2], values[i]);
+  return pos + count * 2;
+}
+
+static uint8_t writeRegisters(const uint8_t* payload, size_t len)
+{
+  uint16_t values[PROTO_MAX_REGS];
+  uint8_t count, i;
+
+  if (len < 3 || (len - 1) % 2 != 0)
+    return PROTO_BAD_LENGTH;
+
+  count = (len - 1) / 2;
+  if (count > PROTO_MAX_REGS)
+    return PROTO_BAD_LENGTH;
+
+  for (i = 0; i < count; i++)
+    values[i] = get16(&payload[1 + i * 2]);
+
+  return protoWriteRegisters(payload[0], count, values) ? PROTO_OK : PROTO_BAD_ADDRESS;
+}
+
+/*
+ * Handles a request, returns the reply length, 0 if there is no reply.
+ */
+size_t protoProcess(const uint8_t* msg, size_t len, uint8_t* reply)
+{
+  const uint8_t* payload = &msg[2];
+  size_t n;
+
+  if (len < 2 || (msg[1] & PROTO_REPLY) != 0)
+    return 0; // Not a request
+
+  len -= 2;
+  reply[0] = msg[0];
+  reply[1] = msg[1] | PROTO_REPLY;
+  reply[2] = PROTO_OK;
+
+  switch (msg[1]) {
+  case PROTO_PING:
+    reply[3] = PROTO_VERSION;
+    reply[4] = protoRegisterCount();
+    return 5;
+  case PROTO_READ:
+    if (len != 2)
+      break;
+    n = putRegisters(reply, 3, payload[0], payload[1]);
+    if (n != 0)
+      return n;
+    reply[2] = PROTO_BAD_ADDRESS;
+    return 3;
+  case PROTO_WRITE:
+    reply[2] = writeRegisters(payload, len);
+    return 3;
+  case PROTO_SUBSCRIBE:
+    if (len != 4)
+      break;
+    if (get16(&payload[2]) != 0 &&
+        (payload[1] == 0 || payload[1] > PROTO_MAX_REGS ||
+         payload[0] >= protoRegisterCount() || payload[1] > protoRegisterCount() - payload[0]))
+    {
+      reply[2] = PROTO_BAD_ADDRESS;
+      return 3;
+    }
+    telemetry_addr = payload[0];
+    telemetry_count = payload[1];
+    telemetry_period = get16(&payload[2]);
+    return 3;
+  case PROTO_EVENTS:
+    if (len != 2)
+      break;
+    event_mask = get16(payload);
+    return 3;
+  default:
+    reply[2] = PROTO_BAD_TYPE;
+    return 3;
+  }
+
+  reply[2] = PROTO_BAD_LENGTH;
+  return 3;
+}
+
+size_t protoTelemetry(uint8_t* msg, uint32_t time)
+{
+  msg[0] = device_seq++;
+  msg[1] = PROTO_TELEMETRY;
+  put32(&msg[2], time);
+  msg[6] = telemetry_addr;
+  msg[7] = telemetry_count;
+  return putRegisters(msg, 8, telemetry_addr, telemetry_count);
+}
+
+size_t protoEvent(uint8_t* msg, uint16_t events, uint32_t time)
+{
+  msg[0] = device_seq++;
+  msg[1] = PROTO_EVENT;
+  put32(&msg[2], time);
+  put16(&msg[6], events);
+  return 8;
+}
+
+uint16_t protoTelemetryPeriod(void)
+{
+  return telemetry_period;
+}
+
+uint16_t protoEventMask(void)
+{
+  return event_mask;
+}
@@ -0,0 +1,25 @@
+#ifndef PROTO_H_
+#define PROTO_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "proto_format.h"
+
+/*
+ * Protocol handler, independent of the transport and of the OS.
+ * Messages are unframed, the reply buffers need PROTO_MAX_MSG bytes.
+ */
+
+size_t protoProcess(const uint8_t* msg, size_t len, uint8_t* reply);
+size_t protoTelemetry(uint8_t* msg, uint32_t time);
+size_t protoEvent(uint8_t* msg, uint16_t events, uint32_t time);
+uint16_t protoTelemetryPeriod(void);
+uint16_t protoEventMask(void);
+
+/* Provided by the port, false rejects the address range */
+uint8_t protoRegisterCount(void);
+bool protoReadRegisters(uint8_t addr, uint8_t count, uint16_t* values);
+bool protoWriteRegisters(uint8_t addr, uint8_t count, const uint16_t* values);
+
+#endif
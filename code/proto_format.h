@@ -0,0 +1,45 @@
+#ifndef PROTO_FORMAT_H_
+#define PROTO_FORMAT_H_
+
+#include <stdint.h>
+
+/*
+ * Command and telemetry protocol on the USB serial port, shared with the
+ * host library.
+ * Message: sequence, type, payload, CRC-16/CCITT-FALSE of the previous
+ * bytes (MSB first), COBS encoded and ended by a null byte.
+ * Values are little endian, registers use the SPI register map.
+ *
+ * Host requests, the reply has the same sequence, type | PROTO_REPLY and
+ * a PROTO_ status byte before its payload:
+ * PING       -                          version, register count
+ * READ       addr, count                values
+ * WRITE      addr, values               -
+ * SUBSCRIBE  addr, count, period (ms)   -           0 period stops
+ * EVENTS     NOTIFY_ mask               -           0 mask stops
+ * Device messages, the sequence counts them to show losses:
+ * TELEMETRY  time (us), addr, count, values
+ * EVENT      time (us), NOTIFY_ events
+ */
+
+#define PROTO_VERSION 1
+
+#define PROTO_PING 0x01
+#define PROTO_READ 0x02
+#define PROTO_WRITE 0x03
+#define PROTO_SUBSCRIBE 0x04
+#define PROTO_EVENTS 0x05
+#define PROTO_TELEMETRY 0x40
+#define PROTO_EVENT 0x41
+#define PROTO_REPLY 0x80
+
+#define PROTO_OK 0x00
+#define PROTO_BAD_TYPE 0x01
+#define PROTO_BAD_LENGTH 0x02
+#define PROTO_BAD_ADDRESS 0x03 // Out of the map, or not writable
+
+#define PROTO_MAX_REGS 64 // Registers per message
+#define PROTO_MAX_MSG (2 + 1 + 6 + PROTO_MAX_REGS * 2 + 2) // Longest message with its CRC
+#define PROTO_MAX_FRAME (PROTO_MAX_MSG + PROTO_MAX_MSG / 254 + 2) // COBS overhead and delimiter
+
+#endif
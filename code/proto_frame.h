@@ -0,0 +1,16 @@
+#ifndef PROTO_FRAME_H_
+#define PROTO_FRAME_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "proto_format.h"
+
+/*
+ * COBS framing with a CRC, shared by the firmware and the host library.
+ */
+
+size_t protoFrame(const uint8_t* msg, size_t len, uint8_t* frame);
+size_t protoUnframe(const uint8_t* frame, size_t len, uint8_t* msg);
+uint16_t protoCrc(const uint8_t* buf, size_t len);
+
+#endif
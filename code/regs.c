@@ -0,0 +1,93 @@
+#include "hal.h"
+#include "regs.h"
+#include "knock.h"
+#include "vr.h"
+#include "notify.h"
+#include "timebase.h"
+#include "capture.h"
+#include "cpuload.h"
+#include "memhealth.h"
+#include "supervisor.h"
+
+/*
+ * Register file, served by the SPI slave and the USB protocol.
+ */
+
+void regsRead(uint16_t* r)
+{
+  uint8_t i;
+
+  r[SPI_REG_STATUS] = 0;
+  if (palReadLine(LINE_SAMPLE) == PAL_HIGH)
+    r[SPI_REG_STATUS] |= SPI_STATUS_SAMPLING;
+  if (memhealthIsLow())
+    r[SPI_REG_STATUS] |= SPI_STATUS_MEM_LOW;
+  if (supervisorWasReset())
+    r[SPI_REG_STATUS] |= SPI_STATUS_WDG_RESET;
+
+  for (i = 0; i < 3; i++)
+  {
+    if (vrIsValid(i))
+      r[SPI_REG_STATUS] |= SPI_STATUS_VR1_VALID << i;
+    r[SPI_REG_VR_INTERVAL + i] = vrGetInterval(i);
+    r[SPI_REG_VR_THRESHOLD + i] = vrGetThreshold(i);
+  }
+
+  for (i = 0; i < 4; i++)
+    r[SPI_REG_KNOCK + i] = knockGetValue(i);
+
+  for (i = 0; i < KNOCK_MAX_CYLINDERS; i++)
+    r[SPI_REG_KNOCK_CYL + i] = knockGetCylinderValue(i);
+
+  r[SPI_REG_RPM] = vrGetRpm();
+  r[SPI_REG_CRC_ERRORS] = spiSlaveGetCrcErrors();
+  r[SPI_REG_INT_LATENCY] = notifyGetLatency();
+  r[SPI_REG_INT_LATENCY_MAX] = notifyGetMaxLatency();
+  r[SPI_REG_CAPTURE] = captureGetStatus();
+  r[SPI_REG_CPU_LOAD] = cpuloadGetLoad();
+  r[SPI_REG_CPU_LOAD_AVG] = cpuloadGetAverage();
+  r[SPI_REG_CPU_LOAD_PEAK] = cpuloadGetPeak();
+  r[SPI_REG_STACK_MIN] = memhealthGetStackMin();
+
+  for (i = 0; i < SETTINGS_COUNT; i++)
+    r[SPI_REG_SETTINGS + i] = ((uint16_t*)&settings)[i];
+}
+
+static void readTime(uint16_t* r, uint32_t local)
+{
+  const uint32_t ecu = timebaseToEcuI(local);
+
+  r[0] = ecu >> 16;
+  r[1] = ecu & 0xFFFF;
+}
+
+/*
+ * Registers changed from interrupts, read with the system locked so
+ * they are consistent with each other.
+ */
+void regsReadLocked(uint16_t* r)
+{
+  uint8_t i;
+
+  if (timebaseIsSyncedI())
+    r[SPI_REG_STATUS] |= SPI_STATUS_TIME_SYNC;
+  else
+    r[SPI_REG_STATUS] &= ~SPI_STATUS_TIME_SYNC;
+
+  r[SPI_REG_EVENTS] = notifyGetPending();
+  r[SPI_REG_TIME_DRIFT] = (uint16_t)timebaseGetDriftI();
+  readTime(&r[SPI_REG_TIME_SYNC], timebaseNowI());
+  readTime(&r[SPI_REG_KNOCK_TIME], knockGetTime());
+  for (i = 0; i < 3; i++)
+    readTime(&r[SPI_REG_TOOTH_TIME + i * 2], vrGetToothTime(i));
+}
+
+bool regsWritable(uint8_t addr, size_t count)
+{
+  return addr >= SPI_REG_SETTINGS && addr < SPI_REG_COUNT && count <= SPI_REG_COUNT - addr;
+}
+
+void regsWrite(uint8_t addr, uint16_t val)
+{
+  ((uint16_t*)&settings)[addr - SPI_REG_SETTINGS] = val;
+}
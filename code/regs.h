@@ -0,0 +1,15 @@
+#ifndef REGS_H_
+#define REGS_H_
+
+#include "spi_slave.h" // Register map
+
+/*
+ * A full read is regsRead() then regsReadLocked() with the system locked.
+ * Only the settings are writable.
+ */
+void regsRead(uint16_t* r);
+void regsReadLocked(uint16_t* r);
+bool regsWritable(uint8_t addr, size_t count);
+void regsWrite(uint8_t addr, uint16_t val);
+
+#endif
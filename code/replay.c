@@ -0,0 +1,240 @@
+#include "replay.h"
+
+#if REPLAY_ENABLED
+#include "knock.h"
+#include "vr.h"
+#include "ipc.h"
+#include "usb_stream.h"
+#include "supervisor.h"
+
+/*
+ * Host frames on the OUT endpoint of the stream interface.
+ * A frame is a stream_header_t transfer then a transfer of its samples,
+ * received straight into the buffer posted to the processing thread.
+ * Like the ADC halves, each source has two buffers used in turn, the
+ * host paces the frames at the ADC rate so a thread is done with a
+ * buffer before it is filled again.
+ * The header is received into a full packet so a payload packet seen
+ * while waiting for a header is rejected, that is how the host and the
+ * device get back in step.
+ * The threads of a replayed source only get the host frames, they are
+ * not supervised and the ADC frames come back when the host stops
+ * sending for REPLAY_TIMEOUT_MS.
+ */
+
+#define REPLAY_KNOCK_WORDS (FFT_SIZE * KNOCK_SENSORS) // A scan per sample, as knock_mb frames
+#define REPLAY_VR_WORDS (VR_SAMPLES / 2) // Half the circular ADC buffer
+#define REPLAY_TIMEOUT_MS 500 // Without a host frame, checked by the monitor thread
+
+#if (REPLAY_KNOCK_WORDS * 2) % USB_STREAM_PACKET_SIZE != 0 || \
+    (REPLAY_VR_WORDS * 2) % USB_STREAM_PACKET_SIZE != 0
+#error "Replay frames must be whole packets, a short last packet could overflow the buffer"
+#endif
+
+typedef struct {
+  mailbox_t* mb;
+  uint16_t* buffers[2];
+  uint16_t words;
+  size_t size; // Posted with the frame, as the ADC callback does
+  uint8_t threads[2]; // SUPERVISOR_ ids of the threads fed by the source
+} replay_source_t;
+
+static uint16_t knock_buffers[2][REPLAY_KNOCK_WORDS];
+static uint16_t vr_buffers[STREAM_REPLAY_SOURCES - 1][2][REPLAY_VR_WORDS];
+
+static const replay_source_t sources[STREAM_REPLAY_SOURCES] = {
+  {&knock_mb, {knock_buffers[0], knock_buffers[1]}, REPLAY_KNOCK_WORDS, FFT_SIZE,
+   {SUPERVISOR_KNOCK, SUPERVISOR_KNOCK_OUTPUT}},
+  {&vr1_mb, {vr_buffers[0][0], vr_buffers[0][1]}, REPLAY_VR_WORDS, REPLAY_VR_WORDS,
+   {SUPERVISOR_VR1, SUPERVISOR_NONE}},
+  {&vr2_mb, {vr_buffers[1][0], vr_buffers[1][1]}, REPLAY_VR_WORDS, REPLAY_VR_WORDS,
+   {SUPERVISOR_VR2, SUPERVISOR_NONE}},
+  {&vr3_mb, {vr_buffers[2][0], vr_buffers[2][1]}, REPLAY_VR_WORDS, REPLAY_VR_WORDS,
+   {SUPERVISOR_VR3, SUPERVISOR_NONE}},
+};
+
+static union {
+  stream_header_t header;
+  uint8_t packet[USB_STREAM_PACKET_SIZE];
+} rx;
+static uint8_t next[STREAM_REPLAY_SOURCES]; // Buffer the next frame goes to
+static uint8_t receiving; // Source of the payload being received, STREAM_REPLAY_SOURCES for a header
+static bool armed; // A receive is running
+static bool active; // Endpoint configured
+static volatile uint16_t replay_mask; // STREAM_REPLAY_MSK of the replayed sources
+static systime_t last_frame; // Selection or last host frame
+static stream_replay_stats_t stats;
+
+/*
+ * New set of replayed sources, their threads are only supervised while
+ * they get the ADC frames.
+ */
+static void selectI(uint16_t mask)
+{
+  uint8_t source, i;
+
+  replay_mask = mask;
+  last_frame = chVTGetSystemTimeX();
+  for (source = 0; source < STREAM_REPLAY_SOURCES; source++)
+  {
+    for (i = 0; i < 2; i++)
+    {
+      const uint8_t id = sources[source].threads[i];
+
+      if (id == SUPERVISOR_NONE)
+        continue;
+      if (replayActive(source))
+        supervisorSuspendI(id);
+      else
+        supervisorResumeI(id);
+    }
+  }
+}
+
+static void receiveHeaderI(USBDriver *usbp)
+{
+  receiving = STREAM_REPLAY_SOURCES;
+  armed = true;
+  usbStartReceiveI(usbp, USB_STREAM_EP, rx.packet, sizeof(rx.packet));
+}
+
+/* Source of a header, STREAM_REPLAY_SOURCES when it is not valid */
+static uint8_t headerSource(size_t len)
+{
+  uint8_t source;
+
+  if (len != sizeof(stream_header_t) || rx.header.sync != STREAM_SYNC)
+    return STREAM_REPLAY_SOURCES;
+
+  if (rx.header.type == STREAM_KNOCK_RAW && rx.header.channel == 0)
+    source = STREAM_REPLAY_KNOCK;
+  else if (rx.header.type == STREAM_VR_RAW && rx.header.channel < STREAM_REPLAY_SOURCES - STREAM_REPLAY_VR1)
+    source = STREAM_REPLAY_VR1 + rx.header.channel;
+  else
+    return STREAM_REPLAY_SOURCES;
+
+  if (rx.header.count != sources[source].words || !replayActive(source))
+    return STREAM_REPLAY_SOURCES;
+  return source;
+}
+
+void replayConfigureHookI(USBDriver *usbp)
+{
+  active = true;
+  armed = false;
+  if (replay_mask != 0)
+    receiveHeaderI(usbp);
+}
+
+void replaySuspendHookI(USBDriver *usbp)
+{
+  (void)usbp;
+
+  active = false;
+  armed = false;
+  selectI(0); // The ADC frames are back until the host selects again
+}
+
+/*
+ * Vendor requests addressed to the stream interface, after the ones of
+ * usb_stream.c.
+ */
+bool replayRequestsHook(USBDriver *usbp)
+{
+  const uint8_t *setup = usbp->setup;
+  const uint16_t value = setup[2] | (setup[3] << 8);
+
+  if ((setup[0] & USB_RTYPE_TYPE_MASK) != USB_RTYPE_TYPE_VENDOR ||
+      (setup[0] & USB_RTYPE_RECIPIENT_MASK) != USB_RTYPE_RECIPIENT_INTERFACE)
+    return false;
+
+  switch (setup[1]) {
+  case STREAM_REQ_REPLAY:
+    osalSysLockFromISR();
+    selectI(value & (STREAM_REPLAY_MSK(STREAM_REPLAY_SOURCES) - 1));
+    if (active && !armed && replay_mask != 0)
+      receiveHeaderI(usbp);
+    osalSysUnlockFromISR();
+    usbSetupTransfer(usbp, NULL, 0, NULL);
+    return true;
+  case STREAM_REQ_REPLAY_STATS:
+    usbSetupTransfer(usbp, (uint8_t*)&stats, sizeof(stats), NULL);
+    return true;
+  default:
+    return false;
+  }
+}
+
+/*
+ * End of a header or payload transfer. A frame is posted once its
+ * samples are all in, then the next header is waited for.
+ */
+void replayReceived(USBDriver *usbp, usbep_t ep)
+{
+  const size_t len = usbGetReceiveTransactionSizeX(usbp, ep);
+  uint8_t source;
+
+  osalSysLockFromISR();
+  armed = false;
+  if (!active)
+  {
+    osalSysUnlockFromISR();
+    return;
+  }
+
+  source = receiving;
+  if (source == STREAM_REPLAY_SOURCES)
+  {
+    source = headerSource(len);
+    if (source != STREAM_REPLAY_SOURCES)
+    {
+      const replay_source_t* src = &sources[source];
+
+      receiving = source;
+      armed = true;
+      usbStartReceiveI(usbp, ep, (uint8_t*)src->buffers[next[source]], src->words * 2);
+      osalSysUnlockFromISR();
+      return;
+    }
+    stats.rejected++;
+  }
+  else if (len == sources[source].words * 2u && replayActive(source))
+  {
+    const replay_source_t* src = &sources[source];
+
+    last_frame = chVTGetSystemTimeX();
+    if (allocSendSamplesI(src->mb, src->buffers[next[source]], src->size))
+      stats.frames++;
+    else
+      stats.dropped++;
+    next[source] ^= 1;
+  }
+  else
+  {
+    stats.rejected++;
+  }
+
+  if (replay_mask != 0)
+    receiveHeaderI(usbp);
+  osalSysUnlockFromISR();
+}
+
+/*
+ * Gives the sources back to the ADCs once the host stopped sending, as
+ * when kvr_replay was killed. Called by the monitor thread.
+ */
+void replayUpdate(void)
+{
+  chSysLock();
+  if (replay_mask != 0 &&
+      chTimeDiffX(last_frame, chVTGetSystemTimeX()) > TIME_MS2I(REPLAY_TIMEOUT_MS))
+    selectI(0);
+  chSysUnlock();
+}
+
+/* Called by the ADC callbacks, a replayed source ignores its ADC frames */
+bool replayActive(uint8_t source)
+{
+  return (replay_mask & STREAM_REPLAY_MSK(source)) != 0;
+}
+#endif
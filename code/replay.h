@@ -0,0 +1,31 @@
+#ifndef REPLAY_H_
+#define REPLAY_H_
+
+#include "stream_format.h"
+
+/*
+ * Replay of recorded samples from the host in place of the ADC frames,
+ * for the bench without an engine. Built with USE_REPLAY=yes, host/kvr_replay
+ * sends the frames. The ADCs keep converting, their frames of a replayed
+ * source are not posted. The VR teeth still come from the comparators.
+ * A source is given back to its ADC when the host stops sending.
+ */
+
+#if !defined(REPLAY_ENABLED)
+#define REPLAY_ENABLED FALSE
+#endif
+
+#if REPLAY_ENABLED
+#include "hal.h"
+
+void replayConfigureHookI(USBDriver *usbp);
+void replaySuspendHookI(USBDriver *usbp);
+bool replayRequestsHook(USBDriver *usbp);
+void replayReceived(USBDriver *usbp, usbep_t ep);
+bool replayActive(uint8_t source);
+void replayUpdate(void);
+#else
+#define replayActive(source) false
+#endif
+
+#endif
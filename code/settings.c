@@ -1,8 +1,28 @@
 #include "settings.h"
+#include "knock.h"
+#include "vr.h"
+#include "notify.h"
+#include "capture.h"
 
 settings_t settings = {SETTING_KNOCK_ON,
                        8000,
                        10,
+                       KNOCK_DEFAULT_RATE,
+                       KNOCK_DEFAULT_SENSOR_MAP,
+                       KNOCK_UNITY_GAIN,
+                       0,
                        SETTING_VR_ON_MSK,
                        300,
-                       500};
+                       500,
+                       VR_DEFAULT_TEETH,
+                       NOTIFY_DEFAULT_MASK,
+                       0,
+                       0,
+                       0,
+                       0,
+                       0xFFFF,
+                       CAPTURE_DEFAULT_POST,
+                       0,
+                       CAPTURE_DEFAULT_VR,
+                       CAPTURE_DEFAULT_DECIMATION,
+                       KNOCK_DEFAULT_CYLINDERS};
@@ -19,11 +19,29 @@ typedef struct {
     uint16_t knock_modes;
     uint16_t knock_freq;
     uint16_t knock_ratio;
+    uint16_t knock_rate; // kS/s
+    uint16_t knock_sensor_map; // Sensor of each cylinder, see KNOCK_CYL_SENSOR
+    uint16_t knock_gain; // Output gain, KNOCK_UNITY_GAIN is 1
+    uint16_t knock_integrator; // Integrator time constant in us, 0 holds the peak instead
     uint16_t vr_modes;
     uint16_t vr_watchdog;
     uint16_t vr_threshold;
+    uint16_t vr_teeth; // Crank wheel teeth, for the RPM
+    uint16_t int_mask; // Events asserting the data ready line, see NOTIFY_KNOCK
+    uint16_t spectrum_sensor; // Knock sensor streamed by SPI_ADDR_SPECTRUM
+    uint16_t spectrum_first; // First streamed bin
+    uint16_t spectrum_count; // Streamed bins, 0 goes up to the end
+    uint16_t capture_trigger; // CAPTURE_TRIG_ enabled, 0 stops the capture
+    uint16_t capture_level; // Knock output triggering a capture
+    uint16_t capture_post; // Percent of the capture after the trigger
+    uint16_t capture_sensor; // Knock sensor recorded
+    uint16_t capture_vr; // VR recorded, 0-2
+    uint16_t capture_vr_decimation; // One VR sample recorded every capture_vr_decimation
+    uint16_t knock_cylinders; // Knock windows per engine cycle, KNOCK_MAX_CYLINDERS max
 } settings_t;
 
+#define SETTINGS_COUNT (sizeof(settings_t) / sizeof(uint16_t)) // All fields are 16 bits
+
 extern settings_t settings;
 
 #endif
@@ -0,0 +1,14 @@
+#ifndef BOARD_H
+#define BOARD_H
+
+/*
+ * Simulated board, the pin names of the real one and no CCM.
+ */
+
+#define BOARD_NAME "Knock + VR Board (simulator)"
+
+#include "board_gpio.h"
+
+#define CCM_FUNC
+
+#endif
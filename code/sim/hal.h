@@ -0,0 +1,676 @@
+#ifndef SIM_HAL_H_
+#define SIM_HAL_H_
+
+/*
+ * Simulator HAL, takes the place of the ChibiOS HAL in the hosted build.
+ * Only the drivers and registers used by the firmware are there, with
+ * the same names and config layouts as the STM32F3 ones. The peripherals
+ * are modelled in hal_sim.c, registers the firmware writes directly are
+ * read back when it returns to the simulator (ISR exit or idle).
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "ch.h"
+#include "board.h"
+
+/* The simulated clock tree, HSE 8MHz and PLL at 72MHz */
+#define STM32_SYSCLK 72000000U
+#define STM32_HCLK STM32_SYSCLK
+#define STM32_PLLCLKOUT STM32_SYSCLK
+#define STM32_TIMCLK1 STM32_SYSCLK
+#define STM32_TIMCLK2 STM32_SYSCLK
+#define STM32_ADCCLK STM32_SYSCLK // ADC12PRES and ADC34PRES at 1
+
+/* The DWT cycle counter, from the simulated time */
+#undef chSysGetRealtimeCounterX
+#define chSysGetRealtimeCounterX() simRealtimeCounter()
+#if !defined(RTC2US)
+#define RTC2US(freq, n) ((((n) - 1UL) / ((freq) / 1000000UL)) + 1UL)
+#endif
+
+#define CORTEX_NUM_VECTORS 82
+#define CORTEX_PRIORITY_LEVELS 16
+
+/* Exception number of the simulated interrupt running, 0 in threads */
+#define __get_IPSR() simGetIpsr()
+
+#define osalSysHalt(reason) chSysHalt(reason)
+#define osalSysLockFromISR() chSysLockFromISR()
+#define osalSysUnlockFromISR() chSysUnlockFromISR()
+#define OSAL_IRQ_HANDLER(id) CH_IRQ_HANDLER(id)
+#define OSAL_IRQ_PROLOGUE() CH_IRQ_PROLOGUE()
+#define OSAL_IRQ_EPILOGUE() CH_IRQ_EPILOGUE()
+
+/*
+ * Interrupt numbers, as on the STM32F303xC.
+ */
+#define STM32_DMA1_CH1_NUMBER 11
+#define STM32_ADC1_2_NUMBER 18
+#define STM32_USB1_LP_NUMBER 20
+#define STM32_TIM15_NUMBER 24
+#define STM32_TIM16_NUMBER 25
+#define STM32_TIM17_NUMBER 26
+#define STM32_EXTI15_10_NUMBER 40
+#define STM32_DMA2_CH1_NUMBER 56
+#define STM32_DMA2_CH2_NUMBER 57
+#define STM32_DMA2_CH5_NUMBER 60
+#define STM32_COMP123_NUMBER 64
+#define STM32_COMP456_NUMBER 65
+
+#define STM32_TIM15_HANDLER VectorA0
+#define STM32_TIM16_HANDLER VectorA4
+#define STM32_TIM17_HANDLER VectorA8
+
+void nvicEnableVector(uint32_t n, uint32_t prio);
+void nvicDisableVector(uint32_t n);
+
+/*
+ * RCC, the reset flags are set by the simulator.
+ */
+typedef struct {
+  volatile uint32_t CSR;
+} RCC_TypeDef;
+
+#define RCC_CSR_RMVF (1U << 24)
+#define RCC_CSR_OBLRSTF (1U << 25)
+#define RCC_CSR_PINRSTF (1U << 26)
+#define RCC_CSR_PORRSTF (1U << 27)
+#define RCC_CSR_SFTRSTF (1U << 28)
+#define RCC_CSR_IWDGRSTF (1U << 29)
+#define RCC_CSR_WWDGRSTF (1U << 30)
+#define RCC_CSR_LPWRRSTF (1U << 31)
+
+extern RCC_TypeDef sim_rcc;
+#define RCC (&sim_rcc)
+
+#define rccEnableTIM15() simTimReset(TIM15)
+#define rccEnableTIM16() simTimReset(TIM16)
+#define rccEnableTIM17() simTimReset(TIM17)
+#define rccResetTIM15() simTimReset(TIM15)
+#define rccResetTIM16() simTimReset(TIM16)
+#define rccResetTIM17() simTimReset(TIM17)
+#define rccResetSPI1() (void)0
+
+/*
+ * EXTI, edges are delivered as soon as they happen so nothing is ever
+ * pending.
+ */
+typedef struct {
+  volatile uint32_t PR;
+} EXTI_TypeDef;
+
+extern EXTI_TypeDef sim_exti;
+#define EXTI (&sim_exti)
+
+/*
+ * PAL, lines are a port index and a pad.
+ */
+typedef uint32_t ioportid_t;
+typedef uint32_t ioline_t;
+typedef uint32_t iomode_t;
+typedef void (*palcallback_t)(void *arg);
+
+#define GPIOA 0U
+#define GPIOB 1U
+#define GPIOC 2U
+#define GPIOD 3U
+#define GPIOE 4U
+#define GPIOF 5U
+
+#define PAL_LINE(port, pad) ((ioline_t)(((port) << 4U) | (pad)))
+#define PAL_PORT(line) ((line) >> 4U)
+#define PAL_PAD(line) ((line) & 0x0FU)
+#define PAL_LOW 0U
+#define PAL_HIGH 1U
+
+#define PAL_MODE_INPUT 0U
+#define PAL_MODE_OUTPUT_PUSHPULL 1U
+#define PAL_MODE_ALTERNATE(n) (2U | ((n) << 7U))
+#define PAL_MODE_INPUT_ANALOG 3U
+#define PAL_STM32_OSPEED_HIGHEST (3U << 3U)
+
+#define PAL_EVENT_MODE_DISABLED 0U
+#define PAL_EVENT_MODE_RISING_EDGE 1U
+#define PAL_EVENT_MODE_FALLING_EDGE 2U
+#define PAL_EVENT_MODE_BOTH_EDGES 3U
+
+uint32_t palReadLine(ioline_t line);
+void palSetLine(ioline_t line);
+void palClearLine(ioline_t line);
+void palSetLineMode(ioline_t line, iomode_t mode);
+void palEnableLineEvent(ioline_t line, uint32_t mode);
+void palSetLineCallback(ioline_t line, palcallback_t cb, void *arg);
+
+/*
+ * DMA streams, only what the SPI slave drives directly.
+ */
+typedef struct {
+  const volatile void *peripheral;
+  void *memory;
+  uint32_t total; // Items of the transaction
+  uint32_t size; // Items left, CNDTR
+  uint32_t mode;
+  bool enabled;
+} stm32_dma_stream_t;
+
+#define STM32_DMA_CR_EN (1U << 0)
+#define STM32_DMA_CR_TCIE (1U << 1)
+#define STM32_DMA_CR_HTIE (1U << 2)
+#define STM32_DMA_CR_TEIE (1U << 3)
+#define STM32_DMA_CR_DIR_P2M (0U << 4)
+#define STM32_DMA_CR_DIR_M2P (1U << 4)
+#define STM32_DMA_CR_CIRC (1U << 5)
+#define STM32_DMA_CR_PINC (1U << 6)
+#define STM32_DMA_CR_MINC (1U << 7)
+#define STM32_DMA_CR_PSIZE_WORD (2U << 8)
+#define STM32_DMA_CR_MSIZE_WORD (2U << 10)
+#define STM32_DMA_CR_PL(n) ((n) << 12)
+#define STM32_DMA_ISR_TCIF (1U << 1)
+#define STM32_DMA_ISR_HTIF (1U << 2)
+
+#define dmaStreamSetPeripheral(dmastp, addr) ((dmastp)->peripheral = (addr))
+#define dmaStreamSetMemory0(dmastp, addr) ((dmastp)->memory = (void *)(addr))
+#define dmaStreamSetTransactionSize(dmastp, n) ((dmastp)->size = (dmastp)->total = (uint32_t)(n))
+#define dmaStreamGetTransactionSize(dmastp) ((size_t)(dmastp)->size)
+#define dmaStreamSetMode(dmastp, m) ((dmastp)->mode = (m))
+#define dmaStreamEnable(dmastp) ((dmastp)->enabled = true)
+#define dmaStreamDisable(dmastp) ((dmastp)->enabled = false)
+
+/*
+ * ADC, ADCv3 registers and conversion groups.
+ */
+typedef uint16_t adcsample_t;
+typedef uint16_t adc_channels_num_t;
+typedef enum {
+  ADC_UNINIT = 0,
+  ADC_STOP = 1,
+  ADC_READY = 2,
+  ADC_ACTIVE = 3,
+  ADC_COMPLETE = 4,
+  ADC_ERROR = 5
+} adcstate_t;
+
+typedef struct ADCDriver ADCDriver;
+typedef void (*adccallback_t)(ADCDriver *adcp, adcsample_t *buffer, size_t n);
+typedef void (*adcerrorcallback_t)(ADCDriver *adcp, uint32_t err);
+
+typedef struct {
+  bool circular;
+  adc_channels_num_t num_channels;
+  adccallback_t end_cb;
+  adcerrorcallback_t error_cb;
+  uint32_t cfgr;
+  uint32_t tr1;
+  uint32_t smpr[2];
+  uint32_t sqr[4];
+} ADCConversionGroup;
+
+typedef struct {
+  uint32_t difsel;
+} ADCConfig;
+
+typedef struct {
+  volatile uint32_t ISR;
+  volatile uint32_t IER;
+  volatile uint32_t CR;
+  volatile uint32_t CFGR;
+  volatile uint32_t SMPR1;
+  volatile uint32_t SMPR2;
+  volatile uint32_t TR1;
+  volatile uint32_t SQR1;
+  volatile uint32_t DR;
+  volatile uint32_t OFR1; // OFR1 to OFR4 follow each other
+  volatile uint32_t OFR2;
+  volatile uint32_t OFR3;
+  volatile uint32_t OFR4;
+  volatile uint32_t CALFACT;
+} ADC_TypeDef;
+
+typedef struct sim_adc sim_adc_t;
+
+struct ADCDriver {
+  adcstate_t state;
+  const ADCConfig *config;
+  adcsample_t *samples;
+  size_t depth;
+  const ADCConversionGroup *grpp;
+  thread_reference_t thread;
+  ADC_TypeDef *adcm;
+  const stm32_dma_stream_t *dmastp;
+  sim_adc_t *sim;
+};
+
+#define ADC_CR_ADSTART (1U << 2)
+#define ADC_CR_ADSTP (1U << 4)
+#define ADC_CFGR_ALIGN (1U << 5)
+#define ADC_CFGR_EXTSEL_SRC(n) ((uint32_t)(n) << 6)
+#define ADC_CFGR_EXTEN_MASK (3U << 10)
+#define ADC_CFGR_EXTEN_RISING (1U << 10)
+#define ADC_CFGR_CONT (1U << 13)
+#define ADC_TR(low, high) (((uint32_t)(high) << 16) | (uint32_t)(low))
+#define ADC_OFR1_OFFSET1_Msk 0xFFFU
+#define ADC_OFR1_OFFSET1_CH_Pos 26U
+#define ADC_OFR1_OFFSET1_EN (1U << 31)
+#define ADC_CALFACT_CALFACT_S 0x7FU
+
+#define ADC_CHANNEL_IN1 1U
+#define ADC_CHANNEL_IN2 2U
+#define ADC_CHANNEL_IN3 3U
+#define ADC_CHANNEL_IN4 4U
+#define ADC_CHANNEL_IN5 5U
+#define ADC_CHANNEL_IN6 6U
+#define ADC_CHANNEL_IN7 7U
+#define ADC_CHANNEL_IN8 8U
+#define ADC_CHANNEL_IN9 9U
+#define ADC_CHANNEL_IN10 10U
+#define ADC_CHANNEL_IN11 11U
+#define ADC_CHANNEL_IN12 12U
+#define ADC_CHANNEL_IN13 13U
+#define ADC_CHANNEL_IN14 14U
+#define ADC_CHANNEL_IN15 15U
+#define ADC_CHANNEL_IN16 16U
+#define ADC_CHANNEL_IN17 17U
+#define ADC_CHANNEL_IN18 18U
+
+#define ADC_SMPR_SMP_1P5 0U
+#define ADC_SMPR_SMP_2P5 1U
+#define ADC_SMPR_SMP_4P5 2U
+#define ADC_SMPR_SMP_7P5 3U
+#define ADC_SMPR_SMP_19P5 4U
+#define ADC_SMPR_SMP_61P5 5U
+#define ADC_SMPR_SMP_181P5 6U
+#define ADC_SMPR_SMP_601P5 7U
+
+#define ADC_SMPR1_SMP_AN1(n) ((n) << 3U)
+#define ADC_SMPR1_SMP_AN2(n) ((n) << 6U)
+#define ADC_SMPR1_SMP_AN3(n) ((n) << 9U)
+#define ADC_SMPR1_SMP_AN4(n) ((n) << 12U)
+#define ADC_SMPR1_SMP_AN5(n) ((n) << 15U)
+#define ADC_SMPR1_SMP_AN6(n) ((n) << 18U)
+#define ADC_SMPR1_SMP_AN7(n) ((n) << 21U)
+#define ADC_SMPR1_SMP_AN8(n) ((n) << 24U)
+#define ADC_SMPR1_SMP_AN9(n) ((n) << 27U)
+#define ADC_SMPR2_SMP_AN10(n) ((n) << 0U)
+#define ADC_SMPR2_SMP_AN11(n) ((n) << 3U)
+#define ADC_SMPR2_SMP_AN12(n) ((n) << 6U)
+#define ADC_SMPR2_SMP_AN13(n) ((n) << 9U)
+#define ADC_SMPR2_SMP_AN14(n) ((n) << 12U)
+#define ADC_SMPR2_SMP_AN15(n) ((n) << 15U)
+#define ADC_SMPR2_SMP_AN16(n) ((n) << 18U)
+#define ADC_SMPR2_SMP_AN17(n) ((n) << 21U)
+#define ADC_SMPR2_SMP_AN18(n) ((n) << 24U)
+
+#define ADC_SQR1_SQ1_N(n) ((n) << 6U)
+#define ADC_SQR1_SQ2_N(n) ((n) << 12U)
+#define ADC_SQR1_SQ3_N(n) ((n) << 18U)
+#define ADC_SQR1_SQ4_N(n) ((n) << 24U)
+
+extern ADCDriver ADCD1, ADCD2, ADCD3, ADCD4;
+#define ADC1 (ADCD1.adcm)
+#define ADC2 (ADCD2.adcm)
+#define ADC3 (ADCD3.adcm)
+#define ADC4 (ADCD4.adcm)
+
+void adcStart(ADCDriver *adcp, const ADCConfig *config);
+void adcStop(ADCDriver *adcp);
+void adcStartConversion(ADCDriver *adcp, const ADCConversionGroup *grpp,
+                        adcsample_t *samples, size_t depth);
+void adcStartConversionI(ADCDriver *adcp, const ADCConversionGroup *grpp,
+                         adcsample_t *samples, size_t depth);
+void adcStopConversion(ADCDriver *adcp);
+void adcStopConversionI(ADCDriver *adcp);
+msg_t adcConvert(ADCDriver *adcp, const ADCConversionGroup *grpp,
+                 adcsample_t *samples, size_t depth);
+
+/*
+ * TIM15 to TIM17, the VR timeouts.
+ */
+typedef struct {
+  volatile uint32_t CR1;
+  volatile uint32_t CR2;
+  volatile uint32_t SMCR;
+  volatile uint32_t DIER;
+  volatile uint32_t SR;
+  volatile uint32_t EGR;
+  volatile uint32_t CCMR1;
+  volatile uint32_t CCMR2;
+  volatile uint32_t CCER;
+  volatile uint32_t CNT;
+  volatile uint32_t PSC;
+  volatile uint32_t ARR;
+  volatile uint32_t RCR;
+  volatile uint32_t CCR1;
+  volatile uint32_t CCR2;
+  volatile uint32_t BDTR;
+  volatile uint32_t DCR;
+  volatile uint32_t DMAR;
+} TIM_TypeDef;
+
+#define TIM_CR1_CEN (1U << 0)
+#define TIM_CR2_MMS_1 (1U << 5)
+#define STM32_TIM_CR1_CEN (1U << 0)
+#define STM32_TIM_CR1_URS (1U << 2)
+#define STM32_TIM_CR1_OPM (1U << 3)
+#define STM32_TIM_CR1_ARPE (1U << 7)
+#define STM32_TIM_DIER_UIE (1U << 0)
+#define STM32_TIM_DIER_CC1IE (1U << 1)
+#define STM32_TIM_DIER_IRQ_MASK 0xFFU
+#define STM32_TIM_SR_UIF (1U << 0)
+#define STM32_TIM_SR_CC1IF (1U << 1)
+#define STM32_TIM_EGR_UG (1U << 0)
+#define STM32_TIM_EGR_CC1G (1U << 1)
+#define STM32_TIM_CCMR1_OC1M(n) ((n) << 4U)
+#define STM32_TIM_CCMR1_OC1PE (1U << 3)
+
+extern TIM_TypeDef sim_tim15, sim_tim16, sim_tim17;
+#define TIM15 (&sim_tim15)
+#define TIM16 (&sim_tim16)
+#define TIM17 (&sim_tim17)
+
+void simTimReset(TIM_TypeDef *tim);
+
+/*
+ * GPT, TIM6 only triggers the knock ADC.
+ */
+typedef uint32_t gptcnt_t;
+typedef uint32_t gptfreq_t;
+typedef struct GPTDriver GPTDriver;
+typedef void (*gptcallback_t)(GPTDriver *gptp);
+
+typedef struct {
+  gptfreq_t frequency;
+  gptcallback_t callback;
+  uint32_t cr2;
+  uint32_t dier;
+} GPTConfig;
+
+struct GPTDriver {
+  const GPTConfig *config;
+  bool running;
+  uint64_t anchor; // An update event, simulated time
+  uint64_t period; // Simulated time
+};
+
+extern GPTDriver GPTD6;
+
+void gptStart(GPTDriver *gptp, const GPTConfig *config);
+void gptStartContinuous(GPTDriver *gptp, gptcnt_t interval);
+void gptChangeIntervalI(GPTDriver *gptp, gptcnt_t interval);
+void gptStopTimer(GPTDriver *gptp);
+
+/*
+ * DAC, channel 1 of DAC1 biases the VR inputs, DAC2 is the knock output.
+ */
+typedef uint16_t dacsample_t;
+typedef enum {
+  DAC_DHRM_12BIT_RIGHT = 0,
+  DAC_DHRM_12BIT_LEFT = 1,
+  DAC_DHRM_8BIT_RIGHT = 2
+} dacdhrmode_t;
+
+typedef struct {
+  dacsample_t init;
+  dacdhrmode_t datamode;
+  uint32_t cr;
+} DACConfig;
+
+typedef struct {
+  const DACConfig *config;
+  dacsample_t value;
+  uint8_t index;
+} DACDriver;
+
+extern DACDriver DACD1, DACD2;
+
+void dacStart(DACDriver *dacp, const DACConfig *config);
+void dacPutChannelX(DACDriver *dacp, uint32_t channel, dacsample_t sample);
+
+/*
+ * OPAMP, the simulated inputs are already buffered.
+ */
+typedef struct {
+  uint32_t csr;
+} OPAMPConfig;
+
+typedef struct {
+  const OPAMPConfig *config;
+} OPAMPDriver;
+
+#define OPAMP1_CSR_VPSEL_PA01 (0U << 2)
+#define OPAMP2_CSR_VPSEL_PB14 (1U << 2)
+#define OPAMP3_CSR_VPSEL_PB00 (2U << 2)
+#define OPAMP4_CSR_VPSEL_PB13 (0U << 2)
+#define OPAMP1_CSR_VMSEL_FOLWR (3U << 5)
+#define OPAMP2_CSR_VMSEL_FOLWR (3U << 5)
+#define OPAMP3_CSR_VMSEL_FOLWR (3U << 5)
+#define OPAMP4_CSR_VMSEL_FOLWR (3U << 5)
+
+extern OPAMPDriver OPAMPD1, OPAMPD2, OPAMPD3, OPAMPD4;
+
+void opampStart(OPAMPDriver *opampp, const OPAMPConfig *config);
+void opampEnable(OPAMPDriver *opampp);
+
+/*
+ * COMP, each one compares a VR input with DAC1.
+ */
+typedef struct {
+  volatile uint32_t CSR;
+} COMP_TypeDef;
+
+typedef struct COMPDriver COMPDriver;
+typedef void (*compcallback_t)(COMPDriver *comp);
+
+typedef enum {
+  COMP_OUTPUT_NORMAL = 0,
+  COMP_OUTPUT_INVERTED = 1
+} comp_output_mode_t;
+
+typedef enum {
+  COMP_IRQ_RISING = 1,
+  COMP_IRQ_FALLING = 2,
+  COMP_IRQ_BOTH = 3
+} comp_irq_mode_t;
+
+typedef struct {
+  comp_output_mode_t output_mode;
+  comp_irq_mode_t irq_mode;
+  compcallback_t cb;
+  uint32_t csr;
+} COMPConfig;
+
+struct COMPDriver {
+  const COMPConfig *config;
+  COMP_TypeDef *reg;
+  bool enabled;
+  uint8_t index;
+};
+
+#define COMP_CSR_COMPxOUT (1U << 30)
+#define STM32_COMP_InvertingInput_DAC1OUT1 (4U << 4)
+#define STM32_COMP_BlankingSrce_None (0U << 18)
+#define STM32_COMP_NonInvertingInput_IO1 (0U << 7)
+#define STM32_COMP_NonInvertingInput_IO2 (1U << 7)
+#define STM32_COMP_Hysteresis_Medium (2U << 16)
+#define STM32_COMP_OutputLevel_High (0U << 15)
+#define STM32_COMP_Mode_HighSpeed (0U << 2)
+
+extern COMPDriver COMPD1, COMPD2, COMPD6;
+
+void compStart(COMPDriver *compp, const COMPConfig *config);
+void compEnable(COMPDriver *compp);
+void compDisable(COMPDriver *compp);
+
+/*
+ * SPI1 slave, transactions are clocked by the simulated ECU.
+ */
+typedef enum {
+  SPI_UNINIT = 0,
+  SPI_STOP = 1,
+  SPI_READY = 2,
+  SPI_ACTIVE = 3
+} spistate_t;
+
+typedef struct SPIDriver SPIDriver;
+typedef void (*spicallback_t)(SPIDriver *spip);
+
+typedef struct {
+  bool circular;
+  spicallback_t end_cb;
+  ioportid_t ssport;
+  uint16_t sspad;
+  uint16_t cr1;
+  uint16_t cr2;
+} SPIConfig;
+
+typedef struct {
+  volatile uint32_t CR1;
+  volatile uint32_t CR2;
+  volatile uint32_t SR;
+  volatile uint32_t DR;
+} SPI_TypeDef;
+
+struct SPIDriver {
+  spistate_t state;
+  const SPIConfig *config;
+  SPI_TypeDef *spi;
+  stm32_dma_stream_t *dmarx;
+  stm32_dma_stream_t *dmatx;
+  uint32_t rxdmamode;
+  uint32_t txdmamode;
+};
+
+#define SPI_CR1_CPHA (1U << 0)
+#define SPI_CR1_MSTR (1U << 2)
+#define SPI_CR1_SPE (1U << 6)
+#define SPI_CR1_SSI (1U << 8)
+#define SPI_CR1_SSM (1U << 9)
+#define SPI_CR2_RXDMAEN (1U << 0)
+#define SPI_CR2_TXDMAEN (1U << 1)
+#define SPI_CR2_DS_0 (1U << 8)
+#define SPI_CR2_DS_1 (1U << 9)
+#define SPI_CR2_DS_2 (1U << 10)
+#define SPI_CR2_DS_3 (1U << 11)
+#define SPI_CR2_FRXTH (1U << 12)
+
+extern SPIDriver SPID1;
+
+void spiStart(SPIDriver *spip, const SPIConfig *config);
+
+/*
+ * CRC unit, computed in software.
+ */
+typedef struct {
+  uint32_t poly_size;
+  uint32_t poly;
+  uint32_t initial_val;
+  uint32_t final_val;
+  bool reflect_data;
+  bool reflect_remainder;
+} CRCConfig;
+
+typedef struct {
+  const CRCConfig *config;
+  uint32_t crc;
+} CRCDriver;
+
+extern CRCDriver CRCD1;
+
+void crcStart(CRCDriver *crcp, const CRCConfig *config);
+void crcResetI(CRCDriver *crcp);
+uint32_t crcCalc(CRCDriver *crcp, size_t n, const void *buf);
+
+/*
+ * Independent watchdog, the simulation stops when it expires.
+ */
+typedef struct {
+  uint32_t pr;
+  uint32_t rlr;
+  uint32_t winr;
+} WDGConfig;
+
+typedef struct {
+  const WDGConfig *config;
+} WDGDriver;
+
+#define STM32_IWDG_PR_4 0U
+#define STM32_IWDG_PR_8 1U
+#define STM32_IWDG_PR_16 2U
+#define STM32_IWDG_PR_32 3U
+#define STM32_IWDG_PR_64 4U
+#define STM32_IWDG_RL(n) (n)
+#define STM32_IWDG_WIN_DISABLED 0x0FFFU
+#define STM32_LSICLK 40000U
+
+extern WDGDriver WDGD1;
+
+void wdgStart(WDGDriver *wdgp, const WDGConfig *config);
+void wdgReset(WDGDriver *wdgp);
+
+/*
+ * USB, the bulk stream goes to a file and the serial port to a pty.
+ */
+typedef uint8_t usbep_t;
+typedef enum {
+  USB_UNINIT = 0,
+  USB_STOP = 1,
+  USB_READY = 2,
+  USB_SELECTED = 3,
+  USB_ACTIVE = 4,
+  USB_SUSPENDED = 5
+} usbstate_t;
+
+typedef struct USBDriver USBDriver;
+typedef void (*usbcallback_t)(USBDriver *usbp);
+
+typedef struct {
+  uint32_t unused;
+} USBConfig;
+
+struct USBDriver {
+  usbstate_t state;
+  const USBConfig *config;
+  uint8_t setup[8];
+};
+
+#define USB_RTYPE_DIR_HOST2DEV (0U << 7)
+#define USB_RTYPE_DIR_DEV2HOST (1U << 7)
+#define USB_RTYPE_TYPE_MASK (3U << 5)
+#define USB_RTYPE_TYPE_VENDOR (2U << 5)
+#define USB_RTYPE_RECIPIENT_MASK 0x1FU
+#define USB_RTYPE_RECIPIENT_INTERFACE 1U
+
+extern USBDriver USBD1;
+
+void usbStart(USBDriver *usbp, const USBConfig *config);
+void usbConnectBus(USBDriver *usbp);
+void usbDisconnectBus(USBDriver *usbp);
+void usbStartTransmitI(USBDriver *usbp, usbep_t ep, const uint8_t *buf, size_t n);
+void usbSetupTransfer(USBDriver *usbp, uint8_t *buf, size_t n, usbcallback_t endcb);
+
+typedef struct {
+  USBDriver *usbp;
+  usbep_t bulk_in;
+  usbep_t bulk_out;
+  usbep_t int_in;
+} SerialUSBConfig;
+
+typedef struct {
+  const SerialUSBConfig *config;
+} SerialUSBDriver;
+
+void sduObjectInit(SerialUSBDriver *sdup);
+void sduStart(SerialUSBDriver *sdup, const SerialUSBConfig *config);
+msg_t chnGetTimeout(SerialUSBDriver *sdup, sysinterval_t timeout);
+size_t chnWriteTimeout(SerialUSBDriver *sdup, const uint8_t *bp, size_t n, sysinterval_t timeout);
+
+/*
+ * Simulator entry points, see hal_sim.c.
+ */
+void halInit(void);
+rtcnt_t simRealtimeCounter(void);
+uint32_t simGetIpsr(void);
+void simStop(int code, const char *reason); // CH_CFG_SYSTEM_HALT_HOOK
+
+#endif
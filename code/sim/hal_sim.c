@@ -0,0 +1,1213 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "sim.h"
+
+/*
+ * Simulated peripherals and the event loop.
+ * ChibiOS calls _sim_check_for_interrupts() from its idle thread, the
+ * simulated time then jumps to the next event and the interrupts due
+ * are run. Interrupts are only taken while the firmware idles, an
+ * event that happens while a thread runs is handled once it is done.
+ * In SIM_TIME_VIRTUAL mode the code takes no time at all, runs are
+ * deterministic. In SIM_TIME_HOST mode the host CPU time spent in the
+ * firmware is added to the simulated time, scaled by host_scale.
+ */
+
+#define ADC_COUNT 4
+#define TIM_COUNT 3
+#define COMP_COUNT 3
+#define ADC_MAX_CHANNELS 16
+#define ADC_CONVERSION_HALF_CYCLES 25 // 12.5 clocks
+
+/* Events, the first one wins when several happen at the same time */
+enum {
+  EV_TICK,
+  EV_WDG,
+  EV_END,
+  EV_ADC1,
+  EV_TIM15 = EV_ADC1 + ADC_COUNT,
+  EV_ECU = EV_TIM15 + TIM_COUNT,
+  EV_USB,
+  /* Found by scanning the inputs, after the others */
+  EV_SAMPLE,
+  EV_COMP1,
+  EV_COUNT = EV_COMP1 + COMP_COUNT
+};
+
+struct sim_adc {
+  ADCDriver *adcp;
+  ADC_TypeDef regs;
+  uint32_t irq; // DMA channel
+  int16_t offset_error; // LSB, removed by the calibration
+  uint8_t channels[ADC_MAX_CHANNELS];
+  simtime_t sampled[ADC_MAX_CHANNELS]; // End of each sampling, from the scan start
+  simtime_t scan_time;
+  bool triggered; // By GPTD6, continuous otherwise
+  bool single; // One scan per start
+  size_t scans; // Stored in the current pass over the buffer
+  size_t target; // Scans of the next callback
+  simtime_t next_scan; // Start of the scan stored next
+};
+
+typedef struct {
+  TIM_TypeDef *regs;
+  uint32_t irq;
+  void (*handler)(void);
+  uint32_t cr1, cnt, sr; // As seen by the firmware
+  uint32_t arr, psc; // Active values, the registers are preloaded
+  bool running;
+  simtime_t base; // Time the counter was base_cnt
+  uint32_t base_cnt;
+  bool pending_update; // Next event is an update, a CC1 match otherwise
+} sim_tim_t;
+
+/* Digital view of an input, found by scanning it */
+typedef struct {
+  uint8_t input;
+  double high, low; // Thresholds, mV
+  bool level;
+  simtime_t scanned; // Next time to look at
+  simtime_t edge; // Found ahead of time, SIM_NEVER if not yet
+} sim_edge_t;
+
+/* Analog inputs as wired on the board, see knock.h and vr.h */
+typedef struct {
+  uint8_t adc;
+  uint8_t channel;
+  uint8_t input;
+} analog_pin_t;
+
+static const analog_pin_t analog_pins[] = {
+  {1, ADC_CHANNEL_IN3, SIM_IN_KNOCK1}, // OPAMP2 output
+  {1, ADC_CHANNEL_IN5, SIM_IN_KNOCK1 + 1},
+  {1, ADC_CHANNEL_IN11, SIM_IN_KNOCK1 + 2},
+  {1, ADC_CHANNEL_IN12, SIM_IN_KNOCK1 + 3},
+  {0, ADC_CHANNEL_IN3, SIM_IN_VR1}, // OPAMP1 output
+  {2, ADC_CHANNEL_IN1, SIM_IN_VR1 + 1}, // OPAMP3 output
+  {3, ADC_CHANNEL_IN3, SIM_IN_VR1 + 2}, // OPAMP4 output
+};
+
+sim_options_t sim_options;
+
+RCC_TypeDef sim_rcc;
+EXTI_TypeDef sim_exti;
+TIM_TypeDef sim_tim15, sim_tim16, sim_tim17;
+
+static sim_adc_t adcs[ADC_COUNT];
+ADCDriver ADCD1 = {.adcm = &adcs[0].regs, .sim = &adcs[0]};
+ADCDriver ADCD2 = {.adcm = &adcs[1].regs, .sim = &adcs[1]};
+ADCDriver ADCD3 = {.adcm = &adcs[2].regs, .sim = &adcs[2]};
+ADCDriver ADCD4 = {.adcm = &adcs[3].regs, .sim = &adcs[3]};
+
+GPTDriver GPTD6;
+DACDriver DACD1 = {.index = 1};
+DACDriver DACD2 = {.index = 2};
+OPAMPDriver OPAMPD1, OPAMPD2, OPAMPD3, OPAMPD4;
+
+static COMP_TypeDef comp_regs[COMP_COUNT];
+COMPDriver COMPD1 = {.reg = &comp_regs[0], .index = 0};
+COMPDriver COMPD2 = {.reg = &comp_regs[1], .index = 1};
+COMPDriver COMPD6 = {.reg = &comp_regs[2], .index = 2};
+static COMPDriver * const comps[COMP_COUNT] = {&COMPD1, &COMPD2, &COMPD6};
+static const uint32_t comp_irqs[COMP_COUNT] = {
+  STM32_COMP123_NUMBER, STM32_COMP123_NUMBER, STM32_COMP456_NUMBER
+};
+static sim_edge_t comp_edges[COMP_COUNT];
+
+static SPI_TypeDef spi1_regs;
+static stm32_dma_stream_t spi1_dma_rx, spi1_dma_tx;
+SPIDriver SPID1 = {.spi = &spi1_regs, .dmarx = &spi1_dma_rx, .dmatx = &spi1_dma_tx};
+
+CRCDriver CRCD1;
+WDGDriver WDGD1;
+
+extern void STM32_TIM15_HANDLER(void);
+extern void STM32_TIM16_HANDLER(void);
+extern void STM32_TIM17_HANDLER(void);
+
+static sim_tim_t tims[TIM_COUNT] = {
+  {.regs = &sim_tim15, .irq = STM32_TIM15_NUMBER, .handler = STM32_TIM15_HANDLER},
+  {.regs = &sim_tim16, .irq = STM32_TIM16_NUMBER, .handler = STM32_TIM16_HANDLER},
+  {.regs = &sim_tim17, .irq = STM32_TIM17_NUMBER, .handler = STM32_TIM17_HANDLER},
+};
+
+/* PAL lines, 16 per port */
+static struct {
+  bool level;
+  uint32_t event_mode;
+  palcallback_t cb;
+  void *arg;
+} lines[6 * 16];
+static sim_edge_t sample_edge;
+
+static bool nvic[CORTEX_NUM_VECTORS];
+static uint32_t ipsr;
+
+static simtime_t now;
+static simtime_t next_tick;
+static simtime_t wdg_period;
+static simtime_t wdg_expiry = SIM_NEVER;
+
+static struct timespec host_mark; // SIM_TIME_HOST, start of the code measured
+static struct timespec wall_start; // Realtime pacing
+static double host_busy; // Seconds spent in the firmware
+
+/*===========================================================================*/
+/* Time                                                                      */
+/*===========================================================================*/
+
+static double elapsed(const struct timespec *from, const struct timespec *to)
+{
+  return (to->tv_sec - from->tv_sec) + (to->tv_nsec - from->tv_nsec) * 1e-9;
+}
+
+static void hostMark(void)
+{
+  if (sim_options.time_mode == SIM_TIME_HOST)
+    clock_gettime(CLOCK_MONOTONIC, &host_mark);
+}
+
+static simtime_t hostElapsed(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (simtime_t)(elapsed(&host_mark, &ts) * sim_options.host_scale * SIM_FREQ);
+}
+
+/* Adds the time spent in the firmware since hostMark() */
+static void hostAccount(void)
+{
+  simtime_t dt;
+
+  if (sim_options.time_mode != SIM_TIME_HOST)
+    return;
+
+  dt = hostElapsed();
+  host_busy += (double)dt / (SIM_FREQ * sim_options.host_scale);
+  now += dt;
+  hostMark();
+}
+
+simtime_t simNow(void)
+{
+  if (sim_options.time_mode == SIM_TIME_HOST)
+    return now + hostElapsed();
+  return now;
+}
+
+rtcnt_t simRealtimeCounter(void)
+{
+  return (rtcnt_t)(simNow() / (SIM_FREQ / STM32_HCLK));
+}
+
+uint32_t simGetIpsr(void)
+{
+  return ipsr;
+}
+
+/* Waits until the wall clock catches up with t */
+static void pace(simtime_t t)
+{
+  struct timespec ts = wall_start;
+  const uint64_t ns = (uint64_t)((double)t * 1e9 / SIM_FREQ);
+
+  ts.tv_sec += ns / 1000000000U;
+  ts.tv_nsec += ns % 1000000000U;
+  if (ts.tv_nsec >= 1000000000)
+  {
+    ts.tv_sec++;
+    ts.tv_nsec -= 1000000000;
+  }
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0)
+    ;
+}
+
+/*===========================================================================*/
+/* Inputs and outputs                                                        */
+/*===========================================================================*/
+
+double simInputMv(uint8_t input, simtime_t t)
+{
+  return simSourceValue(&sim_options.inputs[input], (double)t / SIM_FREQ);
+}
+
+void simLog(const char *signal, uint32_t channel, int32_t value)
+{
+  if (sim_options.event_log == NULL)
+    return;
+
+  fprintf(sim_options.event_log, "%.3f,%s,%u,%d\n",
+          (double)simNow() / (SIM_FREQ / 1000000U), signal, channel, value);
+}
+
+void simStop(int code, const char *reason)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  fprintf(stderr, "kvr_sim: %s at %.6fs, %.3fs host\n", reason,
+          (double)simNow() / SIM_FREQ, elapsed(&wall_start, &ts));
+  if (sim_options.time_mode == SIM_TIME_HOST)
+    fprintf(stderr, "kvr_sim: %.3fs in the firmware\n", host_busy);
+
+  if (sim_options.event_log != NULL)
+    fflush(sim_options.event_log);
+  if (sim_options.ecu_log != NULL)
+    fflush(sim_options.ecu_log);
+  if (sim_options.stream_file != NULL)
+    fflush(sim_options.stream_file);
+  exit(code);
+}
+
+/* No thresholds crossed, ever */
+static bool sourceIsStatic(const sim_source_t *src)
+{
+  return (src->kind == SIM_SOURCE_NONE || src->kind == SIM_SOURCE_CONST) && src->noise == 0;
+}
+
+static void edgeReset(sim_edge_t *e, simtime_t t)
+{
+  e->level = simInputMv(e->input, t) >= e->high;
+  e->scanned = t;
+  e->edge = SIM_NEVER;
+}
+
+/* Next threshold crossing up to limit */
+static simtime_t edgeNext(sim_edge_t *e, simtime_t limit)
+{
+  double v;
+
+  if (e->edge != SIM_NEVER)
+    return e->edge;
+  if (sourceIsStatic(&sim_options.inputs[e->input]))
+    return SIM_NEVER;
+
+  for (; e->scanned <= limit; e->scanned += SIM_SCAN_STEP)
+  {
+    v = simInputMv(e->input, e->scanned);
+    if (e->level ? v < e->low : v >= e->high)
+    {
+      e->edge = e->scanned;
+      return e->edge;
+    }
+  }
+  return SIM_NEVER;
+}
+
+static void edgeTaken(sim_edge_t *e)
+{
+  e->level = !e->level;
+  e->scanned = e->edge + SIM_SCAN_STEP;
+  e->edge = SIM_NEVER;
+}
+
+/*===========================================================================*/
+/* NVIC and interrupts                                                       */
+/*===========================================================================*/
+
+void nvicEnableVector(uint32_t n, uint32_t prio)
+{
+  (void)prio;
+  nvic[n] = true;
+}
+
+void nvicDisableVector(uint32_t n)
+{
+  nvic[n] = false;
+}
+
+static void timSyncIn(void);
+static void timSyncOut(void);
+
+/* Runs a handler as exception n, it is timed in SIM_TIME_HOST mode */
+static void isrRun(uint32_t exception, void (*isr)(void *arg), void *arg)
+{
+  const uint32_t prev = ipsr;
+
+  ipsr = exception;
+  timSyncIn();
+  hostMark();
+  isr(arg);
+  hostAccount();
+  timSyncOut();
+  ipsr = prev;
+}
+
+typedef struct {
+  void (*isr)(void *arg);
+  void *arg;
+} irq_call_t;
+
+static void irqWrapper(void *p)
+{
+  const irq_call_t *call = p;
+
+  CH_IRQ_PROLOGUE();
+  call->isr(call->arg);
+  CH_IRQ_EPILOGUE();
+}
+
+void simRaiseIrq(uint32_t irq, void (*isr)(void *arg), void *arg)
+{
+  irq_call_t call = {isr, arg};
+
+  isrRun(16 + irq, irqWrapper, &call);
+}
+
+static void sysTick(void *arg)
+{
+  (void)arg;
+
+  CH_IRQ_PROLOGUE();
+  chSysLockFromISR();
+  chSysTimerHandlerI();
+  chSysUnlockFromISR();
+  CH_IRQ_EPILOGUE();
+}
+
+/*===========================================================================*/
+/* PAL and EXTI                                                              */
+/*===========================================================================*/
+
+static void palLog(ioline_t line, bool level)
+{
+  if (line == LINE_INT)
+    simLog("int", 0, level);
+  else if (line == LINE_TR1_OUT)
+    simLog("tr", 1, level);
+  else if (line == LINE_TR2_OUT)
+    simLog("tr", 2, level);
+  else if (line == LINE_TR3_OUT)
+    simLog("tr", 3, level);
+}
+
+uint32_t palReadLine(ioline_t line)
+{
+  if (line == LINE_SAMPLE)
+    return sample_edge.level ? PAL_HIGH : PAL_LOW;
+  if (line == LINE_SPI1_NSS)
+    return simEcuReadNss();
+  return lines[line].level ? PAL_HIGH : PAL_LOW;
+}
+
+void palSetLine(ioline_t line)
+{
+  if (!lines[line].level)
+    palLog(line, true);
+  lines[line].level = true;
+}
+
+void palClearLine(ioline_t line)
+{
+  const bool fell = lines[line].level;
+
+  lines[line].level = false;
+  if (fell)
+  {
+    palLog(line, false);
+    if (line == LINE_INT)
+      simEcuDataReady();
+  }
+}
+
+void palSetLineMode(ioline_t line, iomode_t mode)
+{
+  (void)line;
+  (void)mode;
+}
+
+void palEnableLineEvent(ioline_t line, uint32_t mode)
+{
+  lines[line].event_mode = mode;
+}
+
+void palSetLineCallback(ioline_t line, palcallback_t cb, void *arg)
+{
+  lines[line].cb = cb;
+  lines[line].arg = arg;
+}
+
+/* An input line changed, runs its EXTI callback */
+void simPalEdge(ioline_t line, bool level)
+{
+  const uint32_t mode = level ? PAL_EVENT_MODE_RISING_EDGE : PAL_EVENT_MODE_FALLING_EDGE;
+
+  lines[line].level = level;
+  if ((lines[line].event_mode & mode) != 0 && lines[line].cb != NULL)
+    simRaiseIrq(STM32_EXTI15_10_NUMBER, lines[line].cb, lines[line].arg);
+}
+
+/*===========================================================================*/
+/* ADC                                                                       */
+/*===========================================================================*/
+
+/* Sampling time of the SMPR codes, half cycles */
+static const uint16_t smp_half_cycles[8] = {3, 5, 9, 15, 39, 123, 363, 1203};
+
+static uint8_t adcSequence(const ADCConversionGroup *grpp, uint8_t i)
+{
+  if (i < 4)
+    return (grpp->sqr[0] >> (6 * (i + 1))) & 0x1F;
+  if (i < 9)
+    return (grpp->sqr[1] >> (6 * (i - 4))) & 0x1F;
+  if (i < 14)
+    return (grpp->sqr[2] >> (6 * (i - 9))) & 0x1F;
+  return (grpp->sqr[3] >> (6 * (i - 14))) & 0x1F;
+}
+
+static uint8_t adcSampleTime(const ADCConversionGroup *grpp, uint8_t channel)
+{
+  if (channel < 10)
+    return (grpp->smpr[0] >> (3 * channel)) & 0x07;
+  return (grpp->smpr[1] >> (3 * (channel - 10))) & 0x07;
+}
+
+/* Result of a conversion with the offset and alignment of the ADC */
+static adcsample_t adcResult(sim_adc_t *a, uint8_t channel, simtime_t t)
+{
+  const volatile uint32_t *ofr = &a->regs.OFR1;
+  const uint8_t index = a - adcs;
+  double mv = 0;
+  int32_t raw, value;
+  uint8_t i;
+
+  for (i = 0; i < sizeof(analog_pins) / sizeof(analog_pins[0]); i++)
+  {
+    const analog_pin_t *pin = &analog_pins[i];
+
+    if (pin->adc != index || pin->channel != channel)
+      continue;
+    mv = simInputMv(pin->input, t);
+    if (pin->input < SIM_IN_VR1)
+      mv += SIM_KNOCK_BIAS_MV;
+    else
+      mv += DACD1.value * SIM_VDDA_MV / 4095.0;
+    break;
+  }
+
+  raw = (int32_t)(mv * 4095.0 / SIM_VDDA_MV + 0.5) + a->offset_error;
+  if (raw < 0)
+    raw = 0;
+  else if (raw > 4095)
+    raw = 4095;
+
+  for (i = 0; i < 4; i++)
+  {
+    if ((ofr[i] & ADC_OFR1_OFFSET1_EN) != 0 &&
+        ((ofr[i] >> ADC_OFR1_OFFSET1_CH_Pos) & 0x1F) == channel)
+    {
+      /* Signed, sign extended to bit 15 or from bit 15 when left aligned */
+      value = raw - (int32_t)(ofr[i] & ADC_OFR1_OFFSET1_Msk);
+      if ((a->regs.CFGR & ADC_CFGR_ALIGN) != 0)
+        value *= 8;
+      return (adcsample_t)(int16_t)value;
+    }
+  }
+
+  if ((a->regs.CFGR & ADC_CFGR_ALIGN) != 0)
+    return (adcsample_t)(raw << 4);
+  return (adcsample_t)raw;
+}
+
+static simtime_t gptNext(const GPTDriver *gptp, simtime_t t);
+
+static simtime_t adcScanStep(const sim_adc_t *a)
+{
+  return a->triggered ? GPTD6.period : a->scan_time;
+}
+
+/* Converts the scans that start before the one of index upto */
+static void adcConvertScans(sim_adc_t *a, size_t upto)
+{
+  ADCDriver *adcp = a->adcp;
+  const size_t n = adcp->grpp->num_channels;
+  size_t i, k;
+
+  for (i = a->scans; i < upto; i++)
+  {
+    for (k = 0; k < n; k++)
+      adcp->samples[i * n + k] = adcResult(a, a->channels[k], a->next_scan + a->sampled[k]);
+    a->next_scan += adcScanStep(a);
+  }
+  a->scans = upto;
+}
+
+static simtime_t adcNext(const sim_adc_t *a)
+{
+  if (a->adcp->state != ADC_ACTIVE || a->next_scan == SIM_NEVER)
+    return SIM_NEVER;
+  if (a->single && a->target > 1)
+    return SIM_NEVER; // One scan per start, never completes
+  if (a->scans == a->target)
+    return 0; // Converted ahead by gptCatchUp(), overdue
+
+  return a->next_scan + (a->target - 1 - a->scans) * adcScanStep(a) + a->scan_time;
+}
+
+/* DMA half and full transfer */
+static void adcIsr(void *p)
+{
+  sim_adc_t *a = p;
+  ADCDriver *adcp = a->adcp;
+  const ADCConversionGroup *grpp = adcp->grpp;
+  const size_t half = adcp->depth / 2;
+
+  adcConvertScans(a, a->target);
+
+  if (grpp->circular)
+  {
+    if (adcp->depth > 1 && a->target == half)
+    {
+      a->target = adcp->depth;
+      if (grpp->end_cb != NULL)
+        grpp->end_cb(adcp, adcp->samples, half);
+    }
+    else
+    {
+      a->scans = 0;
+      a->target = adcp->depth > 1 ? half : 1;
+      if (grpp->end_cb != NULL)
+        grpp->end_cb(adcp, adcp->samples + half * grpp->num_channels, adcp->depth - half);
+    }
+    return;
+  }
+
+  adcp->state = ADC_COMPLETE;
+  if (grpp->end_cb != NULL)
+    grpp->end_cb(adcp, adcp->samples, adcp->depth);
+  if (adcp->state == ADC_COMPLETE)
+  {
+    adcp->state = ADC_READY;
+    adcp->grpp = NULL;
+  }
+  chSysLockFromISR();
+  chThdResumeI(&adcp->thread, MSG_OK);
+  chSysUnlockFromISR();
+}
+
+void adcStart(ADCDriver *adcp, const ADCConfig *config)
+{
+  adcp->config = config;
+  if (adcp->state != ADC_READY)
+    adcp->adcm->CALFACT = 0x40 + (adcp->sim - adcs); // Self-calibration result
+  adcp->state = ADC_READY;
+}
+
+void adcStop(ADCDriver *adcp)
+{
+  adcp->state = ADC_STOP;
+}
+
+void adcStartConversionI(ADCDriver *adcp, const ADCConversionGroup *grpp,
+                         adcsample_t *samples, size_t depth)
+{
+  sim_adc_t *a = adcp->sim;
+  simtime_t t = 0;
+  uint8_t i;
+
+  chDbgAssert(adcp->state == ADC_READY, "not ready");
+  chDbgAssert(grpp->num_channels <= ADC_MAX_CHANNELS, "too many channels");
+
+  adcp->grpp = grpp;
+  adcp->samples = samples;
+  adcp->depth = depth;
+  adcp->state = ADC_ACTIVE;
+
+  a->regs.CFGR = grpp->cfgr;
+  a->regs.SMPR1 = grpp->smpr[0];
+  a->regs.SMPR2 = grpp->smpr[1];
+  a->regs.SQR1 = grpp->sqr[0];
+  a->regs.TR1 = grpp->tr1;
+
+  for (i = 0; i < grpp->num_channels; i++)
+  {
+    a->channels[i] = adcSequence(grpp, i);
+    t += smp_half_cycles[adcSampleTime(grpp, a->channels[i])];
+    a->sampled[i] = t;
+    t += ADC_CONVERSION_HALF_CYCLES;
+  }
+  a->scan_time = t;
+  a->triggered = (grpp->cfgr & ADC_CFGR_EXTEN_MASK) != 0;
+  a->single = !a->triggered && (grpp->cfgr & ADC_CFGR_CONT) == 0;
+  a->scans = 0;
+  a->target = grpp->circular && depth > 1 ? depth / 2 : depth;
+  a->next_scan = a->triggered ? gptNext(&GPTD6, simNow()) : simNow();
+}
+
+void adcStartConversion(ADCDriver *adcp, const ADCConversionGroup *grpp,
+                        adcsample_t *samples, size_t depth)
+{
+  chSysLock();
+  adcStartConversionI(adcp, grpp, samples, depth);
+  chSysUnlock();
+}
+
+void adcStopConversionI(ADCDriver *adcp)
+{
+  if (adcp->state != ADC_ACTIVE)
+    return;
+
+  adcp->state = ADC_READY;
+  adcp->grpp = NULL;
+  chThdResumeI(&adcp->thread, MSG_RESET);
+}
+
+void adcStopConversion(ADCDriver *adcp)
+{
+  chSysLock();
+  adcStopConversionI(adcp);
+  chSysUnlock();
+}
+
+msg_t adcConvert(ADCDriver *adcp, const ADCConversionGroup *grpp,
+                 adcsample_t *samples, size_t depth)
+{
+  msg_t msg;
+
+  chSysLock();
+  adcStartConversionI(adcp, grpp, samples, depth);
+  msg = chThdSuspendS(&adcp->thread);
+  chSysUnlock();
+  return msg;
+}
+
+/*===========================================================================*/
+/* GPT, the knock ADC trigger                                                */
+/*===========================================================================*/
+
+/* First update event at or after t */
+static simtime_t gptNext(const GPTDriver *gptp, simtime_t t)
+{
+  if (!gptp->running)
+    return SIM_NEVER;
+  if (t <= gptp->anchor)
+    return gptp->anchor;
+  return gptp->anchor + ((t - gptp->anchor + gptp->period - 1) / gptp->period) * gptp->period;
+}
+
+/* Triggered ADCs take the scans started so far at the old period */
+static void gptCatchUp(const GPTDriver *gptp, simtime_t t)
+{
+  uint8_t i;
+
+  for (i = 0; i < ADC_COUNT; i++)
+  {
+    sim_adc_t *a = &adcs[i];
+
+    if (!a->triggered || a->adcp->state != ADC_ACTIVE || !gptp->running)
+      continue;
+    while (a->scans < a->target && a->next_scan < t)
+      adcConvertScans(a, a->scans + 1);
+  }
+}
+
+static void gptRetrigger(const GPTDriver *gptp, simtime_t t)
+{
+  uint8_t i;
+
+  for (i = 0; i < ADC_COUNT; i++)
+  {
+    if (adcs[i].triggered && adcs[i].adcp->state == ADC_ACTIVE)
+      adcs[i].next_scan = gptNext(gptp, t);
+  }
+}
+
+void gptStart(GPTDriver *gptp, const GPTConfig *config)
+{
+  gptp->config = config;
+}
+
+void gptStartContinuous(GPTDriver *gptp, gptcnt_t interval)
+{
+  const simtime_t t = simNow();
+
+  gptCatchUp(gptp, t);
+  gptp->period = (simtime_t)interval * SIM_FREQ / gptp->config->frequency;
+  gptp->anchor = t + gptp->period;
+  gptp->running = true;
+  gptRetrigger(gptp, t);
+}
+
+/* ARR is preloaded, the current period ends first */
+void gptChangeIntervalI(GPTDriver *gptp, gptcnt_t interval)
+{
+  const simtime_t t = simNow();
+
+  gptCatchUp(gptp, t);
+  gptp->anchor = gptNext(gptp, t);
+  gptp->period = (simtime_t)interval * SIM_FREQ / gptp->config->frequency;
+  gptRetrigger(gptp, t);
+}
+
+void gptStopTimer(GPTDriver *gptp)
+{
+  gptCatchUp(gptp, simNow());
+  gptp->running = false;
+  gptRetrigger(gptp, simNow());
+}
+
+/*===========================================================================*/
+/* TIM15 to TIM17                                                            */
+/*===========================================================================*/
+
+static simtime_t timTick(const sim_tim_t *tm)
+{
+  return (SIM_FREQ / STM32_TIMCLK2) * (tm->psc + 1);
+}
+
+static uint32_t timCount(const sim_tim_t *tm, simtime_t t)
+{
+  if (!tm->running)
+    return tm->base_cnt;
+  return tm->base_cnt + (uint32_t)((t - tm->base) / timTick(tm));
+}
+
+void simTimReset(TIM_TypeDef *tim)
+{
+  uint8_t i;
+
+  for (i = 0; i < TIM_COUNT; i++)
+  {
+    sim_tim_t *tm = &tims[i];
+
+    if (tm->regs != tim)
+      continue;
+    memset(tim, 0, sizeof(*tim));
+    tim->ARR = 0xFFFF;
+    tm->cr1 = tm->cnt = tm->sr = 0;
+    tm->arr = 0xFFFF;
+    tm->psc = 0;
+    tm->running = false;
+    tm->base_cnt = 0;
+  }
+}
+
+/* Registers as the firmware sees them */
+static void timSyncIn(void)
+{
+  const simtime_t t = simNow();
+  uint8_t i;
+
+  for (i = 0; i < TIM_COUNT; i++)
+  {
+    sim_tim_t *tm = &tims[i];
+
+    tm->cnt = timCount(tm, t);
+    tm->regs->CNT = tm->cnt;
+    tm->regs->CR1 = tm->cr1;
+    tm->regs->SR = tm->sr;
+  }
+}
+
+/* Applies what the firmware wrote */
+static void timSyncOut(void)
+{
+  const simtime_t t = simNow();
+  uint8_t i;
+
+  for (i = 0; i < TIM_COUNT; i++)
+  {
+    sim_tim_t *tm = &tims[i];
+    TIM_TypeDef *regs = tm->regs;
+    const bool run = (regs->CR1 & STM32_TIM_CR1_CEN) != 0;
+    uint32_t cnt = regs->CNT & 0xFFFF;
+
+    if ((regs->EGR & STM32_TIM_EGR_UG) != 0)
+    {
+      /* Reinitializes the counter and loads the shadow registers */
+      tm->arr = regs->ARR & 0xFFFF;
+      tm->psc = regs->PSC & 0xFFFF;
+      cnt = 0;
+      tm->cnt = ~0U;
+    }
+    regs->EGR = 0;
+    tm->sr &= regs->SR;
+    if ((regs->CR1 & STM32_TIM_CR1_ARPE) == 0)
+      tm->arr = regs->ARR & 0xFFFF;
+
+    if (cnt != tm->cnt || (run && !tm->running))
+    {
+      tm->base = t;
+      tm->base_cnt = cnt;
+    }
+    else if (!run && tm->running)
+    {
+      tm->base_cnt = timCount(tm, t);
+    }
+    tm->running = run;
+    tm->cr1 = regs->CR1;
+    regs->SR = tm->sr;
+  }
+}
+
+static simtime_t timNext(sim_tim_t *tm)
+{
+  const uint32_t ccr = tm->regs->CCR1 & 0xFFFF;
+  const uint32_t top = tm->base_cnt <= tm->arr ? tm->arr : 0xFFFF;
+  simtime_t update, cc = SIM_NEVER;
+
+  if (!tm->running)
+    return SIM_NEVER;
+
+  update = tm->base + (simtime_t)(top - tm->base_cnt + 1) * timTick(tm);
+  if (ccr > tm->base_cnt && ccr <= top)
+    cc = tm->base + (simtime_t)(ccr - tm->base_cnt) * timTick(tm);
+
+  tm->pending_update = update <= cc;
+  return tm->pending_update ? update : cc;
+}
+
+static void timVector(void *p)
+{
+  ((sim_tim_t *)p)->handler();
+}
+
+static void timFire(sim_tim_t *tm, simtime_t t)
+{
+  if (tm->pending_update)
+  {
+    tm->sr |= STM32_TIM_SR_UIF;
+    if ((tm->regs->CCR1 & 0xFFFF) == 0)
+      tm->sr |= STM32_TIM_SR_CC1IF;
+    tm->arr = tm->regs->ARR & 0xFFFF;
+    tm->psc = tm->regs->PSC & 0xFFFF;
+    tm->base_cnt = 0;
+    if ((tm->cr1 & STM32_TIM_CR1_OPM) != 0)
+    {
+      tm->cr1 &= ~STM32_TIM_CR1_CEN;
+      tm->running = false;
+    }
+  }
+  else
+  {
+    tm->sr |= STM32_TIM_SR_CC1IF;
+    tm->base_cnt = tm->regs->CCR1 & 0xFFFF;
+  }
+  tm->base = t;
+  tm->cnt = tm->base_cnt;
+  tm->regs->CR1 = tm->cr1;
+  tm->regs->SR = tm->sr;
+
+  if ((tm->sr & tm->regs->DIER & STM32_TIM_DIER_IRQ_MASK) != 0 && nvic[tm->irq])
+    isrRun(16 + tm->irq, timVector, tm);
+}
+
+/*===========================================================================*/
+/* DAC, OPAMP and COMP                                                       */
+/*===========================================================================*/
+
+void dacStart(DACDriver *dacp, const DACConfig *config)
+{
+  dacp->config = config;
+  dacPutChannelX(dacp, 0, config->init);
+}
+
+void dacPutChannelX(DACDriver *dacp, uint32_t channel, dacsample_t sample)
+{
+  (void)channel;
+
+  sample &= 0xFFF;
+  if (sample != dacp->value)
+    simLog("dac", dacp->index, sample);
+  dacp->value = sample;
+}
+
+void opampStart(OPAMPDriver *opampp, const OPAMPConfig *config)
+{
+  opampp->config = config;
+}
+
+void opampEnable(OPAMPDriver *opampp)
+{
+  (void)opampp;
+}
+
+static void compUpdateOutput(COMPDriver *compp)
+{
+  const bool level = comp_edges[compp->index].level;
+  const bool out = compp->config->output_mode == COMP_OUTPUT_INVERTED ? !level : level;
+
+  if (out)
+    compp->reg->CSR |= COMP_CSR_COMPxOUT;
+  else
+    compp->reg->CSR &= ~COMP_CSR_COMPxOUT;
+}
+
+void compStart(COMPDriver *compp, const COMPConfig *config)
+{
+  compp->config = config;
+  compp->reg->CSR = config->csr;
+}
+
+/* The VR input swings around the DAC1 bias it is compared to */
+void compEnable(COMPDriver *compp)
+{
+  sim_edge_t *e = &comp_edges[compp->index];
+
+  e->input = SIM_IN_VR1 + compp->index;
+  e->high = SIM_COMP_HYSTERESIS_MV / 2;
+  e->low = -SIM_COMP_HYSTERESIS_MV / 2;
+  edgeReset(e, simNow());
+  compp->enabled = true;
+  compUpdateOutput(compp);
+}
+
+void compDisable(COMPDriver *compp)
+{
+  compp->enabled = false;
+}
+
+static void compIsr(void *p)
+{
+  COMPDriver *compp = p;
+
+  compp->config->cb(compp);
+}
+
+static void compFire(COMPDriver *compp)
+{
+  sim_edge_t *e = &comp_edges[compp->index];
+  comp_irq_mode_t mode;
+
+  edgeTaken(e);
+  compUpdateOutput(compp);
+  simLog("comp", compp->index + 1, e->level);
+
+  mode = e->level ? COMP_IRQ_RISING : COMP_IRQ_FALLING;
+  if (compp->config->cb != NULL && (compp->config->irq_mode & mode) != 0)
+    simRaiseIrq(comp_irqs[compp->index], compIsr, compp);
+}
+
+/*===========================================================================*/
+/* SPI, CRC and IWDG                                                         */
+/*===========================================================================*/
+
+void spiStart(SPIDriver *spip, const SPIConfig *config)
+{
+  spip->config = config;
+  spip->rxdmamode = STM32_DMA_CR_DIR_P2M;
+  spip->txdmamode = STM32_DMA_CR_DIR_M2P;
+  spip->state = SPI_READY;
+}
+
+void crcStart(CRCDriver *crcp, const CRCConfig *config)
+{
+  crcp->config = config;
+  crcp->crc = config->initial_val;
+}
+
+void crcResetI(CRCDriver *crcp)
+{
+  crcp->crc = crcp->config->initial_val;
+}
+
+static uint32_t reflect(uint32_t v, uint8_t bits)
+{
+  uint32_t r = 0;
+  uint8_t i;
+
+  for (i = 0; i < bits; i++)
+    r |= ((v >> i) & 1U) << (bits - 1 - i);
+  return r;
+}
+
+/* The unit keeps the running value between calls */
+uint32_t crcCalc(CRCDriver *crcp, size_t n, const void *buf)
+{
+  const CRCConfig *cfg = crcp->config;
+  const uint8_t *p = buf;
+  const uint32_t top = 1U << (cfg->poly_size - 1);
+  const uint32_t mask = cfg->poly_size == 32 ? 0xFFFFFFFFU : (1U << cfg->poly_size) - 1;
+  uint32_t crc = crcp->crc;
+  uint8_t i;
+
+  while (n-- > 0)
+  {
+    const uint8_t b = cfg->reflect_data ? reflect(*p, 8) : *p;
+
+    p++;
+    crc ^= (uint32_t)b << (cfg->poly_size - 8);
+    for (i = 0; i < 8; i++)
+      crc = (crc & top) != 0 ? (crc << 1) ^ cfg->poly : crc << 1;
+    crc &= mask;
+  }
+  crcp->crc = crc;
+
+  if (cfg->reflect_remainder)
+    crc = reflect(crc, cfg->poly_size);
+  return crc ^ cfg->final_val;
+}
+
+void wdgStart(WDGDriver *wdgp, const WDGConfig *config)
+{
+  wdgp->config = config;
+  wdg_period = (simtime_t)(4U << config->pr) * (config->rlr + 1) * SIM_FREQ / STM32_LSICLK;
+  wdg_expiry = simNow() + wdg_period;
+}
+
+void wdgReset(WDGDriver *wdgp)
+{
+  (void)wdgp;
+  wdg_expiry = simNow() + wdg_period;
+}
+
+/*===========================================================================*/
+/* Event loop                                                                */
+/*===========================================================================*/
+
+static simtime_t eventTime(uint8_t ev, simtime_t limit)
+{
+  if (ev == EV_TICK)
+    return next_tick;
+  if (ev == EV_WDG)
+    return wdg_expiry;
+  if (ev == EV_END)
+    return sim_options.duration != 0 ? sim_options.duration : SIM_NEVER;
+  if (ev < EV_TIM15)
+    return adcNext(&adcs[ev - EV_ADC1]);
+  if (ev < EV_ECU)
+    return timNext(&tims[ev - EV_TIM15]);
+  if (ev == EV_ECU)
+    return simEcuNext();
+  if (ev == EV_USB)
+    return simUsbNext();
+  if (ev == EV_SAMPLE)
+    return edgeNext(&sample_edge, limit);
+  if (!comps[ev - EV_COMP1]->enabled)
+    return SIM_NEVER;
+  return edgeNext(&comp_edges[ev - EV_COMP1], limit);
+}
+
+/* The inputs are only scanned up to the first other event */
+static simtime_t nextEvent(uint8_t *ev)
+{
+  simtime_t next = SIM_NEVER, t;
+  uint8_t i;
+
+  for (i = 0; i < EV_COUNT; i++)
+  {
+    t = eventTime(i, next);
+    if (t < next)
+    {
+      next = t;
+      *ev = i;
+    }
+  }
+  return next;
+}
+
+static void fire(uint8_t ev, simtime_t t)
+{
+  if (ev == EV_TICK)
+  {
+    isrRun(15, sysTick, NULL);
+    next_tick += SIM_FREQ / CH_CFG_ST_FREQUENCY;
+  }
+  else if (ev == EV_WDG)
+  {
+    simLog("wdg", 0, 1);
+    simStop(2, "watchdog reset");
+  }
+  else if (ev == EV_END)
+  {
+    simStop(0, "end of the run");
+  }
+  else if (ev < EV_TIM15)
+  {
+    simRaiseIrq(adcs[ev - EV_ADC1].irq, adcIsr, &adcs[ev - EV_ADC1]);
+  }
+  else if (ev < EV_ECU)
+  {
+    timFire(&tims[ev - EV_TIM15], t);
+  }
+  else if (ev == EV_ECU)
+  {
+    simEcuRun(t);
+  }
+  else if (ev == EV_USB)
+  {
+    simUsbRun(t);
+  }
+  else if (ev == EV_SAMPLE)
+  {
+    edgeTaken(&sample_edge);
+    simLog("sample", 0, sample_edge.level);
+    simPalEdge(LINE_SAMPLE, sample_edge.level);
+  }
+  else
+  {
+    compFire(comps[ev - EV_COMP1]);
+  }
+}
+
+/*
+ * Called by the idle thread, runs the next interrupts.
+ */
+void _sim_check_for_interrupts(void)
+{
+  simtime_t t;
+  uint8_t ev = EV_TICK;
+  bool fired = false;
+
+  hostAccount();
+  timSyncOut();
+
+  t = nextEvent(&ev);
+  if (t > now)
+  {
+    if (sim_options.realtime)
+      pace(t);
+    now = t;
+  }
+
+  while ((t = nextEvent(&ev)) <= now)
+  {
+    fire(ev, t);
+    fired = true;
+  }
+
+  timSyncIn();
+  if (fired)
+  {
+    chSysLock();
+    if (chSchIsPreemptionRequired())
+      chSchDoReschedule();
+    chSysUnlock();
+  }
+  hostMark();
+}
+
+void halInit(void)
+{
+  static const uint32_t adc_irqs[ADC_COUNT] = {
+    STM32_DMA1_CH1_NUMBER, STM32_DMA2_CH1_NUMBER, STM32_DMA2_CH5_NUMBER, STM32_DMA2_CH2_NUMBER
+  };
+  static const int16_t adc_offset_errors[ADC_COUNT] = {3, -2, 4, -3};
+  ADCDriver * const adcds[ADC_COUNT] = {&ADCD1, &ADCD2, &ADCD3, &ADCD4};
+  uint8_t i;
+
+  for (i = 0; i < ADC_COUNT; i++)
+  {
+    adcs[i].adcp = adcds[i];
+    adcs[i].irq = adc_irqs[i];
+    adcs[i].offset_error = adc_offset_errors[i];
+    adcds[i]->state = ADC_STOP;
+  }
+  for (i = 0; i < TIM_COUNT; i++)
+    simTimReset(tims[i].regs);
+
+  sim_rcc.CSR = RCC_CSR_PINRSTF | (sim_options.watchdog_reset ? RCC_CSR_IWDGRSTF : RCC_CSR_PORRSTF);
+
+  sample_edge.input = SIM_IN_SAMPLE;
+  sample_edge.high = sample_edge.low = 0.5;
+  edgeReset(&sample_edge, 0);
+
+  next_tick = SIM_FREQ / CH_CFG_ST_FREQUENCY;
+  clock_gettime(CLOCK_MONOTONIC, &wall_start);
+  hostMark();
+
+  simEcuInit();
+  simUsbInit();
+}
@@ -0,0 +1,109 @@
+/*
+ * Writes synthetic engine signals as raw int16 LE samples, the input of
+ * the simulator file sources, kvr_stream -r and the benchmarks, and the
+ * ground truth of the run as CSV:
+ * time_us,signal,channel,value, see simSourceTruth(). The channel of
+ * the teeth and the value of the knocks is the input, 1 based, in the
+ * order given. kvr_score scores the teeth of input N as the ones of vrN.
+ * Several inputs are interleaved, as the knock sensors in STREAM_KNOCK_RAW.
+ *
+ *   kvr_siggen -t 1 -e rpm=3000,seed=3 -i knock:prob=0.2,mech=8 -o knock.raw -g truth.csv
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include "sim_source.h"
+
+#define SIGGEN_INPUTS 8
+#define SIGGEN_DEFAULT_RATE 100000 // Hz, KNOCK_DEFAULT_RATE
+#define SIGGEN_DEFAULT_SCALE (3300.0 / 4096) // mV per LSB, 12 bits ADC
+
+static sim_engine_t engine;
+static sim_source_t inputs[SIGGEN_INPUTS];
+static uint8_t input_count;
+
+static void usage(const char* name)
+{
+  fprintf(stderr,
+          "usage: %s [-t seconds] [-e engine] -i source... [-r rate] [-s scale]\n"
+          "       [-o samples.raw] [-g truth.csv]\n"
+          "  -t length, 1s by default\n"
+          "  -e engine, see sim_engine.h\n"
+          "  -i source, see sim_source.h, interleaved in the order given\n"
+          "  -r samples per second, 100000 by default\n"
+          "  -s mV per LSB, a 12 bits ADC on 3.3V by default\n", name);
+}
+
+int main(int argc, char** argv)
+{
+  double seconds = 1.0, rate = SIGGEN_DEFAULT_RATE, scale = SIGGEN_DEFAULT_SCALE;
+  FILE* out = NULL;
+  FILE* truth = NULL;
+  uint64_t i, samples;
+  uint8_t k;
+  int opt;
+
+  simEngineParse(&engine, "");
+
+  while ((opt = getopt(argc, argv, "t:e:i:r:s:o:g:h")) != -1)
+  {
+    switch (opt) {
+    case 't': seconds = atof(optarg); break;
+    case 'e':
+      if (!simEngineParse(&engine, optarg))
+        return 1;
+      break;
+    case 'i':
+      if (input_count == SIGGEN_INPUTS)
+      {
+        fprintf(stderr, "%u inputs max\n", SIGGEN_INPUTS);
+        return 1;
+      }
+      if (!simSourceParse(&inputs[input_count], optarg, input_count + 1, &engine))
+        return 1;
+      input_count++;
+      break;
+    case 'r': rate = atof(optarg); break;
+    case 's': scale = atof(optarg); break;
+    case 'o': out = fopen(optarg, "wb"); break;
+    case 'g': truth = fopen(optarg, "w"); break;
+    default: usage(argv[0]); return 1;
+    }
+  }
+
+  if (input_count == 0 || rate <= 0 || scale <= 0 || (out == NULL && truth == NULL))
+  {
+    usage(argv[0]);
+    return 1;
+  }
+
+  if (out != NULL)
+  {
+    samples = (uint64_t)(seconds * rate);
+    for (i = 0; i < samples; i++)
+    {
+      for (k = 0; k < input_count; k++)
+      {
+        const long code = lround(simSourceValue(&inputs[k], i / rate) / scale);
+        const int16_t v = code > INT16_MAX ? INT16_MAX : code < INT16_MIN ? INT16_MIN : (int16_t)code;
+        const uint8_t b[2] = {(uint8_t)v, (uint8_t)((uint16_t)v >> 8)};
+
+        fwrite(b, 1, 2, out);
+      }
+    }
+    fclose(out);
+  }
+
+  if (truth != NULL)
+  {
+    fprintf(truth, "time_us,signal,channel,value\n");
+    for (k = 0; k < input_count; k++)
+      simSourceTruth(truth, &inputs[k], k + 1, seconds);
+    fclose(truth);
+  }
+
+  return 0;
+}
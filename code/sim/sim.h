@@ -0,0 +1,77 @@
+#ifndef SIM_H_
+#define SIM_H_
+
+#include <stdio.h>
+#include "hal.h"
+#include "sim_source.h"
+
+/*
+ * Simulated time counts half cycles of the 72MHz clock, so the ADC
+ * conversion times (n.5 clocks) and every timer period are exact.
+ */
+#define SIM_FREQ (2ULL * STM32_SYSCLK)
+#define SIM_US(us) ((simtime_t)(us) * (SIM_FREQ / 1000000U))
+#define SIM_MS(ms) ((simtime_t)(ms) * (SIM_FREQ / 1000U))
+#define SIM_NEVER UINT64_MAX
+
+#define SIM_VDDA_MV 3300.0
+#define SIM_KNOCK_BIAS_MV 1650.0 // Divider on the knock inputs
+#define SIM_COMP_HYSTERESIS_MV 15.0 // STM32_COMP_Hysteresis_Medium
+#define SIM_SCAN_STEP SIM_US(1) // Comparator and digital edges resolution
+
+/* Simulated inputs */
+#define SIM_IN_KNOCK1 0 // One per knock sensor, 4 max
+#define SIM_IN_VR1 4 // VR1 to VR3, from the DAC1 bias
+#define SIM_IN_SAMPLE 7 // Knock window, LINE_SAMPLE
+#define SIM_INPUTS 8
+
+/* Time modes */
+#define SIM_TIME_VIRTUAL 0 // Code runs in no time, deterministic
+#define SIM_TIME_HOST 1 // Code runs in the host CPU time it takes, scaled
+
+typedef struct {
+  simtime_t duration; // Run length, 0 runs until interrupted
+  uint8_t time_mode;
+  double host_scale; // Simulated time per host CPU time, SIM_TIME_HOST
+  bool realtime; // Paced by the wall clock
+  bool watchdog_reset; // Starts as after a watchdog reset
+  sim_engine_t engine; // Of the wheel, knock and window inputs
+  sim_source_t inputs[SIM_INPUTS];
+  /* ECU */
+  simtime_t ecu_period; // Register file reads, 0 disables
+  bool ecu_on_int; // Reads on the data ready line
+  simtime_t ecu_int_delay; // Data ready to chip select
+  uint32_t spi_rate; // Bits per second
+  FILE* ecu_log;
+  bool ecu_check; // Polled reads must return the live knock values
+  /* USB */
+  FILE* stream_file;
+  uint16_t stream_mask;
+  uint16_t vr_decimation;
+  bool pty;
+  /* Outputs */
+  FILE* event_log;
+} sim_options_t;
+
+extern sim_options_t sim_options;
+
+simtime_t simNow(void);
+void simLog(const char* signal, uint32_t channel, int32_t value);
+double simInputMv(uint8_t input, simtime_t t);
+void simRaiseIrq(uint32_t irq, void (*isr)(void* arg), void* arg);
+void simStop(int code, const char* reason);
+void simPalEdge(ioline_t line, bool level);
+
+/* sim_ecu.c */
+void simEcuInit(void);
+simtime_t simEcuNext(void);
+void simEcuRun(simtime_t t);
+void simEcuDataReady(void);
+uint32_t simEcuReadNss(void);
+
+/* sim_usb.c */
+void simUsbInit(void);
+simtime_t simUsbNext(void);
+void simUsbRun(simtime_t t);
+
+#endif
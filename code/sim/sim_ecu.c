@@ -0,0 +1,228 @@
+#include <string.h>
+#include "sim.h"
+#include "spi_slave.h"
+#include "knock.h"
+
+/*
+ * Simulated ECU, the SPI master of the register file.
+ * It reads every register, either periodically or once the data ready
+ * line (LINE_INT) is asserted, and logs the replies. The master frame
+ * is all SPI_CMD_NONE so the read address is never changed.
+ * The bytes are exchanged with the DMA streams when NSS rises, the
+ * firmware only rearms them while NSS is high.
+ * With -C the knock registers of a polled read must hold the values the
+ * firmware has when NSS falls, or the ones it had ECU_CHECK_AGE before
+ * as the armed frame can be one refresh period old.
+ */
+
+#if SPI_USE_TPIC8101
+#define ECU_FRAME_SIZE 1 // One command byte per transaction
+#else
+#define ECU_FRAME_SIZE SPI_FRAME_SIZE(SPI_REG_COUNT)
+#endif
+#define ECU_NSS_SETUP SIM_US(1) // NSS low to the first clock
+#define ECU_CHECK_AGE SIM_MS(2 * SPI_REFRESH_MS) // A refresh period and the thread wake up
+
+static bool busy; // NSS low
+static simtime_t end_time = SIM_NEVER; // Next NSS rising edge
+static simtime_t next_poll = SIM_NEVER;
+static simtime_t int_time = SIM_NEVER; // LINE_INT seen low
+static uint8_t mosi[ECU_FRAME_SIZE];
+static uint8_t miso[ECU_FRAME_SIZE];
+static bool polled; // The running transaction is a periodic read
+static simtime_t next_look = SIM_NEVER; // Knock values seen before the next poll
+#if !SPI_USE_TPIC8101
+static uint16_t knock_old[KNOCK_SENSORS]; // At next_look
+static uint16_t knock_now[KNOCK_SENSORS]; // When NSS fell
+#endif
+
+static uint16_t crc16(const uint8_t* buf, size_t len)
+{
+  uint16_t crc = 0xFFFF;
+  uint8_t i;
+
+  while (len-- > 0)
+  {
+    crc ^= (uint16_t)*buf++ << 8;
+    for (i = 0; i < 8; i++)
+      crc = (crc & 0x8000) != 0 ? (crc << 1) ^ 0x1021 : crc << 1;
+  }
+  return crc;
+}
+
+/* One byte each way through the SPI1 DMA streams */
+static uint8_t exchange(uint8_t out)
+{
+  stm32_dma_stream_t* rx = SPID1.dmarx;
+  stm32_dma_stream_t* tx = SPID1.dmatx;
+  uint8_t in = 0;
+
+  if (tx->enabled && tx->size > 0)
+  {
+    in = ((const uint8_t*)tx->memory)[tx->total - tx->size];
+    tx->size--;
+  }
+  if (rx->enabled && rx->size > 0)
+  {
+    ((uint8_t*)rx->memory)[rx->total - rx->size] = out;
+    rx->size--;
+  }
+  return in;
+}
+
+static uint16_t reg(uint8_t addr)
+{
+  return ((uint16_t)miso[1 + addr * 2] << 8) | miso[2 + addr * 2];
+}
+
+static void logReply(simtime_t t)
+{
+  FILE* f = sim_options.ecu_log;
+
+  if (f == NULL)
+    return;
+
+#if SPI_USE_TPIC8101
+  fprintf(f, "%.3f,%u\n", (double)t / (SIM_FREQ / 1000000U), miso[0]);
+#else
+  const bool crc_ok = crc16(miso, ECU_FRAME_SIZE - 2) ==
+                      (((uint16_t)miso[ECU_FRAME_SIZE - 2] << 8) | miso[ECU_FRAME_SIZE - 1]);
+
+  fprintf(f, "%.3f,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u\n", (double)t / (SIM_FREQ / 1000000U),
+          miso[0], crc_ok, reg(SPI_REG_STATUS), reg(SPI_REG_EVENTS), reg(SPI_REG_RPM),
+          reg(SPI_REG_KNOCK), reg(SPI_REG_KNOCK + 1), reg(SPI_REG_KNOCK + 2),
+          reg(SPI_REG_KNOCK + 3), reg(SPI_REG_INT_LATENCY));
+#endif
+}
+
+#if !SPI_USE_TPIC8101
+static void lookKnock(uint16_t* values)
+{
+  uint8_t s;
+
+  for (s = 0; s < KNOCK_SENSORS; s++)
+    values[s] = knockGetValue(s);
+}
+
+/* Stale polled reads stop the run, they are not the live values */
+static void checkReply(void)
+{
+  uint8_t s;
+
+  for (s = 0; s < KNOCK_SENSORS; s++)
+  {
+    const uint16_t val = reg(SPI_REG_KNOCK + s);
+
+    if (val != knock_now[s] && val != knock_old[s])
+    {
+      fprintf(stderr, "kvr_sim: knock%u read %u, live %u\n", s + 1, val, knock_now[s]);
+      simStop(4, "stale register file read");
+    }
+  }
+}
+#endif
+
+/* Next time the knock values are looked at before a poll */
+static void scheduleLook(void)
+{
+  next_look = SIM_NEVER;
+#if !SPI_USE_TPIC8101
+  if (sim_options.ecu_check && next_poll != SIM_NEVER && next_poll >= ECU_CHECK_AGE)
+    next_look = next_poll - ECU_CHECK_AGE;
+#endif
+}
+
+void simEcuInit(void)
+{
+#if SPI_USE_TPIC8101
+  mosi[0] = TPIC_CMD_ADVANCED;
+#else
+  memset(mosi, SPI_CMD_NONE, sizeof(mosi));
+#endif
+
+  if (sim_options.ecu_log != NULL)
+  {
+#if SPI_USE_TPIC8101
+    fprintf(sim_options.ecu_log, "time_us,so\n");
+#else
+    fprintf(sim_options.ecu_log, "time_us,ack,crc_ok,status,events,rpm,"
+            "knock1,knock2,knock3,knock4,int_latency\n");
+#endif
+  }
+
+  if (sim_options.ecu_period != 0)
+    next_poll = sim_options.ecu_period;
+  scheduleLook();
+}
+
+/* LINE_INT fell */
+void simEcuDataReady(void)
+{
+  if (sim_options.ecu_on_int && int_time == SIM_NEVER)
+    int_time = simNow() + sim_options.ecu_int_delay;
+}
+
+uint32_t simEcuReadNss(void)
+{
+  return busy ? PAL_LOW : PAL_HIGH;
+}
+
+simtime_t simEcuNext(void)
+{
+  simtime_t next;
+
+  if (busy)
+    return end_time;
+  next = next_poll < int_time ? next_poll : int_time;
+  return next_look < next ? next_look : next;
+}
+
+void simEcuRun(simtime_t t)
+{
+  const uint32_t rate = sim_options.spi_rate != 0 ? sim_options.spi_rate : 1000000;
+  size_t i;
+
+#if !SPI_USE_TPIC8101
+  if (!busy && next_look <= t && next_poll > t && int_time > t)
+  {
+    lookKnock(knock_old);
+    next_look = SIM_NEVER;
+    return;
+  }
+#endif
+
+  if (!busy)
+  {
+    /* Polls that fell in the previous transaction are merged */
+    polled = next_look == SIM_NEVER && next_poll <= t;
+    while (next_poll <= t)
+      next_poll += sim_options.ecu_period;
+    scheduleLook();
+#if !SPI_USE_TPIC8101
+    lookKnock(knock_now);
+#endif
+    if (int_time <= t)
+      int_time = SIM_NEVER;
+
+    busy = true;
+    end_time = t + ECU_NSS_SETUP + ECU_FRAME_SIZE * 8 * SIM_FREQ / rate;
+    simPalEdge(LINE_SPI1_NSS, false);
+    return;
+  }
+
+  for (i = 0; i < ECU_FRAME_SIZE; i++)
+    miso[i] = exchange(mosi[i]);
+  busy = false;
+  end_time = SIM_NEVER;
+  simLog("nss", 0, 1);
+  simPalEdge(LINE_SPI1_NSS, true);
+  logReply(t);
+#if !SPI_USE_TPIC8101
+  if (sim_options.ecu_check && polled)
+    checkReply();
+#endif
+
+  /* Still asserted, the events were not all cleared */
+  if (sim_options.ecu_on_int && palReadLine(LINE_INT) == PAL_LOW && int_time == SIM_NEVER)
+    int_time = t + sim_options.ecu_int_delay;
+}
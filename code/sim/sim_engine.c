@@ -0,0 +1,285 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "sim_engine.h"
+#include "sim_source.h"
+
+#define ENGINE_NOISE_RATE 1000000.0 // Mechanical noise samples per second
+#define ENGINE_DROPOUT_SEED 0x44524F50 // "DROP", independent of the noise
+#define ENGINE_MECH_SEED 0x4D454348 // "MECH"
+#define KNOCK_DECAY_TAUS 10 // Ringing kept, in time constants
+
+/*
+ * Parses key=value,... into eng.
+ */
+bool simEngineParse(sim_engine_t* eng, const char* spec)
+{
+  char buf[256];
+  char* key;
+  char* save = NULL;
+  bool end_set = false;
+
+  memset(eng, 0, sizeof(*eng));
+  eng->rpm = 3000;
+  eng->cylinders = 4;
+
+  snprintf(buf, sizeof(buf), "%s", spec);
+  for (key = strtok_r(buf, ",", &save); key != NULL; key = strtok_r(NULL, ",", &save))
+  {
+    char* value = strchr(key, '=');
+    double v;
+
+    if (value == NULL)
+    {
+      fprintf(stderr, "engine parameter %s has no value\n", key);
+      return false;
+    }
+    *value++ = 0;
+    v = atof(value);
+
+    if (strcmp(key, "rpm") == 0)
+      eng->rpm = v;
+    else if (strcmp(key, "rpm_end") == 0)
+    {
+      eng->rpm_end = v;
+      end_set = true;
+    }
+    else if (strcmp(key, "ramp_start") == 0)
+      eng->ramp_start = v;
+    else if (strcmp(key, "ramp") == 0)
+      eng->ramp = v;
+    else if (strcmp(key, "cylinders") == 0)
+      eng->cylinders = (uint8_t)v;
+    else if (strcmp(key, "seed") == 0)
+      eng->seed = (uint32_t)strtoul(value, NULL, 0);
+    else
+    {
+      fprintf(stderr, "unknown engine parameter %s\n", key);
+      return false;
+    }
+  }
+
+  if (!end_set)
+    eng->rpm_end = eng->rpm;
+  if (eng->cylinders == 0 || eng->cylinders > SIM_ENGINE_CYLINDERS)
+  {
+    fprintf(stderr, "engines have 1 to %u cylinders\n", SIM_ENGINE_CYLINDERS);
+    return false;
+  }
+  if (eng->rpm < 0 || eng->rpm_end < 0 || eng->ramp < 0 || eng->ramp_start < 0)
+  {
+    fprintf(stderr, "engine speeds and times are positive\n");
+    return false;
+  }
+  return true;
+}
+
+double simEngineRpm(const sim_engine_t* eng, double t)
+{
+  if (t <= eng->ramp_start)
+    return eng->rpm;
+  if (t >= eng->ramp_start + eng->ramp)
+    return eng->rpm_end;
+  return eng->rpm + (eng->rpm_end - eng->rpm) * (t - eng->ramp_start) / eng->ramp;
+}
+
+/*
+ * Crank turns since t = 0, negative before.
+ */
+double simEngineRevs(const sim_engine_t* eng, double t)
+{
+  const double u = t - eng->ramp_start;
+  double revs;
+
+  if (u <= 0)
+    return eng->rpm * t / 60.0;
+
+  revs = eng->rpm * eng->ramp_start / 60.0;
+  if (u < eng->ramp)
+    return revs + (eng->rpm * u + (eng->rpm_end - eng->rpm) * u * u / (2.0 * eng->ramp)) / 60.0;
+
+  revs += (eng->rpm + eng->rpm_end) * eng->ramp / 120.0;
+  return revs + eng->rpm_end * (u - eng->ramp) / 60.0;
+}
+
+/*
+ * Time of a crank position, the inverse of simEngineRevs().
+ * Positions never reached are at an infinite time.
+ */
+double simEngineTime(const sim_engine_t* eng, double revs)
+{
+  const double ramp_revs = eng->rpm * eng->ramp_start / 60.0;
+  const double ramp_end = (eng->rpm + eng->rpm_end) * eng->ramp / 2.0; // rpm.s
+  double c, a;
+
+  if (revs <= ramp_revs)
+  {
+    if (eng->rpm > 0)
+      return revs * 60.0 / eng->rpm;
+    return revs <= 0 ? 0.0 : INFINITY;
+  }
+
+  c = (revs - ramp_revs) * 60.0;
+  if (c < ramp_end)
+  {
+    a = (eng->rpm_end - eng->rpm) / (2.0 * eng->ramp);
+    if (fabs(a) < 1e-12)
+      return eng->ramp_start + c / eng->rpm;
+    return eng->ramp_start + (sqrt(eng->rpm * eng->rpm + 4.0 * a * c) - eng->rpm) / (2.0 * a);
+  }
+
+  if (eng->rpm_end <= 0)
+    return INFINITY;
+  return eng->ramp_start + eng->ramp + (c - ramp_end) / eng->rpm_end;
+}
+
+/*
+ * TDC of a cylinder, 0 based, in degrees of the 720 degrees cycle.
+ */
+double simEngineTdc(const sim_engine_t* eng, uint8_t cyl)
+{
+  return cyl * 720.0 / eng->cylinders;
+}
+
+void simWheelInit(sim_wheel_t* wheel)
+{
+  memset(wheel, 0, sizeof(*wheel));
+  wheel->teeth = 36;
+  wheel->missing = 1;
+  wheel->ratio = 1.0;
+  wheel->tooth = 1.0;
+  wheel->amp = 200.0;
+  wheel->clip = 1500.0;
+}
+
+bool simWheelSet(sim_wheel_t* wheel, const char* key, const char* value)
+{
+  const double v = atof(value);
+
+  if (strcmp(key, "teeth") == 0)
+    wheel->teeth = (uint16_t)v;
+  else if (strcmp(key, "missing") == 0)
+    wheel->missing = (uint16_t)v;
+  else if (strcmp(key, "ratio") == 0)
+    wheel->ratio = v;
+  else if (strcmp(key, "offset") == 0)
+    wheel->offset = v;
+  else if (strcmp(key, "tooth") == 0)
+    wheel->tooth = v;
+  else if (strcmp(key, "amp") == 0)
+    wheel->amp = v;
+  else if (strcmp(key, "clip") == 0)
+    wheel->clip = v;
+  else if (strcmp(key, "dropout") == 0)
+    wheel->dropout = v;
+  else
+    return false;
+  return true;
+}
+
+/*
+ * Tooth counts from the crank 0, the wheel index is tooth % teeth.
+ */
+bool simWheelDropped(const sim_wheel_t* wheel, uint32_t seed, int64_t tooth)
+{
+  return wheel->dropout > 0 &&
+         simSourceUniform(seed ^ ENGINE_DROPOUT_SEED, (uint64_t)tooth) < wheel->dropout;
+}
+
+double simWheelValue(const sim_engine_t* eng, const sim_wheel_t* wheel, uint32_t seed, double t)
+{
+  const double pos = (simEngineRevs(eng, t) * wheel->ratio + wheel->offset / 360.0) * wheel->teeth;
+  const double k = floor(pos);
+  const double frac = pos - k;
+  int64_t index = (int64_t)k % wheel->teeth;
+  double v;
+
+  if (index < 0)
+    index += wheel->teeth;
+  if (index >= wheel->teeth - wheel->missing || frac >= wheel->tooth ||
+      simWheelDropped(wheel, seed, (int64_t)k))
+    return 0.0;
+
+  v = wheel->amp * simEngineRpm(eng, t) / 1000.0 * sin(2.0 * M_PI * frac / wheel->tooth);
+  if (wheel->clip > 0)
+    v = fmax(-wheel->clip, fmin(wheel->clip, v));
+  return v;
+}
+
+void simKnockInit(sim_knock_t* knock)
+{
+  memset(knock, 0, sizeof(*knock));
+  knock->freq = 8000.0; // Default knock_freq setting
+  knock->damping = 0.03;
+  knock->amp = 300.0;
+  knock->angle = 15.0;
+  knock->prob = 1.0;
+  knock->mask = 0xFF;
+}
+
+bool simKnockSet(sim_knock_t* knock, const char* key, const char* value)
+{
+  const double v = atof(value);
+
+  if (strcmp(key, "freq") == 0)
+    knock->freq = v;
+  else if (strcmp(key, "damping") == 0)
+    knock->damping = v;
+  else if (strcmp(key, "amp") == 0)
+    knock->amp = v;
+  else if (strcmp(key, "angle") == 0)
+    knock->angle = v;
+  else if (strcmp(key, "prob") == 0)
+    knock->prob = v;
+  else if (strcmp(key, "cyl") == 0)
+    knock->mask = (uint32_t)strtoul(value, NULL, 0);
+  else if (strcmp(key, "mech") == 0)
+    knock->mech = v;
+  else
+    return false;
+  return true;
+}
+
+/*
+ * Whether the combustion of a cylinder (0 based) knocks in a cycle,
+ * the same for every sensor with the same prob.
+ */
+bool simKnockOccurs(const sim_engine_t* eng, const sim_knock_t* knock, int64_t cycle, uint8_t cyl)
+{
+  return cycle >= 0 && (knock->mask & (1U << cyl)) != 0 &&
+         simSourceUniform(eng->seed, (uint64_t)cycle * SIM_ENGINE_CYLINDERS + cyl) < knock->prob;
+}
+
+double simKnockValue(const sim_engine_t* eng, const sim_knock_t* knock, uint32_t seed, double t)
+{
+  const double deg = simEngineRevs(eng, t) * 360.0;
+  const double w = 2.0 * M_PI * knock->freq;
+  const double tau = 1.0 / (w * fmax(knock->damping, 1e-4));
+  double v = 0.0;
+  uint8_t cyl;
+
+  for (cyl = 0; cyl < eng->cylinders; cyl++)
+  {
+    const double onset = simEngineTdc(eng, cyl) + knock->angle;
+    const int64_t cycle = (int64_t)floor((deg - onset) / 720.0);
+    int64_t n;
+
+    /* The ringing can outlast a cycle at high speed and low damping */
+    for (n = cycle; n >= cycle - 1; n--)
+    {
+      double dt;
+
+      if (!simKnockOccurs(eng, knock, n, cyl))
+        continue;
+      dt = t - simEngineTime(eng, (n * 720.0 + onset) / 360.0);
+      if (dt >= 0 && dt < tau * KNOCK_DECAY_TAUS)
+        v += knock->amp * exp(-dt / tau) * sin(w * dt);
+    }
+  }
+
+  if (knock->mech != 0 && t >= 0)
+    v += knock->mech * simEngineRpm(eng, t) / 1000.0 *
+         simSourceNoise(seed ^ ENGINE_MECH_SEED, (uint64_t)(t * ENGINE_NOISE_RATE));
+  return v;
+}
@@ -0,0 +1,76 @@
+#ifndef SIM_ENGINE_H_
+#define SIM_ENGINE_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Synthetic four stroke engine, the crank, cam and knock sensor
+ * signals of sim_source.h and kvr_siggen. Everything is a function of
+ * the time so any input can be sampled at any rate and the runs are
+ * reproducible.
+ * The engine is given as key=value,... for instance
+ *   rpm=800,rpm_end=6000,ramp_start=0.5,ramp=2,cylinders=4,seed=1
+ * The cylinders fire in their number order, evenly spaced over the
+ * cycle, cylinder 1 at 0 degrees. The seed draws the knocking
+ * combustions, all the knock sensors see the same ones.
+ */
+
+#define SIM_ENGINE_CYLINDERS 8 // Max
+
+typedef struct {
+  double rpm; // Until ramp_start
+  double rpm_end; // After the ramp, rpm by default
+  double ramp_start; // Seconds
+  double ramp; // Seconds, linear
+  uint8_t cylinders;
+  uint32_t seed;
+} sim_engine_t;
+
+/*
+ * VR sensor on a wheel, one sine period per tooth and an amplitude
+ * proportional to the speed. The missing teeth are the last ones before
+ * tooth 0, a dropped tooth gives no signal.
+ */
+typedef struct {
+  uint16_t teeth; // Including the missing ones
+  uint16_t missing;
+  double ratio; // Wheel turns per crank turn, 0.5 for a cam wheel
+  double offset; // Degrees of the wheel at the crank 0
+  double tooth; // Signal width, fraction of the tooth pitch
+  double amp; // mV per 1000 rpm of the crank
+  double clip; // mV, input protection, 0 is none
+  double dropout; // Probability of a dropped tooth
+} sim_wheel_t;
+
+/*
+ * Knock sensor, a damped resonance per knocking combustion over the
+ * mechanical noise, which scales with the speed.
+ */
+typedef struct {
+  double freq; // Resonance, Hz
+  double damping; // Ratio, the decay time constant is 1/(2*pi*freq*damping)
+  double amp; // mV
+  double angle; // Onset, degrees after the TDC
+  double prob; // Probability of a knocking combustion
+  uint32_t mask; // Cylinders that can knock, bit 0 is cylinder 1
+  double mech; // Mechanical noise, mV rms per 1000 rpm
+} sim_knock_t;
+
+bool simEngineParse(sim_engine_t* eng, const char* spec);
+double simEngineRpm(const sim_engine_t* eng, double t);
+double simEngineRevs(const sim_engine_t* eng, double t);
+double simEngineTime(const sim_engine_t* eng, double revs);
+double simEngineTdc(const sim_engine_t* eng, uint8_t cyl);
+
+void simWheelInit(sim_wheel_t* wheel);
+bool simWheelSet(sim_wheel_t* wheel, const char* key, const char* value);
+bool simWheelDropped(const sim_wheel_t* wheel, uint32_t seed, int64_t tooth);
+double simWheelValue(const sim_engine_t* eng, const sim_wheel_t* wheel, uint32_t seed, double t);
+
+void simKnockInit(sim_knock_t* knock);
+bool simKnockSet(sim_knock_t* knock, const char* key, const char* value);
+bool simKnockOccurs(const sim_engine_t* eng, const sim_knock_t* knock, int64_t cycle, uint8_t cyl);
+double simKnockValue(const sim_engine_t* eng, const sim_knock_t* knock, uint32_t seed, double t);
+
+#endif
@@ -0,0 +1,202 @@
+/*
+ * Hosted build of the firmware, see the Makefile.
+ * The inputs are generators or recorded waveforms, the outputs are the
+ * USB stream file, the simulated ECU log and an event log.
+ *
+ *   kvr_sim -t 2 -i vr1=sine:freq=600,amp=900 -i sample=pulse:period=20000,width=5000 \
+ *           -i knock1=sine:freq=6800,amp=300,noise=5 -S ksep -w stream.bin -g events.csv
+ *   kvr_sim -t 4 -e rpm=1000,rpm_end=6000,ramp=3,seed=7 -i vr1=wheel:teeth=36,missing=1 \
+ *           -i knock1=knock:prob=0.1,mech=5 -i sample=window:angle=5,span=60
+ *   kvr_stream -r stream.bin -o frames.csv
+ * -G writes the ground truth of the engine inputs, kvr_score compares it
+ * with the event log of the stream:
+ *   kvr_sim -t 3 -e rpm=0,rpm_end=3000,ramp_start=0.2,ramp=0.5,seed=2 -i vr1=wheel \
+ *           -i knock1=knock:prob=0.2 -i sample=window:angle=5,span=60 -S e -w stream.bin -G truth.csv
+ *   kvr_score -g truth.csv -r stream.bin
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "sim.h"
+#include "stream_format.h"
+
+#define STACK_FILL 0x55 // As memhealth.c expects
+#define STACK_SIZE 0x400 // USE_EXCEPTIONS_STACKSIZE and USE_PROCESS_STACKSIZE
+
+extern int firmwareMain(void);
+
+/*
+ * memhealth.c reports the Cortex-M exception and process stacks, they
+ * are not used here and stay filled.
+ */
+uint8_t __main_stack_base__[STACK_SIZE], __process_stack_base__[STACK_SIZE];
+__asm__(".globl __main_stack_end__\n"
+        ".set __main_stack_end__, __main_stack_base__ + 0x400\n"
+        ".globl __process_stack_end__\n"
+        ".set __process_stack_end__, __process_stack_base__ + 0x400\n");
+
+static const char* const input_names[SIM_INPUTS] = {
+  "knock1", "knock2", "knock3", "knock4", "vr1", "vr2", "vr3", "sample"
+};
+
+static const char stream_letters[STREAM_TYPES] = {
+  'k', 'v', 's', 'c', 'e', 'l', 'p', 'T', 'm', 'f', 'b'
+};
+
+static void usage(const char* name)
+{
+  fprintf(stderr,
+          "usage: %s [-t seconds] [-e engine] [-i input=source]... [-H scale] [-R] [-W]\n"
+          "       [-P us] [-I us] [-C] [-b bps] [-l ecu.csv] [-S streams] [-d decimation]\n"
+          "       [-w stream.bin] [-p] [-g events.csv] [-G truth.csv]\n"
+          "  -t run length, until interrupted by default\n"
+          "  -e engine of the wheel, knock and window sources, see sim_engine.h\n"
+          "  -i input source, inputs: knock1-4 vr1-3 sample, see sim_source.h\n"
+          "  -H code takes the host CPU time, times scale, none by default\n"
+          "  -R paced by the wall clock\n"
+          "  -W starts as after a watchdog reset\n"
+          "  -P ECU register reads period, -I ECU reads after data ready\n"
+          "  -C stops when a periodic read is older than the SPI refresh\n"
+          "  -b SPI clock, 1MHz by default, -l ECU reads log\n"
+          "  -S USB streams, kvr_stream letters (kvsceplTmfb), -d VR decimation\n"
+          "  -w USB stream file, -p serial port on a pty\n"
+          "  -g outputs and inputs edges log\n"
+          "  -G ground truth of the engine inputs, needs -t, see simSourceTruth()\n", name);
+}
+
+static FILE* openOutput(const char* path, const char* mode)
+{
+  FILE* f = fopen(path, mode);
+
+  if (f == NULL)
+  {
+    perror(path);
+    exit(1);
+  }
+  return f;
+}
+
+static bool parseInput(const char* arg)
+{
+  const char* eq = strchr(arg, '=');
+  uint8_t i;
+
+  if (eq == NULL)
+    return false;
+
+  for (i = 0; i < SIM_INPUTS; i++)
+  {
+    if (strlen(input_names[i]) == (size_t)(eq - arg) && strncmp(arg, input_names[i], eq - arg) == 0)
+      return simSourceParse(&sim_options.inputs[i], eq + 1, i + 1, &sim_options.engine);
+  }
+  fprintf(stderr, "unknown input %.*s\n", (int)(eq - arg), arg);
+  return false;
+}
+
+/*
+ * The teeth are on the channel of their VR input, 1 to 3, the knocks
+ * have the number of their sensor input.
+ */
+static void writeTruth(FILE* f)
+{
+  const double seconds = (double)sim_options.duration / SIM_FREQ;
+  uint8_t i;
+
+  fprintf(f, "time_us,signal,channel,value\n");
+  for (i = 0; i < SIM_INPUTS; i++)
+  {
+    uint8_t channel = 0; // The window
+
+    if (i < SIM_IN_VR1)
+      channel = i - SIM_IN_KNOCK1 + 1;
+    else if (i < SIM_IN_SAMPLE)
+      channel = i - SIM_IN_VR1 + 1;
+    simSourceTruth(f, &sim_options.inputs[i], channel, seconds);
+  }
+  fclose(f);
+}
+
+static bool parseStreams(const char* arg)
+{
+  const char* c;
+  uint8_t i;
+
+  for (c = arg; *c != 0; c++)
+  {
+    for (i = 0; i < STREAM_TYPES && stream_letters[i] != *c; i++);
+    if (i == STREAM_TYPES)
+    {
+      fprintf(stderr, "unknown stream %c\n", *c);
+      return false;
+    }
+    sim_options.stream_mask |= STREAM_MSK(i);
+  }
+  return true;
+}
+
+int main(int argc, char** argv)
+{
+  FILE* truth = NULL;
+  int opt;
+
+  sim_options.host_scale = 1.0;
+  sim_options.spi_rate = 1000000;
+  sim_options.ecu_int_delay = SIM_US(20);
+  simEngineParse(&sim_options.engine, "");
+
+  while ((opt = getopt(argc, argv, "t:e:i:H:RWP:I:Cb:l:S:d:w:pg:G:h")) != -1)
+  {
+    switch (opt) {
+    case 't': sim_options.duration = (simtime_t)(atof(optarg) * SIM_FREQ); break;
+    case 'e':
+      if (!simEngineParse(&sim_options.engine, optarg))
+        return 1;
+      break;
+    case 'i':
+      if (!parseInput(optarg))
+        return 1;
+      break;
+    case 'H':
+      sim_options.time_mode = SIM_TIME_HOST;
+      sim_options.host_scale = atof(optarg);
+      break;
+    case 'R': sim_options.realtime = true; break;
+    case 'W': sim_options.watchdog_reset = true; break;
+    case 'P': sim_options.ecu_period = SIM_US(atoi(optarg)); break;
+    case 'C': sim_options.ecu_check = true; break;
+    case 'I':
+      sim_options.ecu_on_int = true;
+      sim_options.ecu_int_delay = SIM_US(atoi(optarg));
+      break;
+    case 'b': sim_options.spi_rate = atoi(optarg); break;
+    case 'l': sim_options.ecu_log = openOutput(optarg, "w"); break;
+    case 'S':
+      if (!parseStreams(optarg))
+        return 1;
+      break;
+    case 'd': sim_options.vr_decimation = atoi(optarg); break;
+    case 'w': sim_options.stream_file = openOutput(optarg, "wb"); break;
+    case 'p': sim_options.pty = true; break;
+    case 'g':
+      sim_options.event_log = openOutput(optarg, "w");
+      fprintf(sim_options.event_log, "time_us,signal,channel,value\n");
+      break;
+    case 'G': truth = openOutput(optarg, "w"); break;
+    default: usage(argv[0]); return 1;
+    }
+  }
+
+  if (sim_options.host_scale <= 0 || (truth != NULL && sim_options.duration == 0))
+  {
+    usage(argv[0]);
+    return 1;
+  }
+  if (truth != NULL)
+    writeTruth(truth);
+
+  memset(__main_stack_base__, STACK_FILL, sizeof(__main_stack_base__));
+  memset(__process_stack_base__, STACK_FILL, sizeof(__process_stack_base__));
+
+  return firmwareMain();
+}
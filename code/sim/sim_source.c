@@ -0,0 +1,317 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "sim_source.h"
+
+#define NOISE_RATE 1000000.0 // Noise samples per second
+
+static const char* const kinds[] = {"none", "const", "sine", "pulse", "file", "wheel", "knock", "window"};
+
+static bool loadFile(sim_source_t* src, const char* path)
+{
+  FILE* f = fopen(path, "rb");
+  uint8_t b[2];
+  size_t n = 0;
+
+  if (f == NULL)
+  {
+    perror(path);
+    return false;
+  }
+
+  fseek(f, 0, SEEK_END);
+  src->len = ftell(f) / 2;
+  fseek(f, 0, SEEK_SET);
+  src->data = malloc(src->len * sizeof(int16_t) + 1);
+  while (n < src->len && fread(b, 1, 2, f) == 2)
+    src->data[n++] = (int16_t)(b[0] | (b[1] << 8));
+  fclose(f);
+
+  src->len = n;
+  if (n == 0)
+  {
+    fprintf(stderr, "%s: no samples\n", path);
+    return false;
+  }
+  return true;
+}
+
+static bool setParam(sim_source_t* src, const char* key, const char* value)
+{
+  const double v = atof(value);
+
+  /* The engine kinds have their own amp and freq */
+  if (src->kind == SIM_SOURCE_WHEEL && simWheelSet(&src->wheel, key, value))
+    return true;
+  if (src->kind == SIM_SOURCE_KNOCK && simKnockSet(&src->knock, key, value))
+    return true;
+
+  if (strcmp(key, "level") == 0)
+    src->level = v;
+  else if (strcmp(key, "amp") == 0)
+    src->amp = v;
+  else if (strcmp(key, "freq") == 0)
+    src->freq = v;
+  else if (strcmp(key, "phase") == 0)
+    src->phase = v * M_PI / 180.0;
+  else if (strcmp(key, "period") == 0)
+    src->period = v * 1e-6;
+  else if (strcmp(key, "width") == 0)
+    src->width = v * 1e-6;
+  else if (strcmp(key, "delay") == 0)
+    src->delay = v * 1e-6;
+  else if (strcmp(key, "rate") == 0)
+    src->rate = v;
+  else if (strcmp(key, "scale") == 0)
+    src->scale = v;
+  else if (strcmp(key, "angle") == 0)
+    src->angle = v;
+  else if (strcmp(key, "span") == 0)
+    src->span = v;
+  else if (strcmp(key, "noise") == 0)
+    src->noise = v;
+  else if (strcmp(key, "seed") == 0)
+    src->seed = (uint32_t)strtoul(value, NULL, 0);
+  else if (strcmp(key, "path") == 0)
+    return loadFile(src, value);
+  else
+  {
+    fprintf(stderr, "unknown source parameter %s\n", key);
+    return false;
+  }
+  return true;
+}
+
+/*
+ * Parses kind:key=value,... into src, the seed makes the noise of each
+ * input different. The engine kinds keep a reference to the engine.
+ */
+bool simSourceParse(sim_source_t* src, const char* spec, uint32_t seed, const sim_engine_t* engine)
+{
+  char buf[256];
+  char* params;
+  char* key;
+  char* save = NULL;
+  uint8_t i;
+
+  memset(src, 0, sizeof(*src));
+  src->amp = 1.0;
+  src->scale = 1.0;
+  src->seed = seed;
+  src->engine = engine;
+  simWheelInit(&src->wheel);
+  simKnockInit(&src->knock);
+
+  snprintf(buf, sizeof(buf), "%s", spec);
+  params = strchr(buf, ':');
+  if (params != NULL)
+    *params++ = 0;
+
+  for (i = 0; i < sizeof(kinds) / sizeof(kinds[0]); i++)
+  {
+    if (strcmp(buf, kinds[i]) == 0)
+      break;
+  }
+  if (i == sizeof(kinds) / sizeof(kinds[0]))
+  {
+    fprintf(stderr, "unknown source %s\n", buf);
+    return false;
+  }
+  src->kind = i;
+
+  for (key = params != NULL ? strtok_r(params, ",", &save) : NULL; key != NULL;
+       key = strtok_r(NULL, ",", &save))
+  {
+    char* value = strchr(key, '=');
+
+    if (value == NULL)
+    {
+      fprintf(stderr, "source parameter %s has no value\n", key);
+      return false;
+    }
+    *value++ = 0;
+    if (!setParam(src, key, value))
+      return false;
+  }
+
+  if (src->kind == SIM_SOURCE_FILE && (src->data == NULL || src->rate <= 0))
+  {
+    fprintf(stderr, "file sources need a path and a rate\n");
+    return false;
+  }
+  if (src->kind == SIM_SOURCE_PULSE && src->period <= 0)
+  {
+    fprintf(stderr, "pulse sources need a period\n");
+    return false;
+  }
+  if (src->kind == SIM_SOURCE_WHEEL && (src->wheel.teeth == 0 || src->wheel.missing >= src->wheel.teeth ||
+                                        src->wheel.tooth <= 0 || src->wheel.tooth > 1))
+  {
+    fprintf(stderr, "wheels need more teeth than missing ones and a tooth in ]0, 1]\n");
+    return false;
+  }
+  return true;
+}
+
+static uint32_t hash(uint32_t seed, uint64_t n)
+{
+  uint64_t x = n * 0x9E3779B97F4A7C15ULL + seed;
+
+  x ^= x >> 31;
+  x *= 0xBF58476D1CE4E5B9ULL;
+  x ^= x >> 27;
+  x *= 0x94D049BB133111EBULL;
+  x ^= x >> 31;
+  return (uint32_t)x;
+}
+
+/*
+ * Unit gaussian noise, sample n of a seed.
+ */
+double simSourceNoise(uint32_t seed, uint64_t n)
+{
+  const double u1 = (hash(seed, n * 2) + 1.0) / 4294967297.0;
+  const double u2 = hash(seed, n * 2 + 1) / 4294967296.0;
+
+  return sqrt(-2.0 * log(u1)) * cos(2.0 * M_PI * u2);
+}
+
+/*
+ * Uniform in [0, 1), sample n of a seed.
+ */
+double simSourceUniform(uint32_t seed, uint64_t n)
+{
+  return hash(seed, n) / 4294967296.0;
+}
+
+/*
+ * Value at t seconds, in mV.
+ */
+double simSourceValue(const sim_source_t* src, double t)
+{
+  double v = src->level, pos, frac;
+  size_t i;
+
+  switch (src->kind)
+  {
+  case SIM_SOURCE_SINE:
+    v += src->amp * sin(2.0 * M_PI * src->freq * t + src->phase);
+    break;
+  case SIM_SOURCE_PULSE:
+    pos = fmod(t - src->delay, src->period);
+    if (t >= src->delay && pos < src->width)
+      v += src->amp;
+    break;
+  case SIM_SOURCE_FILE:
+    pos = fmod(t * src->rate, (double)src->len);
+    i = (size_t)pos;
+    frac = pos - i;
+    v += src->scale * (src->data[i] * (1.0 - frac) + src->data[(i + 1) % src->len] * frac);
+    break;
+  case SIM_SOURCE_WHEEL:
+    v += simWheelValue(src->engine, &src->wheel, src->seed, t);
+    break;
+  case SIM_SOURCE_KNOCK:
+    v += simKnockValue(src->engine, &src->knock, src->seed, t);
+    break;
+  case SIM_SOURCE_WINDOW:
+    pos = fmod(simEngineRevs(src->engine, t) * 360.0 - src->angle, 720.0 / src->engine->cylinders);
+    if (pos < 0)
+      pos += 720.0 / src->engine->cylinders;
+    if (pos < src->span)
+      v += src->amp;
+    break;
+  default:
+    break;
+  }
+
+  if (src->noise != 0)
+    v += src->noise * simSourceNoise(src->seed, (uint64_t)(t * NOISE_RATE));
+  return v;
+}
+
+static void truthTeeth(FILE* f, const sim_source_t* src, uint32_t channel, double seconds)
+{
+  const sim_wheel_t* wheel = &src->wheel;
+  const double end = simEngineRevs(src->engine, seconds) * wheel->ratio * wheel->teeth +
+                     wheel->offset / 360.0 * wheel->teeth;
+  int64_t k = (int64_t)ceil(wheel->offset / 360.0 * wheel->teeth);
+
+  for (; k < end; k++)
+  {
+    int64_t index = k % wheel->teeth;
+    const double revs = ((k + wheel->tooth / 2.0) / wheel->teeth - wheel->offset / 360.0) / wheel->ratio;
+    const double t = simEngineTime(src->engine, revs);
+
+    if (index < 0)
+      index += wheel->teeth;
+    if (index >= wheel->teeth - wheel->missing || t > seconds)
+      continue;
+    fprintf(f, "%.3f,tooth,%u,%lld\n", t * 1e6, channel,
+            simWheelDropped(wheel, src->seed, k) ? -1LL : (long long)index);
+  }
+}
+
+static void truthKnocks(FILE* f, const sim_source_t* src, uint32_t channel, double seconds)
+{
+  const sim_engine_t* eng = src->engine;
+  const int64_t cycles = (int64_t)ceil(simEngineRevs(eng, seconds) / 2.0);
+  int64_t n;
+  uint8_t cyl;
+
+  for (n = 0; n < cycles; n++)
+  {
+    for (cyl = 0; cyl < eng->cylinders; cyl++)
+    {
+      const double t = simEngineTime(eng, (n * 720.0 + simEngineTdc(eng, cyl) + src->knock.angle) / 360.0);
+
+      if (t <= seconds && simKnockOccurs(eng, &src->knock, n, cyl))
+        fprintf(f, "%.3f,knock,%u,%u\n", t * 1e6, cyl + 1, channel);
+    }
+  }
+}
+
+/* Window k opens angle degrees after the TDC of cylinder k % cylinders */
+static void truthWindows(FILE* f, const sim_source_t* src, double seconds)
+{
+  const sim_engine_t* eng = src->engine;
+  const double pitch = 720.0 / eng->cylinders;
+  const double end = simEngineRevs(eng, seconds) * 360.0;
+  int64_t k;
+
+  if (src->span <= 0)
+    return;
+  for (k = 0; src->angle + k * pitch < end; k++)
+  {
+    const double open = simEngineTime(eng, (src->angle + k * pitch) / 360.0);
+    const double close = simEngineTime(eng, (src->angle + k * pitch + src->span) / 360.0);
+    const unsigned cyl = (unsigned)(k % eng->cylinders) + 1;
+
+    if (open > seconds)
+      break;
+    fprintf(f, "%.3f,window,%u,1\n", open * 1e6, cyl);
+    if (close <= seconds)
+      fprintf(f, "%.3f,window,%u,0\n", close * 1e6, cyl);
+  }
+}
+
+/*
+ * Ground truth of the engine kinds until seconds, as CSV rows of
+ * time_us,signal,channel,value
+ *   tooth   zero crossing of a wheel tooth, value is the tooth index,
+ *           -1 when it was dropped
+ *   knock   onset of a knocking combustion, channel is the cylinder
+ *           (1 based), value the channel given
+ *   window  knock window edge, channel is the cylinder, value the level
+ * The rows are in time order for each source, not across sources.
+ */
+void simSourceTruth(FILE* f, const sim_source_t* src, uint32_t channel, double seconds)
+{
+  if (src->kind == SIM_SOURCE_WHEEL)
+    truthTeeth(f, src, channel, seconds);
+  else if (src->kind == SIM_SOURCE_KNOCK)
+    truthKnocks(f, src, channel, seconds);
+  else if (src->kind == SIM_SOURCE_WINDOW)
+    truthWindows(f, src, seconds);
+}
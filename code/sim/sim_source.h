@@ -0,0 +1,63 @@
+#ifndef SIM_SOURCE_H_
+#define SIM_SOURCE_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "sim_engine.h"
+
+/*
+ * Signal sources of the simulated inputs, in mV at the pin and around
+ * its bias. Digital inputs are high above 0.5.
+ * A source is given as kind:key=value,... for instance
+ *   sine:freq=600,amp=800,noise=5
+ *   pulse:period=20000,width=5000
+ *   file:path=knock.raw,rate=100000,scale=0.8
+ *   wheel:teeth=60,missing=2,amp=150,dropout=0.001
+ *   knock:freq=6800,amp=400,prob=0.2,cyl=0x5,mech=10
+ * The wheel, knock and window kinds follow the engine, see sim_engine.h.
+ * Every kind takes noise (mV rms), it is a function of the time so the
+ * ADC and the comparators see the same signal.
+ */
+
+typedef uint64_t simtime_t;
+
+#define SIM_SOURCE_NONE 0 // 0 mV
+#define SIM_SOURCE_CONST 1 // level
+#define SIM_SOURCE_SINE 2 // freq (Hz), amp (mV), phase (degrees), level
+#define SIM_SOURCE_PULSE 3 // period, width, delay (us), amp (mV, 1 by default), level
+#define SIM_SOURCE_FILE 4 // path, rate (Hz), scale (mV per LSB), raw int16 LE, looped
+#define SIM_SOURCE_WHEEL 5 // VR sensor, sim_wheel_t
+#define SIM_SOURCE_KNOCK 6 // Knock sensor, sim_knock_t
+#define SIM_SOURCE_WINDOW 7 // angle, span (degrees after each TDC), amp (mV, 1 by default), level
+
+typedef struct {
+  uint8_t kind;
+  double level; // mV
+  double amp; // mV
+  double freq; // Hz
+  double phase; // Radians
+  double period; // Seconds
+  double width;
+  double delay;
+  double rate; // File samples per second
+  double scale; // File mV per LSB
+  double noise; // mV rms
+  uint32_t seed;
+  int16_t* data;
+  size_t len;
+  const sim_engine_t* engine;
+  sim_wheel_t wheel;
+  sim_knock_t knock;
+  double angle; // Window start, degrees
+  double span;
+} sim_source_t;
+
+bool simSourceParse(sim_source_t* src, const char* spec, uint32_t seed, const sim_engine_t* engine);
+double simSourceValue(const sim_source_t* src, double t);
+double simSourceNoise(uint32_t seed, uint64_t n);
+double simSourceUniform(uint32_t seed, uint64_t n);
+void simSourceTruth(FILE* f, const sim_source_t* src, uint32_t channel, double seconds);
+
+#endif
@@ -0,0 +1,186 @@
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <termios.h>
+#include "sim.h"
+#include "usb_config.h"
+#include "usb_stream.h"
+
+/*
+ * Simulated USB device, already enumerated by a host that selects the
+ * streams of the command line. The bulk stream goes to a file, in the
+ * format kvr_stream -r reads. The serial port is a pty the host tools
+ * can open.
+ */
+
+/* As in usb_config.c */
+#define USB_INTERRUPT_EP_A 1
+#define USB_DATA_EP_A 2
+#define USB_STREAM_IF_NUM 2
+
+#define USB_ENUMERATION_TIME SIM_MS(10) // Connect to configured
+#define USB_PACKET_TIME (SIM_US(1000) / 19) // Full speed bulk, 19 packets per frame
+
+USBDriver USBD1;
+SerialUSBDriver SDU1;
+const USBConfig usbcfg = {0};
+const SerialUSBConfig serusbcfg1 = {
+  &USBD1,
+  USB_DATA_EP_A,
+  USB_DATA_EP_A,
+  USB_INTERRUPT_EP_A
+};
+
+static simtime_t configure_time = SIM_NEVER;
+static simtime_t transmitted_time = SIM_NEVER;
+static int pty = -1;
+
+void simUsbInit(void)
+{
+  int slave;
+  struct termios tio;
+
+  if (!sim_options.pty)
+    return;
+
+  pty = posix_openpt(O_RDWR | O_NOCTTY);
+  if (pty < 0 || grantpt(pty) != 0 || unlockpt(pty) != 0)
+  {
+    perror("pty");
+    exit(1);
+  }
+  fcntl(pty, F_SETFL, O_NONBLOCK);
+
+  /* Kept open so the master does not read EIO without a client */
+  slave = open(ptsname(pty), O_RDWR | O_NOCTTY);
+  if (slave >= 0 && tcgetattr(slave, &tio) == 0)
+  {
+    cfmakeraw(&tio);
+    tcsetattr(slave, TCSANOW, &tio);
+  }
+  fprintf(stderr, "kvr_sim: serial port on %s\n", ptsname(pty));
+}
+
+/* Vendor request of the host to the stream interface */
+static void vendorRequest(uint8_t request, uint16_t value)
+{
+  USBD1.setup[0] = USB_RTYPE_DIR_HOST2DEV | USB_RTYPE_TYPE_VENDOR | USB_RTYPE_RECIPIENT_INTERFACE;
+  USBD1.setup[1] = request;
+  USBD1.setup[2] = value & 0xFF;
+  USBD1.setup[3] = value >> 8;
+  USBD1.setup[4] = USB_STREAM_IF_NUM;
+  USBD1.setup[5] = 0;
+  USBD1.setup[6] = 0;
+  USBD1.setup[7] = 0;
+  usbStreamRequestsHook(&USBD1);
+}
+
+static void configured(void* arg)
+{
+  (void)arg;
+
+  chSysLockFromISR();
+  USBD1.state = USB_ACTIVE;
+  usbStreamConfigureHookI(&USBD1);
+  chSysUnlockFromISR();
+
+  if (sim_options.vr_decimation != 0)
+    vendorRequest(STREAM_REQ_VR_DECIMATION, sim_options.vr_decimation);
+  vendorRequest(STREAM_REQ_SELECT, sim_options.stream_mask);
+}
+
+static void transmitted(void* arg)
+{
+  (void)arg;
+
+  usbStreamTransmitted(&USBD1, USB_STREAM_EP);
+}
+
+simtime_t simUsbNext(void)
+{
+  return configure_time < transmitted_time ? configure_time : transmitted_time;
+}
+
+void simUsbRun(simtime_t t)
+{
+  if (t == configure_time)
+  {
+    configure_time = SIM_NEVER;
+    simRaiseIrq(STM32_USB1_LP_NUMBER, configured, NULL);
+  }
+  else
+  {
+    transmitted_time = SIM_NEVER;
+    simRaiseIrq(STM32_USB1_LP_NUMBER, transmitted, NULL);
+  }
+}
+
+void usbStart(USBDriver *usbp, const USBConfig *config)
+{
+  usbp->config = config;
+  usbp->state = USB_READY;
+}
+
+void usbConnectBus(USBDriver *usbp)
+{
+  (void)usbp;
+  configure_time = simNow() + USB_ENUMERATION_TIME;
+}
+
+void usbDisconnectBus(USBDriver *usbp)
+{
+  (void)usbp;
+}
+
+void usbStartTransmitI(USBDriver *usbp, usbep_t ep, const uint8_t *buf, size_t n)
+{
+  (void)usbp;
+
+  if (ep != USB_STREAM_EP)
+    return;
+
+  if (sim_options.stream_file != NULL)
+    fwrite(buf, 1, n, sim_options.stream_file);
+  transmitted_time = simNow() + ((n + USB_STREAM_PACKET_SIZE - 1) / USB_STREAM_PACKET_SIZE) * USB_PACKET_TIME;
+}
+
+/* Only the stream requests are sent, nothing is read back */
+void usbSetupTransfer(USBDriver *usbp, uint8_t *buf, size_t n, usbcallback_t endcb)
+{
+  (void)usbp;
+  (void)buf;
+  (void)n;
+  (void)endcb;
+}
+
+void sduObjectInit(SerialUSBDriver *sdup)
+{
+  sdup->config = NULL;
+}
+
+void sduStart(SerialUSBDriver *sdup, const SerialUSBConfig *config)
+{
+  sdup->config = config;
+}
+
+msg_t chnGetTimeout(SerialUSBDriver *sdup, sysinterval_t timeout)
+{
+  uint8_t c;
+
+  (void)sdup;
+
+  if (pty >= 0 && read(pty, &c, 1) == 1)
+    return c;
+  chThdSleep(timeout);
+  return MSG_TIMEOUT;
+}
+
+size_t chnWriteTimeout(SerialUSBDriver *sdup, const uint8_t *bp, size_t n, sysinterval_t timeout)
+{
+  (void)sdup;
+  (void)timeout;
+
+  if (pty >= 0 && write(pty, bp, n) < 0)
+    return 0;
+  return n;
+}
@@ -1,62 +1,618 @@
+#include <string.h>
 #include "hal.h"
 #include "spi_slave.h"
+#include "knock.h"
+#include "notify.h"
+#include "timebase.h"
+#include "regs.h"
+#include "capture.h"
+#include "evlog.h"
+#include "memhealth.h"
+#include "supervisor.h"
+#include "proto_frame.h"
 
-typedef uint8_t cmd_t;
+/*
+ * The reply of a transaction is loaded in the TX DMA beforehand.
+ * When NSS rises the command is applied and the DMA is armed again,
+ * the next transaction is served by the DMA only.
+ * In register file mode the reply is built from a snapshot refreshed
+ * by the SPI thread, which also reloads the armed frame while the bus is
+ * idle so a polled read is at most SPI_REFRESH_MS old.
+ */
 
-enum {
-  STATUS = 0u
-} cmd_enum;
+#define SPI_DMA_IRQ_MSK (STM32_DMA_CR_TCIE | STM32_DMA_CR_HTIE | STM32_DMA_CR_TEIE)
 
 static const SPIConfig spicfg = {
   false,
   NULL,
   PORT_SPI1_NSS,
   PAD_SPI1_NSS,
-  0,
-  0
+#if SPI_USE_TPIC8101
+  SPI_CR1_CPHA, // Mode 1, SI latched on the falling edge
+#else
+  0, // Mode 0
+#endif
+  SPI_CR2_DS_2 | SPI_CR2_DS_1 | SPI_CR2_DS_0 // 8 bits
 };
 
-cmd_t readCmd(uint8_t* buf, size_t len)
+#define SPECTRUM_FRAME_SIZE (2 + SPECTRUM_SIZE * 2 + 2) // Header, bins, CRC
+
+#if SPI_USE_TPIC8101
+static uint8_t rxbuf[SPI_FRAME_SIZE(SPI_REG_COUNT)]; // Longest write, command, every register and CRC
+#else
+/* Longest write, or a full spectrum frame clocked by the master */
+static uint8_t rxbuf[SPECTRUM_FRAME_SIZE > SPI_FRAME_SIZE(SPI_REG_COUNT) ?
+                     SPECTRUM_FRAME_SIZE : SPI_FRAME_SIZE(SPI_REG_COUNT)];
+#endif
+
+/*
+ * Prepares the next transaction, NSS must be high.
+ */
+CCM_FUNC static void armTransaction(const uint8_t* tx, size_t len)
+{
+  SPI_TypeDef *spi = SPID1.spi;
+
+  /* The TX FIFO still holds bytes loaded for the aborted frame,
+     only a peripheral reset flushes it. */
+  spi->CR1 &= ~SPI_CR1_SPE;
+  rccResetSPI1();
+  spi->CR1 = SPID1.config->cr1 & ~(SPI_CR1_MSTR | SPI_CR1_SSM | SPI_CR1_SSI); // Slave, hardware NSS
+  spi->CR2 = SPID1.config->cr2 | SPI_CR2_FRXTH | SPI_CR2_RXDMAEN;
+
+  /* No DMA interrupts, the transaction ends with NSS */
+  dmaStreamSetPeripheral(SPID1.dmarx, &spi->DR);
+  dmaStreamSetMemory0(SPID1.dmarx, rxbuf);
+  dmaStreamSetTransactionSize(SPID1.dmarx, sizeof(rxbuf));
+  dmaStreamSetMode(SPID1.dmarx, (SPID1.rxdmamode | STM32_DMA_CR_MINC) & ~SPI_DMA_IRQ_MSK);
+  dmaStreamEnable(SPID1.dmarx);
+
+  dmaStreamSetPeripheral(SPID1.dmatx, &spi->DR);
+  dmaStreamSetMemory0(SPID1.dmatx, tx);
+  dmaStreamSetTransactionSize(SPID1.dmatx, len);
+  dmaStreamSetMode(SPID1.dmatx, (SPID1.txdmamode | STM32_DMA_CR_MINC) & ~SPI_DMA_IRQ_MSK);
+  dmaStreamEnable(SPID1.dmatx);
+
+  spi->CR2 |= SPI_CR2_TXDMAEN; // Preloads the TX FIFO
+  spi->CR1 |= SPI_CR1_SPE;
+}
+
+/*
+ * Stops both streams, returns the number of bytes received.
+ */
+CCM_FUNC static size_t endTransaction(void)
+{
+  dmaStreamDisable(SPID1.dmatx);
+  dmaStreamDisable(SPID1.dmarx);
+  return sizeof(rxbuf) - dmaStreamGetTransactionSize(SPID1.dmarx);
+}
+
+#if SPI_USE_TPIC8101
+/*
+ * TPIC8101 emulation.
+ * SO returns the previous command, or in advanced mode the 10 bits
+ * integrator output latched by INT/HOLD (LINE_SAMPLE), low byte first.
+ * The prescaler has no use here, it is only echoed.
+ */
+
+/* Band-pass center frequencies, Hz */
+static const uint16_t tpic_freqs[64] = {
+  1220, 1260, 1310, 1350, 1400, 1450, 1510, 1570,
+  1630, 1710, 1780, 1870, 1960, 2070, 2180, 2310,
+  2460, 2540, 2620, 2710, 2810, 2920, 3030, 3150,
+  3280, 3430, 3590, 3760, 3950, 4160, 4390, 4660,
+  4950, 5120, 5290, 5480, 5680, 5900, 6120, 6370,
+  6640, 6940, 7270, 7630, 8020, 8460, 8950, 9500,
+  10120, 10460, 10830, 11220, 11650, 12100, 12600, 13140,
+  13720, 14360, 15070, 15840, 16710, 17670, 18760, 19980
+};
+
+/* Gains, KNOCK_UNITY_GAIN units */
+static const uint16_t tpic_gains[64] = {
+  2000, 1929, 1857, 1786, 1714, 1643, 1571, 1500,
+  1429, 1357, 1286, 1214, 1143, 1063, 1000, 944,
+  895, 850, 810, 773, 739, 708, 680, 654,
+  630, 607, 586, 567, 548, 500, 471, 444,
+  421, 400, 381, 364, 348, 333, 320, 308,
+  296, 286, 276, 267, 258, 250, 236, 222,
+  211, 200, 190, 182, 174, 167, 160, 154,
+  148, 143, 138, 133, 129, 125, 118, 111
+};
+
+/* Integrator time constants, us */
+static const uint16_t tpic_integrators[32] = {
+  40, 45, 50, 55, 60, 65, 70, 75,
+  80, 90, 100, 110, 120, 130, 140, 150,
+  160, 180, 200, 220, 240, 260, 280, 300,
+  320, 360, 400, 440, 480, 520, 560, 600
+};
+
+static uint8_t tpic_reply; // Loaded in the TX DMA
+static uint8_t tpic_last; // Previous command
+static bool tpic_advanced;
+static uint8_t tpic_byte; // Advanced mode, integrator byte sent next
+
+CCM_FUNC static uint8_t tpicReply(void)
+{
+  uint16_t val;
+
+  if (!tpic_advanced)
+    return tpic_last;
+
+  val = knockGetHeld() >> 6; // 10 bits
+  return tpic_byte == 0 ? val & 0xFF : val >> 8;
+}
+
+CCM_FUNC static void tpicCommand(uint8_t cmd)
+{
+  if ((cmd & 0xC0) == TPIC_CMD_FREQ)
+    settings.knock_freq = tpic_freqs[cmd & 0x3F];
+  else if ((cmd & 0xC0) == TPIC_CMD_GAIN)
+    settings.knock_gain = tpic_gains[cmd & 0x3F];
+  else if ((cmd & 0xE0) == TPIC_CMD_INTEGRATOR)
+    settings.knock_integrator = tpic_integrators[cmd & 0x1F];
+  else if ((cmd & 0xE0) == TPIC_CMD_PRESCALER)
+  {
+    if (cmd & 0x01) // SO disabled, Hi-Z
+      palSetLineMode(LINE_SPI1_MISO, PAL_MODE_INPUT);
+    else
+      palSetLineMode(LINE_SPI1_MISO, PAL_MODE_ALTERNATE(5) | PAL_STM32_OSPEED_HIGHEST);
+  }
+  else if ((cmd & 0xFE) == TPIC_CMD_CHANNEL)
+    knockSetSensor(cmd & 0x01);
+  else if (cmd == TPIC_CMD_ADVANCED)
+    tpic_advanced = true;
+
+  tpic_last = cmd;
+}
+
+/*
+ * Called on the falling edge of LINE_SAMPLE, the held value is loaded
+ * right away unless a transaction is running.
+ */
+void spiSlaveHoldI(void)
+{
+  if (palReadLine(LINE_SPI1_NSS) == PAL_LOW)
+    return;
+
+  endTransaction();
+  tpic_byte = 0;
+  tpic_reply = tpicReply();
+  armTransaction(&tpic_reply, 1);
+}
+
+/*
+ * End of transaction, only the last byte counts like the TPIC shift register.
+ */
+CCM_FUNC static void nss_cb(void *arg)
+{
+  size_t len;
+  (void)arg;
+
+  chSysLockFromISR();
+  len = endTransaction();
+  if (len > 0)
+    tpicCommand(rxbuf[len - 1]);
+  notifyClearI(NOTIFY_ALL); // Any transaction reads the result
+  if (tpic_advanced)
+    tpic_byte ^= 1;
+
+  tpic_reply = tpicReply();
+  armTransaction(&tpic_reply, 1);
+  chSysUnlockFromISR();
+}
+
+uint16_t spiSlaveGetCrcErrors(void)
+{
+  return 0; // Single byte commands, no CRC
+}
+
+void createSpiThreads(void)
 {
+  spiStart(&SPID1, &spicfg); // Allocates the DMA streams
+
+  chSysLock();
+  tpic_reply = tpicReply();
+  armTransaction(&tpic_reply, 1);
+  chSysUnlock();
 
+  palEnableLineEvent(LINE_SPI1_NSS, PAL_EVENT_MODE_RISING_EDGE);
+  palSetLineCallback(LINE_SPI1_NSS, nss_cb, NULL);
 }
 
-void prepareReply(uint8_t* buf, size_t len)
+#else
+/*
+ * Register file mode, every frame ends with a CRC computed by the CRC unit.
+ * Replies start with an acknowledge of the previous command, a command with
+ * a bad CRC is not applied and has to be sent again.
+ */
+static const CRCConfig crccfg = {
+  .poly_size         = 16, // CRC-16/CCITT-FALSE
+  .poly              = 0x1021,
+  .initial_val       = 0xFFFF,
+  .final_val         = 0x0000,
+  .reflect_data      = false,
+  .reflect_remainder = false
+};
+
+static uint16_t regs[SPI_REG_COUNT];
+static uint8_t snapshot[SPI_REG_COUNT * 2];
+static uint8_t txbuf[SPI_FRAME_SIZE(SPI_REG_COUNT)];
+static uint8_t read_addr = SPI_REG_STATUS;
+static uint8_t read_count = SPI_REG_COUNT;
+static uint16_t crc_errors;
+static uint8_t last_ack;
+static uint16_t frame_events; // Events register value in the armed frame
+static size_t frame_events_end; // Bytes to clock out before it is read, 0 if not sent
+static uint32_t nss_time; // Previous NSS rising edge, local us
+
+/*
+ * Spectrum stream double buffer, the knock thread computes the magnitudes
+ * in the back buffer and the DMA sends the front one as is. The header and
+ * CRC are stored around the streamed range, over bins that are not sent.
+ */
+#define SPECTRUM_NONE 0xFF
+
+static uint16_t spectrum[2][1 + SPECTRUM_SIZE + 1]; // Header, bins, CRC
+static uint8_t spectrum_back; // Filled by the knock thread
+static uint8_t spectrum_armed = SPECTRUM_NONE; // Loaded in the DMA
+static bool spectrum_ready; // The front buffer holds a frame
+static const uint8_t* spectrum_frame; // Front buffer frame
+static size_t spectrum_len;
+static uint8_t spectrum_seq;
+
+/*
+ * Capture dump, the frame is built when armed and the cursor moves once
+ * it was clocked out in full.
+ */
+#define CAPTURE_FRAME_SIZE(words) (4 + (words) * 2 + 2) // Header, words, CRC
+
+static uint16_t capture_frame[CAPTURE_FRAME_SIZE(CAPTURE_SPI_WORDS) / 2];
+static size_t capture_len; // Armed capture frame, 0 if none
+static uint16_t capture_seq;
+static uint16_t capture_offset;
+static uint16_t capture_size;
+static uint16_t capture_words; // In the armed frame
+
+/*
+ * Only used with the system locked, the unit holds a running value.
+ */
+static uint16_t frameCrc(const uint8_t* buf, size_t len)
 {
+  crcResetI(&CRCD1);
+  return (uint16_t)crcCalc(&CRCD1, len, buf);
+}
 
+uint16_t spiSlaveGetCrcErrors(void)
+{
+  return crc_errors;
 }
 
-static uint8_t rxbuf[8], txbuf[8];
-static THD_WORKING_AREA(waSpiThread, 128);
+static void storeRegisters(uint8_t* buf, const uint16_t* r)
+{
+  uint16_t i;
+
+  for (i = 0; i < SPI_REG_COUNT; i++)
+  {
+    buf[i * 2] = r[i] >> 8;
+    buf[i * 2 + 1] = r[i] & 0xFF;
+  }
+}
+
+/*
+ * Checks and applies a command frame, returns its acknowledge.
+ */
+CCM_FUNC static uint8_t processCommand(const uint8_t* buf, size_t len)
+{
+  uint8_t addr, count;
+  size_t i;
+
+  if (len == 0 || buf[0] == SPI_CMD_NONE)
+    return SPI_ACK_SYNC;
+
+  if (len < 3 || frameCrc(buf, len - 2) != (((uint16_t)buf[len - 2] << 8) | buf[len - 1]))
+  {
+    crc_errors++;
+    evlogI(EVLOG_FAULT, EVLOG_FAULT_SPI_CRC, crc_errors);
+    return SPI_ACK_SYNC | SPI_ACK_CRC_ERROR;
+  }
+  len -= 2;
+
+  addr = buf[0] & SPI_CMD_ADDR_MSK;
+  if (buf[0] == SPI_ADDR_SPECTRUM || buf[0] == SPI_ADDR_CAPTURE)
+  {
+    read_addr = addr;
+    return SPI_ACK_SYNC | SPI_ACK_OK;
+  }
+
+  if ((buf[0] & SPI_CMD_WRITE) == 0)
+  {
+    count = len > 1 ? buf[1] : 0;
+    if (count == 0 && addr < SPI_REG_COUNT)
+      count = SPI_REG_COUNT - addr; // Up to the end
+    if (addr >= SPI_REG_COUNT || count > SPI_REG_COUNT - addr)
+      return SPI_ACK_SYNC | SPI_ACK_BAD_CMD;
+
+    read_addr = addr;
+    read_count = count;
+    return SPI_ACK_SYNC | SPI_ACK_OK;
+  }
+
+  count = (len - 1) / 2;
+  if (addr == SPI_REG_TIME_SYNC && len == 5)
+  {
+    timebaseSyncI(((uint32_t)buf[1] << 24) | ((uint32_t)buf[2] << 16) |
+                  ((uint32_t)buf[3] << 8) | buf[4], nss_time);
+    return SPI_ACK_SYNC | SPI_ACK_OK;
+  }
+
+  if ((len - 1) % 2 != 0 || !regsWritable(addr, count))
+    return SPI_ACK_SYNC | SPI_ACK_BAD_CMD; // Nothing written, all or nothing
+
+  for (i = 1; i < len; i += 2)
+    regsWrite(addr++, ((uint16_t)buf[i] << 8) | buf[i + 1]);
+
+  return SPI_ACK_SYNC | SPI_ACK_OK;
+}
+
+/*
+ * Acknowledge, registers from the read address, CRC of both.
+ */
+CCM_FUNC static size_t buildFrame(uint8_t ack)
+{
+  const size_t len = 1 + read_count * 2;
+  uint16_t crc;
+
+  txbuf[0] = ack;
+  memcpy(&txbuf[1], &snapshot[read_addr * 2], read_count * 2);
+  crc = frameCrc(txbuf, len);
+  txbuf[len] = crc >> 8;
+  txbuf[len + 1] = crc & 0xFF;
+
+  frame_events_end = 0;
+  if (read_addr <= SPI_REG_EVENTS && SPI_REG_EVENTS < read_addr + read_count)
+  {
+    frame_events = ((uint16_t)snapshot[SPI_REG_EVENTS * 2] << 8) | snapshot[SPI_REG_EVENTS * 2 + 1];
+    frame_events_end = 1 + (SPI_REG_EVENTS - read_addr + 1) * 2;
+  }
+
+  return len + 2;
+}
+
+/*
+ * Next words of the frozen capture, the words are stored as they are
+ * after the 4 bytes header.
+ */
+CCM_FUNC static size_t buildCaptureFrame(void)
+{
+  uint8_t* frame = (uint8_t*)capture_frame;
+  uint16_t seq, offset = SPI_CAPTURE_NONE;
+  size_t len;
+  uint16_t crc;
+
+  capture_words = 0;
+  if (captureImageI(&seq, &capture_size))
+  {
+    if (seq != capture_seq)
+    {
+      capture_seq = seq;
+      capture_offset = 0;
+    }
+    offset = capture_offset;
+    capture_words = capture_size - offset > CAPTURE_SPI_WORDS ? CAPTURE_SPI_WORDS : capture_size - offset;
+    captureRead(offset, &capture_frame[2], capture_words);
+  }
+
+  frame[0] = SPI_CAPTURE_SYNC;
+  frame[1] = capture_seq & 0xFF;
+  frame[2] = offset >> 8;
+  frame[3] = offset & 0xFF;
+  len = 4 + capture_words * 2;
+  crc = frameCrc(frame, len);
+  frame[len] = crc >> 8;
+  frame[len + 1] = crc & 0xFF;
+
+  return len + 2;
+}
+
+/*
+ * Loads the reply of the next transaction, the capture dump, or the
+ * latest spectrum in stream mode once one was published.
+ */
+CCM_FUNC static void armReply(void)
+{
+  capture_len = 0;
+  if (read_addr == SPI_ADDR_CAPTURE)
+  {
+    spectrum_armed = SPECTRUM_NONE;
+    frame_events_end = 0;
+    capture_len = buildCaptureFrame();
+    armTransaction((uint8_t*)capture_frame, capture_len);
+    return;
+  }
+
+  if (read_addr == SPI_ADDR_SPECTRUM && spectrum_ready)
+  {
+    spectrum_armed = spectrum_back ^ 1;
+    frame_events_end = 0;
+    armTransaction(spectrum_frame, spectrum_len);
+    return;
+  }
+
+  spectrum_armed = SPECTRUM_NONE;
+  armTransaction(txbuf, buildFrame(last_ack));
+}
+
+/*
+ * End of transaction.
+ */
+CCM_FUNC static void nss_cb(void *arg)
+{
+  uint8_t ack;
+  size_t len;
+  uint32_t now;
+  (void)arg;
+
+  chSysLockFromISR();
+  now = timebaseNowI();
+  len = endTransaction();
+  if (frame_events_end != 0 && len >= frame_events_end)
+    notifyClearI(frame_events);
+  if (capture_len != 0 && capture_words != 0 && len >= capture_len)
+  {
+    capture_offset += capture_words;
+    if (capture_offset >= capture_size)
+      captureDoneI(capture_seq);
+  }
+  ack = processCommand(rxbuf, len);
+  nss_time = now;
+  last_ack = ack;
+  armReply();
+  chSysUnlockFromISR();
+}
+
+/*
+ * No transaction running or about to be processed, the armed frame can
+ * be replaced.
+ */
+CCM_FUNC static bool busIdleI(void)
+{
+  return palReadLine(LINE_SPI1_NSS) == PAL_HIGH && (EXTI->PR & (1U << PAD_SPI1_NSS)) == 0;
+}
+
+/*
+ * Loads a frame with the latest results before the data ready line is
+ * asserted, unless a transaction is running or about to be processed.
+ */
+CCM_FUNC void spiSlaveRefreshI(void)
+{
+  uint16_t r[SPI_REG_COUNT];
+
+  regsRead(r);
+  regsReadLocked(r);
+  storeRegisters(snapshot, r);
+
+  if (SPID1.state != SPI_READY)
+    return; // Not started yet
+
+  if (!busIdleI())
+    return; // The next frame is built from this snapshot
+
+  if (read_addr == SPI_ADDR_SPECTRUM)
+    return; // Loaded when published
+
+  endTransaction();
+  armReply();
+}
+
+/*
+ * Bins to compute the spectrum of the sensor into, NULL when it is not
+ * streamed or the back buffer is still being sent. Knock thread only.
+ */
+uint16_t* spiSlaveSpectrumBuffer(uint8_t sensor)
+{
+  uint16_t* bins = NULL;
+
+  chSysLock();
+  if (read_addr == SPI_ADDR_SPECTRUM && sensor == settings.spectrum_sensor)
+  {
+    spectrum_seq++; // Dropped frames leave a gap
+    if (spectrum_armed != spectrum_back)
+      bins = &spectrum[spectrum_back][1];
+  }
+  chSysUnlock();
+
+  return bins;
+}
+
+/*
+ * Makes the back buffer the front one, it is sent right away unless a
+ * transaction is running. The back buffer belongs to the knock thread,
+ * only the swap is done with the system locked.
+ */
+void spiSlaveSpectrumPublish(uint8_t sensor)
+{
+  uint16_t* buf = spectrum[spectrum_back];
+  uint16_t first = settings.spectrum_first;
+  uint16_t count = settings.spectrum_count;
+  uint8_t* frame;
+  size_t len;
+  uint16_t crc;
+
+  if (first >= SPECTRUM_SIZE)
+    first = 0;
+  if (count == 0 || count > SPECTRUM_SIZE - first)
+    count = SPECTRUM_SIZE - first;
+
+  /* The word before the range becomes the header */
+  frame = (uint8_t*)&buf[first];
+  len = 2 + count * 2;
+  frame[0] = SPI_SPECTRUM_SYNC | sensor;
+  frame[1] = spectrum_seq; // Only changed by the knock thread
+
+  /* Same CRC as the unit, which is shared with the NSS callback */
+  crc = protoCrc(frame, len);
+  frame[len] = crc >> 8;
+  frame[len + 1] = crc & 0xFF;
+
+  chSysLock();
+  spectrum_frame = frame;
+  spectrum_len = len + 2;
+  spectrum_ready = true;
+  spectrum_back ^= 1;
+
+  if (read_addr == SPI_ADDR_SPECTRUM && busIdleI())
+  {
+    endTransaction();
+    armReply();
+  }
+  chSysUnlock();
+}
+
+static THD_WORKING_AREA(waSpiThread, 256);
 static THD_FUNCTION(SpiThread, arg)
 {
   (void) arg;
+  chRegSetThreadName("SPI");
+
   while (TRUE)
   {
-    spiAcquireBus(&SPID1);
-    spiReceive(&SPID1, 2, rxbuf);
-    switch (readCmd(rxbuf, 2))
+    supervisorHeartbeat(SUPERVISOR_SPI);
+    regsRead(regs);
+
+    /* The armed frame is a copy, it is rebuilt from the new snapshot
+       unless the master is clocking it out */
+    chSysLock();
+    regsReadLocked(regs);
+    storeRegisters(snapshot, regs);
+    if (read_addr < SPI_REG_COUNT && busIdleI())
     {
-      default:
-        break;
+      endTransaction();
+      armReply();
     }
+    chSysUnlock();
 
-    prepareReply(rxbuf, 8);
-    spiSend(&SPID1, 8, txbuf);
-
-    spiReleaseBus(&SPID1);
-    chThdSleepMilliseconds(10);
+    chThdSleepMilliseconds(SPI_REFRESH_MS);
   }
 }
 
 void createSpiThreads(void)
 {
-  spiStart(&SPID1, &spicfg);
-  SPID1.spi->CR1 &= ~SPI_CR1_SPE; // Disable
-  SPID1.spi->CR1 = SPID1.config->cr1 & ~(SPI_CR1_MSTR | SPI_CR1_SSM | SPI_CR1_SSI); // Remove the SPI master stuff
-  SPID1.spi->CR2 = SPI_CR2_FRXTH | SPI_CR2_RXDMAEN | SPI_CR2_TXDMAEN; // Remove the SPI slave select stuff
-  SPID1.spi->CR2 |= SPI_CR2_RXNEIE | SPI_CR2_ERRIE; // enable receive, error irq
-  SPID1.spi->CR1 |= SPI_CR1_SPE; // Enable
+  crcStart(&CRCD1, &crccfg);
+  spiStart(&SPID1, &spicfg); // Allocates the DMA streams
+
+  regsRead(regs);
+
+  chSysLock();
+  regsReadLocked(regs);
+  storeRegisters(snapshot, regs);
+  last_ack = SPI_ACK_SYNC;
+  armReply();
+  chSysUnlock();
+
+  palEnableLineEvent(LINE_SPI1_NSS, PAL_EVENT_MODE_RISING_EDGE);
+  palSetLineCallback(LINE_SPI1_NSS, nss_cb, NULL);
 
-  chThdCreateStatic(waSpiThread, sizeof(waSpiThread), NORMALPRIO, SpiThread, NULL);
+  memhealthCreateStatic(waSpiThread, NORMALPRIO, SpiThread, NULL);
+  supervisorWatch(SUPERVISOR_SPI, SPI_REFRESH_MS * 1000);
 }
+#endif
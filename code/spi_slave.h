@@ -1,7 +1,110 @@
 #ifndef _SPI_SLAVE_H_
 #define _SPI_SLAVE_H_
 
+#include "settings.h"
 
+/*
+ * Replaces the register file with the TPIC8101/HIP9011 command set,
+ * one command byte per transaction.
+ */
+#if !defined(SPI_USE_TPIC8101)
+#define SPI_USE_TPIC8101 FALSE
+#endif
+
+/*
+ * SPI1 slave, register file of 16 bits registers sent MSB first.
+ * Every transaction returns the selected registers, so the live values
+ * can be read with a single chip select.
+ * Master frame, applied when NSS rises:
+ * 0x00-0x7F, count: read address and register count of the next replies,
+ *                   a null count reads up to the end.
+ * 0x80-0xFF, data:  write, the values are stored from the address on.
+ *                   Only the settings and TIME_SYNC are writable.
+ * 0xFF alone:       no command.
+ * Spectrum stream: reading SPI_ADDR_SPECTRUM makes every reply the
+ * latest knock spectrum of settings.spectrum_sensor, one per frame:
+ * SPI_SPECTRUM_SYNC | sensor, sequence, bins (16 bits, LSB first), CRC.
+ * The sequence counts knock frames, a gap is a frame that was dropped.
+ * The master frame follows the usual rules, 0xFF first sends no command.
+ * Capture dump: reading SPI_ADDR_CAPTURE makes every reply the next
+ * CAPTURE_SPI_WORDS of the frozen capture image, see capture_format.h:
+ * SPI_CAPTURE_SYNC, capture sequence, image offset (MSB first), words
+ * (LSB first), CRC. A frame clocked out in full moves to the next words,
+ * the last one rearms the capture. The offset is 0xFFFF with no words
+ * while there is nothing to dump.
+ * Any other read goes back to the register file.
+ * Time sync: the ECU writes to TIME_SYNC its time of the NSS rising edge
+ * that ended the previous transaction, the time registers are then
+ * given in the ECU timebase. Reading TIME_SYNC returns the ECU time of
+ * the snapshot. Values of 32 bits are sent high register first.
+ * Slave frame: acknowledge of the previous command, then the registers.
+ * Both frames end with a CRC-16/CCITT (MSB first) of the previous bytes.
+ */
+
+#define SPI_CMD_WRITE 0x80
+#define SPI_CMD_ADDR_MSK 0x7F
+#define SPI_CMD_NONE 0xFF
+
+#define SPI_ACK_SYNC 0xA0 // Always set, tells a reply from a stuck line
+#define SPI_ACK_OK (1 << 0) // Previous command applied
+#define SPI_ACK_CRC_ERROR (1 << 1) // Previous command corrupted, send it again
+#define SPI_ACK_BAD_CMD (1 << 2) // Previous command rejected, bad address or length
+
+#define SPI_ADDR_SPECTRUM 0x7F // Read address selecting the spectrum stream
+#define SPI_SPECTRUM_SYNC 0xC0 // First byte of a spectrum frame, ORed with the sensor
+#define SPI_ADDR_CAPTURE 0x7E // Read address selecting the capture dump
+#define SPI_CAPTURE_SYNC 0xD0 // First byte of a capture frame
+#define SPI_CAPTURE_NONE 0xFFFF // Offset when no capture is frozen
+
+#define SPI_FRAME_SIZE(regs) (1 + (regs) * 2 + 2) // Command or acknowledge, registers, CRC
 
+#define SPI_REG_STATUS 0x00
+#define SPI_REG_KNOCK 0x01 // One per sensor, 4 max
+#define SPI_REG_KNOCK_CYL 0x05 // Last window peak of each cylinder, 8 max
+#define SPI_REG_RPM 0x0D
+#define SPI_REG_VR_INTERVAL 0x0E // VR1-3, VR_TIM_FREQ ticks
+#define SPI_REG_VR_THRESHOLD 0x11 // VR1-3, ADC raw value from the zero
+#define SPI_REG_CRC_ERRORS 0x14 // Master frames rejected for their CRC
+#define SPI_REG_EVENTS 0x15 // Pending NOTIFY_ events, cleared once clocked out
+#define SPI_REG_INT_LATENCY 0x16 // Data ready assertion latency, us, last
+#define SPI_REG_INT_LATENCY_MAX 0x17 // Data ready assertion latency, us, worst
+#define SPI_REG_TIME_DRIFT 0x18 // ECU clock drift, 0.01 ppm, signed
+#define SPI_REG_TIME_SYNC 0x19 // 2 registers, ECU time in us, see below
+#define SPI_REG_KNOCK_TIME 0x1B // 2 registers, ECU time the last knock window closed, us
+#define SPI_REG_TOOTH_TIME 0x1D // VR1-3, 2 registers each, ECU time of the last tooth, us
+#define SPI_REG_CAPTURE 0x23 // CAPTURE_ state, captures count in the high byte
+#define SPI_REG_CPU_LOAD 0x24 // Everything but idle, 0.1 %, last second
+#define SPI_REG_CPU_LOAD_AVG 0x25 // Same, last 10 seconds
+#define SPI_REG_CPU_LOAD_PEAK 0x26 // Same, worst second since reset
+#define SPI_REG_STACK_MIN 0x27 // Smallest stack margin left of any thread, bytes
+#define SPI_REG_SETTINGS 0x28 // settings_t fields, in order
+#define SPI_REG_COUNT (SPI_REG_SETTINGS + SETTINGS_COUNT)
+
+#define SPI_STATUS_SAMPLING (1 << 0) // LINE_SAMPLE is high
+#define SPI_STATUS_VR1_VALID (1 << 1)
+#define SPI_STATUS_VR2_VALID (1 << 2)
+#define SPI_STATUS_VR3_VALID (1 << 3)
+#define SPI_STATUS_TIME_SYNC (1 << 4) // Timestamps are in the ECU timebase
+#define SPI_STATUS_MEM_LOW (1 << 5) // A stack is nearly full or samples were dropped, see memhealth.h
+#define SPI_STATUS_WDG_RESET (1 << 6) // The last reset was done by the watchdog, see supervisor.h
+
+#define SPI_REFRESH_MS 1 // Register file snapshot period
+
+/* TPIC8101 commands */
+#define TPIC_CMD_FREQ 0x00 // 00FFFFFF, band-pass center frequency
+#define TPIC_CMD_PRESCALER 0x40 // 010PPPPS, oscillator prescaler and SO disable
+#define TPIC_CMD_ADVANCED 0x71 // Integrator output on SO
+#define TPIC_CMD_GAIN 0x80 // 10GGGGGG
+#define TPIC_CMD_INTEGRATOR 0xC0 // 110IIIII, integrator time constant
+#define TPIC_CMD_CHANNEL 0xE0 // 1110000C
+
+uint16_t spiSlaveGetCrcErrors(void);
+#if SPI_USE_TPIC8101
+void spiSlaveHoldI(void);
+#else
+void spiSlaveRefreshI(void);
+uint16_t* spiSlaveSpectrumBuffer(uint8_t sensor);
+void spiSlaveSpectrumPublish(uint8_t sensor);
+#endif
 
 #endif
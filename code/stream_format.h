@@ -0,0 +1,112 @@
+#ifndef STREAM_FORMAT_H_
+#define STREAM_FORMAT_H_
+
+#include <stdint.h>
+
+/*
+ * USB bulk stream format, shared with the host tools.
+ * The stream is a sequence of frames, little endian, transfers may cut
+ * frames anywhere. A receiver out of sync looks for the next sync word
+ * and checks the sequence of each type for lost frames.
+ */
+
+#define STREAM_SYNC 0x4B56 // "VK" on the wire
+
+#define STREAM_KNOCK_RAW 0 // Knock ADC samples, sensors interleaved
+#define STREAM_VR_RAW 1 // VR ADC samples, decimated, channel is the VR
+#define STREAM_SPECTRUM 2 // Knock spectrum, channel is the sensor
+#define STREAM_CAPTURE 3 // Capture image offset then words, channel is the capture sequence
+#define STREAM_EVLOG 4 // Event log block, see evlog_format.h
+#define STREAM_LOAD 5 // CPU load, stream_load_t rows, the total first
+#define STREAM_LATENCY 6 // Latency histogram, see latency_format.h, channel is the path
+#define STREAM_TRACE 7 // Trace records, see trace_format.h
+#define STREAM_MEMORY 8 // Stacks, samples pool and mailboxes, stream_memory_t rows
+#define STREAM_FAULT 9 // Record of the last reset, see supervisor_format.h, sent once
+#define STREAM_BENCH 10 // DSP kernels benchmark, stream_bench_t rows, sent once
+#define STREAM_TYPES 11
+
+#define STREAM_MSK(type) (1 << (type))
+
+/* Vendor requests to the stream interface */
+#define STREAM_REQ_SELECT 0x01 // wValue: STREAM_MSK of the enabled streams, 0 stops
+#define STREAM_REQ_VR_DECIMATION 0x02 // wValue: one VR sample every wValue sent
+#define STREAM_REQ_STATS 0x03 // Returns stream_stats_t
+#define STREAM_REQ_REPLAY 0x04 // wValue: STREAM_REPLAY_MSK of the replayed sources, 0 stops
+#define STREAM_REQ_REPLAY_STATS 0x05 // Returns stream_replay_stats_t
+
+/*
+ * Replay, builds with USE_REPLAY=yes: the host sends frames to the OUT
+ * endpoint of the stream interface in place of the ADC ones, a header
+ * then its samples as two transfers. The header is a STREAM_KNOCK_RAW
+ * or STREAM_VR_RAW one with the count of a full ADC frame, see replay.c.
+ */
+#define STREAM_REPLAY_KNOCK 0
+#define STREAM_REPLAY_VR1 1 // To 3
+#define STREAM_REPLAY_SOURCES 4
+#define STREAM_REPLAY_MSK(source) (1 << (source))
+
+typedef struct {
+  uint16_t sync;
+  uint8_t type;
+  uint8_t channel;
+  uint16_t seq; // Per type, counts dropped frames too
+  uint16_t count; // 16 bits words following the header
+  uint32_t time; // Local timebase us, end of the samples
+} __attribute__((packed)) stream_header_t;
+#define STREAM_HEADER_SIZE 12 // sizeof(stream_header_t), for the preprocessor
+
+typedef struct {
+  uint32_t frames; // Frames queued
+  uint32_t dropped; // Frames lost for lack of buffer space
+  uint32_t bytes; // Bytes handed to the USB driver
+  uint32_t transfers;
+} __attribute__((packed)) stream_stats_t;
+
+typedef struct {
+  uint32_t frames; // Frames handed to the processing threads
+  uint32_t rejected; // Transfers that were not a header of a replayed source or its samples
+  uint32_t dropped; // Frames the samples pool or the mailbox had no room for
+} __attribute__((packed)) stream_replay_stats_t;
+
+/* STREAM_LOAD row, loads in 0.1 % */
+#define STREAM_LOAD_TOTAL 0xFFFF // Everything but idle
+#define STREAM_LOAD_OTHER 0xFFFE // Contexts past the accounted ones
+#define STREAM_LOAD_IRQ 0x8000 // ORed with the exception number, threads are 0-0x7FFF
+
+typedef struct {
+  uint16_t id;
+  uint16_t load; // Last second
+  uint16_t average; // Last 10 seconds
+  uint16_t peak; // Since reset
+  char name[8]; // Thread name, null padded, empty for interrupts
+} __attribute__((packed)) stream_load_t;
+
+/* STREAM_MEMORY row, stacks in bytes, the pool and mailboxes in messages */
+#define STREAM_MEMORY_STACK 0 // Thread or exception stack, used is the peak
+#define STREAM_MEMORY_POOL 1 // Samples messages
+#define STREAM_MEMORY_MAILBOX 2 // Samples mailbox of a thread
+
+typedef struct {
+  uint16_t kind;
+  uint16_t size;
+  uint16_t used;
+  uint16_t peak;
+  uint16_t failures; // Samples dropped because it was full
+  char name[8]; // Null padded
+} __attribute__((packed)) stream_memory_t;
+
+/* STREAM_BENCH row, see dspbench.c */
+#define STREAM_BENCH_CYCLES 0 // Target, DWT cycles
+#define STREAM_BENCH_NS 1 // Hosted build
+
+typedef struct {
+  char name[12]; // Kernel, null padded
+  uint8_t variant; // KNOCK_DSP
+  uint8_t unit;
+  uint16_t repeats;
+  uint32_t calls; // Over all the repeats
+  uint32_t best; // Fastest repeat
+  uint32_t total;
+} __attribute__((packed)) stream_bench_t;
+
+#endif
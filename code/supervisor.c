@@ -0,0 +1,199 @@
+#include <stddef.h>
+#include <string.h>
+#include "hal.h"
+#include "supervisor.h"
+#include "usb_stream.h"
+
+/*
+ * The record lives in the no-init RAM section, crt1 leaves it alone so a
+ * watchdog reset keeps it. It is only trusted with its magic and check,
+ * and started again at power up.
+ */
+
+/* Longest time between heartbeats of each thread, ms */
+static volatile uint16_t deadlines[SUPERVISOR_THREADS];
+
+static supervisor_fault_t record __attribute__((section(".ram0"), aligned(4)));
+static uint16_t last[sizeof(supervisor_fault_t) / 2]; // Read at boot, sent as words
+static bool watchdog_reset;
+static volatile systime_t beats[SUPERVISOR_THREADS];
+static uint8_t watched; // Mask of the ids
+static uint8_t suspended; // Watched ids not checked for now
+static bool stalled;
+static bool sent; // The record went on the stream
+
+static uint32_t checkOf(const supervisor_fault_t* f)
+{
+  uint32_t w[sizeof(supervisor_fault_t) / 4];
+  uint32_t check = 0;
+  size_t i;
+
+  memcpy(w, f, sizeof(w));
+  for (i = 0; i < offsetof(supervisor_fault_t, check) / 4; i++)
+    check ^= w[i];
+  return ~check;
+}
+
+static void storeRecord(void)
+{
+  record.magic = SUPERVISOR_MAGIC;
+  record.check = checkOf(&record);
+}
+
+/*
+ * Reads back the record of the previous reset, before the watchdog starts.
+ */
+void supervisorInit(void)
+{
+  const uint32_t csr = RCC->CSR;
+
+  if ((csr & RCC_CSR_PORRSTF) || record.magic != SUPERVISOR_MAGIC ||
+      record.check != checkOf(&record))
+  {
+    memset(&record, 0, sizeof(record));
+    record.thread = SUPERVISOR_NONE;
+  }
+
+  watchdog_reset = (csr & RCC_CSR_IWDGRSTF) != 0;
+  if (watchdog_reset)
+  {
+    /* No record, the supervisor itself did not run */
+    if (record.cause != SUPERVISOR_CAUSE_STALL)
+    {
+      record.cause = SUPERVISOR_CAUSE_WATCHDOG;
+      record.thread = SUPERVISOR_NONE;
+      record.late = 0;
+      record.uptime = 0;
+    }
+    record.resets++;
+  }
+  else
+  {
+    record.cause = SUPERVISOR_CAUSE_NONE;
+  }
+  memcpy(last, &record, sizeof(last));
+
+  /* Armed for the next fault */
+  record.cause = SUPERVISOR_CAUSE_NONE;
+  storeRecord();
+  RCC->CSR |= RCC_CSR_RMVF;
+}
+
+/*
+ * Starts watching a thread that beats once per period, its first deadline
+ * starts now.
+ */
+void supervisorWatch(uint8_t id, uint32_t period_us)
+{
+  supervisorSetPeriod(id, period_us);
+  beats[id] = chVTGetSystemTimeX();
+  chSysLock();
+  watched |= 1 << id;
+  chSysUnlock();
+}
+
+/*
+ * New heartbeat period, when the frame rate of the thread changes.
+ */
+void supervisorSetPeriod(uint8_t id, uint32_t period_us)
+{
+  uint32_t deadline = ((uint64_t)period_us * SUPERVISOR_LATE_FRAMES + 999) / 1000;
+
+  if (deadline < SUPERVISOR_DEADLINE_MS)
+    deadline = SUPERVISOR_DEADLINE_MS;
+  if (deadline > 0xFFFF)
+    deadline = 0xFFFF;
+  deadlines[id] = deadline;
+}
+
+/*
+ * Stops checking a watched thread until supervisorResumeI(), for the
+ * sources that stop delivering frames on purpose.
+ */
+void supervisorSuspendI(uint8_t id)
+{
+  if (watched & (1 << id))
+  {
+    watched &= ~(1 << id);
+    suspended |= 1 << id;
+  }
+}
+
+/*
+ * Checks a suspended thread again, its deadline starts now.
+ */
+void supervisorResumeI(uint8_t id)
+{
+  if (suspended & (1 << id))
+  {
+    beats[id] = chVTGetSystemTimeX();
+    suspended &= ~(1 << id);
+    watched |= 1 << id;
+  }
+}
+
+CCM_FUNC void supervisorHeartbeat(uint8_t id)
+{
+  beats[id] = chVTGetSystemTimeX();
+}
+
+/*
+ * Called by the watchdog thread, the IWDG is fed only when every watched
+ * thread is on time. The most overdue thread is recorded once, the board
+ * then resets within the IWDG deadline.
+ */
+bool supervisorCheck(void)
+{
+  const systime_t now = chVTGetSystemTimeX();
+  uint32_t late, worst = 0;
+  uint8_t i, id = SUPERVISOR_NONE;
+
+  if (stalled)
+    return false;
+
+  for (i = 0; i < SUPERVISOR_THREADS; i++)
+  {
+    if (!(watched & (1 << i)))
+      continue;
+    late = chTimeI2MS(chTimeDiffX(beats[i], now));
+    if (late > deadlines[i] && late > worst)
+    {
+      worst = late;
+      id = i;
+    }
+  }
+
+  if (id == SUPERVISOR_NONE)
+    return true;
+
+  record.cause = SUPERVISOR_CAUSE_STALL;
+  record.thread = id;
+  record.late = worst;
+  record.uptime = chTimeI2MS(now);
+  storeRecord();
+  stalled = true;
+  return false;
+}
+
+/*
+ * The last reset was done by the watchdog.
+ */
+bool supervisorWasReset(void)
+{
+  return watchdog_reset;
+}
+
+/*
+ * Sends the record of the last reset once the stream is enabled, called
+ * by the monitor thread.
+ */
+void supervisorUpdate(void)
+{
+  if (!usbStreamEnabled(STREAM_FAULT))
+  {
+    sent = false;
+    return;
+  }
+  if (!sent)
+    sent = usbStreamWrite(STREAM_FAULT, 0, last, sizeof(last) / 2);
+}
@@ -0,0 +1,32 @@
+#ifndef SUPERVISOR_H_
+#define SUPERVISOR_H_
+
+#include "ch.h"
+#include "supervisor_format.h"
+
+/*
+ * Watchdog supervisor. Each watched thread calls supervisorHeartbeat()
+ * from its loop, the watchdog thread only feeds the IWDG while every one
+ * of them did within its deadline. Otherwise a fault record is written to
+ * no-init RAM and the IWDG resets the board, the record is read back on
+ * the next start.
+ * The deadline of a thread is SUPERVISOR_LATE_FRAMES of its frame period,
+ * a thread whose frames legitimately stop, as replayed ones, is suspended.
+ */
+
+#define SUPERVISOR_PERIOD_MS 100 // Checks, below the IWDG deadline
+#define SUPERVISOR_LATE_FRAMES 8 // Frame periods without a heartbeat before a thread is stalled
+#define SUPERVISOR_DEADLINE_MS 20 // Shortest deadline, scheduling jitter
+#define SUPERVISOR_MAGIC 0x53555056 // "SUPV"
+
+void supervisorInit(void);
+void supervisorWatch(uint8_t id, uint32_t period_us);
+void supervisorSetPeriod(uint8_t id, uint32_t period_us);
+void supervisorSuspendI(uint8_t id);
+void supervisorResumeI(uint8_t id);
+void supervisorHeartbeat(uint8_t id);
+bool supervisorCheck(void);
+bool supervisorWasReset(void);
+void supervisorUpdate(void);
+
+#endif
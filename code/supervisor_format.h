@@ -0,0 +1,34 @@
+#ifndef SUPERVISOR_FORMAT_H_
+#define SUPERVISOR_FORMAT_H_
+
+#include <stdint.h>
+
+/*
+ * Record of the last watchdog reset, shared with the host tools.
+ * Sent as a STREAM_FAULT frame.
+ */
+
+#define SUPERVISOR_KNOCK 0 // Knock DSP thread
+#define SUPERVISOR_KNOCK_OUTPUT 1 // Knock integrator thread
+#define SUPERVISOR_VR1 2 // VR1-3 threads
+#define SUPERVISOR_VR2 3
+#define SUPERVISOR_VR3 4
+#define SUPERVISOR_SPI 5 // SPI register refresh thread
+#define SUPERVISOR_THREADS 6
+#define SUPERVISOR_NONE 0xFF
+
+#define SUPERVISOR_CAUSE_NONE 0 // Power up or reset pin
+#define SUPERVISOR_CAUSE_STALL 1 // thread missed its deadline, the watchdog was left to expire
+#define SUPERVISOR_CAUSE_WATCHDOG 2 // Watchdog reset without a record, the supervisor was stuck
+
+typedef struct {
+  uint32_t magic;
+  uint8_t cause;
+  uint8_t thread; // SUPERVISOR_ id, SUPERVISOR_NONE when unknown
+  uint16_t resets; // Watchdog resets since power up
+  uint32_t late; // ms since the last heartbeat of the thread
+  uint32_t uptime; // ms at the fault
+  uint32_t check; // Complement of the xor of the previous words
+} __attribute__((packed)) supervisor_fault_t;
+
+#endif
@@ -9,3 +9,4 @@
 void createKnockThread(void);
 void createVrThreads(void);
 void createSpiThreads(void);
+void createUsbThreads(void);
@@ -0,0 +1,106 @@
+#include "hal.h"
+#include "timebase.h"
+#include "evlog.h"
+
+/*
+ * Local time is the DWT cycle counter extended to 64 bits, it must be
+ * read at least once per wrap (60s at 72MHz), see timebaseUpdate().
+ * ECU time is modelled as ref_ecu + (local - ref_local) * (1 + drift),
+ * all 32 bits values wrap and are only compared as differences.
+ */
+
+static uint32_t cyc_hi;
+static rtcnt_t cyc_last;
+
+static bool synced;
+static uint32_t ref_local; // Last sample, local us
+static uint32_t ref_ecu; // ECU time estimated at ref_local
+static float drift; // ECU clock rate error relative to ours
+static uint32_t base_local; // Start of the drift measurement
+static uint32_t base_ecu;
+
+CCM_FUNC uint32_t timebaseNowI(void)
+{
+  const rtcnt_t now = chSysGetRealtimeCounterX();
+
+  if (now < cyc_last)
+    cyc_hi++;
+  cyc_last = now;
+
+  return (uint32_t)((((uint64_t)cyc_hi << 32) | now) / (STM32_HCLK / 1000000));
+}
+
+/*
+ * Called periodically by the monitor thread, keeps the extension right
+ * when nothing else reads the time for a whole wrap.
+ */
+void timebaseUpdate(void)
+{
+  chSysLock();
+  (void)timebaseNowI();
+  chSysUnlock();
+}
+
+CCM_FUNC uint32_t timebaseToEcuI(uint32_t local)
+{
+  const int32_t dt = (int32_t)(local - ref_local);
+
+  return ref_ecu + dt + (int32_t)((float)dt * drift);
+}
+
+/*
+ * New pair of timestamps of the same NSS edge.
+ */
+CCM_FUNC void timebaseSyncI(uint32_t ecu, uint32_t local)
+{
+  const int32_t err = (int32_t)(ecu - timebaseToEcuI(local));
+  const uint32_t span = local - base_local;
+
+  if (!timebaseIsSyncedI() || err > TIMEBASE_STEP_US || err < -TIMEBASE_STEP_US)
+  {
+    /* First sample, timeout or ECU clock jump */
+    if (timebaseIsSyncedI())
+      evlogI(EVLOG_FAULT, EVLOG_FAULT_TIME_STEP, (uint32_t)err);
+    ref_ecu = ecu;
+    ref_local = local;
+    base_ecu = ecu;
+    base_local = local;
+    synced = true;
+    return;
+  }
+
+  ref_ecu = timebaseToEcuI(local) + (err >> TIMEBASE_OFFSET_SHIFT);
+  ref_local = local;
+
+  /* The raw pairs are used over a long span, the edge jitter averages out */
+  if (span >= TIMEBASE_DRIFT_PERIOD_US)
+  {
+    const float measured = (float)(int32_t)((ecu - base_ecu) - span) / (float)span;
+
+    drift += (measured - drift) / (1 << TIMEBASE_DRIFT_SHIFT);
+    base_ecu = ecu;
+    base_local = local;
+  }
+}
+
+/*
+ * Needs a recent sample, the conversion is meaningless otherwise.
+ */
+CCM_FUNC bool timebaseIsSyncedI(void)
+{
+  return synced && timebaseNowI() - ref_local < TIMEBASE_TIMEOUT_US;
+}
+
+/*
+ * Drift in 0.01 ppm units, positive when the ECU clock runs faster.
+ */
+int16_t timebaseGetDriftI(void)
+{
+  const float ppm100 = drift * 1e8f;
+
+  if (ppm100 > INT16_MAX)
+    return INT16_MAX;
+  if (ppm100 < INT16_MIN)
+    return INT16_MIN;
+  return (int16_t)ppm100;
+}
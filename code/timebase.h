@@ -0,0 +1,27 @@
+#ifndef TIMEBASE_H_
+#define TIMEBASE_H_
+
+#include "ch.h"
+
+/*
+ * ECU timebase, in microseconds.
+ * The ECU timestamps the rising edge of NSS for each transaction and
+ * sends that value in the next one, the board pairs it with its own
+ * timestamp of the same edge. Local timestamps are then converted with
+ * the estimated offset and drift.
+ */
+
+#define TIMEBASE_STEP_US 500 // Error above which the offset is stepped instead of filtered
+#define TIMEBASE_OFFSET_SHIFT 2 // Offset filter weight (1/4 per sample)
+#define TIMEBASE_DRIFT_PERIOD_US 1000000 // Baseline of a drift measurement
+#define TIMEBASE_DRIFT_SHIFT 2 // Drift filter weight (1/4 per measurement)
+#define TIMEBASE_TIMEOUT_US 2000000 // Unsynchronised without samples for this long
+
+uint32_t timebaseNowI(void);
+void timebaseUpdate(void);
+void timebaseSyncI(uint32_t ecu, uint32_t local);
+uint32_t timebaseToEcuI(uint32_t local);
+bool timebaseIsSyncedI(void);
+int16_t timebaseGetDriftI(void);
+
+#endif
@@ -0,0 +1,120 @@
+#include "hal.h"
+#include "trace.h"
+#include "usb_stream.h"
+
+/*
+ * Writers reserve a record with an atomic increment of head, fill it,
+ * then count it in done. Interrupts always finish their record before
+ * the code they preempted goes on, so head equal to done means every
+ * reserved record was written. The reader only copies such a snapshot
+ * and drops what writers lapped during the copy.
+ */
+
+#define TRACE_MASK (TRACE_RECORDS - 1)
+
+static trace_record_t ring[TRACE_RECORDS];
+static uint32_t head; // Records reserved
+static uint32_t done; // Records written
+static uint32_t sent; // Records read by the USB thread
+static bool enabled;
+static uint16_t frame[(TRACE_USB_RECORDS + 1) * sizeof(trace_record_t) / 2]; // TRACE_LOST first
+
+CCM_FUNC void trace(uint8_t event, uint8_t channel, uint16_t arg)
+{
+  const uint32_t i = __atomic_fetch_add(&head, 1, __ATOMIC_RELAXED);
+  trace_record_t* const r = &ring[i & TRACE_MASK];
+
+  r->time = chSysGetRealtimeCounterX();
+  r->event = event;
+  r->channel = channel;
+  r->arg = arg;
+  __atomic_fetch_add(&done, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * CH_CFG_CONTEXT_SWITCH_HOOK, after the CPU load one gave the slot.
+ */
+CCM_FUNC void traceSwitchHook(thread_t* ntp)
+{
+  trace(TRACE_SWITCH, 0, ntp->load_slot);
+}
+
+/*
+ * CH_CFG_IRQ_PROLOGUE_HOOK.
+ */
+CCM_FUNC void traceIrqHook(void)
+{
+  trace(TRACE_IRQ, 0, __get_IPSR() & 0x1FF);
+}
+
+/*
+ * Sends a frame per call from the USB thread.
+ */
+void traceUsbService(void)
+{
+  trace_record_t* const records = (trace_record_t*)frame;
+  trace_record_t* out;
+  uint32_t end, start, first, count, skip = 0, lost = 0, i;
+  uint8_t retry;
+
+  if (!usbStreamEnabled(STREAM_TRACE))
+  {
+    enabled = false;
+    return;
+  }
+
+  for (retry = 0; retry < 4; retry++)
+  {
+    end = __atomic_load_n(&done, __ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&head, __ATOMIC_RELAXED) == end)
+      break;
+  }
+  if (retry == 4)
+    return; // A thread is writing, next time
+
+  if (!enabled)
+  {
+    /* A new dump starts with the whole ring */
+    sent = end > TRACE_RECORDS ? end - TRACE_RECORDS : 0;
+    enabled = true;
+  }
+
+  start = sent;
+  if (end - start > TRACE_RECORDS)
+  {
+    lost = end - start - TRACE_RECORDS;
+    start = end - TRACE_RECORDS;
+  }
+  count = end - start;
+  if (count > TRACE_USB_RECORDS)
+    count = TRACE_USB_RECORDS;
+  if (count == 0 && lost == 0)
+    return;
+
+  for (i = 0; i < count; i++)
+    records[1 + i] = ring[(start + i) & TRACE_MASK];
+
+  /* Records overwritten while copying are dropped */
+  first = __atomic_load_n(&head, __ATOMIC_RELAXED) - TRACE_RECORDS;
+  if ((int32_t)(first - start) > 0)
+  {
+    skip = first - start < count ? first - start : count;
+    lost += skip;
+  }
+
+  out = &records[1 + skip];
+  if (lost != 0)
+  {
+    /* Timed as the record that follows, the order is kept */
+    out--;
+    out->time = skip < count ? out[1].time : chSysGetRealtimeCounterX();
+    out->event = TRACE_LOST;
+    out->channel = 0;
+    out->arg = lost > 0xFFFF ? 0xFFFF : lost;
+  }
+
+  first = out - records;
+  if (usbStreamWrite(STREAM_TRACE, 0, &frame[first * sizeof(trace_record_t) / 2],
+                     (1 + count - first) * sizeof(trace_record_t) / 2))
+    sent = start + count;
+}
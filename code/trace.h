@@ -0,0 +1,21 @@
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include "ch.h"
+#include "trace_format.h"
+
+/*
+ * Trace ring of fixed size records, see trace_format.h.
+ * Recording is always on and takes no lock, it can be called from any
+ * context. Once STREAM_TRACE is selected the ring is sent, then every
+ * new record.
+ */
+
+#define TRACE_RECORDS 256 // Power of two
+#define TRACE_USB_RECORDS 64 // Per frame
+
+/* The switch and interrupt hooks are declared in chconf.h */
+void trace(uint8_t event, uint8_t channel, uint16_t arg);
+void traceUsbService(void);
+
+#endif
@@ -0,0 +1,29 @@
+#ifndef TRACE_FORMAT_H_
+#define TRACE_FORMAT_H_
+
+#include <stdint.h>
+
+/*
+ * Trace records, shared with the host tools.
+ * STREAM_TRACE frames carry records, oldest first. The time is the DWT
+ * cycle counter, it wraps every minute at 72 MHz: the header time of the
+ * frame (us) places the last record.
+ */
+
+#define TRACE_LOST 0 // arg: records overwritten before they were sent, saturated
+#define TRACE_SWITCH 1 // arg: thread now running, STREAM_LOAD id
+#define TRACE_IRQ 2 // arg: exception number entered
+#define TRACE_ADC 3 // channel: 0 knock, 1-3 VR, arg: samples of the frame
+#define TRACE_TOOTH 4 // channel: VR, arg: interval in VR_TIM_FREQ ticks
+#define TRACE_KNOCK 5 // channel: sensor, arg: knock output of the frame
+#define TRACE_WINDOW 6 // channel: cylinder, arg: output held when the window closed
+#define TRACE_EVENTS 7
+
+typedef struct {
+  uint32_t time; // Cycles
+  uint8_t event;
+  uint8_t channel;
+  uint16_t arg;
+} __attribute__((packed)) trace_record_t;
+
+#endif
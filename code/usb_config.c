@@ -16,12 +16,13 @@
 
 #include "ch.h"
 #include "hal.h"
+#include "usb_stream.h"
+#include "replay.h"
 
 /*
- * Virtual serial ports over USB.
+ * Virtual serial port over USB.
  */
 SerialUSBDriver SDU1;
-SerialUSBDriver SDU2;
 
 #define USB_DEVICE_VID  0x0483
 #define USB_DEVICE_PID  0xBEEF
@@ -32,8 +33,6 @@ SerialUSBDriver SDU2;
  */
 #define USB_INTERRUPT_EP_A  1
 #define USB_DATA_EP_A       2
-#define USB_INTERRUPT_EP_B  3
-#define USB_DATA_EP_B       4
 
 #define USB_INTERRUPT_REQUEST_SIZE 0x10
 #define USB_DATA_SIZE              0x40
@@ -41,11 +40,10 @@ SerialUSBDriver SDU2;
 /*
  * Interfaces
  */
-#define USB_NUM_INTERFACES 4
+#define USB_NUM_INTERFACES 3
 #define USB_CDC_CIF_NUM0   0
 #define USB_CDC_DIF_NUM0   1
-#define USB_BASE_CIF_NUM1  2
-#define USB_BASE_DIF_NUM1  3
+#define USB_STREAM_IF_NUM  2
 
 /*
  * Current Line Coding.
@@ -246,14 +244,50 @@ static const USBDescriptor usb_device_descriptor = {
   /* CDC Interface descriptor set */                                        \
   CDC_IF_DESC_SET(comIfNum, datIfNum, comInEp, datOutEp, datInEp)
 
+#if REPLAY_ENABLED
+#define STREAM_IF_ENDPOINTS 2
+/* Endpoint, Bulk OUT, replayed samples.*/
+#define STREAM_IF_OUT_DESC(datOutEp)                                        \
+  , USB_DESC_ENDPOINT(                                                      \
+    datOutEp,                               /* bEndpointAddress.        */  \
+    USB_EP_MODE_TYPE_BULK,                  /* bmAttributes.            */  \
+    USB_STREAM_PACKET_SIZE,                 /* wMaxPacketSize.          */  \
+    0x00)                                   /* bInterval.               */
+#else
+#define STREAM_IF_ENDPOINTS 1
+#define STREAM_IF_OUT_DESC(datOutEp)
+#endif
 
+#define STREAM_IF_DESC_SET_SIZE                                             \
+  (USB_DESC_INTERFACE_SIZE + STREAM_IF_ENDPOINTS * USB_DESC_ENDPOINT_SIZE)
 
-/* Configuration Descriptor tree for a CDC.*/
+#define STREAM_IF_DESC_SET(ifNum, datInEp, datOutEp)                        \
+  /* Vendor Interface Descriptor.*/                                         \
+  USB_DESC_INTERFACE(                                                       \
+    ifNum,                                  /* bInterfaceNumber.        */  \
+    0x00,                                   /* bAlternateSetting.       */  \
+    STREAM_IF_ENDPOINTS,                    /* bNumEndpoints.           */  \
+    0xFF,                                   /* bInterfaceClass (vendor).*/  \
+    0x00,                                   /* bInterfaceSubClass.      */  \
+    0x00,                                   /* bInterfaceProtocol.      */  \
+    0x04),                                  /* iInterface.              */  \
+  /* Endpoint, Bulk IN.*/                                                   \
+  USB_DESC_ENDPOINT(                                                        \
+    datInEp,                                /* bEndpointAddress.        */  \
+    USB_EP_MODE_TYPE_BULK,                  /* bmAttributes.            */  \
+    USB_STREAM_PACKET_SIZE,                 /* wMaxPacketSize.          */  \
+    0x00)                                   /* bInterval.               */  \
+  STREAM_IF_OUT_DESC(datOutEp)
+
+
+
+/* Configuration Descriptor tree for a CDC and the stream interface.*/
 static const uint8_t usb_configuration_descriptor_data[] = {
   /* Configuration Descriptor.*/
   USB_DESC_CONFIGURATION(
     USB_DESC_CONFIGURATION_SIZE +
-    (IAD_CDC_IF_DESC_SET_SIZE * 2),         /* wTotalLength.                */
+    IAD_CDC_IF_DESC_SET_SIZE +
+    STREAM_IF_DESC_SET_SIZE,                /* wTotalLength.                */
     USB_NUM_INTERFACES,                     /* bNumInterfaces.              */
     0x01,                                   /* bConfigurationValue.         */
     0,                                      /* iConfiguration.              */
@@ -267,12 +301,10 @@ static const uint8_t usb_configuration_descriptor_data[] = {
     USB_ENDPOINT_OUT(USB_DATA_EP_A),
     USB_ENDPOINT_IN(USB_DATA_EP_A)
   ),
-  IAD_CDC_IF_DESC_SET(
-    USB_BASE_CIF_NUM1,
-    USB_BASE_DIF_NUM1,
-    USB_ENDPOINT_IN(USB_INTERRUPT_EP_B),
-    USB_ENDPOINT_OUT(USB_DATA_EP_B),
-    USB_ENDPOINT_IN(USB_DATA_EP_B)
+  STREAM_IF_DESC_SET(
+    USB_STREAM_IF_NUM,
+    USB_ENDPOINT_IN(USB_STREAM_EP),
+    USB_ENDPOINT_OUT(USB_STREAM_EP)
   ),
 };
 
@@ -287,14 +319,7 @@ static const USBCompatIDDesc usb_compat_id_descriptor_data = {
     },
     .sections = {
         {
-            .bFirstInterfaceNumber = 0x02,
-            .bInterfaceCount = 1,
-            .compatibleID = "WINUSB\0\0",
-            .subCompatibleID = {0, 0, 0, 0, 0, 0, 0, 0},
-            .reserved = {0, 0, 0, 0, 0, 0},
-        },
-        {
-            .bFirstInterfaceNumber = 0x03,
+            .bFirstInterfaceNumber = USB_STREAM_IF_NUM,
             .bInterfaceCount = 1,
             .compatibleID = "WINUSB\0\0",
             .subCompatibleID = {0, 0, 0, 0, 0, 0, 0, 0},
@@ -386,7 +411,7 @@ static const USBStringDesc usb_string3 = {
 static const USBStringDesc usb_string4 = {
   USB_DESC_BYTE(sizeof(USBStringDesc)),  /* bLength.                         */
   USB_DESC_BYTE(USB_DESCRIPTOR_STRING),  /* bDescriptorType.                 */
-  u"KVR Serial Interface 2"
+  u"KVR Stream Interface"
 };
 
 /*
@@ -489,54 +514,50 @@ static const USBEndpointConfig ep2config = {
  */
 static USBInEndpointState ep3instate;
 
+#if REPLAY_ENABLED
 /**
- * @brief   EP3 initialization structure (IN only).
+ * @brief   OUT EP3 state.
+ */
+static USBOutEndpointState ep3outstate;
+
+/**
+ * @brief   EP3 initialization structure (both IN and OUT), stream and replay.
  */
 static const USBEndpointConfig ep3config = {
-  USB_EP_MODE_TYPE_INTR,
-  NULL,
-  sduInterruptTransmitted,
+  USB_EP_MODE_TYPE_BULK,
   NULL,
-  USB_INTERRUPT_REQUEST_SIZE,
-  0x0000,
+  usbStreamTransmitted,
+  replayReceived,
+  USB_STREAM_PACKET_SIZE,
+  USB_STREAM_PACKET_SIZE,
   &ep3instate,
-  NULL,
+  &ep3outstate,
   1,
   NULL
 };
-
+#else
 /**
- * @brief   IN EP4 state.
+ * @brief   EP3 initialization structure (IN only), stream.
  */
-static USBInEndpointState ep4instate;
-
-/**
- * @brief   OUT EP4 state.
- */
-static USBOutEndpointState ep4outstate;
-
-/**
- * @brief   EP4 initialization structure (both IN and OUT).
- */
-static const USBEndpointConfig ep4config = {
+static const USBEndpointConfig ep3config = {
   USB_EP_MODE_TYPE_BULK,
   NULL,
-  sduDataTransmitted,
-  sduDataReceived,
-  USB_DATA_SIZE,
-  USB_DATA_SIZE,
-  &ep4instate,
-  &ep4outstate,
+  usbStreamTransmitted,
+  NULL,
+  USB_STREAM_PACKET_SIZE,
+  0x0000,
+  &ep3instate,
+  NULL,
   1,
   NULL
 };
+#endif
 
 /*
  * Handles the USB driver global events.
  */
 static void usb_event(USBDriver *usbp, usbevent_t event) {
   extern SerialUSBDriver SDU1;
-  extern SerialUSBDriver SDU2;
 
   switch (event) {
   case USB_EVENT_RESET:
@@ -552,12 +573,14 @@ static void usb_event(USBDriver *usbp, usbevent_t event) {
          must be used.*/
       usbInitEndpointI(usbp, USB_INTERRUPT_EP_A, &ep1config);
       usbInitEndpointI(usbp, USB_DATA_EP_A, &ep2config);
-      usbInitEndpointI(usbp, USB_INTERRUPT_EP_B, &ep3config);
-      usbInitEndpointI(usbp, USB_DATA_EP_B, &ep4config);
+      usbInitEndpointI(usbp, USB_STREAM_EP, &ep3config);
 
       /* Resetting the state of the CDC subsystem.*/
       sduConfigureHookI(&SDU1);
-      sduConfigureHookI(&SDU2);
+      usbStreamConfigureHookI(usbp);
+#if REPLAY_ENABLED
+      replayConfigureHookI(usbp);
+#endif
     }
     else if (usbp->state == USB_SELECTED) {
       usbDisableEndpointsI(usbp);
@@ -570,7 +593,10 @@ static void usb_event(USBDriver *usbp, usbevent_t event) {
 
     /* Disconnection event on suspend.*/
     sduSuspendHookI(&SDU1);
-    sduSuspendHookI(&SDU2);
+    usbStreamSuspendHookI(usbp);
+#if REPLAY_ENABLED
+    replaySuspendHookI(usbp);
+#endif
 
     chSysUnlockFromISR();
     return;
@@ -578,7 +604,6 @@ static void usb_event(USBDriver *usbp, usbevent_t event) {
     chSysLockFromISR();
 
     sduWakeupHookI(&SDU1);
-    sduWakeupHookI(&SDU2);
 
     chSysUnlockFromISR();
     return;
@@ -619,6 +644,13 @@ static bool requests_hook(USBDriver *usbp) {
 
   USBSetupPkt *setup = (USBSetupPkt*)usbp->setup;
 
+  if (setup->wIndex == USB_STREAM_IF_NUM && usbStreamRequestsHook(usbp))
+    return true;
+#if REPLAY_ENABLED
+  if (setup->wIndex == USB_STREAM_IF_NUM && replayRequestsHook(usbp))
+    return true;
+#endif
+
   if (((setup->bmRequestType & USB_RTYPE_RECIPIENT_MASK) == USB_RTYPE_RECIPIENT_INTERFACE) &&
       (setup->bRequest == USB_REQ_SET_INTERFACE)) {
     usbSetupTransfer(usbp, NULL, 0, NULL);
@@ -660,7 +692,6 @@ static void sof_handler(USBDriver *usbp) {
 
   osalSysLockFromISR();
   sduSOFHookI(&SDU1);
-  sduSOFHookI(&SDU2);
   osalSysUnlockFromISR();
 }
 
@@ -684,16 +715,6 @@ const SerialUSBConfig serusbcfg1 = {
   USB_INTERRUPT_EP_A
 };
 
-/*
- * Serial over USB driver configuration 2.
- */
-const SerialUSBConfig serusbcfg2 = {
-  &USBD1,
-  USB_DATA_EP_B,
-  USB_DATA_EP_B,
-  USB_INTERRUPT_EP_B
-};
-
 /*
  * USB will pull input low when connected.
  */
@@ -7,10 +7,8 @@
 /*===========================================================================*/
 
 extern const USBConfig usbcfg;
-extern SerialUSBConfig serusbcfg1;
-extern SerialUSBConfig serusbcfg2;
+extern const SerialUSBConfig serusbcfg1;
 extern SerialUSBDriver SDU1;
-extern SerialUSBDriver SDU2;
 
 bool usbConnected(void);
 bool usb_lld_connect_bus(USBDriver *usbp);
@@ -0,0 +1,155 @@
+#include <string.h>
+#include "hal.h"
+#include "usb_config.h"
+#include "proto.h"
+#include "proto_frame.h"
+#include "regs.h"
+#include "notify.h"
+#include "timebase.h"
+#include "capture.h"
+#include "evlog.h"
+#include "trace.h"
+#include "memhealth.h"
+
+/*
+ * Command and telemetry protocol on SDU1.
+ * The thread wakes every USB_PROTO_POLL_MS at most to send the telemetry
+ * and the events, replies are sent as soon as a request is complete.
+ */
+
+#define USB_PROTO_POLL_MS 1
+#define USB_PROTO_WRITE_MS 10 // Messages are dropped if the host does not read
+
+static uint8_t rx_frame[PROTO_MAX_FRAME];
+static size_t rx_len;
+static bool rx_overflow; // Frame too long, dropped up to the next delimiter
+static uint8_t msg[PROTO_MAX_MSG];
+static uint8_t reply[PROTO_MAX_MSG];
+static uint8_t tx_frame[PROTO_MAX_FRAME];
+
+uint8_t protoRegisterCount(void)
+{
+  return SPI_REG_COUNT;
+}
+
+bool protoReadRegisters(uint8_t addr, uint8_t count, uint16_t* values)
+{
+  uint16_t r[SPI_REG_COUNT];
+
+  if (addr >= SPI_REG_COUNT || count > SPI_REG_COUNT - addr)
+    return false;
+
+  regsRead(r);
+  chSysLock();
+  regsReadLocked(r);
+  chSysUnlock();
+
+  memcpy(values, &r[addr], count * sizeof(uint16_t));
+  return true;
+}
+
+bool protoWriteRegisters(uint8_t addr, uint8_t count, const uint16_t* values)
+{
+  uint8_t i;
+
+  if (!regsWritable(addr, count))
+    return false; // All or nothing
+
+  for (i = 0; i < count; i++)
+    regsWrite(addr + i, values[i]);
+  return true;
+}
+
+static void sendMessage(const uint8_t* buf, size_t len)
+{
+  const size_t n = protoFrame(buf, len, tx_frame);
+
+  chnWriteTimeout(&SDU1, tx_frame, n, TIME_MS2I(USB_PROTO_WRITE_MS));
+}
+
+static void receiveByte(uint8_t b)
+{
+  size_t len;
+
+  if (b != 0)
+  {
+    if (rx_len < sizeof(rx_frame))
+      rx_frame[rx_len++] = b;
+    else
+      rx_overflow = true;
+    return;
+  }
+
+  /* Delimiter, corrupted frames are ignored and the host times out */
+  len = rx_overflow ? 0 : protoUnframe(rx_frame, rx_len, msg);
+  rx_len = 0;
+  rx_overflow = false;
+
+  if (len != 0 && (len = protoProcess(msg, len, reply)) != 0)
+    sendMessage(reply, len);
+}
+
+static THD_WORKING_AREA(waThreadUsb, 512);
+static THD_FUNCTION(ThreadUsb, arg)
+{
+  (void)arg;
+  chRegSetThreadName("USB");
+
+  systime_t telemetry_last = chVTGetSystemTime();
+
+  while (TRUE)
+  {
+    sysinterval_t period;
+    uint16_t events;
+    uint32_t time;
+    size_t len;
+    msg_t c;
+
+    if (SDU1.config->usbp->state != USB_ACTIVE)
+    {
+      chThdSleepMilliseconds(100); // Not configured, reads would return at once
+      continue;
+    }
+
+    c = chnGetTimeout(&SDU1, TIME_MS2I(USB_PROTO_POLL_MS));
+    if (c >= 0)
+      receiveByte((uint8_t)c);
+    else if (c == MSG_RESET)
+      chThdSleepMilliseconds(USB_PROTO_POLL_MS);
+
+    chSysLock();
+    events = notifyFetchI(&time) & protoEventMask();
+    chSysUnlock();
+    if (events != 0)
+      sendMessage(msg, protoEvent(msg, events, time));
+
+    captureUsbService();
+    evlogUsbService();
+    traceUsbService();
+
+    period = TIME_MS2I(protoTelemetryPeriod());
+    if (period == 0)
+    {
+      telemetry_last = chVTGetSystemTime();
+    }
+    else if (chVTTimeElapsedSinceX(telemetry_last) >= period)
+    {
+      /* A late message is not caught up */
+      telemetry_last += period;
+      if (chVTTimeElapsedSinceX(telemetry_last) >= period)
+        telemetry_last = chVTGetSystemTime();
+
+      chSysLock();
+      time = timebaseNowI();
+      chSysUnlock();
+      len = protoTelemetry(msg, time);
+      if (len != 0)
+        sendMessage(msg, len);
+    }
+  }
+}
+
+void createUsbThreads(void)
+{
+  memhealthCreateStatic(waThreadUsb, NORMALPRIO, ThreadUsb, NULL);
+}
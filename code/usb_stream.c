@@ -0,0 +1,158 @@
+#include <string.h>
+#include "usb_stream.h"
+#include "timebase.h"
+
+/*
+ * Vendor bulk stream.
+ * Frames are appended to the filling buffer while the other one is sent
+ * as a single multi-packet transfer. When the endpoint is idle the
+ * filling buffer is sent right away, under load the transfers grow up
+ * to USB_STREAM_BUFFER_SIZE. The USB peripheral has no double-buffered
+ * bulk support in the driver, the two transfer buffers take its place.
+ * A frame that does not fit in the filling buffer is dropped.
+ */
+
+static uint8_t buffers[2][USB_STREAM_BUFFER_SIZE];
+static uint8_t fill; // Buffer frames are appended to
+static size_t fill_len;
+static uint8_t writers; // Copies running into the filling buffer
+static bool busy; // A transfer is running
+static bool active; // Endpoint configured
+
+static uint16_t stream_mask; // STREAM_MSK of the enabled streams
+static uint16_t vr_decimation = 16;
+static uint16_t seqs[STREAM_TYPES];
+static stream_stats_t stats;
+
+/*
+ * Sends the filling buffer once the endpoint is idle and every copy
+ * into it is done.
+ */
+static void startTransferI(USBDriver *usbp)
+{
+  if (!active || busy || writers != 0 || fill_len == 0)
+    return;
+
+  busy = true;
+  stats.bytes += fill_len;
+  stats.transfers++;
+  usbStartTransmitI(usbp, USB_STREAM_EP, buffers[fill], fill_len);
+  fill ^= 1;
+  fill_len = 0;
+}
+
+void usbStreamConfigureHookI(USBDriver *usbp)
+{
+  (void)usbp;
+
+  fill_len = 0;
+  busy = false;
+  active = true;
+}
+
+void usbStreamSuspendHookI(USBDriver *usbp)
+{
+  (void)usbp;
+
+  active = false;
+  stream_mask = 0; // The host selects the streams again
+}
+
+void usbStreamTransmitted(USBDriver *usbp, usbep_t ep)
+{
+  (void)ep;
+
+  osalSysLockFromISR();
+  busy = false;
+  startTransferI(usbp);
+  osalSysUnlockFromISR();
+}
+
+/*
+ * Vendor requests addressed to the stream interface.
+ */
+bool usbStreamRequestsHook(USBDriver *usbp)
+{
+  const uint8_t *setup = usbp->setup;
+  const uint16_t value = setup[2] | (setup[3] << 8);
+
+  if ((setup[0] & USB_RTYPE_TYPE_MASK) != USB_RTYPE_TYPE_VENDOR ||
+      (setup[0] & USB_RTYPE_RECIPIENT_MASK) != USB_RTYPE_RECIPIENT_INTERFACE)
+    return false;
+
+  switch (setup[1]) {
+  case STREAM_REQ_SELECT:
+    stream_mask = value;
+    usbSetupTransfer(usbp, NULL, 0, NULL);
+    return true;
+  case STREAM_REQ_VR_DECIMATION:
+    vr_decimation = value == 0 ? 1 : value;
+    usbSetupTransfer(usbp, NULL, 0, NULL);
+    return true;
+  case STREAM_REQ_STATS:
+    usbSetupTransfer(usbp, (uint8_t*)&stats, sizeof(stats), NULL);
+    return true;
+  default:
+    return false;
+  }
+}
+
+bool usbStreamEnabled(uint8_t type)
+{
+  return active && (stream_mask & STREAM_MSK(type)) != 0;
+}
+
+/*
+ * Queues a frame of 16 bits words, VR samples are decimated.
+ * Called from the processing threads, the space is reserved with the
+ * system locked and the copy is done unlocked. Returns false if the
+ * frame was not queued.
+ */
+bool usbStreamWrite(uint8_t type, uint8_t channel, const uint16_t* data, size_t n)
+{
+  const size_t step = type == STREAM_VR_RAW ? vr_decimation : 1;
+  const size_t count = (n + step - 1) / step;
+  const size_t len = sizeof(stream_header_t) + count * 2;
+  stream_header_t header;
+  uint8_t* dst;
+  uint16_t* words;
+  size_t i;
+
+  if (!usbStreamEnabled(type))
+    return false;
+
+  header.sync = STREAM_SYNC;
+  header.type = type;
+  header.channel = channel;
+  header.count = count;
+
+  chSysLock();
+  header.seq = seqs[type]++;
+  header.time = timebaseNowI();
+  stats.frames++;
+  if (len > USB_STREAM_BUFFER_SIZE - fill_len)
+  {
+    /* Room is only made by the end of a transfer */
+    stats.dropped++;
+    chSysUnlock();
+    return false;
+  }
+
+  dst = &buffers[fill][fill_len];
+  fill_len += len;
+  writers++;
+  chSysUnlock();
+
+  /* Headers and payloads are even sized, the words stay aligned */
+  memcpy(dst, &header, sizeof(header));
+  words = (uint16_t*)(dst + sizeof(header));
+  for (i = 0; i < count; i++)
+    words[i] = data[i * step];
+
+  chSysLock();
+  writers--;
+  startTransferI(&USBD1);
+  chSysUnlock();
+
+  return true;
+}
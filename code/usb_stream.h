@@ -0,0 +1,18 @@
+#ifndef USB_STREAM_H_
+#define USB_STREAM_H_
+
+#include "hal.h"
+#include "stream_format.h"
+
+#define USB_STREAM_EP 3
+#define USB_STREAM_PACKET_SIZE 0x40 // Full speed bulk maximum
+#define USB_STREAM_BUFFER_SIZE 2560 // Bytes, longest transfer, two are used. Fits a raw knock frame of two sensors
+
+void usbStreamConfigureHookI(USBDriver *usbp);
+void usbStreamSuspendHookI(USBDriver *usbp);
+bool usbStreamRequestsHook(USBDriver *usbp);
+void usbStreamTransmitted(USBDriver *usbp, usbep_t ep);
+bool usbStreamEnabled(uint8_t type);
+bool usbStreamWrite(uint8_t type, uint8_t channel, const uint16_t* data, size_t n);
+
+#endif
@@ -2,10 +2,23 @@
 #include "hal.h"
 #include "ipc.h"
 #include "settings.h"
-#include "median.h"
+#include "vr_dsp.h"
 #include "vrtimers.h"
+#include "calib.h"
+#include "knock.h"
+#include "notify.h"
+#include "timebase.h"
+#include "usb_stream.h"
+#include "capture.h"
+#include "evlog.h"
+#include "latency.h"
+#include "trace.h"
+#include "memhealth.h"
+#include "supervisor.h"
+#include "replay.h"
 
 #define VALID_MSK 0x03
+#define THRESHOLD_LOG_SHIFT 3 // Threshold changes over 1/8 are logged
 
 #define tr1Enable() palSetLineMode(LINE_TR1_OUT, 8)
 #define tr2Enable() palSetLineMode(LINE_TR2_OUT, 8)
@@ -26,15 +39,9 @@
 
 typedef struct
 {
-  uint16_t high;
-  uint16_t low;
-} high_low_t;
-
-typedef struct
-{
-  uint8_t pad:6;
+  bool peak:1; // Bit 0, see VALID_MSK
   bool time:1;
-  bool peak:1;
+  uint8_t pad:6;
 } valid_t;
 
 typedef struct
@@ -42,6 +49,10 @@ typedef struct
   high_low_t threshold;
   high_low_t peak;
   uint16_t min_time;
+  uint16_t zero; // Calibrated zero, ADC raw value
+  uint16_t interval; // Last tooth interval, VR_TIM_FREQ ticks
+  uint32_t time; // Last tooth, local timebase us
+  uint16_t logged_threshold; // Last one in the event log
   union {
     valid_t valid;
     uint8_t valid_msk;
@@ -50,6 +61,7 @@ typedef struct
 } vr_t;
 
 static vr_t vr1, vr2, vr3;
+static vr_t * const vrs[3] = {&vr1, &vr2, &vr3};
 
 /*
  * Peripherals
@@ -99,11 +111,41 @@ CCM_FUNC inline static void timSetReload(TIM_TypeDef *tim, uint32_t value)
 
 inline static void OverflowReset(vr_t *vr)
 {
-  vr->threshold.low = VR_DEFAULT_NEG_THRESHOLD;
-  vr->threshold.high = VR_DEFAULT_POS_THRESHOLD;
+  vr->interval = 0; // Stalled
+  vr->threshold.low = vr->zero - VR_DEFAULT_THRESHOLD;
+  vr->threshold.high = vr->zero + VR_DEFAULT_THRESHOLD;
   vr->valid_msk = 0;
 }
 
+/* Crank wheel input, see vrGetRpm() */
+#if KNOCK_USE_DUAL_MODE
+#define VR_CRANK 1
+#else
+#define VR_CRANK 0
+#endif
+
+/* Signal lost after a valid tooth, the ECU is told */
+CCM_FUNC static void OverflowHandler(vr_t *vr, uint8_t n)
+{
+  const rtcnt_t now = chSysGetRealtimeCounterX();
+  const uint16_t interval = vr->interval;
+  const bool lost = interval != 0;
+
+  OverflowReset(vr);
+
+  chSysLockFromISR();
+  if (lost)
+  {
+    notifyI(NOTIFY_VR_LOST(n), now);
+    evlogI(EVLOG_LOST, n, 0);
+    if (n == VR_CRANK)
+      knockSetCylinderI(0); // The engine stopped, the next window is the first cylinder
+  }
+  captureTriggerI(lost ? CAPTURE_TRIG_VR_LOST | CAPTURE_TRIG_VR_TIMEOUT : CAPTURE_TRIG_VR_TIMEOUT,
+                  n, interval);
+  chSysUnlockFromISR();
+}
+
 /*
  * Watchdog timeout callbacks
  * This happens when no output was generated before the timer completes
@@ -112,17 +154,17 @@ inline static void OverflowReset(vr_t *vr)
  */
 CCM_FUNC void VR1_OVERFLOW_HANDLER(void)
 {
-  OverflowReset(&vr1);
+  OverflowHandler(&vr1, 0);
 }
 
 CCM_FUNC void VR2_OVERFLOW_HANDLER(void)
 {
-  OverflowReset(&vr2);
+  OverflowHandler(&vr2, 1);
 }
 
 CCM_FUNC void VR3_OVERFLOW_HANDLER(void)
 {
-  OverflowReset(&vr3);
+  OverflowHandler(&vr3, 2);
 }
 
 
@@ -147,22 +189,46 @@ CCM_FUNC void VR3_COMPARE_HANDLER(void)
 
 
 /* Set new thresholds to 80% of previous peaks, reset validation */
-CCM_FUNC static void ComparatorThresholdHandler(vr_t *vr, TIM_TypeDef *tim)
+CCM_FUNC static void ComparatorThresholdHandler(vr_t *vr, TIM_TypeDef *tim, uint8_t n, rtcnt_t now)
 {
   if (vr->valid_msk & VALID_MSK)
   {
+    const bool sync = vr->interval == 0;
     // Get last interval, set timeout;
     uint32_t cnt = timCounter(tim);
     uint32_t reload = cnt * VR_DEFAULT_MULT_THRESHOLD;
     if (reload > 0xFFFF)
         reload = 0xFFFF;
     timSetReload(tim, reload);
+    timRestart(tim);
+    vr->interval = (uint16_t)cnt;
 
-    vr->threshold.low = (uint16_t)((float)vr->peak.low * 1.2f);
-    vr->threshold.high = (uint16_t)((float)vr->peak.high * 0.8f);
-    vr->peak.low = VR_ZERO;
-    vr->peak.high = VR_ZERO;
+    vr->threshold.low = vr->zero - (uint16_t)((float)(vr->zero - vr->peak.low) * 0.8f);
+    vr->threshold.high = vr->zero + (uint16_t)((float)(vr->peak.high - vr->zero) * 0.8f);
+    vr->peak.low = vr->zero;
+    vr->peak.high = vr->zero;
     vr->valid_msk = 0;
+
+    const uint16_t threshold = vr->threshold.high - vr->zero;
+    const uint16_t change = threshold > vr->logged_threshold ?
+                            threshold - vr->logged_threshold : vr->logged_threshold - threshold;
+
+    chSysLockFromISR();
+    vr->time = timebaseNowI();
+    evlogI(EVLOG_TOOTH, n, cnt);
+    trace(TRACE_TOOTH, n, cnt);
+    if (sync)
+    {
+      notifyI(NOTIFY_VR_SYNC(n), now);
+      evlogI(EVLOG_SYNC, n, 0);
+    }
+    if (change > (vr->logged_threshold >> THRESHOLD_LOG_SHIFT))
+    {
+      vr->logged_threshold = threshold;
+      evlogI(EVLOG_THRESHOLD, n, threshold);
+    }
+    latencyAddI(LATENCY_VR_EDGE, now);
+    chSysUnlockFromISR();
   }
 }
 
@@ -173,20 +239,22 @@ CCM_FUNC static void ComparatorThresholdHandler(vr_t *vr, TIM_TypeDef *tim)
  */
 CCM_FUNC static void comp_cb(COMPDriver *comp)
 {
+  const rtcnt_t now = latencyStamp();
+
   /* Check if output is high (rising) */
   if (comp->reg->CSR & COMP_CSR_COMPxOUT)
   {
     if (comp == &VR1_COMPD)
     {
-      ComparatorThresholdHandler(&vr1, VR1_TIM);
+      ComparatorThresholdHandler(&vr1, VR1_TIM, 0, now);
     }
     else if (comp == &VR2_COMPD)
     {
-      ComparatorThresholdHandler(&vr2, VR2_TIM);
+      ComparatorThresholdHandler(&vr2, VR2_TIM, 1, now);
     }
     else if (comp == &VR3_COMPD)
     {
-      ComparatorThresholdHandler(&vr3, VR3_TIM);
+      ComparatorThresholdHandler(&vr3, VR3_TIM, 2, now);
     }
   }
   else // LOW
@@ -202,15 +270,21 @@ static void adcCallback(ADCDriver *adcp, adcsample_t *buffer, size_t n)
   chSysLockFromISR();
   if (adcp == &VR1_ADCD)
   {
-    allocSendSamplesI(&vr1_mb, (void*)buffer, n);
+    trace(TRACE_ADC, 1, n);
+    if (!replayActive(STREAM_REPLAY_VR1))
+      allocSendSamplesI(&vr1_mb, (void*)buffer, n);
   }
   else if (adcp == &VR2_ADCD)
   {
-    allocSendSamplesI(&vr2_mb, (void*)buffer, n);
+    trace(TRACE_ADC, 2, n);
+    if (!replayActive(STREAM_REPLAY_VR1 + 1))
+      allocSendSamplesI(&vr2_mb, (void*)buffer, n);
   }
   else if (adcp == &VR3_ADCD)
   {
-    allocSendSamplesI(&vr3_mb, (void*)buffer, n);
+    trace(TRACE_ADC, 3, n);
+    if (!replayActive(STREAM_REPLAY_VR1 + 2))
+      allocSendSamplesI(&vr3_mb, (void*)buffer, n);
   }
   chSysUnlockFromISR();
 }
@@ -282,6 +356,7 @@ static const OPAMPConfig opamp4_conf = {
   OPAMP4_CSR_VMSEL_FOLWR // INM connected to vout (follower)
 };
 
+#if !KNOCK_USE_DUAL_MODE
 /* ADC1 Clk is 72Mhz/1 72Mhz  */
 static const ADCConversionGroup vr1grpcfg = {
   TRUE,
@@ -291,7 +366,7 @@ static const ADCConversionGroup vr1grpcfg = {
   ADC_CFGR_CONT,    /* CFGR - Continous */
   ADC_TR(0, 4095),                  /* TR1 - Watchdog  */
   {                                 /* SMPR[2] */
-    ADC_SMPR1_SMP_AN1(ADC_SMPR_SMP_61P5),  /* Sampling rate = 72000000/(61.5+12.5) = 972.972Khz  */
+    ADC_SMPR1_SMP_AN3(ADC_SMPR_SMP_61P5),  /* Sampling rate = 72000000/(61.5+12.5) = 972.972Khz  */
     0,
   },
   {                                 /* SQR[4]  */
@@ -301,6 +376,7 @@ static const ADCConversionGroup vr1grpcfg = {
     0
   }
 };
+#endif
 
 /* ADC3 Clk is 72Mhz/1 72Mhz  */
 static const ADCConversionGroup vr2grpcfg = {
@@ -332,7 +408,7 @@ static const ADCConversionGroup vr3grpcfg = {
   ADC_CFGR_CONT,    /* CFGR - Continous */
   ADC_TR(0, 4095),                  /* TR1 - Watchdog  */
   {                                 /* SMPR[2] */
-    ADC_SMPR1_SMP_AN1(ADC_SMPR_SMP_61P5),  /* Sampling rate = 72000000/(61.5+12.5) = 972.972Khz  */
+    ADC_SMPR1_SMP_AN3(ADC_SMPR_SMP_61P5),  /* Sampling rate = 72000000/(61.5+12.5) = 972.972Khz  */
     0,
   },
   {                                 /* SQR[4]  */
@@ -343,27 +419,34 @@ static const ADCConversionGroup vr3grpcfg = {
   }
 };
 
-CCM_FUNC static bool checkPeak(vr_t* vr, median_t* median, const adcsample_t* samples, size_t size)
+static bool checkPeak(vr_t* vr, median_t* median, const adcsample_t* samples, size_t size)
 {
-  /* Filtering and finding min/max */
-  uint16_t val, min, max = 0;
-  for (uint16_t i = 0; i < size; i++)
-  {
-    val = median_filter(median, samples[i]);
-    if (val > max) max = val;
-    if (val < min) min = val;
-  }
-  if (min < vr->peak.low)
-      vr->peak.low = min;
-  if (max > vr->peak.high)
-      vr->peak.high = max;
+  return vrDspCheckPeak(&vr->peak, &vr->threshold, median, samples, size);
+}
+
+/*
+ * Loads the calibrated offset and starts the conversions.
+ * Samples are kept in the raw domain, centered on VR_ZERO when possible.
+ */
+static void startConversion(ADCDriver* adcp, const ADCConversionGroup* grpp,
+                            adcsample_t* samples, vr_t* vr, uint8_t input)
+{
+  adcp->adcm->OFR1 = calibOffsetReg(input, VR_ZERO);
+
+  chSysLock();
+  vr->zero = calibZero(input);
+  vr->peak.low = vr->zero;
+  vr->peak.high = vr->zero;
+  OverflowReset(vr);
+  chSysUnlock();
 
-  return vr->peak.low <= vr->threshold.low && vr->peak.high >= vr->threshold.high;
+  adcStartConversion(adcp, grpp, samples, VR_SAMPLES);
 }
 
+#if !KNOCK_USE_DUAL_MODE
 static pair_t vr1_pair[VR_SAMPLES];
 static adcsample_t vr1_samples[VR_SAMPLES];
-static THD_WORKING_AREA(waThreadVR1, 128);
+static THD_WORKING_AREA(waThreadVR1, 256);
 CCM_FUNC static THD_FUNCTION(ThreadVR1, arg)
 {
   (void)arg;
@@ -371,30 +454,44 @@ CCM_FUNC static THD_FUNCTION(ThreadVR1, arg)
 
   adcsample_t * adc_data_ptr;
   size_t adc_data_size;
+  rtcnt_t frame_time;
   median_t median;
 
   median_init(&median, 0, vr1_pair, VR_SAMPLES);
 
-  /* ADC 1 Ch3 Offset. -2048 */
-  VR1_ADC->OFR1 = ADC_OFR1_OFFSET1_EN | ADC_OFR1_OFFSET1_CH_0 | ADC_OFR1_OFFSET1_CH_1 | (2048 & 0xFFF);
-  adcStartConversion(&VR1_ADCD, &vr1grpcfg, vr1_samples, VR_SAMPLES);
+  /* ADC 1 Ch3 Offset, measured by calibrateVr() */
+  startConversion(&VR1_ADCD, &vr1grpcfg, vr1_samples, &vr1, CALIB_VR1);
 
   while (TRUE)
   {
-    recvFreeSamples(&vr1_mb, (void*)&adc_data_ptr, &adc_data_size, TIME_INFINITE);
+    recvFreeSamples(&vr1_mb, (void*)&adc_data_ptr, &adc_data_size, &frame_time, TIME_INFINITE);
+    supervisorHeartbeat(SUPERVISOR_VR1);
+    usbStreamWrite(STREAM_VR_RAW, 0, adc_data_ptr, adc_data_size);
+    captureVr(0, adc_data_ptr, adc_data_size);
 
     bool res = checkPeak(&vr1, &median, adc_data_ptr, adc_data_size);
+    latencyAdd(LATENCY_VR_FRAME, frame_time);
 
     if (!vr1.valid.peak)
     {
       vr1.valid.peak = res;
     }
+
+    /* No signal, follow the offset drift. Replayed samples are not the ADC ones */
+    if (!vr1.valid_msk && !replayActive(STREAM_REPLAY_VR1) &&
+        calibTrackIdle(CALIB_VR1, adc_data_ptr, adc_data_size, 1))
+    {
+      adcStopConversion(&VR1_ADCD);
+      startConversion(&VR1_ADCD, &vr1grpcfg, vr1_samples, &vr1, CALIB_VR1);
+    }
   }
 }
 
+#endif
+
 static pair_t vr2_pair[VR_SAMPLES];
 static adcsample_t vr2_samples[VR_SAMPLES];
-static THD_WORKING_AREA(waThreadVR2, 128);
+static THD_WORKING_AREA(waThreadVR2, 256);
 CCM_FUNC static THD_FUNCTION(ThreadVR2, arg)
 {
   (void)arg;
@@ -402,30 +499,42 @@ CCM_FUNC static THD_FUNCTION(ThreadVR2, arg)
 
   adcsample_t * adc_data_ptr;
   size_t adc_data_size;
+  rtcnt_t frame_time;
   median_t median;
 
   median_init(&median, 0, vr2_pair, VR_SAMPLES);
 
-  /* ADC 3 Ch1 Offset. -2048 */
-  VR2_ADC->OFR1 = ADC_OFR1_OFFSET1_EN | ADC_OFR1_OFFSET1_CH_0 | (2048 & 0xFFF);
-  adcStartConversion(&VR2_ADCD, &vr2grpcfg, vr2_samples, VR_SAMPLES);
+  /* ADC 3 Ch1 Offset, measured by calibrateVr() */
+  startConversion(&VR2_ADCD, &vr2grpcfg, vr2_samples, &vr2, CALIB_VR2);
 
   while (TRUE)
   {
-    recvFreeSamples(&vr2_mb, (void*)&adc_data_ptr, &adc_data_size, TIME_INFINITE);
+    recvFreeSamples(&vr2_mb, (void*)&adc_data_ptr, &adc_data_size, &frame_time, TIME_INFINITE);
+    supervisorHeartbeat(SUPERVISOR_VR2);
+    usbStreamWrite(STREAM_VR_RAW, 1, adc_data_ptr, adc_data_size);
+    captureVr(1, adc_data_ptr, adc_data_size);
 
     bool res = checkPeak(&vr2, &median, adc_data_ptr, adc_data_size);
+    latencyAdd(LATENCY_VR_FRAME, frame_time);
 
     if (!vr2.valid.peak)
     {
       vr2.valid.peak = res;
     }
+
+    /* No signal, follow the offset drift. Replayed samples are not the ADC ones */
+    if (!vr2.valid_msk && !replayActive(STREAM_REPLAY_VR1 + 1) &&
+        calibTrackIdle(CALIB_VR2, adc_data_ptr, adc_data_size, 1))
+    {
+      adcStopConversion(&VR2_ADCD);
+      startConversion(&VR2_ADCD, &vr2grpcfg, vr2_samples, &vr2, CALIB_VR2);
+    }
   }
 }
 
 static pair_t vr3_pair[VR_SAMPLES];
 static adcsample_t vr3_samples[VR_SAMPLES];
-static THD_WORKING_AREA(waThreadVR3, 128);
+static THD_WORKING_AREA(waThreadVR3, 256);
 CCM_FUNC static THD_FUNCTION(ThreadVR3, arg)
 {
   (void)arg;
@@ -433,33 +542,104 @@ CCM_FUNC static THD_FUNCTION(ThreadVR3, arg)
 
   adcsample_t * adc_data_ptr;
   size_t adc_data_size;
+  rtcnt_t frame_time;
   median_t median;
 
   median_init(&median, 0, vr3_pair, VR_SAMPLES);
 
-  /* ADC 4 Ch3 Offset. -2048 */
-  VR3_ADC->OFR1 = ADC_OFR1_OFFSET1_EN | ADC_OFR1_OFFSET1_CH_0 | ADC_OFR1_OFFSET1_CH_1 | (2048 & 0xFFF);
-  adcStartConversion(&VR3_ADCD, &vr3grpcfg, vr3_samples, VR_SAMPLES);
+  /* ADC 4 Ch3 Offset, measured by calibrateVr() */
+  startConversion(&VR3_ADCD, &vr3grpcfg, vr3_samples, &vr3, CALIB_VR3);
 
   while (TRUE)
   {
-    recvFreeSamples(&vr3_mb, (void*)&adc_data_ptr, &adc_data_size, TIME_INFINITE);
+    recvFreeSamples(&vr3_mb, (void*)&adc_data_ptr, &adc_data_size, &frame_time, TIME_INFINITE);
+    supervisorHeartbeat(SUPERVISOR_VR3);
+    usbStreamWrite(STREAM_VR_RAW, 2, adc_data_ptr, adc_data_size);
+    captureVr(2, adc_data_ptr, adc_data_size);
 
     bool res = checkPeak(&vr3, &median, adc_data_ptr, adc_data_size);
+    latencyAdd(LATENCY_VR_FRAME, frame_time);
 
     if (!vr3.valid.peak)
     {
       vr3.valid.peak = res;
     }
+
+    /* No signal, follow the offset drift. Replayed samples are not the ADC ones */
+    if (!vr3.valid_msk && !replayActive(STREAM_REPLAY_VR1 + 2) &&
+        calibTrackIdle(CALIB_VR3, adc_data_ptr, adc_data_size, 1))
+    {
+      adcStopConversion(&VR3_ADCD);
+      startConversion(&VR3_ADCD, &vr3grpcfg, vr3_samples, &vr3, CALIB_VR3);
+    }
   }
 }
 
+uint16_t vrGetInterval(uint8_t vr)
+{
+  if (vr >= 3)
+    return 0;
+
+  return vrs[vr]->interval;
+}
+
+/*
+ * Distance between the calibrated zero and the current high threshold.
+ */
+uint16_t vrGetThreshold(uint8_t vr)
+{
+  if (vr >= 3)
+    return 0;
+
+  return vrs[vr]->threshold.high - vrs[vr]->zero;
+}
+
+/*
+ * Last tooth time, local timebase us.
+ */
+uint32_t vrGetToothTime(uint8_t vr)
+{
+  if (vr >= 3)
+    return 0;
+
+  return vrs[vr]->time;
+}
+
+bool vrIsValid(uint8_t vr)
+{
+  if (vr >= 3)
+    return false;
+
+  return (vrs[vr]->valid_msk & VALID_MSK) == VALID_MSK;
+}
+
+/*
+ * Engine speed from the crank wheel, VR2 in dual mode since VR1 is unused.
+ */
+uint16_t vrGetRpm(void)
+{
+#if KNOCK_USE_DUAL_MODE
+  const uint32_t interval = vr2.interval;
+#else
+  const uint32_t interval = vr1.interval;
+#endif
+  uint32_t rpm;
+
+  if (interval == 0 || settings.vr_teeth == 0)
+    return 0;
+
+  rpm = (60U * VR_TIM_FREQ) / (interval * settings.vr_teeth);
+  return rpm > 0xFFFF ? 0xFFFF : (uint16_t)rpm;
+}
+
 void createVrThreads(void)
 {
   opampStart(&VR1_OPAMPD, &opamp1_conf);
   opampStart(&VR2_OPAMPD, &opamp3_conf);
   opampStart(&VR3_OPAMPD, &opamp4_conf);
-  adcStart(&VR1_ADCD, NULL);
+#if !KNOCK_USE_DUAL_MODE
+  adcStart(&VR1_ADCD, NULL); // ADC1 is the knock master in dual mode
+#endif
   adcStart(&VR2_ADCD, NULL);
   adcStart(&VR3_ADCD, NULL);
   dacStart(&VR_DACD, &dac_conf);
@@ -467,7 +647,6 @@ void createVrThreads(void)
   compStart(&VR2_COMPD, &comp2_conf);
   compStart(&VR3_COMPD, &comp6_conf);
 
-  dacPutChannelX(&VR_DACD, 0, 2048); // This sets the biasing for our sensors and comparators.
   compEnable(&VR1_COMPD);
   compEnable(&VR2_COMPD);
   compEnable(&VR3_COMPD);
@@ -475,9 +654,16 @@ void createVrThreads(void)
   opampEnable(&VR2_OPAMPD);
   opampEnable(&VR3_OPAMPD);
 
+  calibrateVr(); // This sets the biasing for our sensors and comparators.
+
   setupTimers();
 
-  chThdCreateStatic(waThreadVR1, sizeof(waThreadVR1), NORMALPRIO, ThreadVR1, NULL);
-  chThdCreateStatic(waThreadVR2, sizeof(waThreadVR2), NORMALPRIO, ThreadVR2, NULL);
-  chThdCreateStatic(waThreadVR3, sizeof(waThreadVR3), NORMALPRIO, ThreadVR3, NULL);
+#if !KNOCK_USE_DUAL_MODE
+  memhealthCreateStatic(waThreadVR1, NORMALPRIO, ThreadVR1, NULL);
+  supervisorWatch(SUPERVISOR_VR1, VR_FRAME_US);
+#endif
+  memhealthCreateStatic(waThreadVR2, NORMALPRIO, ThreadVR2, NULL);
+  memhealthCreateStatic(waThreadVR3, NORMALPRIO, ThreadVR3, NULL);
+  supervisorWatch(SUPERVISOR_VR2, VR_FRAME_US);
+  supervisorWatch(SUPERVISOR_VR3, VR_FRAME_US);
 }
@@ -21,6 +21,10 @@
 #define VR2_ADCD ADCD3
 #define VR3_ADCD ADCD4
 
+#define VR1_ADC_CHANNEL ADC_CHANNEL_IN3
+#define VR2_ADC_CHANNEL ADC_CHANNEL_IN1
+#define VR3_ADC_CHANNEL ADC_CHANNEL_IN3
+
 #define VR1_COMPD COMPD1
 #define VR2_COMPD COMPD2
 #define VR3_COMPD COMPD6
@@ -33,14 +37,16 @@
 
 #define VR_SAMPLES 512
 #define VR_SAMPLE_SPEED
+#define VR_SAMPLE_FREQ 972972 // Hz, 72MHz / (61.5 + 12.5) clocks
+#define VR_FRAME_US ((VR_SAMPLES / 2) * 1000000ULL / VR_SAMPLE_FREQ) // Half the circular buffer per frame
 #define VR_ZERO 2047 // ADC raw value
 #define VR_MIN 0
 #define VR_MAX 4095
 
-#define VR_DEFAULT_POS_THRESHOLD 2147 // ADC raw value
-#define VR_DEFAULT_NEG_THRESHOLD 1947 // ADC raw value
+#define VR_DEFAULT_THRESHOLD 100 // ADC raw value, from the calibrated zero
 #define VR_DEFAULT_WDG_THRESHOLD 300 // millisecond
 #define VR_DEFAULT_MULT_THRESHOLD 4 // last interval multiplier
+#define VR_DEFAULT_TEETH 36 // Crank wheel teeth, for the RPM
 
 extern uint16_t vr1_min;
 extern uint16_t vr1_max;
@@ -49,4 +55,10 @@ extern uint16_t vr2_max;
 extern uint16_t vr3_min;
 extern uint16_t vr3_max;
 
+uint16_t vrGetInterval(uint8_t vr);
+uint16_t vrGetThreshold(uint8_t vr);
+uint32_t vrGetToothTime(uint8_t vr);
+bool vrIsValid(uint8_t vr);
+uint16_t vrGetRpm(void);
+
 #endif
@@ -0,0 +1,32 @@
+#include "vr_dsp.h"
+#if !defined(VR_DSP_HOSTED)
+#include "board.h"
+#else
+#define CCM_FUNC // Host benchmark, see bench/
+#endif
+
+#define VR_DSP_MIN 0 // VR_MIN and VR_MAX, 12 bits ADC
+#define VR_DSP_MAX 4095
+
+/*
+ * Filters a frame and widens the peaks with its extremes.
+ * True once the peaks cross both thresholds.
+ */
+CCM_FUNC bool vrDspCheckPeak(high_low_t* peak, const high_low_t* threshold, median_t* median,
+                             const uint16_t* samples, size_t size)
+{
+  /* Filtering and finding min/max */
+  uint16_t val, min = VR_DSP_MAX, max = VR_DSP_MIN;
+  for (uint16_t i = 0; i < size; i++)
+  {
+    val = median_filter(median, samples[i]);
+    if (val > max) max = val;
+    if (val < min) min = val;
+  }
+  if (min < peak->low)
+      peak->low = min;
+  if (max > peak->high)
+      peak->high = max;
+
+  return peak->low <= threshold->low && peak->high >= threshold->high;
+}
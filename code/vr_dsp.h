@@ -0,0 +1,23 @@
+#ifndef VR_DSP_H_
+#define VR_DSP_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "median.h"
+
+/*
+ * VR frame processing, independent of the HAL so the benchmarks can
+ * run it on the host, see bench/.
+ */
+
+typedef struct
+{
+  uint16_t high;
+  uint16_t low;
+} high_low_t;
+
+bool vrDspCheckPeak(high_low_t* peak, const high_low_t* threshold, median_t* median,
+                    const uint16_t* samples, size_t size);
+
+#endif
@@ -79,7 +79,7 @@ void setupTimers()
     tp->CCR1 = 0; // Channels disabled
     tp->CCR2 = 0; // Channels disabled
     tp->CNT = 0; // Reset counter
-    tp->PSC = STM32_TIMCLK2 / 30000;  /* 30kHz PWM clock frequency.   */
+    tp->PSC = (STM32_TIMCLK2 / VR_TIM_FREQ) - 1;  /* 30kHz PWM clock frequency.   */
     tp->ARR = 0xFFFF; /* Initial period maxed out.    */
     tp->EGR = STM32_TIM_EGR_UG | STM32_TIM_EGR_CC1G; // Enable events for CC1 and Update.
     tp->SR = 0; // Clear status reg
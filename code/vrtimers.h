@@ -6,6 +6,7 @@
 #define VR1_TIM TIM15
 #define VR2_TIM TIM16
 #define VR3_TIM TIM17
+#define VR_TIM_FREQ 30000 // Hz, tooth interval resolution
 
 #define VR1_OVERFLOW_HANDLER TIM15_OVERFLOW_HANDLER
 #define VR2_OVERFLOW_HANDLER TIM16_OVERFLOW_HANDLER